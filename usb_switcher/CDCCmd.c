@@ -8,6 +8,14 @@
 #include "ReportParser.h"  // For interface_report_parser_info
 #include "class/hid/hid.h"  // For HID_ITF_PROTOCOL_* constants
 #include "host/usbh.h"  // For TinyUSB host functions
+#include "LinkMux.h"  // For link push/status
+#include "LinkLatency.h"  // For link latency histograms
+#include "SofScheduler.h"  // For SOF-synchronised report timing
+#include "KeyTimeline.h"  // For type() playback statistics
+#include "LuaCache.h"  // For compiling uploaded scripts
+#include "LuaArena.h"  // For Lua heap statistics
+#include "MacroRecorder.h"  // For input recording / playback
+#include "KeyLayout.h"  // For keyboard layout status
 #include <stdlib.h>
 #include <string.h>
 
@@ -75,6 +83,7 @@ static int save_file_to_littlefs(const char* filename, const uint8_t* data, size
         return -1;
     }
     
+    lua_cache_schedule(filename);
     return 0;
 }
 
@@ -96,6 +105,7 @@ static int save_prog_text_to_littlefs(const char* filename, const char* text_dat
         return -1;
     }
     
+    lua_cache_schedule(filename);
     return 0;
 }
 
@@ -400,6 +410,26 @@ void process_cdc_command(const char* command)
         snprintf(count_str, sizeof(count_str), "%d", FIFO_BUFFER_SIZE);
         tud_cdc_write_str(count_str);
         tud_cdc_write_str(" commands\r\n");
+        print_running_macros();
+    } else if (strcmp(command, "stop") == 0 || strncmp(command, "stop ", 5) == 0) {
+        // Stop running macros (the Lua task ends them on its next pass)
+        char stop_command[MAX_COMMAND_LENGTH];
+        const char* name = command[4] == ' ' ? command + 5 : "*";
+        snprintf(stop_command, sizeof(stop_command), "STOP:%s", name);
+        if (fifo_push(stop_command)) {
+            tud_cdc_write_str("Stopping: ");
+            tud_cdc_write_str(name);
+            tud_cdc_write_str("\r\n");
+        } else {
+            tud_cdc_write_str("Error: Queue is full\r\n");
+        }
+    } else if (strcmp(command, "kill") == 0 || strncmp(command, "kill ", 5) == 0) {
+        // Abort running macros right away, even one stuck in a loop (not through the queue)
+        const char* name = command[4] == ' ' ? command + 5 : "*";
+        lua_kill_macros(name);
+        tud_cdc_write_str("Killing: ");
+        tud_cdc_write_str(name);
+        tud_cdc_write_str("\r\n");
     } else if (strcmp(command, "ls") == 0) {
         // List filesystem contents
         tud_cdc_write_str("Directory listing:\r\n");
@@ -422,6 +452,7 @@ void process_cdc_command(const char* command)
         if (strlen(filename) > 0) {
             int result = fstask_remove_file(filename);
             if (result == 0) {
+                lua_cache_remove(filename);
                 tud_cdc_write_str("File '");
                 tud_cdc_write_str(filename);
                 tud_cdc_write_str("' removed successfully\r\n");
@@ -453,22 +484,30 @@ void process_cdc_command(const char* command)
         while (*filename == ' ') filename++;
         
         if (strlen(filename) > 0) {
-            // Try to read the file
-            char* file_buffer = malloc(4096); // 4KB buffer for file reading
-            if (!file_buffer) {
-                tud_cdc_write_str("Error: Failed to allocate memory for file reading\r\n");
-            } else {
-                int bytes_read = fstask_read_file(filename, file_buffer, 4095);
-                if (bytes_read >= 0) {
-                    file_buffer[bytes_read] = '\0'; // Null terminate
-                    
-                    tud_cdc_write_str("--- Content of '");
-                    tud_cdc_write_str(filename);
-                    tud_cdc_write_str("' ---\r\n");
+            // Stream the file in small chunks (any size, constant memory)
+            lfs_file_t file;
+            int result = fstask_open(&file, filename, false);
+            if (result >= 0) {
+                char chunk[128];
+                int bytes_read;
+                int total = 0;
+                
+                tud_cdc_write_str("--- Content of '");
+                tud_cdc_write_str(filename);
+                tud_cdc_write_str("' ---\r\n");
+                
+                while ((bytes_read = fstask_read(&file, chunk, sizeof(chunk))) > 0) {
+                    // Wait for room in the TX FIFO (a chunk is at most 4x longer after escaping)
+                    uint32_t wait_start = board_millis();
+                    while (tud_cdc_connected() && tud_cdc_write_available() < sizeof(chunk) * 4 &&
+                           board_millis() - wait_start < 1000) {
+                        tud_cdc_write_flush();
+                        vTaskDelay(1);
+                    }
                     
                     // Output file content, handling binary data safely
                     for (int i = 0; i < bytes_read; i++) {
-                        char ch = file_buffer[i];
+                        char ch = chunk[i];
                         if (ch >= 0x20 && ch <= 0x7E) {
                             // Printable ASCII character
                             tud_cdc_write(&ch, 1);
@@ -485,29 +524,33 @@ void process_cdc_command(const char* command)
                             tud_cdc_write_str(hex_str);
                         }
                     }
-                    
-                    tud_cdc_write_str("\r\n--- End of file (");
-                    char size_str[16];
-                    snprintf(size_str, sizeof(size_str), "%d", bytes_read);
-                    tud_cdc_write_str(size_str);
-                    tud_cdc_write_str(" bytes) ---\r\n");
+                    total += bytes_read;
+                    tud_cdc_write_flush();
+                }
+                fstask_close(&file);
+                if (bytes_read < 0) result = bytes_read;
+                
+                tud_cdc_write_str("\r\n--- End of file (");
+                char size_str[16];
+                snprintf(size_str, sizeof(size_str), "%d", total);
+                tud_cdc_write_str(size_str);
+                tud_cdc_write_str(" bytes) ---\r\n");
+            }
+            if (result < 0) {
+                tud_cdc_write_str("Error: Failed to read file '");
+                tud_cdc_write_str(filename);
+                tud_cdc_write_str("'\r\n");
+                
+                // Provide more specific error messages
+                if (result == -2) { // LFS_ERR_NOENT
+                    tud_cdc_write_str("Reason: File not found\r\n");
+                } else if (result == -1) {
+                    tud_cdc_write_str("Reason: Filesystem not mounted or invalid file\r\n");
                 } else {
-                    tud_cdc_write_str("Error: Failed to read file '");
-                    tud_cdc_write_str(filename);
-                    tud_cdc_write_str("'\r\n");
-                    
-                    // Provide more specific error messages
-                    if (bytes_read == -2) { // LFS_ERR_NOENT
-                        tud_cdc_write_str("Reason: File not found\r\n");
-                    } else if (bytes_read == -1) {
-                        tud_cdc_write_str("Reason: Filesystem not mounted or invalid file\r\n");
-                    } else {
-                        char error_str[64];  // バッファサイズを拡大
-                        snprintf(error_str, sizeof(error_str), "Reason: LFS error code %d\r\n", (int)bytes_read);
-                        tud_cdc_write_str(error_str);
-                    }
+                    char error_str[64];  // バッファサイズを拡大
+                    snprintf(error_str, sizeof(error_str), "Reason: LFS error code %d\r\n", result);
+                    tud_cdc_write_str(error_str);
                 }
-                free(file_buffer);
             }
         } else {
             tud_cdc_write_str("Error: cat command requires a filename\r\n");
@@ -580,7 +623,7 @@ void process_cdc_command(const char* command)
         while (*lang == ' ') lang++;
         
         if (strlen(lang) > 0) {
-            // Create a Lua command to set the language
+            // Create a Lua command to set the language (the Lua task owns the layout while typing)
             char lua_command[MAX_COMMAND_LENGTH];
             snprintf(lua_command, sizeof(lua_command), "lang('%s')", lang);
             
@@ -594,15 +637,11 @@ void process_cdc_command(const char* command)
         } else {
             tud_cdc_write_str("Error: lang command requires a language\r\n");
             tud_cdc_write_str("Usage: lang <language>\r\n");
-            tud_cdc_write_str("Supported: us (US English), ja (Japanese)\r\n");
+            tud_cdc_write_str("Supported: us (US English), ja (Japanese), <name> (<name>.kbd layout file)\r\n");
         }
     } else if (strcmp(command, "lang") == 0) {
-        // Show current language - add to Lua queue for execution
-        if (fifo_push("print('Current language: ' .. getlang())")) {
-            // Command queued successfully
-        } else {
-            tud_cdc_write_str("Error: Command queue is full\r\n");
-        }
+        // Show the current keyboard layout and the loaded layout files
+        key_layout_print();
     } else if (strcmp(command, "list") == 0) {
         // List connected USB Host devices
         tud_cdc_write_str("Connected USB Host devices:\r\n");
@@ -701,11 +740,96 @@ void process_cdc_command(const char* command)
         tud_cdc_write_str("'.\r\n");
         tud_cdc_write_str("Enter plain text. Press Ctrl-D to save and finish.\r\n");
         return; // Don't show prompt
+    } else if (strncmp(command, "push ", 5) == 0) {
+        // Send a file to the other Pico over the link bulk channel
+        const char* filename = command + 5;
+        
+        // Skip leading spaces
+        while (*filename == ' ') filename++;
+        
+        if (strlen(filename) == 0) {
+            tud_cdc_write_str("Error: push command requires a filename\r\n");
+            tud_cdc_write_str("Usage: push <filename>\r\n");
+        } else {
+            int result = link_push_file(filename);
+            if (result == 0) {
+                tud_cdc_write_str("Pushing '");
+                tud_cdc_write_str(filename);
+                tud_cdc_write_str("' to peer (see 'link' for progress)\r\n");
+            } else if (result == 1) {
+                tud_cdc_write_str("Error: A file transfer is already in progress\r\n");
+            } else {
+                tud_cdc_write_str("Error: Failed to read file '");
+                tud_cdc_write_str(filename);
+                tud_cdc_write_str("'\r\n");
+            }
+        }
+    } else if (strcmp(command, "link") == 0) {
+        // Show link channel statistics
+        link_print_status();
+    } else if (strcmp(command, "latency") == 0) {
+        // Show link clock synchronisation and one-way latency histograms
+        link_latency_print();
+    } else if (strcmp(command, "latency reset") == 0) {
+        link_latency_reset();
+        tud_cdc_write_str("Latency histograms cleared\r\n");
+    } else if (strcmp(command, "sof") == 0) {
+        // Show SOF phase, guard time and report pickup delays
+        sof_sched_print();
+        key_timeline_print();
+    } else if (strcmp(command, "sof reset") == 0) {
+        sof_sched_reset();
+        key_timeline_reset();
+        tud_cdc_write_str("SOF statistics cleared\r\n");
+    } else if (strcmp(command, "rec") == 0) {
+        // Show recording / playback status
+        macro_recorder_print();
+    } else if (strcmp(command, "rec stop") == 0) {
+        macro_rec_stop();
+        tud_cdc_write_str("Recording stopped\r\n");
+    } else if (strncmp(command, "rec ", 4) == 0) {
+        // Record host input to a file: rec <filename>
+        const char* filename = command + 4;
+        while (*filename == ' ') filename++;
+
+        if (macro_rec_start(filename) == 0) {
+            tud_cdc_write_str("Recording to '");
+            tud_cdc_write_str(filename);
+            tud_cdc_write_str("' (rec stop to finish)\r\n");
+        } else {
+            tud_cdc_write_str("Error: Cannot record to '");
+            tud_cdc_write_str(filename);
+            tud_cdc_write_str("' (already recording / playing?)\r\n");
+        }
+    } else if (strcmp(command, "play stop") == 0) {
+        macro_play_stop();
+        tud_cdc_write_str("Playback stopped\r\n");
+    } else if (strncmp(command, "play ", 5) == 0) {
+        // Play recorded input: play <filename> [loops] [speed%] [target]
+        char filename[32];
+        unsigned int loops = 1, speed = 100, target = 0;
+        if (sscanf(command + 5, "%31s %u %u %x", filename, &loops, &speed, &target) < 1) {
+            tud_cdc_write_str("Usage: play <filename> [loops(0=forever)] [speed%] [target node(hex)]\r\n");
+        } else if (macro_play_start(filename, (uint16_t)loops, (uint16_t)speed, (uint8_t)target) == 0) {
+            tud_cdc_write_str("Playing '");
+            tud_cdc_write_str(filename);
+            tud_cdc_write_str("' (play stop to stop)\r\n");
+        } else {
+            tud_cdc_write_str("Error: Cannot play '");
+            tud_cdc_write_str(filename);
+            tud_cdc_write_str("' (missing / not a recording, or already recording / playing)\r\n");
+        }
+    } else if (strcmp(command, "luac") == 0) {
+        // Show Lua bytecode cache hits / compiles
+        lua_cache_print();
+    } else if (strcmp(command, "luamem") == 0) {
+        // Show Lua heap usage and fragmentation
+        lua_arena_print();
     } else if (strlen(command) > 0) {
         tud_cdc_write_str("Unknown command: ");
         tud_cdc_write_str(command);
         tud_cdc_write_str("\r\n");
-        tud_cdc_write_str("Available commands: version, run <filename>, queue, ls, rm <filename>, cat <filename>, receive <filename>, rcv <filename>, prog <filename>, list\r\n");
+        tud_cdc_write_str("Available commands: version, run <filename>, queue, kill [name], ls, rm <filename>, cat <filename>, receive <filename>, rcv <filename>, prog <filename>, list, lang [name], push <filename>, link, latency [reset], sof [reset], rec [<filename>|stop], play <filename>|stop, luac, luamem, stop [name]\r\n");
     }
     
     // Show prompt
@@ -719,6 +843,9 @@ void process_cdc_command(const char* command)
 
 void cdc_cmd_task(void)
 {
+    // Link frames queued by the CDC transport (Core1) are written here, between console lines
+    link_cdc_tx_task();
+
     // Check if CDC is connected
     if ( tud_cdc_connected() )
     {
@@ -734,7 +861,9 @@ void cdc_cmd_task(void)
                 "Available commands:\r\n"
                 "  version        - Show version information\r\n"
                 "  run <filename> - Execute Lua script file from LittleFS\r\n"
-                "  queue          - Show queue status\r\n"
+                "  queue          - Show queue status and running macros\r\n"
+                "  stop [name]    - Stop a running macro (all macros without a name)\r\n"
+                "  kill [name]    - Abort a macro immediately (even a busy loop) and release its keys\r\n"
                 "  ls             - List filesystem contents\r\n"
                 "  rm <filename>  - Remove specified file\r\n"
                 "  cat <filename> - Display file contents\r\n"
@@ -742,6 +871,15 @@ void cdc_cmd_task(void)
                 "  rcv <filename>     - Alias for receive command\r\n"
                 "  prog <filename>    - Program mode (plain text input, Ctrl-D to save)\r\n"
                 "  list           - Show connected USB Host devices\r\n"
+                "  lang [name]    - Show / switch the type() keyboard layout (us, ja, <name>.kbd)\r\n"
+                "  push <filename> - Send file to the other Pico over the link\r\n"
+                "  link           - Show link channel statistics\r\n"
+                "  latency [reset] - Show link clock sync and latency histograms\r\n"
+                "  sof [reset]    - Show SOF-synchronised report timing and type() playback\r\n"
+                "  rec [<filename>|stop] - Record host input to a file / show status\r\n"
+                "  play <filename> [loops] [speed%] [target] - Play recorded input (play stop)\r\n"
+                "  luac           - Show Lua bytecode cache statistics\r\n"
+                "  luamem         - Show Lua heap usage\r\n"
                 "> ";
 
             tud_cdc_write(welcome_msg, sizeof(welcome_msg));
@@ -767,6 +905,13 @@ void cdc_cmd_task(void)
                         memset(cdc_command_buffer, 0, sizeof(cdc_command_buffer));
                     }
                     // Ignore Ctrl-D in other modes
+                } else if ((ch == '\r' || ch == '\n') && receive_state == RECEIVE_STATE_IDLE &&
+                           cdc_command_buffer[0] == LINK_CDC_FRAME_PREFIX) {
+                    // Link frame from a PC-side node ("~<frame>"): no echo, no prompt
+                    cdc_command_buffer[cdc_buffer_index] = '\0';
+                    link_cdc_receive_line(&cdc_command_buffer[1]);
+                    cdc_buffer_index = 0;
+                    memset(cdc_command_buffer, 0, sizeof(cdc_command_buffer));
                 } else if (ch == '\r' || ch == '\n') {
                     // End of line - process it
                     cdc_command_buffer[cdc_buffer_index] = '\0';
@@ -811,8 +956,10 @@ void cdc_cmd_task(void)
                     if (cdc_buffer_index < sizeof(cdc_command_buffer) - 1) {
                         cdc_command_buffer[cdc_buffer_index] = ch;
                         cdc_buffer_index++;
-                        tud_cdc_write(&ch, 1);  // Echo character
-                        tud_cdc_write_flush();
+                        if (cdc_command_buffer[0] != LINK_CDC_FRAME_PREFIX || receive_state != RECEIVE_STATE_IDLE) {
+                            tud_cdc_write(&ch, 1);  // Echo character
+                            tud_cdc_write_flush();
+                        }
                     }
                 }
                 // Ignore other control characters
@@ -6,6 +6,10 @@
 #include "LuaTask.h" // For duplicate checking functions
 #include "base64.h"  // For base64 encoding
 #include "hardware/uart.h" // For UART communication
+#include "LinkMux.h" // For link output queue
+#include "RawHID.h"  // For the raw HID input stream
+#include "MacroRecorder.h" // For input recording
+#include "InputEvents.h" // For Lua wait_button() / wait_axis_change()
 
 const gamepad_report_parser_info_t Samwa_400_JYP62U_gamepad_report_info = {
          .ReportID = 0xffff,
@@ -149,6 +153,10 @@ static void handle_gamepad_button_press(int button_number)
 
 // Function to process parsed gamepad report
 void process_gamepad_report(uint8_t dev_addr, uint8_t instance, const parsed_gamepad_report_t* parsed_report) {
+    raw_hid_stream_input('G', parsed_report, sizeof(*parsed_report));
+    macro_rec_gamepad(parsed_report);
+    input_events_gamepad(parsed_report);
+
     /* printf("[%u:%u] Parsed Gamepad - X:%d Y:%d Z:%d RZ:%d Hat:%u Buttons:0x%04X\n",
            dev_addr, instance, 
            parsed_report->x, parsed_report->y, parsed_report->z, parsed_report->rz,
@@ -176,7 +184,7 @@ void process_gamepad_report(uint8_t dev_addr, uint8_t instance, const parsed_gam
     gamepad_state_updated = true;
     has_gamepad_key = true; // Indicate that gamepad is active
     
-    // Send gamepad data to UART0 regardless of USB_output_switch value
+    // Send gamepad data over the link regardless of USB_output_switch value
     {
         // Prepare gamepad data for UART transmission
         // Pack gamepad data into 8 bytes: x, y, z, rz, hat, buttons(2 bytes), reserved
@@ -190,23 +198,8 @@ void process_gamepad_report(uint8_t dev_addr, uint8_t instance, const parsed_gam
         gamepad_data[6] = (uint8_t)((parsed_report->buttons >> 8) & 0xFF); // Buttons high byte
         gamepad_data[7] = 0;                             // Reserved/unused
 
-        // Encode to base64
-        char base64_output[16]; // 8 bytes -> 12 chars base64 + null terminator + padding
-        int encoded_length = base64_encode(gamepad_data, sizeof(gamepad_data), base64_output, sizeof(base64_output));
-        
-        if (encoded_length > 0) {
-            // Send gamepad report to UART1 in format: "GX<base64_data>\n"
-            // where X is the device_id
-            char uart_message[32];
-            snprintf(uart_message, sizeof(uart_message), "G%d%s\n", device_id, base64_output);
-            
-            // Send to UART1
-            uart_puts(uart1, uart_message);
-            
-            /* printf("UART1: gamepad report sent: %s\n", uart_message); */
-        } else {
-            printf("UART1: Failed to encode gamepad data to base64\n");
-        }
+        // Send gamepad report to every node on the link: "GFF<base64_data>\n"
+        link_send_gamepad(LINK_ADDR_BROADCAST, gamepad_data);
     }
     
     // Here you can add additional logic to:
@@ -0,0 +1,128 @@
+#include "InputEvents.h"
+#include <string.h>
+#include "pico/time.h"
+#include "pico/sem.h"
+#include "pico/util/queue.h"
+
+static queue_t event_queue;                 // input_event_t, Core1 -> Lua タスク
+static semaphore_t event_sem;               // イベントを積んだら Lua タスクを起こす
+static volatile uint8_t event_mask = 0;     // 待っているイベントの種類（Lua タスクが書く）
+static uint32_t dropped = 0;
+
+// Core1: 前の状態（待っていないときも追い、待ち始めに古い変化がイベントにならないようにする）
+// USB ホストとリンクは別々に追う（片方の状態との差をもう片方のイベントにしない）
+static keyboard_bitmap_t prev_keyboard;
+static parsed_gamepad_report_t prev_gamepad;
+static keyboard_bitmap_t prev_link_keyboard;
+static parsed_gamepad_report_t prev_link_gamepad;
+
+void input_events_init(void)
+{
+    queue_init(&event_queue, sizeof(input_event_t), INPUT_EVENT_QUEUE_DEPTH);
+    sem_init(&event_sem, 0, 1);
+}
+
+static void push_event(uint8_t type, uint8_t code, int16_t value, uint64_t now)
+{
+    input_event_t event = { .time_us = now, .type = type, .code = code, .value = value };
+    if (!queue_try_add(&event_queue, &event)) {
+        dropped++;
+    }
+}
+
+static void keyboard_events(const keyboard_bitmap_t* state, keyboard_bitmap_t* prev)
+{
+    if ((event_mask & INPUT_EVENT_KEY) && memcmp(state, prev, sizeof(*state)) != 0) {
+        uint64_t now = time_us_64();
+        uint8_t changed = state->modifier ^ prev->modifier;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            if (changed & (1 << bit)) {
+                push_event(INPUT_EVENT_KEY, HID_KEY_CONTROL_LEFT + bit, (state->modifier >> bit) & 1, now);
+            }
+        }
+        for (uint16_t keycode = HID_KEY_A; keycode < KEYBOARD_NKRO_USAGES; keycode++) {
+            bool pressed = keyboard_bitmap_test(state, (uint8_t)keycode);
+            if (pressed != keyboard_bitmap_test(prev, (uint8_t)keycode)) {
+                push_event(INPUT_EVENT_KEY, (uint8_t)keycode, pressed, now);
+            }
+        }
+        sem_release(&event_sem);
+    }
+    *prev = *state;
+}
+
+static void gamepad_events(const parsed_gamepad_report_t* report, parsed_gamepad_report_t* prev)
+{
+    uint8_t mask = event_mask;
+    uint64_t now = time_us_64();
+    bool pushed = false;
+
+    if ((mask & INPUT_EVENT_BUTTON) && report->buttons != prev->buttons) {
+        uint16_t changed = report->buttons ^ prev->buttons;
+        for (uint8_t button = 0; button < 16; button++) {
+            if (changed & (1 << button)) {
+                push_event(INPUT_EVENT_BUTTON, button + 1, (report->buttons >> button) & 1, now);
+            }
+        }
+        pushed = true;
+    }
+    if (mask & INPUT_EVENT_AXIS) {
+        const int8_t axes[4] = { report->x, report->y, report->z, report->rz };
+        const int8_t prev_axes[4] = { prev->x, prev->y, prev->z, prev->rz };
+        for (uint8_t axis = 0; axis < 4; axis++) {
+            if (axes[axis] != prev_axes[axis]) {
+                push_event(INPUT_EVENT_AXIS, axis, axes[axis], now);
+                pushed = true;
+            }
+        }
+    }
+    if (pushed) {
+        sem_release(&event_sem);
+    }
+    *prev = *report;
+}
+
+void input_events_keyboard(const keyboard_bitmap_t* state)
+{
+    keyboard_events(state, &prev_keyboard);
+}
+
+void input_events_gamepad(const parsed_gamepad_report_t* report)
+{
+    gamepad_events(report, &prev_gamepad);
+}
+
+void input_events_link_keyboard(const keyboard_bitmap_t* state)
+{
+    keyboard_events(state, &prev_link_keyboard);
+}
+
+void input_events_link_gamepad(const parsed_gamepad_report_t* report)
+{
+    gamepad_events(report, &prev_link_gamepad);
+}
+
+void input_events_set_mask(uint8_t mask)
+{
+    event_mask = mask;
+}
+
+bool input_events_pop(input_event_t* event)
+{
+    return queue_try_remove(&event_queue, event);
+}
+
+void input_events_wait(uint32_t timeout_ms)
+{
+    // キューに残っていれば待たない（セマフォは1回分しか数えない）
+    if (queue_is_empty(&event_queue)) {
+        sem_acquire_timeout_ms(&event_sem, timeout_ms);
+    } else {
+        sem_try_acquire(&event_sem);
+    }
+}
+
+uint32_t input_events_dropped(void)
+{
+    return dropped;
+}
@@ -0,0 +1,71 @@
+#ifndef INPUTEVENTS_H
+#define INPUTEVENTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "USBDeviceTask.h"          // For keyboard_bitmap_t
+#include "GamepadReportParser.h"    // For parsed_gamepad_report_t
+
+//--------------------------------------------------------------------+
+// Lua の wait_key / wait_button / wait_axis_change に渡す入力イベント
+//
+// Core1 の入力処理（USB ホストの入力と、リンクから受け取った自ノード宛ての K/N/G フレーム）が
+// キーの押下・ゲームパッドのボタン・軸の変化をイベントにしてキューに積み、
+// セマフォで Lua タスクを起こす（FreeRTOS の pico_sync 連携で Core1 から待ちを解ける）。
+// 待っているマクロがない種類のイベントは積まない（待っていないときの負荷はない）。
+//--------------------------------------------------------------------+
+
+#define INPUT_EVENT_QUEUE_DEPTH 64
+
+// イベントの種類（input_events_set_mask のビット）
+#define INPUT_EVENT_KEY         0x01    // code: キーコード（修飾キーは 0xE0-0xE7）、value: 1 押した / 0 離した
+#define INPUT_EVENT_BUTTON      0x02    // code: ゲームパッドのボタン（1-16）、value: 1 / 0
+#define INPUT_EVENT_AXIS        0x04    // code: 軸（0: X, 1: Y, 2: Z, 3: RZ）、value: 値（-128 - 127）
+
+typedef struct {
+    uint64_t time_us;   // Core1 がレポートを処理した時刻（time_us_64）
+    uint8_t type;       // INPUT_EVENT_*
+    uint8_t code;
+    int16_t value;
+} input_event_t;
+
+/**
+ * キューとセマフォを初期化する（multicore_launch_core1 の前に呼ぶ）
+ */
+void input_events_init(void);
+
+/**
+ * 入力をイベントにする（Core1 の入力処理から呼ぶ）
+ */
+void input_events_keyboard(const keyboard_bitmap_t* state);
+void input_events_gamepad(const parsed_gamepad_report_t* report);
+
+/**
+ * リンクから受け取った入力をイベントにする（Core1 の uart_process_frame から呼ぶ。
+ * 前の状態は USB ホストの入力とは別に持つ）
+ */
+void input_events_link_keyboard(const keyboard_bitmap_t* state);
+void input_events_link_gamepad(const parsed_gamepad_report_t* report);
+
+/**
+ * 積むイベントの種類を設定する（Lua タスク。待っているマクロの種類の OR）
+ */
+void input_events_set_mask(uint8_t mask);
+
+/**
+ * イベントを1つ取り出す（Lua タスク）
+ * @return false: キューが空
+ */
+bool input_events_pop(input_event_t* event);
+
+/**
+ * イベントが積まれるか timeout_ms が過ぎるまで待つ（Lua タスクのループ。vTaskDelay の代わり）
+ */
+void input_events_wait(uint32_t timeout_ms);
+
+/**
+ * @return キューが満杯で捨てたイベント数
+ */
+uint32_t input_events_dropped(void);
+
+#endif // INPUTEVENTS_H
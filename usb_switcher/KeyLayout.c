@@ -0,0 +1,223 @@
+#include "KeyLayout.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tusb.h"
+#include "fstask.h"
+
+typedef struct {
+    char name[KEY_LAYOUT_NAME_LENGTH];
+    key_stroke_t map[256];
+} key_layout_t;
+
+#define K(code) { (code), 0 }
+#define S(code) { (code), KEYBOARD_MODIFIER_LEFTSHIFT }
+
+// どちらの配列でも同じキー
+#define LAYOUT_COMMON \
+    ['\t'] = K(0x2B), ['\n'] = K(0x28), [' '] = K(0x2C), \
+    ['a'] = K(0x04), ['b'] = K(0x05), ['c'] = K(0x06), ['d'] = K(0x07), ['e'] = K(0x08), \
+    ['f'] = K(0x09), ['g'] = K(0x0A), ['h'] = K(0x0B), ['i'] = K(0x0C), ['j'] = K(0x0D), \
+    ['k'] = K(0x0E), ['l'] = K(0x0F), ['m'] = K(0x10), ['n'] = K(0x11), ['o'] = K(0x12), \
+    ['p'] = K(0x13), ['q'] = K(0x14), ['r'] = K(0x15), ['s'] = K(0x16), ['t'] = K(0x17), \
+    ['u'] = K(0x18), ['v'] = K(0x19), ['w'] = K(0x1A), ['x'] = K(0x1B), ['y'] = K(0x1C), \
+    ['z'] = K(0x1D), \
+    ['A'] = S(0x04), ['B'] = S(0x05), ['C'] = S(0x06), ['D'] = S(0x07), ['E'] = S(0x08), \
+    ['F'] = S(0x09), ['G'] = S(0x0A), ['H'] = S(0x0B), ['I'] = S(0x0C), ['J'] = S(0x0D), \
+    ['K'] = S(0x0E), ['L'] = S(0x0F), ['M'] = S(0x10), ['N'] = S(0x11), ['O'] = S(0x12), \
+    ['P'] = S(0x13), ['Q'] = S(0x14), ['R'] = S(0x15), ['S'] = S(0x16), ['T'] = S(0x17), \
+    ['U'] = S(0x18), ['V'] = S(0x19), ['W'] = S(0x1A), ['X'] = S(0x1B), ['Y'] = S(0x1C), \
+    ['Z'] = S(0x1D), \
+    ['1'] = K(0x1E), ['2'] = K(0x1F), ['3'] = K(0x20), ['4'] = K(0x21), ['5'] = K(0x22), \
+    ['6'] = K(0x23), ['7'] = K(0x24), ['8'] = K(0x25), ['9'] = K(0x26), ['0'] = K(0x27), \
+    ['!'] = S(0x1E), ['#'] = S(0x20), ['$'] = S(0x21), ['%'] = S(0x22), \
+    ['-'] = K(0x2D), [','] = K(0x36), ['.'] = K(0x37), ['/'] = K(0x38), \
+    ['<'] = S(0x36), ['>'] = S(0x37), ['?'] = S(0x38)
+
+// US English 104-key
+static const key_layout_t layout_us = { "us", {
+    LAYOUT_COMMON,
+    ['@'] = S(0x1F), ['^'] = S(0x23), ['&'] = S(0x24), ['*'] = S(0x25), ['('] = S(0x26), [')'] = S(0x27),
+    ['='] = K(0x2E), ['['] = K(0x2F), [']'] = K(0x30), ['\\'] = K(0x31), [';'] = K(0x33),
+    ['\''] = K(0x34), ['`'] = K(0x35),
+    ['_'] = S(0x2D), ['+'] = S(0x2E), ['{'] = S(0x2F), ['}'] = S(0x30), ['|'] = S(0x31),
+    [':'] = S(0x33), ['"'] = S(0x34), ['~'] = S(0x35),
+} };
+
+// Japanese 109-key (JIS)
+static const key_layout_t layout_ja = { "ja", {
+    LAYOUT_COMMON,
+    ['"'] = S(0x1F), ['&'] = S(0x23), ['\''] = S(0x24), ['('] = S(0x25), [')'] = S(0x26),  // Shift+0 は何もない
+    ['='] = S(0x2D), ['^'] = K(0x2E), ['~'] = S(0x2E), ['@'] = K(0x2F), ['`'] = S(0x2F),
+    ['['] = K(0x30), ['{'] = S(0x30), [']'] = K(0x32), ['}'] = S(0x32),
+    [';'] = K(0x33), ['+'] = S(0x33), [':'] = K(0x34), ['*'] = S(0x34),
+    ['\\'] = K(0x89), ['|'] = S(0x89),  // ¥ キー（International3）
+    ['_'] = S(0x87),                    // ろ キー（International1）
+} };
+
+static const key_layout_t* const builtin_layouts[] = { &layout_us, &layout_ja };
+
+// LittleFS から読んだ配列（Lua タスクが書く）
+static key_layout_t loaded_layouts[KEY_LAYOUT_CACHE];
+static uint8_t loaded_count = 0;
+static uint8_t loaded_next = 0;             // 満杯のとき次に置き換える
+
+static const key_layout_t* current_layout = &layout_us;
+
+const key_stroke_t* key_layout_lookup(uint8_t c)
+{
+    const key_stroke_t* stroke = &current_layout->map[c];
+    return stroke->keycode != 0 ? stroke : NULL;
+}
+
+const char* key_layout_name(void)
+{
+    return current_layout->name;
+}
+
+static const key_layout_t* find_builtin(const char* name)
+{
+    if (strcmp(name, "en") == 0) name = "us";
+    if (strcmp(name, "jp") == 0) name = "ja";
+    for (size_t i = 0; i < sizeof(builtin_layouts) / sizeof(builtin_layouts[0]); i++) {
+        if (strcmp(builtin_layouts[i]->name, name) == 0) return builtin_layouts[i];
+    }
+    return NULL;
+}
+
+// 文字の欄: 1文字そのまま、または 0xNN
+static bool parse_char(const char* token, uint8_t* c)
+{
+    if (token[0] != '\0' && token[1] == '\0') {
+        *c = (uint8_t)token[0];
+        return true;
+    }
+    char* end;
+    long value = strtol(token, &end, 0);
+    if (*end != '\0' || value < 0 || value > 0xFF) return false;
+    *c = (uint8_t)value;
+    return true;
+}
+
+// "<名前>.kbd" を layout に読む
+// @return 0: 成功, 負の値: ファイルがない・書式の誤り
+static int parse_layout_file(const char* name, key_layout_t* layout)
+{
+    char filename[KEY_LAYOUT_NAME_LENGTH + sizeof(KEY_LAYOUT_FILE_SUFFIX)];
+    char line[64];
+    lfs_file_t file;
+    int line_number = 0;
+    int result = 0;
+
+    snprintf(filename, sizeof(filename), "%s%s", name, KEY_LAYOUT_FILE_SUFFIX);
+    if (fstask_open(&file, filename, false) < 0) {
+        printf("Keyboard layout '%s' not found (no %s)\n", name, filename);
+        return -1;
+    }
+
+    memset(layout, 0, sizeof(*layout));
+    snprintf(layout->name, sizeof(layout->name), "%s", name);
+
+    int len;
+    while ((len = fstask_read_line(&file, line, sizeof(line))) >= 0) {
+        line_number++;
+        char* save;
+        char* token = strtok_r(line, " \t", &save);
+        if (token == NULL || token[0] == '#') {
+            continue;   // 空行・コメント（# の文字は 0x23 と書く）
+        }
+        if (strcmp(token, "base") == 0) {
+            char* base_name = strtok_r(NULL, " \t", &save);
+            const key_layout_t* base = base_name ? find_builtin(base_name) : NULL;
+            if (base == NULL) {
+                result = -2;
+                break;
+            }
+            memcpy(layout->map, base->map, sizeof(layout->map));
+            continue;
+        }
+
+        uint8_t c;
+        char* keycode_token = strtok_r(NULL, " \t", &save);
+        char* end = NULL;
+        long keycode = keycode_token ? strtol(keycode_token, &end, 0) : -1;
+        if (!parse_char(token, &c) || keycode_token == NULL || *end != '\0' || keycode < 0 || keycode > 0xFF) {
+            result = -2;
+            break;
+        }
+
+        uint8_t modifier = 0;
+        char* option;
+        while ((option = strtok_r(NULL, " \t", &save)) != NULL) {
+            if (strcmp(option, "shift") == 0) {
+                modifier |= KEYBOARD_MODIFIER_LEFTSHIFT;
+            } else if (strcmp(option, "altgr") == 0) {
+                modifier |= KEYBOARD_MODIFIER_RIGHTALT;
+            } else {
+                result = -2;
+                break;
+            }
+        }
+        if (result < 0) break;
+
+        layout->map[c].keycode = (uint8_t)keycode;
+        layout->map[c].modifier = keycode != 0 ? modifier : 0;
+    }
+    fstask_close(&file);
+
+    if (result < 0) {
+        printf("Keyboard layout %s: invalid line %d\n", filename, line_number);
+    } else if (len != FSTASK_EOF) {
+        printf("Keyboard layout %s: read error %d\n", filename, len);
+        result = len;
+    }
+    return result;
+}
+
+int key_layout_select(const char* name)
+{
+    const key_layout_t* layout = find_builtin(name);
+
+    // 読み込んである配列
+    for (uint8_t i = 0; layout == NULL && i < loaded_count; i++) {
+        if (strcmp(loaded_layouts[i].name, name) == 0) layout = &loaded_layouts[i];
+    }
+
+    if (layout == NULL) {
+        if (strlen(name) >= KEY_LAYOUT_NAME_LENGTH) return -1;
+
+        // 今の配列は置き換えない（使っている最中の表を書き換えないように）
+        uint8_t slot = loaded_count < KEY_LAYOUT_CACHE ? loaded_count : loaded_next;
+        if (&loaded_layouts[slot] == current_layout) slot = (slot + 1) % KEY_LAYOUT_CACHE;
+
+        static key_layout_t parsed;     // 誤りがあったときに覚えている配列を壊さない
+        int result = parse_layout_file(name, &parsed);
+        if (result < 0) return result;
+
+        loaded_layouts[slot] = parsed;
+        if (loaded_count < KEY_LAYOUT_CACHE) {
+            loaded_count++;
+        } else {
+            loaded_next = (slot + 1) % KEY_LAYOUT_CACHE;
+        }
+        layout = &loaded_layouts[slot];
+        printf("Keyboard layout '%s' loaded\n", name);
+    }
+
+    current_layout = layout;
+    return 0;
+}
+
+void key_layout_print(void)
+{
+    char line[96];
+    int len = snprintf(line, sizeof(line), "Keyboard layout: %s (built in: us, ja", current_layout->name);
+    for (uint8_t i = 0; i < loaded_count && len < (int)sizeof(line); i++) {
+        len += snprintf(line + len, sizeof(line) - len, i == 0 ? "; loaded: %s" : ", %s", loaded_layouts[i].name);
+    }
+    if (len < (int)sizeof(line)) {
+        snprintf(line + len, sizeof(line) - len, ")\r\n");
+    }
+    tud_cdc_write_str(line);
+    tud_cdc_write_flush();
+}
@@ -0,0 +1,54 @@
+#ifndef KEYLAYOUT_H
+#define KEYLAYOUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//--------------------------------------------------------------------+
+// type() の文字 -> キーコード変換（キーボード配列）
+//
+// 配列は文字（1バイト）ごとの 256 要素の表で、キーコードと一緒に押す修飾キー
+// （Shift・AltGr = 右 Alt）を持つ。文字の変換は表を1回引くだけ。
+// us / ja は組み込み。それ以外は LittleFS の "<名前>.kbd" を最初に選んだときに1回だけ読んで
+// 同じ表にし、KEY_LAYOUT_CACHE 個まで覚えておく（次からはすぐに切り替わる）。
+//
+// 配列ファイル（1行に1文字。# で始まる行と空行は読み飛ばす）:
+//   base us                  組み込みの配列から始める（省略時は空の表）
+//   <文字> <キーコード> [shift] [altgr]
+//   文字は1文字そのまま、または 0xNN（空白・# など）。キーコード 0 は割り当てを消す
+//   例: z 0x1C / Z 0x1C shift / @ 0x14 altgr / 0x23 0x32
+//--------------------------------------------------------------------+
+
+#define KEY_LAYOUT_NAME_LENGTH  16
+#define KEY_LAYOUT_CACHE        4       // 読み込んだ配列を覚えておく数
+#define KEY_LAYOUT_FILE_SUFFIX  ".kbd"
+
+// 1文字を入力するキー
+typedef struct {
+    uint8_t keycode;    // 0: 割り当てなし
+    uint8_t modifier;   // 一緒に押す修飾キー（KEYBOARD_MODIFIER_*）
+} key_stroke_t;
+
+/**
+ * 文字を入力するキーを引く（今の配列）
+ * @return NULL: 今の配列では入力できない文字
+ */
+const key_stroke_t* key_layout_lookup(uint8_t c);
+
+/**
+ * 配列を切り替える（us / en、ja / jp、それ以外は "<名前>.kbd" を読む）
+ * @return 0: 成功, 負の値: ファイルがない・書式の誤り（今の配列のまま）
+ */
+int key_layout_select(const char* name);
+
+/**
+ * @return 今の配列の名前
+ */
+const char* key_layout_name(void);
+
+/**
+ * 今の配列と読み込んである配列を CDC に表示する
+ */
+void key_layout_print(void);
+
+#endif // KEYLAYOUT_H
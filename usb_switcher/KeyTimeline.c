@@ -0,0 +1,149 @@
+#include "KeyTimeline.h"
+#include <stdio.h>
+#include <string.h>
+#include "tusb.h"
+#include "pico/time.h"
+#include "pico/util/queue.h"
+#include "hardware/sync.h"
+
+typedef struct {
+    keyboard_bitmap_t state;
+    uint16_t frames;
+} key_step_t;
+
+// 再生の段階（Core1 が書く）
+typedef enum {
+    TIMELINE_IDLE = 0,      // 次のレポートを渡せる
+    TIMELINE_SENT,          // 渡した、PC が取り出すのを待つ
+    TIMELINE_HOLD           // 取り出された、保持時間を待つ
+} timeline_phase_t;
+
+static queue_t step_queue;                      // key_step_t, Core0 -> Core1
+static volatile timeline_phase_t phase = TIMELINE_IDLE;
+static uint32_t hold_start_us;
+static uint32_t hold_us;
+static uint32_t due_us;                         // 先頭のレポートを渡すはずだった時刻
+static bool due_valid = false;
+static uint32_t busy_start_us;
+
+// 止めたときに送る状態（Core0 が書いてから cancel_pending を立てる）
+static keyboard_bitmap_t cancel_state;
+static volatile bool cancel_pending = false;
+
+// 統計（Core1 が書く）
+static uint32_t report_count = 0;
+static uint32_t late_count = 0;                 // 1フレーム以上遅れて渡した（エンドポイントが空かなかった）
+static uint32_t cancel_count = 0;
+static uint64_t busy_us = 0;                    // 再生していた時間の合計
+
+void key_timeline_init(void)
+{
+    queue_init(&step_queue, sizeof(key_step_t), KEY_TIMELINE_DEPTH);
+}
+
+bool key_timeline_push(const keyboard_bitmap_t* state, uint16_t frames)
+{
+    key_step_t step;
+    step.state = *state;
+    step.frames = frames > 0 ? frames : 1;
+    return queue_try_add(&step_queue, &step);
+}
+
+uint32_t key_timeline_space(void)
+{
+    return KEY_TIMELINE_DEPTH - queue_get_level(&step_queue);
+}
+
+bool key_timeline_busy(void)
+{
+    // Core1 は取り出す前に phase を進めるので、どちらかは必ず見える
+    return cancel_pending || phase != TIMELINE_IDLE || !queue_is_empty(&step_queue);
+}
+
+void key_timeline_cancel(const keyboard_bitmap_t* final)
+{
+    cancel_state = *final;
+    __dmb();
+    cancel_pending = true;
+}
+
+// 再生していた時間を数え終える
+static void timeline_finished(uint32_t now)
+{
+    busy_us += now - busy_start_us;
+    due_valid = false;
+}
+
+void key_timeline_task(void)
+{
+    uint32_t now = time_us_32();
+    key_step_t step;
+
+    if (cancel_pending) {
+        // 取り出すのは Core1 だけなので、捨てたあとに final を積めば必ず次に送られる
+        while (queue_try_remove(&step_queue, &step)) {}
+        step.state = cancel_state;
+        step.frames = 1;
+        queue_try_add(&step_queue, &step);
+        if (phase == TIMELINE_HOLD) phase = TIMELINE_IDLE;
+        cancel_pending = false;
+        cancel_count++;
+    }
+
+    if (phase == TIMELINE_SENT) {
+        if (!usb_device_ready(0)) return;
+        phase = TIMELINE_HOLD;
+        hold_start_us = now;
+    }
+    if (phase == TIMELINE_HOLD) {
+        if (now - hold_start_us < hold_us) return;
+        due_us = hold_start_us + hold_us;
+        phase = TIMELINE_IDLE;
+    }
+
+    if (!queue_try_peek(&step_queue, &step)) {
+        if (due_valid) timeline_finished(now);
+        return;
+    }
+    if (!due_valid) {
+        due_valid = true;
+        due_us = now;
+        busy_start_us = now;
+    }
+
+    // 1フレームに1レポート: 前のレポートが取り出されるまでエンドポイントは空かない
+    if (!usb_device_ready(0) || !usb_device_keyboard_bitmap_report(&step.state)) return;
+
+    report_count++;
+    if (now - due_us >= KEY_TIMELINE_FRAME_US) late_count++;
+    hold_us = step.frames > 1 ? (step.frames - 1) * KEY_TIMELINE_FRAME_US + KEY_TIMELINE_FRAME_US / 2 : 0;
+    phase = TIMELINE_SENT;  // busy のまま取り出す
+    queue_try_remove(&step_queue, &step);
+}
+
+void key_timeline_print(void)
+{
+    char line[128];
+    uint64_t total_us = busy_us;
+    if (due_valid) total_us += time_us_32() - busy_start_us;
+
+    snprintf(line, sizeof(line), "Key timeline: %lu reports, %lu late, %lu cancelled, %lu queued\r\n",
+             (unsigned long)report_count, (unsigned long)late_count, (unsigned long)cancel_count,
+             (unsigned long)queue_get_level(&step_queue));
+    tud_cdc_write_str(line);
+    if (total_us > 0) {
+        snprintf(line, sizeof(line), "  playing %lu ms, %lu reports/s\r\n",
+                 (unsigned long)(total_us / 1000), (unsigned long)(report_count * 1000000ull / total_us));
+        tud_cdc_write_str(line);
+    }
+    tud_cdc_write_flush();
+}
+
+void key_timeline_reset(void)
+{
+    report_count = 0;
+    late_count = 0;
+    cancel_count = 0;
+    busy_us = 0;
+    busy_start_us = time_us_32();
+}
@@ -0,0 +1,64 @@
+#ifndef KEYTIMELINE_H
+#define KEYTIMELINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "USBDeviceTask.h"  // For keyboard_bitmap_t
+
+//--------------------------------------------------------------------+
+// キーボードレポートのタイムライン再生（フレーム単位）
+//
+// Lua の type() などが文字列をキーボードの状態（レポート）と保持フレーム数の列に
+// 変換してキューに積み（Core0）、Core1 がそれを1フレームに1レポートずつ送る。
+// レポートごとに Lua へ戻ったり vTaskDelay したりしないので、保持1フレームなら
+// フルスピードの上限（1000 レポート/秒）に近い速さで、揺れなく入力できる。
+//
+// 保持時間は PC がレポートを取り出してから数える（送ってから取り出されるまでは数えない）:
+// 保持 N フレームのレポートは、取り出されてから (N - 1) フレーム + 半フレーム待ってから
+// 次のレポートを渡す。
+// PIO-USB の2つ目のポート（USB2）は取り出しが見えないので、キューに入った時点から数える。
+//--------------------------------------------------------------------+
+
+#define KEY_TIMELINE_DEPTH      64      // キューに積めるレポート
+#define KEY_TIMELINE_FRAME_US   1000    // フルスピードの1フレーム
+
+/**
+ * キューを初期化する（multicore_launch_core1 の前に呼ぶ）
+ */
+void key_timeline_init(void);
+
+/**
+ * レポートをタイムラインの最後に積む（Core0）
+ * @param state 送るキーボードの状態
+ * @param frames 保持するフレーム数（1 以上）
+ * @return false: キューが満杯
+ */
+bool key_timeline_push(const keyboard_bitmap_t* state, uint16_t frames);
+
+/**
+ * @return キューの空き（レポート数）
+ */
+uint32_t key_timeline_space(void);
+
+/**
+ * @return true: 送っていないレポートがあるか、最後のレポートを保持している
+ */
+bool key_timeline_busy(void);
+
+/**
+ * 積んだレポートを捨てて、final を送る（マクロを止めたとき。押したままのキーを戻す）
+ */
+void key_timeline_cancel(const keyboard_bitmap_t* final);
+
+/**
+ * タイムラインの再生（Core1 のループから呼ぶ）
+ */
+void key_timeline_task(void);
+
+/**
+ * 送ったレポート数・遅れ・再生速度を CDC に表示する / 統計をクリアする
+ */
+void key_timeline_print(void);
+void key_timeline_reset(void);
+
+#endif // KEYTIMELINE_H
@@ -0,0 +1,318 @@
+#include "KeyboardReportParser.h"
+#include <stdio.h>
+#include <string.h>
+#include "tusb.h"
+
+#define HID_USAGE_PAGE_KEYBOARD_ID  0x07
+#define HID_USAGE_PAGE_LED_ID       0x08
+#define HID_USAGE_PAGE_CONSUMER_ID  0x0C
+#define HID_PUSH_DEPTH              4
+
+// グローバル項目（Push/Pop で保存する）
+typedef struct {
+    uint16_t usage_page;
+    int32_t  logical_min;
+    uint8_t  report_size;
+    uint8_t  report_count;
+    uint8_t  report_id;
+} hid_globals_t;
+
+// Report ID ごとの Input のビット数（ディスクリプタ解析中のみ使う）
+static uint16_t input_bits[256];
+
+static uint32_t item_unsigned(const uint8_t* data, uint8_t size)
+{
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < size; i++) {
+        value |= (uint32_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+static int32_t item_signed(const uint8_t* data, uint8_t size)
+{
+    uint32_t value = item_unsigned(data, size);
+    if (size > 0 && size < 4 && (value & (1u << (8 * size - 1)))) {
+        value |= 0xFFFFFFFFu << (8 * size);
+    }
+    return (int32_t)value;
+}
+
+// レポートから符号なしでビット列を取り出す（範囲外は 0）
+static uint32_t report_bits(const uint8_t* report, uint16_t report_len, uint32_t bit_offset, uint8_t bit_size)
+{
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < bit_size && i < 32; i++) {
+        uint32_t bit = bit_offset + i;
+        if ((bit >> 3) >= report_len) break;
+        if (report[bit >> 3] & (1 << (bit & 7))) {
+            value |= 1u << i;
+        }
+    }
+    return value;
+}
+
+uint8_t keyboard_report_descriptor_parser(const uint8_t* desc, uint16_t desc_len,
+                                          keyboard_report_parser_info_t* info)
+{
+    hid_globals_t globals = { 0 };
+    hid_globals_t stack[HID_PUSH_DEPTH];
+    uint8_t depth = 0;
+
+    // ローカル項目（Main 項目ごとにクリア）
+    uint32_t first_usage = 0;
+    uint32_t usage_min = 0;
+    bool has_usage = false;
+    bool has_usage_min = false;
+    uint16_t usages[KEYBOARD_CONTROL_MAX_USAGES];
+    uint8_t usage_count = 0;
+
+    memset(info, 0, sizeof(*info));
+    memset(input_bits, 0, sizeof(input_bits));
+
+    uint16_t pos = 0;
+    while (pos < desc_len) {
+        uint8_t prefix = desc[pos++];
+
+        // Long item: bDataSize, bLongItemTag, data
+        if (prefix == 0xFE) {
+            if (pos >= desc_len) break;
+            pos += 2 + desc[pos];
+            continue;
+        }
+
+        uint8_t size = prefix & 0x03;
+        if (size == 3) size = 4;
+        uint8_t type = (prefix >> 2) & 0x03;
+        uint8_t tag = prefix >> 4;
+        if (pos + size > desc_len) break;
+        const uint8_t* data = &desc[pos];
+        pos += size;
+        uint32_t value = item_unsigned(data, size);
+
+        if (type == RI_TYPE_MAIN) {
+            if (tag == RI_MAIN_INPUT) {
+                uint32_t usage = has_usage_min ? usage_min : first_usage;
+                // 4バイトの Usage は上位16ビットが Usage Page
+                uint16_t page = (usage >> 16) ? (uint16_t)(usage >> 16) : globals.usage_page;
+                bool decoded = false;
+
+                if (page == HID_USAGE_PAGE_KEYBOARD_ID && !(value & HID_CONSTANT) &&
+                    (has_usage || has_usage_min) && globals.report_size > 0 &&
+                    info->field_count < KEYBOARD_PARSER_MAX_FIELDS) {
+                    keyboard_field_t* field = &info->fields[info->field_count++];
+                    field->report_id = globals.report_id;
+                    field->is_array = !(value & HID_VARIABLE);
+                    field->bit_offset = input_bits[globals.report_id];
+                    field->size = globals.report_size;
+                    field->count = globals.report_count;
+                    field->usage_min = (uint16_t)usage;
+                    field->logical_min = globals.logical_min;
+                    decoded = true;
+                }
+
+                // メディアキー・システムキー
+                bool is_consumer = page == HID_USAGE_PAGE_CONSUMER_ID;
+                bool is_system = page == HID_USAGE_PAGE_DESKTOP &&
+                                 (uint16_t)usage >= HID_USAGE_DESKTOP_SYSTEM_POWER_DOWN &&
+                                 (uint16_t)usage <= HID_USAGE_DESKTOP_SYSTEM_WAKE_UP;
+                if ((is_consumer || is_system) && !(value & HID_CONSTANT) &&
+                    (has_usage || has_usage_min) && globals.report_size > 0 && globals.report_size <= 16 &&
+                    info->control_count < KEYBOARD_CONTROL_MAX_FIELDS) {
+                    keyboard_control_field_t* control = &info->controls[info->control_count++];
+                    control->report_id = globals.report_id;
+                    control->is_array = !(value & HID_VARIABLE);
+                    control->is_system = is_system;
+                    control->bit_offset = input_bits[globals.report_id];
+                    control->size = globals.report_size;
+                    control->count = globals.report_count;
+                    control->usage_min = (uint16_t)usage;
+                    control->logical_min = globals.logical_min;
+                    control->usage_count = has_usage_min ? 0 : usage_count;
+                    memcpy(control->usages, usages, sizeof(usages[0]) * usage_count);
+                    decoded = true;
+                }
+
+                // スティック・ボタンなど: この Report ID はゲームパッドのパーサーにも渡す
+                if (!decoded && !(value & HID_CONSTANT) && globals.report_size > 0 &&
+                    (page == HID_USAGE_PAGE_DESKTOP || page == HID_USAGE_PAGE_BUTTON)) {
+                    info->other_input_ids[globals.report_id / 8] |= 1 << (globals.report_id % 8);
+                    info->has_other_inputs = true;
+                }
+                input_bits[globals.report_id] += (uint16_t)globals.report_size * globals.report_count;
+            } else if (tag == RI_MAIN_OUTPUT) {
+                if (globals.usage_page == HID_USAGE_PAGE_LED_ID && info->led_report_id == 0) {
+                    info->led_report_id = globals.report_id;
+                }
+            }
+            has_usage = false;
+            has_usage_min = false;
+            usage_count = 0;
+        } else if (type == RI_TYPE_GLOBAL) {
+            switch (tag) {
+                case RI_GLOBAL_USAGE_PAGE:   globals.usage_page = (uint16_t)value; break;
+                case RI_GLOBAL_LOGICAL_MIN:  globals.logical_min = item_signed(data, size); break;
+                case RI_GLOBAL_REPORT_SIZE:  globals.report_size = (uint8_t)value; break;
+                case RI_GLOBAL_REPORT_COUNT: globals.report_count = (uint8_t)value; break;
+                case RI_GLOBAL_REPORT_ID:
+                    globals.report_id = (uint8_t)value;
+                    info->has_report_id = true;
+                    break;
+                case RI_GLOBAL_PUSH:
+                    if (depth < HID_PUSH_DEPTH) stack[depth++] = globals;
+                    break;
+                case RI_GLOBAL_POP:
+                    if (depth > 0) globals = stack[--depth];
+                    break;
+                default: break;
+            }
+        } else if (type == RI_TYPE_LOCAL) {
+            if (tag == RI_LOCAL_USAGE) {
+                if (!has_usage) {
+                    first_usage = value;
+                    has_usage = true;
+                }
+                if (usage_count < KEYBOARD_CONTROL_MAX_USAGES) usages[usage_count++] = (uint16_t)value;
+            } else if (tag == RI_LOCAL_USAGE_MIN) {
+                usage_min = value;
+                has_usage_min = true;
+            }
+        }
+    }
+
+    info->valid = info->field_count > 0;
+    return info->field_count;
+}
+
+int keyboard_report_parser(const keyboard_report_parser_info_t* info,
+                           const uint8_t* report, uint16_t report_len,
+                           keyboard_bitmap_t* state)
+{
+    if (!info->valid) return -1;
+
+    uint8_t report_id = 0;
+    if (info->has_report_id) {
+        if (report_len < 1) return -1;
+        report_id = report[0];
+        report++;
+        report_len--;
+    }
+
+    keyboard_bitmap_t next;
+    bool matched = false;
+    memset(&next, 0, sizeof(next));
+
+    for (uint8_t f = 0; f < info->field_count; f++) {
+        const keyboard_field_t* field = &info->fields[f];
+        if (field->report_id != report_id) continue;
+        matched = true;
+
+        for (uint8_t e = 0; e < field->count; e++) {
+            uint32_t value = report_bits(report, report_len,
+                                         field->bit_offset + (uint32_t)e * field->size, field->size);
+            if (!field->is_array) {
+                if (value) keyboard_bitmap_set(&next, (uint8_t)(field->usage_min + e), true);
+                continue;
+            }
+
+            int32_t index = (int32_t)value - field->logical_min;
+            if (index < 0) continue;
+            uint32_t usage = field->usage_min + (uint32_t)index;
+            if (usage == HID_KEY_NONE || usage > HID_KEY_GUI_RIGHT) continue;
+            if (usage < HID_KEY_A) return -2;   // ErrorRollOver / POSTFail / ErrorUndefined
+            keyboard_bitmap_set(&next, (uint8_t)usage, true);
+        }
+    }
+
+    if (!matched) return -1;
+    *state = next;
+    return 0;
+}
+
+// Usage of element e (variable) or of the value index (array) in a control field
+static uint16_t control_usage(const keyboard_control_field_t* control, uint32_t index)
+{
+    if (control->usage_count == 0) return (uint16_t)(control->usage_min + index);
+    if (index >= control->usage_count) return 0;
+    return control->usages[index];
+}
+
+int keyboard_control_report_parser(const keyboard_report_parser_info_t* info,
+                                   const uint8_t* report, uint16_t report_len,
+                                   keyboard_control_state_t* state)
+{
+    if (info->control_count == 0) return -1;
+
+    uint8_t report_id = 0;
+    if (info->has_report_id) {
+        if (report_len < 1) return -1;
+        report_id = report[0];
+        report++;
+        report_len--;
+    }
+
+    bool matched_consumer = false;
+    bool matched_system = false;
+    uint16_t consumer[USB_CONSUMER_KEYS] = { 0 };
+    uint8_t consumer_count = 0;
+    uint8_t system = 0;
+
+    for (uint8_t f = 0; f < info->control_count; f++) {
+        const keyboard_control_field_t* control = &info->controls[f];
+        if (control->report_id != report_id) continue;
+        if (control->is_system) matched_system = true;
+        else matched_consumer = true;
+
+        for (uint8_t e = 0; e < control->count; e++) {
+            uint32_t value = report_bits(report, report_len,
+                                         control->bit_offset + (uint32_t)e * control->size, control->size);
+            uint16_t usage;
+            if (control->is_array) {
+                int32_t index = (int32_t)value - control->logical_min;
+                if (index < 0) continue;
+                usage = control_usage(control, (uint32_t)index);
+            } else {
+                if (!value) continue;
+                usage = control_usage(control, e);
+            }
+            if (usage == 0) continue;
+
+            if (!control->is_system) {
+                if (consumer_count < USB_CONSUMER_KEYS) consumer[consumer_count++] = usage;
+            } else if (usage >= HID_USAGE_DESKTOP_SYSTEM_POWER_DOWN &&
+                       usage <= HID_USAGE_DESKTOP_SYSTEM_WAKE_UP && system == 0) {
+                system = (uint8_t)usage;
+            }
+        }
+    }
+
+    if (!matched_consumer && !matched_system) return -1;
+    if (matched_consumer) memcpy(state->consumer, consumer, sizeof(state->consumer));
+    if (matched_system) state->system = system;
+    return 0;
+}
+
+bool keyboard_report_has_other_inputs(const keyboard_report_parser_info_t* info,
+                                      const uint8_t* report, uint16_t report_len)
+{
+    if (!info->has_other_inputs) return false;
+
+    uint8_t report_id = 0;
+    if (info->has_report_id) {
+        if (report_len < 1) return false;
+        report_id = report[0];
+    }
+    return (info->other_input_ids[report_id / 8] & (1 << (report_id % 8))) != 0;
+}
+
+int keyboard_boot_report_parser(const uint8_t* report, uint16_t report_len, keyboard_bitmap_t* state)
+{
+    if (report_len < sizeof(hid_keyboard_report_t)) return -1;
+
+    const hid_keyboard_report_t* boot_report = (const hid_keyboard_report_t*)report;
+    if (boot_report->keycode[0] != HID_KEY_NONE && boot_report->keycode[0] < HID_KEY_A) {
+        return -2;
+    }
+    keyboard_bitmap_from_keys(state, boot_report->modifier, boot_report->keycode);
+    return 0;
+}
@@ -0,0 +1,112 @@
+#ifndef KEYBOARD_REPORT_PARSER_H
+#define KEYBOARD_REPORT_PARSER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "USBDeviceTask.h"  // For keyboard_bitmap_t
+
+//--------------------------------------------------------------------+
+// レポートディスクリプタからキーボードの入力フィールドを取り出し、
+// Report プロトコルのレポート（配列形式・ビットマップ形式、Report ID の有無）を
+// keyboard_bitmap_t に変換する。機種ごとの定義ファイルは不要。
+// メディアキー（Consumer ページ）と電源・スリープ（System Control）の
+// フィールドも取り出し、keyboard_control_state_t に変換する。
+//--------------------------------------------------------------------+
+
+#define KEYBOARD_PARSER_MAX_FIELDS  8
+#define KEYBOARD_CONTROL_MAX_FIELDS 4
+#define KEYBOARD_CONTROL_MAX_USAGES 16
+
+// Keyboard/Keypad ページの Input フィールド1つ分
+typedef struct {
+    uint8_t  report_id;     // 0: Report ID なし
+    bool     is_array;      // true: 配列（keycode を並べる）, false: 1キー1ビット
+    uint16_t bit_offset;    // Report ID を除いた先頭からのビット位置
+    uint8_t  size;          // 要素1つのビット数
+    uint8_t  count;         // 要素数
+    uint16_t usage_min;     // 先頭要素（ビットマップ）または値 logical_min の Usage
+    int32_t  logical_min;
+} keyboard_field_t;
+
+// Consumer / System Control の Input フィールド1つ分
+typedef struct {
+    uint8_t  report_id;
+    bool     is_array;
+    bool     is_system;     // true: System Control（Generic Desktop 0x81-0x83）, false: Consumer
+    uint16_t bit_offset;
+    uint8_t  size;
+    uint8_t  count;
+    uint16_t usage_min;     // usage_count == 0 のとき（Usage Minimum からの連番）
+    int32_t  logical_min;
+    uint8_t  usage_count;   // Usage を列挙しているとき
+    uint16_t usages[KEYBOARD_CONTROL_MAX_USAGES];
+} keyboard_control_field_t;
+
+// 押されているメディアキー・システムキー（0: なし）
+typedef struct {
+    uint16_t consumer[USB_CONSUMER_KEYS];   // Consumer ページの Usage（押された順、空きは 0）
+    uint8_t  system;        // 0x81: Power Down, 0x82: Sleep, 0x83: Wake Up
+} keyboard_control_state_t;
+
+typedef struct {
+    bool     valid;
+    bool     has_report_id;
+    uint8_t  led_report_id;     // LED の Output レポートの Report ID
+    uint8_t  field_count;
+    keyboard_field_t fields[KEYBOARD_PARSER_MAX_FIELDS];
+    uint8_t  control_count;
+    keyboard_control_field_t controls[KEYBOARD_CONTROL_MAX_FIELDS];
+    bool     has_other_inputs;
+    uint8_t  other_input_ids[32];   // Report ID ごとの1ビット: スティック・ボタン（ゲームパッドなど）もある
+} keyboard_report_parser_info_t;
+
+/**
+ * レポートディスクリプタからキーボードのフィールドを取り出す
+ * @param desc レポートディスクリプタ
+ * @param desc_len ディスクリプタ長
+ * @param info 出力先
+ * @return 見つかったキーボードのフィールドの数（0: キーボードのフィールドがない）
+ */
+uint8_t keyboard_report_descriptor_parser(const uint8_t* desc, uint16_t desc_len,
+                                          keyboard_report_parser_info_t* info);
+
+/**
+ * Report プロトコルのキーボードレポートを変換する
+ * @param info keyboard_report_descriptor_parser の結果
+ * @param report 受信したレポート（Report ID 付きならその1バイトを含む）
+ * @param report_len レポート長
+ * @param state 変換後のキー状態
+ * @return 0: 成功, -1: キーボードのレポートではない, -2: ロールオーバーエラー（状態は変えない）
+ */
+int keyboard_report_parser(const keyboard_report_parser_info_t* info,
+                           const uint8_t* report, uint16_t report_len,
+                           keyboard_bitmap_t* state);
+
+/**
+ * Report プロトコルのメディアキー・システムキーのレポートを変換する
+ * メディアキーは USB_CONSUMER_KEYS 個まで、システムキーは先頭の1つだけを返す
+ * @param info keyboard_report_descriptor_parser の結果
+ * @param report 受信したレポート（Report ID 付きならその1バイトを含む）
+ * @param report_len レポート長
+ * @param state 変換後の状態（このレポートに含まれない方は変えない）
+ * @return 0: 成功, -1: Consumer / System Control のレポートではない
+ */
+int keyboard_control_report_parser(const keyboard_report_parser_info_t* info,
+                                   const uint8_t* report, uint16_t report_len,
+                                   keyboard_control_state_t* state);
+
+/**
+ * キーボード・メディアキーのほかにスティック・ボタン（Generic Desktop・Button ページ）の
+ * 入力もある Report ID のレポートか（ゲームパッドの Home ボタンの Consumer フィールドなど）
+ * @return true: ゲームパッドのパーサーにも渡す
+ */
+bool keyboard_report_has_other_inputs(const keyboard_report_parser_info_t* info,
+                                      const uint8_t* report, uint16_t report_len);
+
+/**
+ * Boot プロトコルのキーボードレポート（8バイト）を変換する
+ * @return 0: 成功, -1: 長さが足りない, -2: ロールオーバーエラー
+ */
+int keyboard_boot_report_parser(const uint8_t* report, uint16_t report_len, keyboard_bitmap_t* state);
+
+#endif // KEYBOARD_REPORT_PARSER_H
@@ -0,0 +1,288 @@
+#include "LinkLatency.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "tusb.h"
+#include "LinkMux.h"
+
+// 隣接ノードとの時刻同期の状態（Core1のみ更新）
+typedef struct {
+    uint32_t next_ping;         // 次に ping を送る時刻
+    bool ping_scheduled;
+    // 現在のウィンドウで最も往復遅延の小さいサンプル
+    uint8_t window_count;
+    int32_t window_offset;
+    uint32_t window_delay;
+    uint32_t window_time;
+    // 推定値: 相手の時計 - 自分の時計 = offset + drift * (now - ref_time)
+    bool synced;
+    int32_t offset;
+    uint32_t ref_time;
+    int32_t drift_ppb;
+    uint32_t delay;             // 採用したサンプルの往復遅延
+    uint32_t samples;
+} link_clock_t;
+
+// 片方向遅延のヒストグラム
+typedef struct {
+    uint32_t count;
+    uint32_t negative;          // 時刻同期の誤差で負になったもの
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[LINK_LATENCY_BUCKETS];
+} link_latency_hist_t;
+
+static link_clock_t clocks[LINK_PORT_COUNT];
+static link_latency_hist_t histograms[3];   // K, M, G
+static const char latency_types[3] = { 'K', 'M', 'G' };
+static const char* const latency_names[3] = { "keyboard", "mouse", "gamepad" };
+
+// エンドポイントにまだ渡していないマウス・ゲームパッドの最も古い受信時刻（Core1のみ）
+static uint32_t held_ingress[2];                    // M, G
+static bool held[2];
+
+static volatile bool latency_reset_request = false;   // Core0 -> Core1（クリアは Core1 が行う）
+
+static volatile uint32_t ingress_time = 0;
+static volatile bool ingress_marked = false;
+
+// 8桁HEXを読む
+static bool parse_hex32(const char* text, uint32_t* value)
+{
+    char hex[9];
+    for (int i = 0; i < 8; i++) {
+        char c = text[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+        hex[i] = c;
+    }
+    hex[8] = '\0';
+    *value = (uint32_t)strtoul(hex, NULL, 16);
+    return true;
+}
+
+static int32_t clock_offset_at(const link_clock_t* clock, uint32_t now)
+{
+    int64_t elapsed = (int32_t)(now - clock->ref_time);
+    return clock->offset + (int32_t)(elapsed * clock->drift_ppb / 1000000000LL);
+}
+
+//--------------------------------------------------------------------+
+// 時刻同期
+//--------------------------------------------------------------------+
+
+bool link_clock_poll_ping(int port, char* line, size_t size)
+{
+    if (port < 0 || port >= LINK_PORT_COUNT) return false;
+    link_clock_t* clock = &clocks[port];
+    uint32_t now = time_us_32();
+
+    if (clock->ping_scheduled && (int32_t)(now - clock->next_ping) < 0) {
+        return false;
+    }
+
+    // 最初のウィンドウが埋まるまでは短い間隔で送る
+    uint32_t interval_ms = clock->synced ? LINK_PING_INTERVAL_MS : LINK_PING_INTERVAL_MS / 10;
+    clock->next_ping = now + interval_ms * 1000;
+    clock->ping_scheduled = true;
+
+    snprintf(line, size, "P%08lX\n", (unsigned long)now);
+    return true;
+}
+
+// ping/pong 1往復分のサンプルを取り込む
+static void link_clock_add_sample(link_clock_t* clock, uint32_t t1, uint32_t t2, uint32_t t3, uint32_t t4)
+{
+    int32_t offset = ((int32_t)(t2 - t1) + (int32_t)(t3 - t4)) / 2;
+    int32_t delay = (int32_t)(t4 - t1) - (int32_t)(t3 - t2);
+    if (delay < 0) delay = 0;
+
+    clock->samples++;
+    if (clock->window_count == 0 || (uint32_t)delay < clock->window_delay) {
+        clock->window_offset = offset;
+        clock->window_delay = (uint32_t)delay;
+        clock->window_time = t4;
+    }
+    if (++clock->window_count < LINK_CLOCK_WINDOW) {
+        return;
+    }
+
+    // ウィンドウ内で最も遅延の小さいサンプルを採用し、前回との差からドリフトを求める
+    if (clock->synced) {
+        int32_t elapsed = (int32_t)(clock->window_time - clock->ref_time);
+        if (elapsed > 0) {
+            int64_t measured = (int64_t)(clock->window_offset - clock->offset) * 1000000000LL / elapsed;
+            clock->drift_ppb += (int32_t)((measured - clock->drift_ppb) / 4);
+        }
+    }
+    clock->offset = clock->window_offset;
+    clock->ref_time = clock->window_time;
+    clock->delay = clock->window_delay;
+    clock->synced = true;
+    clock->window_count = 0;
+}
+
+bool link_clock_handle_line(int port, const char* line, uint32_t rx_time, char* reply, size_t size)
+{
+    if (port < 0 || port >= LINK_PORT_COUNT) return false;
+
+    uint32_t t1, t2, t3;
+    if (line[0] == 'P') {
+        if (!parse_hex32(&line[1], &t1)) return false;
+        snprintf(reply, size, "Q%08lX%08lX%08lX\n",
+                 (unsigned long)t1, (unsigned long)rx_time, (unsigned long)time_us_32());
+        return true;
+    }
+
+    if (line[0] == 'Q') {
+        if (parse_hex32(&line[1], &t1) && parse_hex32(&line[9], &t2) && parse_hex32(&line[17], &t3)) {
+            link_clock_add_sample(&clocks[port], t1, t2, t3, rx_time);
+        }
+    }
+    return false;
+}
+
+bool link_clock_to_local(int port, uint32_t remote_time, uint32_t* local_time)
+{
+    if (port < 0 || port >= LINK_PORT_COUNT || !clocks[port].synced) return false;
+    *local_time = remote_time - (uint32_t)clock_offset_at(&clocks[port], time_us_32());
+    return true;
+}
+
+//--------------------------------------------------------------------+
+// 遅延計測
+//--------------------------------------------------------------------+
+
+void link_mark_ingress(void)
+{
+    ingress_time = time_us_32();
+    ingress_marked = true;
+}
+
+uint32_t link_ingress_time(void)
+{
+    if (get_core_num() == 1 && ingress_marked) {
+        return ingress_time;
+    }
+    return time_us_32();
+}
+
+static void link_latency_record(char type, uint32_t ingress)
+{
+    if (latency_reset_request) {
+        memset(histograms, 0, sizeof(histograms));
+        __dmb();
+        latency_reset_request = false;
+    }
+
+    link_latency_hist_t* hist = NULL;
+    if (type == 'N' || type == 'U') type = 'K';    // NKRO / media key frames share the keyboard histogram
+    if (type == 'A') type = 'M';                   // pointer warps share the mouse histogram
+    for (int i = 0; i < 3; i++) {
+        if (latency_types[i] == type) hist = &histograms[i];
+    }
+    if (!hist) return;
+
+    int32_t latency = (int32_t)(time_us_32() - ingress);
+    if (latency < 0) {
+        hist->negative++;
+        latency = 0;
+    }
+
+    // bucket 0: <1us, bucket n: [2^(n-1), 2^n)us
+    int bucket = latency == 0 ? 0 : 32 - __builtin_clz((uint32_t)latency);
+    if (bucket >= LINK_LATENCY_BUCKETS) bucket = LINK_LATENCY_BUCKETS - 1;
+
+    if (hist->count == 0 || (uint32_t)latency < hist->min) hist->min = (uint32_t)latency;
+    if ((uint32_t)latency > hist->max) hist->max = (uint32_t)latency;
+    hist->sum += (uint32_t)latency;
+    hist->count++;
+    hist->buckets[bucket]++;
+}
+
+// M/A -> 0, G -> 1, それ以外 -> -1
+static int held_index(char type)
+{
+    if (type == 'M' || type == 'A') return 0;
+    if (type == 'G') return 1;
+    return -1;
+}
+
+void link_latency_arrived(char type, uint32_t ingress)
+{
+    int index = held_index(type);
+    if (index < 0) {
+        link_latency_record(type, ingress);
+        return;
+    }
+    // まとめて送る場合は最初の入力から数える
+    if (!held[index] || (int32_t)(time_us_32() - held_ingress[index]) > LINK_LATENCY_HOLD_MAX_US) {
+        held_ingress[index] = ingress;
+        held[index] = true;
+    }
+}
+
+void link_latency_submitted(char type)
+{
+    int index = held_index(type);
+    if (index < 0 || !held[index]) return;
+    held[index] = false;
+    link_latency_record(type, held_ingress[index]);
+}
+
+void link_latency_reset(void)
+{
+    // Core1 が記録している最中に消さないよう、次の記録の前に Core1 に消してもらう
+    latency_reset_request = true;
+}
+
+void link_latency_print(void)
+{
+    char line[128];
+
+    for (int i = 0; i < LINK_PORT_COUNT; i++) {
+        link_clock_t* clock = &clocks[i];
+        const char* name = i == LINK_PORT_UP ? "up" : "down";
+        if (!clock->synced) {
+            snprintf(line, sizeof(line), "Clock %s: not synchronised (%lu samples)\r\n",
+                     name, (unsigned long)clock->samples);
+        } else {
+            snprintf(line, sizeof(line), "Clock %s: offset %ld us, drift %ld ppb, rtt %lu us, %lu samples\r\n",
+                     name, (long)clock_offset_at(clock, time_us_32()), (long)clock->drift_ppb,
+                     (unsigned long)clock->delay, (unsigned long)clock->samples);
+        }
+        tud_cdc_write_str(line);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        link_latency_hist_t* hist = &histograms[i];
+        if (hist->count == 0 || latency_reset_request) {
+            snprintf(line, sizeof(line), "Latency %s: no samples\r\n", latency_names[i]);
+            tud_cdc_write_str(line);
+            continue;
+        }
+        snprintf(line, sizeof(line), "Latency %s: n=%lu min=%lu avg=%lu max=%lu us (negative %lu)\r\n",
+                 latency_names[i], (unsigned long)hist->count, (unsigned long)hist->min,
+                 (unsigned long)(hist->sum / hist->count), (unsigned long)hist->max,
+                 (unsigned long)hist->negative);
+        tud_cdc_write_str(line);
+
+        for (int b = 0; b < LINK_LATENCY_BUCKETS; b++) {
+            if (hist->buckets[b] == 0) continue;
+            if (b == LINK_LATENCY_BUCKETS - 1) {
+                snprintf(line, sizeof(line), "  >=%6lu us: %lu\r\n",
+                         (unsigned long)(1u << (b - 1)), (unsigned long)hist->buckets[b]);
+            } else {
+                snprintf(line, sizeof(line), "  < %6lu us: %lu\r\n",
+                         (unsigned long)(1u << b), (unsigned long)hist->buckets[b]);
+            }
+            tud_cdc_write_str(line);
+        }
+        tud_cdc_write_flush();
+    }
+    tud_cdc_write_flush();
+}
@@ -0,0 +1,92 @@
+#ifndef LINKLATENCY_H
+#define LINKLATENCY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+//--------------------------------------------------------------------+
+// リンクの時刻同期と片方向遅延の計測
+//
+// 隣接ノード間で ping/pong を交換して相手の時計とのオフセットとドリフトを推定する
+// （NTP と同じ4タイムスタンプ方式）。
+//   ping : "P<t1:8桁HEX>\n"
+//   pong : "Q<t1><t2><t3>\n"   t2 = ping 受信時刻, t3 = pong 送信時刻（相手の時計）
+// ping/pong は隣接ノード間のみで、ルーティングしない。
+//
+// 入力フレーム（K/N/U/M/A/G）には受信時刻 "@<ts:8桁HEX>" を付ける。ts は
+// tuh_hid_report_received_cb に入った時刻で、転送するノードが自分の時計に
+// 換算して付け直す。自ノード宛てのフレームは USB デバイスのエンドポイントに渡した時点で
+// 経過時間を求め、種類ごとのヒストグラムに記録する。
+//   キーボード（K/N/U）: デコードしてすぐ送るので、処理した直後
+//   マウス・ゲームパッド（M/A/G）: SOF スケジューラ（SofScheduler.h）が次のフレームまで
+//     まとめることがあるので、tud_hid_n_report に渡したとき（まとめた中で最も古い入力の時刻）
+// エンドポイントに渡してから PC が取り出すまで（最大1フレーム）は含まない。
+//--------------------------------------------------------------------+
+
+#define LINK_PING_INTERVAL_MS   1000
+#define LINK_CLOCK_WINDOW       8       // 最小遅延のサンプルを選ぶ ping の数
+#define LINK_LATENCY_BUCKETS    16      // 2^n マイクロ秒ごとのビン（最後は 16ms 以上）
+#define LINK_LATENCY_HOLD_MAX_US 100000 // これより前から送られていない受信時刻は捨てる（動きのないフレームなど）
+
+/**
+ * ping を送る時刻なら ping 行を作る（Core1、link_task から呼ぶ）
+ * @param port ポート番号
+ * @param line 出力先バッファ
+ * @param size バッファサイズ
+ * @return true: line に ping 行を作った
+ */
+bool link_clock_poll_ping(int port, char* line, size_t size);
+
+/**
+ * 受信した ping/pong を処理する
+ * @param port 受信したポート
+ * @param line 受信行（改行なし）
+ * @param rx_time 受信時刻（time_us_32）
+ * @param reply ping への応答行の出力先
+ * @param size 応答バッファのサイズ
+ * @return true: reply に pong 行を作った
+ */
+bool link_clock_handle_line(int port, const char* line, uint32_t rx_time, char* reply, size_t size);
+
+/**
+ * 隣接ノードの時刻を自ノードの時刻に換算する
+ * @return true: 換算できた, false: まだ同期していない
+ */
+bool link_clock_to_local(int port, uint32_t remote_time, uint32_t* local_time);
+
+/**
+ * 入力フレームの受信時刻を記録する（tuh_hid_report_received_cb の先頭で呼ぶ）
+ */
+void link_mark_ingress(void);
+
+/**
+ * これから送る入力フレームに付ける受信時刻
+ * Core1 では最後に記録した受信時刻、Core0（Lua）では現在時刻
+ */
+uint32_t link_ingress_time(void);
+
+/**
+ * 自ノード宛てフレームを処理した（Core1、uart_process_frame の後に呼ぶ）
+ * キーボードはここで記録し、マウス・ゲームパッドは link_latency_submitted まで受信時刻を持っておく
+ * @param type フレーム種別（K/N/U/M/A/G）
+ * @param ingress_time 受信時刻（自ノードの時計）
+ */
+void link_latency_arrived(char type, uint32_t ingress_time);
+
+/**
+ * マウス（'M'）・ゲームパッド（'G'）のレポートをエンドポイントに渡した（Core1、tud_hid_n_report の直後）
+ */
+void link_latency_submitted(char type);
+
+/**
+ * 時刻同期の状態と遅延ヒストグラムをCDCへ出力する
+ */
+void link_latency_print(void);
+
+/**
+ * 遅延ヒストグラムをクリアする（要求だけ出し、Core1 が次に記録する前にクリアする）
+ */
+void link_latency_reset(void);
+
+#endif // LINKLATENCY_H
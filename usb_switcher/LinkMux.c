@@ -0,0 +1,873 @@
+#include "LinkMux.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/util/queue.h"
+#include "hardware/sync.h"
+#include "tusb.h"
+#include "UARTtask.h"
+#include "PioUart.h"
+#include "PioLink.h"
+#include "LinkLatency.h"
+#include "USBtask.h"
+#include "USBDeviceTask.h"
+#include "base64.h"
+#include "fstask.h"
+#include "LuaCache.h"
+
+// 送信キューの1要素
+typedef struct {
+    char text[LINK_LINE_MAX];
+} link_line_t;
+
+// 受信したバルクフラグメント（Core1 -> Core0）
+typedef struct {
+    char flag;
+    uint8_t len;
+    uint8_t data[LINK_BULK_FRAGMENT_SIZE];
+} link_fragment_t;
+
+// バルク送信の状態（所有者が Core0 -> Core1 -> Core0 と移る）
+typedef enum {
+    BULK_TX_IDLE = 0,   // Core0: 空き
+    BULK_TX_SENDING,    // Core1: 送信中
+    BULK_TX_DONE        // Core0: 送信完了、バッファ解放待ち
+} bulk_tx_state_t;
+
+typedef struct {
+    // 送信側
+    uint8_t* tx_data;
+    size_t tx_len;
+    size_t tx_offset;           // Core1のみ
+    volatile uint8_t tx_state;
+    uint8_t tx_credits;         // Core1のみ（F行受信で加算）
+    // 受信側
+    queue_t rx_queue;           // Core1 -> Core0
+    uint8_t* rx_data;           // Core0のみ
+    size_t rx_len;
+    bool rx_discard;            // 途中で破棄したメッセージの残りを捨てる
+    uint8_t credits_to_return;  // Core0のみ
+    // 統計
+    uint32_t tx_fragments;
+    uint32_t tx_messages;
+    uint32_t rx_fragments;
+    uint32_t rx_messages;
+    uint32_t rx_errors;
+} link_bulk_channel_t;
+
+// リンクポートごとの状態
+typedef struct {
+    const link_transport_t* transport;
+    bool enabled;
+    queue_t input_queue;
+    queue_t control_queue;
+    // 次に送るフレーム（改行なし、Core1のみ）
+    char tx_line[LINK_LINE_MAX];
+    uint16_t tx_len;
+    // 受信フレーム（Core1のみ）
+    char rx_line[LINK_LINE_MAX];
+    // 統計
+    uint32_t input_sent;
+    uint32_t control_sent;
+    uint32_t input_queue_full;
+    uint32_t rx_lines;
+    uint32_t forwarded;
+    uint32_t dropped;
+} link_port_t;
+
+static link_port_t ports[LINK_PORT_COUNT];
+static queue_t local_queue;     // link_line_t, Core0 -> Core1（自ノード宛て）
+static link_bulk_channel_t bulk_channels[LINK_BULK_CHANNELS];
+static uint8_t bulk_round_robin = 0;
+static bool link_mux_initialized = false;
+static bool downlink_enabled = false;
+static link_uplink_t uplink_type = LINK_UPLINK_UART;
+
+// 宛先ノード -> ポート（LINK_PORT_* / LINK_ROUTE_LOCAL）
+static uint8_t route_table[256];
+static bool route_table_configured = false;
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+static link_bulk_channel_t* get_bulk_channel(link_channel_t ch)
+{
+    if (ch < LINK_BULK_FIRST || ch >= LINK_CH_COUNT) {
+        return NULL;
+    }
+    return &bulk_channels[ch - LINK_BULK_FIRST];
+}
+
+static int parse_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// フレームヘッダ（type + 2桁HEX）から宛先を取り出す
+static int parse_frame_address(const char* line)
+{
+    if (line[0] == '\0' || line[1] == '\0' || line[2] == '\0') return -1;
+    int high = parse_hex_digit(line[1]);
+    int low = parse_hex_digit(line[2]);
+    if (high < 0 || low < 0) return -1;
+    return (high << 4) | low;
+}
+
+// 入力フレーム末尾の受信時刻 "@<ts>" を取り外し、自ノードの時計に換算する
+// port が負なら自ノードで付けた時刻としてそのまま返す
+static bool take_ingress_time(char* line, int port, uint32_t* local_time)
+{
+    char* at = strchr(line, '@');
+    if (!at) return false;
+    *at = '\0';
+
+    char* end;
+    uint32_t stamp = (uint32_t)strtoul(at + 1, &end, 16);
+    if (end != at + 9) return false;
+    if (port < 0) {
+        *local_time = stamp;
+        return true;
+    }
+    return link_clock_to_local(port, stamp, local_time);
+}
+
+//--------------------------------------------------------------------+
+// ルーティング
+//--------------------------------------------------------------------+
+
+void link_route_set(uint8_t addr, uint8_t route)
+{
+    if (!route_table_configured) {
+        memset(route_table, LINK_ROUTE_AUTO, sizeof(route_table));
+        route_table_configured = true;
+    }
+    route_table[addr] = route;
+}
+
+void link_set_downlink_enabled(bool enabled)
+{
+    downlink_enabled = enabled;
+}
+
+void link_set_uplink(link_uplink_t type)
+{
+    uplink_type = type;
+}
+
+bool link_is_local_address(uint8_t addr)
+{
+    // DEVICEID 未設定のノードは従来どおりすべて受け入れる
+    return device_id == 0xFF || addr == (uint8_t)device_id;
+}
+
+uint8_t link_local_address(void)
+{
+    return device_id == 0xFF ? LINK_ADDR_BROADCAST : (uint8_t)device_id;
+}
+
+// DEVICEID からルーティングテーブルを構築する
+// チェーンはアドレス順に並んでいるものとし、自分より大きいアドレスは下流、
+// 小さいアドレスは上流へ送る。ROUTE= で指定されたエントリはそのまま使う。
+static void build_route_table(void)
+{
+    if (!route_table_configured) {
+        memset(route_table, LINK_ROUTE_AUTO, sizeof(route_table));
+        route_table_configured = true;
+    }
+
+    for (int addr = 0; addr < 256; addr++) {
+        if (route_table[addr] != LINK_ROUTE_AUTO) {
+            continue;
+        }
+        if (device_id == 0xFF) {
+            // アドレス未設定のノード（チェーンの先頭）はすべて上流へ
+            route_table[addr] = LINK_PORT_UP;
+        } else if (addr == device_id) {
+            route_table[addr] = LINK_ROUTE_LOCAL;
+        } else if (addr > device_id && ports[LINK_PORT_DOWN].enabled) {
+            route_table[addr] = LINK_PORT_DOWN;
+        } else {
+            route_table[addr] = LINK_PORT_UP;
+        }
+    }
+}
+
+//--------------------------------------------------------------------+
+// 初期化
+//--------------------------------------------------------------------+
+
+static void link_port_init(link_port_id_t id, const link_transport_t* transport)
+{
+    link_port_t* port = &ports[id];
+    memset(port, 0, sizeof(link_port_t));
+    port->transport = transport;
+    queue_init(&port->input_queue, sizeof(link_line_t), LINK_INPUT_QUEUE_DEPTH);
+    queue_init(&port->control_queue, sizeof(link_line_t), LINK_CONTROL_QUEUE_DEPTH);
+    port->enabled = (transport != NULL);
+}
+
+void link_mux_init(void)
+{
+    if (link_mux_initialized) return;
+
+    link_transport_init();
+
+    const link_transport_t* up_transport = &uart_link_transport;
+    if (uplink_type == LINK_UPLINK_PIO) {
+        if (pio_link_init() == 0) {
+            up_transport = &pio_link_transport;
+        } else {
+            printf("Link: PIO link unavailable, using UART1\n");
+        }
+    } else if (uplink_type == LINK_UPLINK_CDC) {
+        up_transport = &link_cdc_transport;
+    } else if (uplink_type == LINK_UPLINK_LOOPBACK) {
+        up_transport = &link_loopback_transport;
+    }
+    link_port_init(LINK_PORT_UP, up_transport);
+
+    const link_transport_t* down_transport = NULL;
+    if (downlink_enabled) {
+        if (pio_uart_init() == 0) {
+            down_transport = &pio_uart_transport;
+        } else {
+            printf("Link: downstream PIO UART unavailable, forwarding disabled\n");
+        }
+    }
+    link_port_init(LINK_PORT_DOWN, down_transport);
+    queue_init(&local_queue, sizeof(link_line_t), LINK_LOCAL_QUEUE_DEPTH);
+
+    for (int i = 0; i < LINK_BULK_CHANNELS; i++) {
+        memset(&bulk_channels[i], 0, sizeof(link_bulk_channel_t));
+        bulk_channels[i].tx_credits = LINK_BULK_WINDOW;
+        queue_init(&bulk_channels[i].rx_queue, sizeof(link_fragment_t), LINK_BULK_WINDOW);
+    }
+
+    build_route_table();
+
+    __dmb();
+    link_mux_initialized = true;
+    printf("Link mux initialized: node %02X, downlink %s, %d bulk channels\n",
+           link_local_address(), ports[LINK_PORT_DOWN].enabled ? "on" : "off", LINK_BULK_CHANNELS);
+}
+
+//--------------------------------------------------------------------+
+// 送信
+//--------------------------------------------------------------------+
+
+static void link_port_pump(link_port_t* port);
+
+// 1行をポートの送信キューへ積む
+static bool link_port_enqueue(link_port_t* port, link_channel_t ch, const char* line)
+{
+    if (!port->enabled) return false;
+
+    queue_t* queue = (ch == LINK_CH_INPUT) ? &port->input_queue : &port->control_queue;
+
+    link_line_t entry;
+    strncpy(entry.text, line, sizeof(entry.text) - 1);
+    entry.text[sizeof(entry.text) - 1] = '\0';
+
+    if (get_core_num() == 1) {
+        // Core1（USBホスト側）からはキューが空くまで自分でポンプを回す
+        // 以前の uart_puts() と同じく、リンクが詰まっている間はホスト処理を待たせる
+        while (!queue_try_add(queue, &entry)) {
+            if (ch == LINK_CH_INPUT) port->input_queue_full++;
+            link_port_pump(port);
+        }
+        link_port_pump(port);
+    } else {
+        // Core0（FreeRTOSタスク）からはブロッキングで積む
+        if (queue_is_full(queue) && ch == LINK_CH_INPUT) port->input_queue_full++;
+        queue_add_blocking(queue, &entry);
+    }
+    return true;
+}
+
+// 自ノード宛ての行を処理する（Core1）。改行を除き、付いている受信時刻で遅延を記録する
+static void process_local_line(const char* line)
+{
+    char frame[LINK_LINE_MAX];
+    size_t len = strcspn(line, "\r\n");
+    if (len >= sizeof(frame)) return;
+    memcpy(frame, line, len);
+    frame[len] = '\0';
+    uint32_t ingress;
+    bool stamped = take_ingress_time(frame, -1, &ingress);
+    uart_process_frame(frame);
+    if (stamped) link_latency_arrived(frame[0], ingress);
+}
+
+bool link_send_line(link_channel_t ch, const char* line)
+{
+    if (!link_mux_initialized || !line) return false;
+    if (ch != LINK_CH_INPUT && ch != LINK_CH_CONTROL) return false;
+
+    int dst = parse_frame_address(line);
+    if (dst < 0) return false;
+
+    if (dst == LINK_ADDR_BROADCAST) {
+        bool sent = false;
+        for (int i = 0; i < LINK_PORT_COUNT; i++) {
+            sent |= link_port_enqueue(&ports[i], ch, line);
+        }
+        return sent;
+    }
+
+    uint8_t route = route_table[dst];
+    if (route == LINK_ROUTE_LOCAL) {
+        // 自ノード宛て（switch で自分を指定した場合など）。処理は Core1 で行う
+        if (get_core_num() == 1) {
+            process_local_line(line);
+        } else {
+            link_line_t entry;
+            strncpy(entry.text, line, sizeof(entry.text) - 1);
+            entry.text[sizeof(entry.text) - 1] = '\0';
+            queue_add_blocking(&local_queue, &entry);
+        }
+        return true;
+    }
+    if (route >= LINK_PORT_COUNT) return false;
+
+    return link_port_enqueue(&ports[route], ch, line);
+}
+
+// "<type><dst><base64>@<ts>\n" を組み立てて送信する
+static bool link_send_report(char type, uint8_t dst, const void* data, size_t len)
+{
+    char line[LINK_LINE_MAX];
+    line[0] = type;
+    line[1] = hex_digits[dst >> 4];
+    line[2] = hex_digits[dst & 0x0F];
+
+    int encoded = base64_encode((const uint8_t*)data, len, &line[3], sizeof(line) - 14);
+    if (encoded < 0) {
+        printf("Link: failed to encode '%c' frame\n", type);
+        return false;
+    }
+    // 受信時刻（tuh_hid_report_received_cb に入った時刻）を付ける
+    snprintf(&line[3 + encoded], sizeof(line) - 3 - encoded, "@%08lX\n", (unsigned long)link_ingress_time());
+
+    return link_send_line(LINK_CH_INPUT, line);
+}
+
+bool link_send_keyboard(uint8_t dst, const uint8_t report[8])
+{
+    return link_send_report('K', dst, report, 8);
+}
+
+bool link_send_keyboard_nkro(uint8_t dst, const uint8_t* state)
+{
+    return link_send_report('N', dst, state, sizeof(keyboard_bitmap_t));
+}
+
+bool link_send_control_keys(uint8_t dst, const uint16_t* consumer, uint8_t system)
+{
+    // Consumer の Usage（2バイト LE）を USB_CONSUMER_KEYS 個 + System
+    uint8_t data[USB_CONSUMER_KEYS * 2 + 1];
+    for (int i = 0; i < USB_CONSUMER_KEYS; i++) {
+        data[i * 2] = consumer[i] & 0xFF;
+        data[i * 2 + 1] = consumer[i] >> 8;
+    }
+    data[USB_CONSUMER_KEYS * 2] = system;
+    return link_send_report('U', dst, data, sizeof(data));
+}
+
+bool link_send_mouse(uint8_t dst, const mouse_report_t* report)
+{
+    return link_send_report('M', dst, report, sizeof(mouse_report_t));
+}
+
+bool link_send_pointer_warp(uint8_t dst, uint16_t x, uint16_t y)
+{
+    uint8_t data[4] = { x & 0xFF, x >> 8, y & 0xFF, y >> 8 };
+    return link_send_report('A', dst, data, sizeof(data));
+}
+
+bool link_send_gamepad(uint8_t dst, const uint8_t data[8])
+{
+    return link_send_report('G', dst, data, 8);
+}
+
+bool link_send_release_all(uint8_t dst)
+{
+    char line[8];
+    snprintf(line, sizeof(line), "0%02X\n", dst);
+    return link_send_line(LINK_CH_INPUT, line);
+}
+
+bool link_send_switch(uint8_t dst, uint8_t value)
+{
+    char line[16];
+    snprintf(line, sizeof(line), "C%02XS%02X\n", dst, value);
+    return link_send_line(LINK_CH_CONTROL, line);
+}
+
+bool link_bulk_send(link_channel_t ch, const uint8_t* data, size_t len)
+{
+    link_bulk_channel_t* bulk = get_bulk_channel(ch);
+    if (!link_mux_initialized || !bulk || !data || len == 0 || len > LINK_BULK_MAX_MESSAGE) {
+        return false;
+    }
+
+    // 前回の送信バッファが残っていれば解放
+    if (bulk->tx_state == BULK_TX_DONE) {
+        free(bulk->tx_data);
+        bulk->tx_data = NULL;
+        bulk->tx_state = BULK_TX_IDLE;
+    }
+    if (bulk->tx_state != BULK_TX_IDLE) {
+        return false;
+    }
+
+    uint8_t* copy = malloc(len);
+    if (!copy) {
+        printf("Link: failed to allocate %u bytes for bulk send\n", (unsigned)len);
+        return false;
+    }
+    memcpy(copy, data, len);
+
+    bulk->tx_data = copy;
+    bulk->tx_len = len;
+    bulk->tx_offset = 0;
+    __dmb();
+    bulk->tx_state = BULK_TX_SENDING;  // ここからCore1の所有
+    return true;
+}
+
+bool link_bulk_busy(link_channel_t ch)
+{
+    link_bulk_channel_t* bulk = get_bulk_channel(ch);
+    return bulk && bulk->tx_state == BULK_TX_SENDING;
+}
+
+int link_push_file(const char* filename)
+{
+    if (!filename || filename[0] == '\0') return -1;
+    if (link_bulk_busy(LINK_CH_BULK_FILE)) return 1;
+
+    lfs_ssize_t file_size = fstask_get_file_size(filename);
+    if (file_size < 0) {
+        return (int)file_size;
+    }
+
+    size_t name_len = strlen(filename) + 1;
+    size_t total = name_len + (size_t)file_size;
+    if (total > LINK_BULK_MAX_MESSAGE) {
+        printf("Link: file '%s' too large for push (%u bytes)\n", filename, (unsigned)total);
+        return -1;
+    }
+
+    // ペイロード: "<filename>\0<data>"（読み込み時の終端用に+1）
+    uint8_t* payload = malloc(total + 1);
+    if (!payload) return -1;
+
+    memcpy(payload, filename, name_len);
+    int bytes_read = 0;
+    if (file_size > 0) {
+        bytes_read = fstask_read_file(filename, (char*)payload + name_len, (size_t)file_size + 1);
+        if (bytes_read < 0) {
+            free(payload);
+            return bytes_read;
+        }
+    }
+
+    bool started = link_bulk_send(LINK_CH_BULK_FILE, payload, name_len + (size_t)bytes_read);
+    free(payload);
+    return started ? 0 : -1;
+}
+
+bool link_log(const char* text)
+{
+    if (!text || text[0] == '\0') return false;
+    return link_bulk_send(LINK_CH_BULK_LOG, (const uint8_t*)text, strlen(text));
+}
+
+// 次のバルクフラグメントを tx_line に組み立てる（Core1, UPポートのみ）
+static bool build_next_fragment(link_port_t* port)
+{
+    for (int i = 0; i < LINK_BULK_CHANNELS; i++) {
+        int index = (bulk_round_robin + i) % LINK_BULK_CHANNELS;
+        link_bulk_channel_t* bulk = &bulk_channels[index];
+
+        if (bulk->tx_state != BULK_TX_SENDING || bulk->tx_credits == 0) {
+            continue;
+        }
+
+        size_t remaining = bulk->tx_len - bulk->tx_offset;
+        size_t chunk = remaining > LINK_BULK_FRAGMENT_SIZE ? LINK_BULK_FRAGMENT_SIZE : remaining;
+        bool first = (bulk->tx_offset == 0);
+        bool last = (chunk == remaining);
+
+        char flag = first ? (last ? 'S' : 'F') : (last ? 'L' : 'M');
+        port->tx_line[0] = 'B';
+        port->tx_line[1] = '0' + (LINK_BULK_FIRST + index);
+        port->tx_line[2] = flag;
+        int encoded = base64_encode(bulk->tx_data + bulk->tx_offset, chunk, &port->tx_line[3], sizeof(port->tx_line) - 3);
+        if (encoded < 0) {
+            // 送れないメッセージは破棄
+            bulk->tx_state = BULK_TX_DONE;
+            continue;
+        }
+        port->tx_len = 3 + encoded;
+
+        bulk->tx_offset += chunk;
+        bulk->tx_credits--;
+        bulk->tx_fragments++;
+        if (last) {
+            bulk->tx_messages++;
+            bulk->tx_state = BULK_TX_DONE;  // Core0へ返却
+        }
+
+        bulk_round_robin = (index + 1) % LINK_BULK_CHANNELS;
+        return true;
+    }
+    return false;
+}
+
+// 次に送る行を選ぶ: INPUT > CONTROL > BULK
+static bool select_next_line(link_port_t* port)
+{
+    link_line_t entry;
+
+    if (queue_try_remove(&port->input_queue, &entry)) {
+        port->input_sent++;
+    } else if (queue_try_remove(&port->control_queue, &entry)) {
+        port->control_sent++;
+    } else if (port == &ports[LINK_PORT_UP]) {
+        return build_next_fragment(port);
+    } else {
+        return false;
+    }
+
+    // キューの行は改行付きなので外す（区切りはトランスポートが付ける）
+    port->tx_len = strcspn(entry.text, "\r\n");
+    memcpy(port->tx_line, entry.text, port->tx_len);
+    return port->tx_len > 0;
+}
+
+static void link_port_pump(link_port_t* port)
+{
+    // 送信側が空いている間は1フレームずつ渡す（ブロックしない）
+    while (port->transport->can_send() && select_next_line(port)) {
+        port->transport->send_frame(port->tx_line, port->tx_len);
+        port->tx_len = 0;
+    }
+}
+
+//--------------------------------------------------------------------+
+// 受信
+//--------------------------------------------------------------------+
+
+// バルクフラグメント・クレジット返却の処理（UPポートのみ）
+static void handle_bulk_line(const char* line)
+{
+    if (line[0] == 'F') {
+        // クレジット返却 "F<ch><n>"
+        link_bulk_channel_t* bulk = get_bulk_channel((link_channel_t)(line[1] - '0'));
+        int credits = line[2] - '0';
+        if (bulk && credits > 0 && credits <= LINK_BULK_WINDOW) {
+            bulk->tx_credits += credits;
+            if (bulk->tx_credits > LINK_BULK_WINDOW) {
+                bulk->tx_credits = LINK_BULK_WINDOW;
+            }
+        }
+        return;
+    }
+
+    // バルクフラグメント "B<ch><flag><base64>"
+    link_bulk_channel_t* bulk = get_bulk_channel((link_channel_t)(line[1] - '0'));
+    if (!bulk || line[2] == '\0') return;
+
+    link_fragment_t fragment;
+    fragment.flag = line[2];
+    int decoded = base64_decode(&line[3], strlen(&line[3]), fragment.data, sizeof(fragment.data));
+    if (decoded < 0) {
+        bulk->rx_errors++;
+        return;
+    }
+    fragment.len = (uint8_t)decoded;
+
+    // 送信側がクレジットを守っていれば溢れない
+    if (!queue_try_add(&bulk->rx_queue, &fragment)) {
+        bulk->rx_errors++;
+    }
+}
+
+// 受信した1行を処理する: 自ノード宛てなら処理、それ以外はデコードせず転送
+static void link_port_handle_line(link_port_t* port, const char* line)
+{
+    uint32_t rx_time = time_us_32();
+    int port_index = (int)(port - ports);
+    port->rx_lines++;
+
+    if (line[0] == 'B' || line[0] == 'F') {
+        if (port == &ports[LINK_PORT_UP]) {
+            handle_bulk_line(line);
+        }
+        return;
+    }
+
+    if (line[0] == 'P' || line[0] == 'Q') {
+        // 時刻同期の ping/pong（隣接ノード間のみ）
+        char reply[LINK_LINE_MAX];
+        if (link_clock_handle_line(port_index, line, rx_time, reply, sizeof(reply))) {
+            link_port_enqueue(port, LINK_CH_CONTROL, reply);
+        }
+        return;
+    }
+
+    int dst = parse_frame_address(line);
+    if (dst < 0) {
+        port->dropped++;
+        return;
+    }
+
+    link_channel_t ch = (line[0] == 'C') ? LINK_CH_CONTROL : LINK_CH_INPUT;
+    char frame[LINK_LINE_MAX];
+    // 改行と "@XXXXXXXX" を足しても切り詰めない大きさ（キューに入るかは下で確かめる）
+    char forward[LINK_LINE_MAX + 10];
+
+    // 受信時刻は相手の時計なので、自ノードの時計に換算して付け直す
+    strncpy(frame, line, sizeof(frame) - 1);
+    frame[sizeof(frame) - 1] = '\0';
+    uint32_t ingress;
+    bool stamped = take_ingress_time(frame, port_index, &ingress);
+    int forward_len = -1;
+    if (stamped) {
+        forward_len = snprintf(forward, sizeof(forward), "%s@%08lX\n", frame, (unsigned long)ingress);
+    }
+    if (forward_len < 0 || forward_len >= LINK_LINE_MAX) {
+        // 受信時刻を付けると1行に収まらないときは付けずに流す
+        forward_len = snprintf(forward, sizeof(forward), "%s\n", frame);
+    }
+    if (forward_len < 0 || forward_len >= LINK_LINE_MAX) {
+        // 改行も入らない長さのフレームは、切り詰めて壊れたまま流さず捨てる
+        port->dropped++;
+        return;
+    }
+
+    if (dst == LINK_ADDR_BROADCAST) {
+        // ブロードキャストは受信ポート以外にも流す
+        for (int i = 0; i < LINK_PORT_COUNT; i++) {
+            if (&ports[i] != port && ports[i].enabled) {
+                link_port_enqueue(&ports[i], ch, forward);
+                port->forwarded++;
+            }
+        }
+    } else if (!link_is_local_address((uint8_t)dst)) {
+        uint8_t route = route_table[dst];
+        if (route < LINK_PORT_COUNT && &ports[route] != port && ports[route].enabled) {
+            link_port_enqueue(&ports[route], ch, forward);
+            port->forwarded++;
+        } else {
+            // 経路がない、または来た方向へ戻すことになるフレームは捨てる
+            port->dropped++;
+        }
+        return;
+    }
+
+    uart_process_frame(frame);
+    if (stamped) {
+        link_latency_arrived(frame[0], ingress);
+    }
+}
+
+static void link_port_receive(link_port_t* port)
+{
+    while (port->transport->poll_frame(port->rx_line, sizeof(port->rx_line)) > 0) {
+        link_port_handle_line(port, port->rx_line);
+    }
+}
+
+void link_task(void)
+{
+    if (!link_mux_initialized) return;
+
+    link_line_t entry;
+    while (queue_try_remove(&local_queue, &entry)) {
+        process_local_line(entry.text);
+    }
+
+    for (int i = 0; i < LINK_PORT_COUNT; i++) {
+        if (ports[i].enabled) {
+            char ping[LINK_LINE_MAX];
+            if (link_clock_poll_ping(i, ping, sizeof(ping))) {
+                link_port_enqueue(&ports[i], LINK_CH_CONTROL, ping);
+            }
+            link_port_receive(&ports[i]);
+            link_port_pump(&ports[i]);
+        }
+    }
+}
+
+// 組み立て完了したメッセージの配送（Core0）
+static void deliver_bulk_message(link_channel_t ch, link_bulk_channel_t* bulk)
+{
+    bulk->rx_messages++;
+
+    if (ch == LINK_CH_BULK_FILE) {
+        // "<filename>\0<data>"
+        size_t name_len = strnlen((const char*)bulk->rx_data, bulk->rx_len);
+        if (name_len == 0 || name_len >= bulk->rx_len) {
+            bulk->rx_errors++;
+            return;
+        }
+        const char* filename = (const char*)bulk->rx_data;
+        const uint8_t* data = bulk->rx_data + name_len + 1;
+        size_t data_len = bulk->rx_len - name_len - 1;
+
+        int result = data_len > 0 ? fstask_write_file(filename, data, data_len) : -1;
+
+        char message[96];
+        if (result >= 0) {
+            lua_cache_schedule(filename);
+            snprintf(message, sizeof(message), "\r\nLink: received file '%s' (%u bytes)\r\n", filename, (unsigned)data_len);
+        } else {
+            snprintf(message, sizeof(message), "\r\nLink: failed to store file '%s' (%d)\r\n", filename, result);
+        }
+        printf("%s", message + 2);
+        tud_cdc_write_str(message);
+        tud_cdc_write_flush();
+    } else if (ch == LINK_CH_BULK_LOG) {
+        tud_cdc_write_str("\r\n[peer] ");
+        tud_cdc_write((const char*)bulk->rx_data, bulk->rx_len);
+        tud_cdc_write_str("\r\n");
+        tud_cdc_write_flush();
+    }
+}
+
+static void return_credits(link_channel_t ch, link_bulk_channel_t* bulk)
+{
+    if (bulk->credits_to_return == 0) return;
+
+    char line[8];
+    snprintf(line, sizeof(line), "F%d%d\n", ch, bulk->credits_to_return);
+    link_port_enqueue(&ports[LINK_PORT_UP], LINK_CH_CONTROL, line);
+    bulk->credits_to_return = 0;
+}
+
+void link_bulk_task(void)
+{
+    if (!link_mux_initialized) return;
+
+    for (int i = 0; i < LINK_BULK_CHANNELS; i++) {
+        link_channel_t ch = (link_channel_t)(LINK_BULK_FIRST + i);
+        link_bulk_channel_t* bulk = &bulk_channels[i];
+        link_fragment_t fragment;
+
+        // 送信完了したバッファの解放
+        if (bulk->tx_state == BULK_TX_DONE) {
+            free(bulk->tx_data);
+            bulk->tx_data = NULL;
+            bulk->tx_state = BULK_TX_IDLE;
+        }
+
+        while (queue_try_remove(&bulk->rx_queue, &fragment)) {
+            bulk->rx_fragments++;
+            bulk->credits_to_return++;
+
+            if (fragment.flag == 'S' || fragment.flag == 'F') {
+                // 新しいメッセージの開始
+                bulk->rx_len = 0;
+                bulk->rx_discard = false;
+                if (!bulk->rx_data) {
+                    bulk->rx_data = malloc(LINK_BULK_MAX_MESSAGE);
+                }
+            }
+
+            if (!bulk->rx_data || bulk->rx_discard || bulk->rx_len + fragment.len > LINK_BULK_MAX_MESSAGE) {
+                if (!bulk->rx_discard) bulk->rx_errors++;
+                bulk->rx_discard = true;
+            } else {
+                memcpy(bulk->rx_data + bulk->rx_len, fragment.data, fragment.len);
+                bulk->rx_len += fragment.len;
+            }
+
+            if ((fragment.flag == 'S' || fragment.flag == 'L') && !bulk->rx_discard) {
+                deliver_bulk_message(ch, bulk);
+                free(bulk->rx_data);
+                bulk->rx_data = NULL;
+                bulk->rx_len = 0;
+            }
+
+            // 窓の半分を消費したらまとめて返却
+            if (bulk->credits_to_return >= LINK_BULK_WINDOW / 2) {
+                return_credits(ch, bulk);
+            }
+        }
+
+        // キューが空になったら端数も返す
+        return_credits(ch, bulk);
+    }
+}
+
+const link_transport_stats_t* link_port_stats(link_port_id_t port)
+{
+    if (port >= LINK_PORT_COUNT || !ports[port].enabled) return NULL;
+    return ports[port].transport->stats;
+}
+
+void link_print_status(void)
+{
+    char line[128];
+
+    snprintf(line, sizeof(line), "Link node: %02X (DEVICEID %s)\r\n",
+             link_local_address(), device_id == 0xFF ? "not set, accepting all" : "set");
+    tud_cdc_write_str(line);
+
+    for (int i = 0; i < LINK_PORT_COUNT; i++) {
+        link_port_t* port = &ports[i];
+        if (!port->enabled) {
+            snprintf(line, sizeof(line), "Port %s: disabled\r\n", i == LINK_PORT_UP ? "up" : "down");
+            tud_cdc_write_str(line);
+            continue;
+        }
+        snprintf(line, sizeof(line),
+                 "Port %s (%s): input=%lu ctrl=%lu queued=%u/%u full=%lu rx=%lu fwd=%lu drop=%lu\r\n",
+                 i == LINK_PORT_UP ? "up" : "down", port->transport->name,
+                 (unsigned long)port->input_sent, (unsigned long)port->control_sent,
+                 queue_get_level(&port->input_queue), queue_get_level(&port->control_queue),
+                 (unsigned long)port->input_queue_full, (unsigned long)port->rx_lines,
+                 (unsigned long)port->forwarded, (unsigned long)port->dropped);
+        tud_cdc_write_str(line);
+
+        link_transport_stats_t* stats = port->transport->stats;
+        snprintf(line, sizeof(line), "  frames tx=%lu rx=%lu, bytes tx=%lu rx=%lu, errors=%lu\r\n",
+                 (unsigned long)stats->frames_sent, (unsigned long)stats->frames_received,
+                 (unsigned long)stats->bytes_sent, (unsigned long)stats->bytes_received,
+                 (unsigned long)stats->errors);
+        tud_cdc_write_str(line);
+    }
+
+    static const char* const bulk_names[LINK_BULK_CHANNELS] = { "file", "log" };
+    for (int i = 0; i < LINK_BULK_CHANNELS; i++) {
+        link_bulk_channel_t* bulk = &bulk_channels[i];
+        snprintf(line, sizeof(line),
+                 "Bulk %-4s: %s credits=%u tx=%lu/%lu rx=%lu/%lu err=%lu\r\n",
+                 bulk_names[i],
+                 bulk->tx_state == BULK_TX_SENDING ? "busy" : "idle",
+                 bulk->tx_credits,
+                 (unsigned long)bulk->tx_messages, (unsigned long)bulk->tx_fragments,
+                 (unsigned long)bulk->rx_messages, (unsigned long)bulk->rx_fragments,
+                 (unsigned long)bulk->rx_errors);
+        tud_cdc_write_str(line);
+    }
+
+    // ルーティングテーブルを連続範囲ごとに表示
+    int start = 0;
+    for (int addr = 1; addr <= 255; addr++) {
+        if (addr == 255 || route_table[addr] != route_table[start]) {
+            uint8_t route = route_table[start];
+            const char* target = route == LINK_ROUTE_LOCAL ? "local" :
+                                 route == LINK_PORT_DOWN ? "down" : "up";
+            snprintf(line, sizeof(line), "Route %02X-%02X -> %s\r\n", start, addr - 1, target);
+            tud_cdc_write_str(line);
+            start = addr;
+        }
+    }
+    tud_cdc_write_flush();
+}
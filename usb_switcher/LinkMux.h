@@ -0,0 +1,184 @@
+#ifndef LINKMUX_H
+#define LINKMUX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "MouseReportParser.h"
+#include "LinkTransport.h"
+
+//--------------------------------------------------------------------+
+// Pico間リンクのチャネル多重化とルーティング
+//
+// 行単位のテキストプロトコル（"K01xxxx\n" 等）はそのままに、送信側で
+// チャネルごとにキューを分けて優先度付きで送出する。
+//   - INPUT   : K/N/U/M/A/G/0 行。最優先（strict priority）
+//   - CONTROL : C 行とクレジット返却（F 行）
+//   - BULK    : ファイル・ログ転送。フラグメント化し、クレジット制御
+// バルクは入力/制御キューが空のときに1フラグメントずつしか送らないので、
+// 大きなファイル転送中でもキー入力の遅延は最大1フラグメント分に収まる。
+//
+// アドレス付きフレーム : "<type><dst:2桁HEX><payload>\n"
+//   type = K(キーボード) N(NKRO キーボード) U(メディア・システムキー) M(マウス)
+//          A(絶対座標ポインタ) G(ゲームパッド) 0(全キー解放) C(制御)
+//   dst  = 宛先ノード（DEVICEID）。FF はブロードキャスト
+//   自ノード宛て以外のフレームはデコードせずにルーティングテーブルに従って転送する。
+// 入力フレーム（K/N/U/M/A/G）の末尾には受信時刻 "@<ts:8桁HEX>" が付く（LinkLatency.h）
+// 制御フレーム         : "C<dst>S<value:2桁HEX>\n"  宛先の USB_output_switch を設定
+// バルクフラグメント   : "B<ch><flag><base64>\n"  flag = S(単独) F(先頭) M(中間) L(最後)
+// クレジット返却       : "F<ch><n>\n"              n = 1..9 フラグメント
+// 時刻同期           : "P<t1>\n" / "Q<t1><t2><t3>\n"  隣接ノード間のみ
+// バルクとクレジットは隣接ノード間（UPポート）のみで、ルーティングしない。
+//--------------------------------------------------------------------+
+
+typedef enum {
+    LINK_CH_INPUT = 0,      // キーボード/マウス/ゲームパッド入力
+    LINK_CH_CONTROL,        // 切り替え制御・クレジット返却
+    LINK_CH_BULK_FILE,      // ファイル転送（スクリプト・設定）
+    LINK_CH_BULK_LOG,       // ログストリーム
+    LINK_CH_COUNT
+} link_channel_t;
+
+// リンクポート
+typedef enum {
+    LINK_PORT_UP = 0,       // UART1 / PIO 同期リンク / CDC / ループバック（ホスト側Picoへ）
+    LINK_PORT_DOWN,         // PIO UART（デイジーチェーンの次ノードへ）
+    LINK_PORT_COUNT
+} link_port_id_t;
+
+// ルーティングテーブルの値（LINK_PORT_* 以外）
+#define LINK_ROUTE_LOCAL        0xFE    // 自ノードで処理
+#define LINK_ROUTE_AUTO         0xFF    // DEVICEID から自動決定
+
+#define LINK_ADDR_BROADCAST     0xFF    // 全ノード宛て（DEVICEID 未設定ノードの受信アドレスも兼ねる）
+
+#define LINK_BULK_FIRST         LINK_CH_BULK_FILE
+#define LINK_BULK_CHANNELS      (LINK_CH_COUNT - LINK_BULK_FIRST)
+
+#define LINK_LINE_MAX           LINK_FRAME_MAX  // 1行の最大長（改行・終端含む）
+#define LINK_INPUT_QUEUE_DEPTH  16
+#define LINK_CONTROL_QUEUE_DEPTH 8
+#define LINK_LOCAL_QUEUE_DEPTH  8       // Core0 から自ノード宛てに送ったフレーム（Core1 が処理する）
+#define LINK_BULK_FRAGMENT_SIZE 24      // 1フラグメントのペイロード（base64で32文字）
+#define LINK_BULK_WINDOW        4       // 受信側の受け入れスロット数 = 初期クレジット
+#define LINK_BULK_MAX_MESSAGE   8192    // 1メッセージの最大サイズ
+
+// 上流ポートのトランスポート（設定ファイルの LINK=）
+typedef enum {
+    LINK_UPLINK_UART = 0,   // UART1
+    LINK_UPLINK_PIO,        // PIO 同期リンク
+    LINK_UPLINK_CDC,        // USB CDC（PC 側のシミュレータと接続）
+    LINK_UPLINK_LOOPBACK    // 自分自身（プロトコルの自己テスト）
+} link_uplink_t;
+
+/**
+ * リンク多重化レイヤーの初期化（設定ファイル読み込み後に呼ぶ）
+ * DEVICEID と ROUTE= 設定からルーティングテーブルを構築し、
+ * DOWNLINK=ON なら下流ポート（PIO UART）を有効にする。
+ */
+void link_mux_init(void);
+
+/**
+ * ルーティングテーブルの静的エントリを設定する（設定ファイルの ROUTE= から）
+ * @param addr 宛先ノード
+ * @param route LINK_PORT_UP, LINK_PORT_DOWN または LINK_ROUTE_LOCAL
+ */
+void link_route_set(uint8_t addr, uint8_t route);
+
+/**
+ * 下流ポート（PIO UART）の有効/無効を設定する（link_mux_init 前に呼ぶ）
+ */
+void link_set_downlink_enabled(bool enabled);
+
+/**
+ * 上流ポートのトランスポートを設定する（link_mux_init 前に呼ぶ）
+ * PIO 同期リンクを初期化できなかった場合は UART1 で動作する。
+ */
+void link_set_uplink(link_uplink_t type);
+
+/**
+ * 自ノード宛てのアドレスかどうか
+ */
+bool link_is_local_address(uint8_t addr);
+
+/**
+ * アドレス付きフレーム1行をルーティングして送信キューへ積む
+ * 宛先が自ノードなら Core1 で処理する（Core1 から呼んだ場合はその場で、Core0 からは
+ * キューに積んで次の link_task で。USB デバイスのレポートと出力先の状態は Core1 だけが触る）。
+ * Core1から呼んだ場合は送信ポンプを回し、キューが満杯の場合は空くまで待つ。
+ * @param ch LINK_CH_INPUT または LINK_CH_CONTROL
+ * @param line 改行を含む送信行
+ * @return true: 成功, false: 引数エラー・経路なし
+ */
+bool link_send_line(link_channel_t ch, const char* line);
+
+// 入力フレームの送信（base64 エンコードして link_send_line へ）
+bool link_send_keyboard(uint8_t dst, const uint8_t report[8]);
+bool link_send_keyboard_nkro(uint8_t dst, const uint8_t* state);   // keyboard_bitmap_t
+bool link_send_control_keys(uint8_t dst, const uint16_t* consumer, uint8_t system);  // USB_CONSUMER_KEYS 個
+bool link_send_mouse(uint8_t dst, const mouse_report_t* report);
+bool link_send_pointer_warp(uint8_t dst, uint16_t x, uint16_t y);  // 0-POINTER_ABS_MAX
+bool link_send_gamepad(uint8_t dst, const uint8_t data[8]);
+bool link_send_release_all(uint8_t dst);
+
+/**
+ * 宛先ノードの USB_output_switch を設定する制御フレームを送る
+ */
+bool link_send_switch(uint8_t dst, uint8_t value);
+
+/**
+ * 宛先ノードの USB_output_switch を指定して自ノードへ出力させるための値
+ * （DEVICEID 未設定ならブロードキャスト）
+ */
+uint8_t link_local_address(void);
+
+/**
+ * バルクチャネルでメッセージを送信する（データはコピーされる）
+ * @param ch LINK_CH_BULK_FILE または LINK_CH_BULK_LOG
+ * @param data 送信データ
+ * @param len データ長（LINK_BULK_MAX_MESSAGE 以下）
+ * @return true: 送信開始, false: 送信中またはエラー
+ */
+bool link_bulk_send(link_channel_t ch, const uint8_t* data, size_t len);
+
+/**
+ * バルクチャネルが送信中かどうか
+ */
+bool link_bulk_busy(link_channel_t ch);
+
+/**
+ * LittleFS上のファイルを相手側Picoへ転送する（Core0から呼ぶ）
+ * @return 0: 成功, 1: 別の転送が進行中, 負の値: エラー
+ */
+int link_push_file(const char* filename);
+
+/**
+ * ログ文字列を相手側Picoへ送る
+ * @return true: 送信開始, false: 送信中またはエラー
+ */
+bool link_log(const char* text);
+
+/**
+ * リンクの受信処理と送信ポンプ（Core1のループから呼ぶ）
+ * Core0 から自ノード宛てに送ったフレームと各ポートの受信行を処理し、TX FIFOに空きがある分だけ書き込む。
+ */
+void link_task(void);
+
+/**
+ * 受信済みバルクフラグメントの組み立てと配送（Core0のタスクから呼ぶ）
+ * LittleFSへの書き込みはここで行う。
+ */
+void link_bulk_task(void);
+
+/**
+ * ポートのトランスポートの統計
+ * @return 統計（ポートが無効なら NULL）
+ */
+const link_transport_stats_t* link_port_stats(link_port_id_t port);
+
+/**
+ * リンクの統計情報をCDCへ出力する
+ */
+void link_print_status(void);
+
+#endif // LINKMUX_H
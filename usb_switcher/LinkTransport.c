@@ -0,0 +1,231 @@
+#include "LinkTransport.h"
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/util/queue.h"
+#include "tusb.h"
+
+typedef struct {
+    char text[LINK_FRAME_MAX];
+} link_frame_t;
+
+//--------------------------------------------------------------------+
+// バイトストリームアダプタ
+//--------------------------------------------------------------------+
+
+// 送信中の行を FIFO に空きがある分だけ書き込む（ブロックしない）
+static void link_stream_drain(link_stream_t* stream)
+{
+    while (stream->tx_pos < stream->tx_len && stream->is_writable()) {
+        stream->putc(stream->tx_line[stream->tx_pos++]);
+    }
+}
+
+bool link_stream_can_send(link_stream_t* stream)
+{
+    link_stream_drain(stream);
+    return stream->tx_pos >= stream->tx_len;
+}
+
+bool link_stream_send(link_stream_t* stream, const char* frame, size_t len)
+{
+    if (!link_stream_can_send(stream) || len >= LINK_FRAME_MAX) {
+        return false;
+    }
+    memcpy(stream->tx_line, frame, len);
+    stream->tx_line[len] = '\n';
+    stream->tx_len = (uint16_t)(len + 1);
+    stream->tx_pos = 0;
+    stream->stats.frames_sent++;
+    stream->stats.bytes_sent += len + 1;
+    link_stream_drain(stream);
+    return true;
+}
+
+size_t link_stream_poll(link_stream_t* stream, char* frame, size_t size)
+{
+    link_stream_drain(stream);
+
+    while (stream->is_readable()) {
+        char c = stream->getc();
+        stream->stats.bytes_received++;
+
+        if (c == '\n' || c == '\r' || c == '\0') {
+            size_t len = stream->rx_index;
+            stream->rx_index = 0;
+            if (len == 0) continue;
+            if (len >= size) {
+                stream->stats.errors++;
+                continue;
+            }
+            memcpy(frame, stream->rx_line, len);
+            frame[len] = '\0';
+            stream->stats.frames_received++;
+            return len;
+        } else if (stream->rx_index < LINK_FRAME_MAX - 1) {
+            stream->rx_line[stream->rx_index++] = c;
+        } else {
+            // Buffer overflow - reset buffer
+            stream->rx_index = 0;
+            stream->stats.errors++;
+        }
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------+
+// CDC トランスポート
+// 受信は Core0 の CDC コンソールからキュー経由で Core1 へ渡す。
+// 送信も Core1 から CDC の FIFO へ直接書かず、キュー経由で Core0 のコンソールに
+// 書かせる（コンソールの出力と1行の途中で混ざらないように）
+//--------------------------------------------------------------------+
+
+static queue_t cdc_rx_queue;
+static queue_t cdc_tx_queue;
+static link_transport_stats_t cdc_stats;
+
+// ループバック
+static queue_t loopback_queue;
+static link_transport_stats_t loopback_stats;
+
+static bool link_transport_initialized = false;
+
+void link_transport_init(void)
+{
+    if (link_transport_initialized) return;
+    queue_init(&cdc_rx_queue, sizeof(link_frame_t), LINK_LOOPBACK_DEPTH);
+    queue_init(&cdc_tx_queue, sizeof(link_frame_t), LINK_LOOPBACK_DEPTH);
+    queue_init(&loopback_queue, sizeof(link_frame_t), LINK_LOOPBACK_DEPTH);
+    link_transport_initialized = true;
+}
+
+void link_cdc_receive_line(const char* frame)
+{
+    if (!link_transport_initialized) return;
+
+    link_frame_t entry;
+    strncpy(entry.text, frame, sizeof(entry.text) - 1);
+    entry.text[sizeof(entry.text) - 1] = '\0';
+    if (!queue_try_add(&cdc_rx_queue, &entry)) {
+        cdc_stats.errors++;
+    }
+}
+
+void link_cdc_tx_task(void)
+{
+    if (!link_transport_initialized) return;
+
+    link_frame_t entry;
+    while (queue_try_peek(&cdc_tx_queue, &entry)) {
+        if (tud_cdc_connected()) {
+            // 1フレーム分の空きができるまでキューに残す（行を分割して書かない）
+            if (tud_cdc_write_available() < LINK_FRAME_MAX + 2) break;
+            char prefix = LINK_CDC_FRAME_PREFIX;
+            tud_cdc_write(&prefix, 1);
+            tud_cdc_write_str(entry.text);
+            tud_cdc_write_str("\r\n");
+        } else {
+            // キューに入れた後で切断された
+            cdc_stats.errors++;
+        }
+        queue_try_remove(&cdc_tx_queue, &entry);
+    }
+    tud_cdc_write_flush();
+}
+
+static bool cdc_can_send(void)
+{
+    // 未接続の間は捨てる（送信側を詰まらせない）
+    return !tud_cdc_connected() || !queue_is_full(&cdc_tx_queue);
+}
+
+static bool cdc_send_frame(const char* frame, size_t len)
+{
+    if (!tud_cdc_connected()) {
+        cdc_stats.errors++;
+        return false;
+    }
+    link_frame_t entry;
+    if (len >= sizeof(entry.text)) return false;
+    memcpy(entry.text, frame, len);
+    entry.text[len] = '\0';
+    if (!queue_try_add(&cdc_tx_queue, &entry)) {
+        cdc_stats.errors++;
+        return false;
+    }
+    cdc_stats.frames_sent++;
+    cdc_stats.bytes_sent += len + 3;
+    return true;
+}
+
+static size_t cdc_poll_frame(char* frame, size_t size)
+{
+    link_frame_t entry;
+    if (!queue_try_remove(&cdc_rx_queue, &entry)) return 0;
+
+    size_t len = strlen(entry.text);
+    if (len == 0 || len >= size) {
+        cdc_stats.errors++;
+        return 0;
+    }
+    memcpy(frame, entry.text, len + 1);
+    cdc_stats.frames_received++;
+    cdc_stats.bytes_received += len;
+    return len;
+}
+
+const link_transport_t link_cdc_transport = {
+    .name = "cdc",
+    .can_send = cdc_can_send,
+    .send_frame = cdc_send_frame,
+    .poll_frame = cdc_poll_frame,
+    .stats = &cdc_stats,
+};
+
+//--------------------------------------------------------------------+
+// ループバックトランスポート
+//--------------------------------------------------------------------+
+
+static bool loopback_can_send(void)
+{
+    return !queue_is_full(&loopback_queue);
+}
+
+static bool loopback_send_frame(const char* frame, size_t len)
+{
+    link_frame_t entry;
+    if (len >= sizeof(entry.text)) return false;
+    memcpy(entry.text, frame, len);
+    entry.text[len] = '\0';
+    if (!queue_try_add(&loopback_queue, &entry)) {
+        loopback_stats.errors++;
+        return false;
+    }
+    loopback_stats.frames_sent++;
+    loopback_stats.bytes_sent += len;
+    return true;
+}
+
+static size_t loopback_poll_frame(char* frame, size_t size)
+{
+    link_frame_t entry;
+    if (!queue_try_remove(&loopback_queue, &entry)) return 0;
+
+    size_t len = strlen(entry.text);
+    if (len >= size) {
+        loopback_stats.errors++;
+        return 0;
+    }
+    memcpy(frame, entry.text, len + 1);
+    loopback_stats.frames_received++;
+    loopback_stats.bytes_received += len;
+    return len;
+}
+
+const link_transport_t link_loopback_transport = {
+    .name = "loopback",
+    .can_send = loopback_can_send,
+    .send_frame = loopback_send_frame,
+    .poll_frame = loopback_poll_frame,
+    .stats = &loopback_stats,
+};
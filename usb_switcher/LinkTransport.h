@@ -0,0 +1,92 @@
+#ifndef LINKTRANSPORT_H
+#define LINKTRANSPORT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+//--------------------------------------------------------------------+
+// リンクのトランスポート
+//
+// LinkMux はフレーム（改行なしの1行）単位でトランスポートとやり取りする。
+// トランスポートを追加するときは link_transport_t を実装して link_mux に渡すだけで、
+// 入力処理やルーティングには手を入れなくてよい。
+//   - uart1     : UART1（UARTtask.c）
+//   - pio-uart  : 下流ポートの PIO UART（PioUart.c）
+//   - pio-link  : PIO 同期リンク（PioLink.c）
+//   - cdc       : USB CDC。"~" で始まる行をリンクのフレームとして扱う（PC 側のシミュレータ用）
+//   - loopback  : 送ったフレームがそのまま受信される（プロトコルの自己テスト用）
+//--------------------------------------------------------------------+
+
+#define LINK_FRAME_MAX          80      // 1フレームの最大長（終端含む）
+#define LINK_CDC_FRAME_PREFIX   '~'
+#define LINK_LOOPBACK_DEPTH     16
+
+// トランスポートの統計
+typedef struct {
+    uint32_t frames_sent;
+    uint32_t frames_received;
+    uint32_t bytes_sent;
+    uint32_t bytes_received;
+    uint32_t errors;            // 破棄したフレーム・同期外れなど
+} link_transport_stats_t;
+
+typedef struct {
+    const char* name;
+    /** 1フレーム送れる状態か（ブロックしない） */
+    bool (*can_send)(void);
+    /** 1フレーム送る（frame は改行なし、len は LINK_FRAME_MAX 未満） */
+    bool (*send_frame)(const char* frame, size_t len);
+    /** 受信済みのフレームを1つ取り出す。終端付きで frame に書き、長さを返す（なければ 0） */
+    size_t (*poll_frame)(char* frame, size_t size);
+    link_transport_stats_t* stats;
+} link_transport_t;
+
+//--------------------------------------------------------------------+
+// バイトストリーム（UART 系）を改行区切りのフレームにするアダプタ
+//--------------------------------------------------------------------+
+
+typedef struct {
+    bool (*is_writable)(void);
+    void (*putc)(char c);
+    bool (*is_readable)(void);
+    char (*getc)(void);
+    // 送信中の行
+    char tx_line[LINK_FRAME_MAX + 1];
+    uint16_t tx_len;
+    uint16_t tx_pos;
+    // 受信中の行
+    char rx_line[LINK_FRAME_MAX];
+    uint16_t rx_index;
+    link_transport_stats_t stats;
+} link_stream_t;
+
+bool link_stream_can_send(link_stream_t* stream);
+bool link_stream_send(link_stream_t* stream, const char* frame, size_t len);
+size_t link_stream_poll(link_stream_t* stream, char* frame, size_t size);
+
+//--------------------------------------------------------------------+
+// CDC / ループバック
+//--------------------------------------------------------------------+
+
+/**
+ * CDC / ループバックトランスポートのキューを初期化する（link_mux_init から呼ぶ）
+ */
+void link_transport_init(void);
+
+extern const link_transport_t link_cdc_transport;
+extern const link_transport_t link_loopback_transport;
+
+/**
+ * CDC コンソールで受け取った "~" 行をリンクのフレームとして渡す（Core0から呼ぶ）
+ * @param frame 先頭の "~" を除いた行
+ */
+void link_cdc_receive_line(const char* frame);
+
+/**
+ * CDC トランスポートで送るフレームを CDC コンソールへ書き出す（Core0 の cdc_cmd_task から呼ぶ）
+ * CDC の FIFO へ書くのはコンソールと同じタスクだけにして、コンソールの出力と混ざらないようにする
+ */
+void link_cdc_tx_task(void);
+
+#endif // LINKTRANSPORT_H
@@ -0,0 +1,311 @@
+#include "LuaArena.h"
+#include <stdio.h>
+#include <string.h>
+#include "tusb.h"
+#include "FreeRTOS.h"
+#include "task.h"
+
+//--------------------------------------------------------------------+
+// ブロック（境界タグ）
+//
+// [header][payload ...][footer]  header = サイズ（ヘッダ込み、8 の倍数）| フラグ
+// payload が 8 バイト境界になるようにブロックは 8n+4 から始まる（lua_Number / lua_Integer は 8 バイト）
+// 空きブロックは payload に前後のリンクを、末尾にサイズ（footer）を持つ
+//
+// 空きリスト（TLSF と同じ2段の分け方）
+// - LUA_ARENA_SMALL_MAX まで: 8 バイトごと（16, 24, ... 128）
+// - それより上: 2 のべき乗を 4 等分
+// 空きのあるリストはビットマップで引く
+//--------------------------------------------------------------------+
+
+#define BLOCK_USED          1u
+#define BLOCK_PREV_USED     2u      // 前のブロックが使用中（空きなら footer で前に戻れる）
+#define BLOCK_FLAGS         (BLOCK_USED | BLOCK_PREV_USED)
+#define BLOCK_HEADER        4u
+
+typedef struct block {
+    uint32_t header;
+    struct block* next;     // 空きのときだけ
+    struct block* prev;
+} block_t;
+
+#define BLOCK_MIN           ((uint32_t)(sizeof(block_t) + sizeof(uint32_t) + 7) & ~7u)    // + footer（16 バイト）
+
+#define SPLIT_BITS          2                                       // 2 のべき乗を 4 等分
+#define SMALL_BINS          ((LUA_ARENA_SMALL_MAX - 16) / 8 + 1)    // 16 .. 128
+#define SMALL_MAX_LOG2      7                                       // log2(LUA_ARENA_SMALL_MAX)
+#define BIN_COUNT           (SMALL_BINS + (32 - SMALL_MAX_LOG2) * (1 << SPLIT_BITS))
+
+static uint8_t arena[LUA_ARENA_SIZE] __attribute__((aligned(8)));
+static block_t* bins[BIN_COUNT];
+static uint32_t bin_bitmap[(BIN_COUNT + 31) / 32];
+static bool arena_ready = false;
+
+static size_t arena_limit = LUA_ARENA_SIZE;
+static size_t live_bytes = 0;
+static size_t peak_bytes = 0;
+static size_t used_bytes = 0;
+static size_t free_bytes = 0;
+static uint32_t alloc_count = 0;
+static uint32_t free_count = 0;
+static uint32_t failure_count = 0;
+
+static inline uint32_t block_size(const block_t* b) { return b->header & ~7u; }
+static inline block_t* block_next(block_t* b) { return (block_t*)((uint8_t*)b + block_size(b)); }
+static inline block_t* block_prev(block_t* b) { return (block_t*)((uint8_t*)b - *((uint32_t*)b - 1)); }
+static inline void* block_payload(block_t* b) { return (uint8_t*)b + BLOCK_HEADER; }
+static inline block_t* payload_block(void* p) { return (block_t*)((uint8_t*)p - BLOCK_HEADER); }
+
+static inline void set_footer(block_t* b)
+{
+    *(uint32_t*)((uint8_t*)b + block_size(b) - sizeof(uint32_t)) = block_size(b);
+}
+
+static inline uint32_t block_need(size_t n)
+{
+    uint32_t need = (uint32_t)((n + BLOCK_HEADER + 7) & ~7u);
+    return need < BLOCK_MIN ? BLOCK_MIN : need;
+}
+
+static inline int bin_index(uint32_t size)
+{
+    if (size <= LUA_ARENA_SMALL_MAX) return (int)(size - 16) / 8;
+
+    int log2 = 31 - __builtin_clz(size);
+    int split = (int)(size >> (log2 - SPLIT_BITS)) & ((1 << SPLIT_BITS) - 1);
+    return SMALL_BINS + (log2 - SMALL_MAX_LOG2) * (1 << SPLIT_BITS) + split;
+}
+
+static void insert_free(block_t* b)
+{
+    int bin = bin_index(block_size(b));
+    b->prev = NULL;
+    b->next = bins[bin];
+    if (b->next) b->next->prev = b;
+    bins[bin] = b;
+    bin_bitmap[bin / 32] |= 1u << (bin % 32);
+    free_bytes += block_size(b);
+}
+
+static void remove_free(block_t* b)
+{
+    int bin = bin_index(block_size(b));
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        bins[bin] = b->next;
+    }
+    if (b->next) b->next->prev = b->prev;
+    if (bins[bin] == NULL) bin_bitmap[bin / 32] &= ~(1u << (bin % 32));
+    free_bytes -= block_size(b);
+}
+
+static void arena_init(void)
+{
+    // 先頭の 4 バイトは payload を 8 バイト境界に揃えるため、末尾の 4 バイトは番兵（使用中・サイズ 0）
+    block_t* first = (block_t*)(arena + BLOCK_HEADER);
+    block_t* sentinel = (block_t*)(arena + LUA_ARENA_SIZE - BLOCK_HEADER);
+
+    memset(bins, 0, sizeof(bins));
+    memset(bin_bitmap, 0, sizeof(bin_bitmap));
+    used_bytes = free_bytes = 0;
+    first->header = (LUA_ARENA_SIZE - 2 * BLOCK_HEADER) | BLOCK_PREV_USED;
+    set_footer(first);
+    sentinel->header = BLOCK_USED;
+    insert_free(first);
+    arena_ready = true;
+}
+
+// 最初のリストは first fit、それより上のリストは先頭のブロックで足りる
+static block_t* find_free(uint32_t need)
+{
+    int bin = bin_index(need);
+    for (block_t* b = bins[bin]; b; b = b->next) {
+        if (block_size(b) >= need) return b;
+    }
+
+    for (int word = (bin + 1) / 32; word < (int)(sizeof(bin_bitmap) / sizeof(bin_bitmap[0])); word++) {
+        uint32_t bits = bin_bitmap[word];
+        if (word == (bin + 1) / 32) bits &= ~0u << ((bin + 1) % 32);
+        if (bits) return bins[word * 32 + __builtin_ctz(bits)];
+    }
+    return NULL;
+}
+
+static void free_block(void* p)
+{
+    block_t* b = payload_block(p);
+    uint32_t size = block_size(b);
+    used_bytes -= size;
+
+    block_t* next = block_next(b);
+    if (!(next->header & BLOCK_USED)) {
+        remove_free(next);
+        size += block_size(next);
+    }
+    if (!(b->header & BLOCK_PREV_USED)) {
+        b = block_prev(b);
+        remove_free(b);
+        size += block_size(b);
+    }
+    b->header = size | (b->header & BLOCK_PREV_USED);
+    set_footer(b);
+    insert_free(b);
+    block_next(b)->header &= ~BLOCK_PREV_USED;
+}
+
+// 使用中のブロックを need まで縮め、余りを空きに戻す
+static void trim_block(block_t* b, uint32_t need)
+{
+    uint32_t size = block_size(b);
+    if (size - need < BLOCK_MIN) return;
+
+    block_t* rest = (block_t*)((uint8_t*)b + need);
+    b->header = need | (b->header & BLOCK_FLAGS);
+    rest->header = (size - need) | BLOCK_USED | BLOCK_PREV_USED;
+    free_block(block_payload(rest));
+}
+
+static void* alloc_block(size_t n)
+{
+    uint32_t need = block_need(n);
+    block_t* b = find_free(need);
+    if (b == NULL) return NULL;
+
+    remove_free(b);
+    b->header |= BLOCK_USED;
+    block_next(b)->header |= BLOCK_PREV_USED;
+    used_bytes += block_size(b);
+    trim_block(b, need);
+    return block_payload(b);
+}
+
+// その場で大きさを変える（伸ばすときは後ろの空きブロックを取り込む）
+static bool resize_block(void* p, size_t n)
+{
+    block_t* b = payload_block(p);
+    uint32_t need = block_need(n);
+
+    if (need > block_size(b)) {
+        block_t* next = block_next(b);
+        if ((next->header & BLOCK_USED) || block_size(b) + block_size(next) < need) return false;
+        remove_free(next);
+        used_bytes += block_size(next);
+        b->header = (block_size(b) + block_size(next)) | (b->header & BLOCK_FLAGS);
+        block_next(b)->header |= BLOCK_PREV_USED;
+    }
+    trim_block(b, need);
+    return true;
+}
+
+//--------------------------------------------------------------------+
+// lua_Alloc
+//--------------------------------------------------------------------+
+
+void* lua_arena_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    (void)ud;
+    if (ptr == NULL) {
+        if (nsize == 0) return NULL;
+        osize = 0;  // ptr が NULL のとき osize はオブジェクトの種類
+    }
+
+    void* result = NULL;
+    vTaskSuspendAll();  // 統計を読む CDC タスクがリストの途中を見ないように
+    if (!arena_ready) arena_init();
+
+    if (nsize == 0) {
+        free_block(ptr);
+        free_count++;
+    } else if (nsize > osize && live_bytes + (nsize - osize) > arena_limit) {
+        // 上限: NULL を返すと Lua が緊急 GC をしてからもう一度呼ぶ
+    } else if (ptr == NULL) {
+        result = alloc_block(nsize);
+        if (result) alloc_count++;
+    } else if (resize_block(ptr, nsize)) {
+        result = ptr;
+    } else {
+        // 縮めるときは必ずその場でできるので、ここは伸ばすときだけ
+        result = alloc_block(nsize);
+        if (result) {
+            memcpy(result, ptr, osize);
+            free_block(ptr);
+        }
+    }
+
+    if (result || nsize == 0) {
+        live_bytes = live_bytes - osize + nsize;
+        if (live_bytes > peak_bytes) peak_bytes = live_bytes;
+    } else {
+        failure_count++;
+    }
+    xTaskResumeAll();
+    return result;
+}
+
+// luaL_newstate の panic と同じ（保護されていないエラー）
+static int arena_panic(lua_State* L)
+{
+    const char* msg = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : "error object is not a string";
+    printf("PANIC: unprotected error in call to Lua API (%s)\n", msg);
+    return 0;
+}
+
+lua_State* lua_arena_newstate(void)
+{
+    lua_State* L = lua_newstate(lua_arena_alloc, NULL);
+    if (L) lua_atpanic(L, arena_panic);
+    return L;
+}
+
+void lua_arena_set_limit(size_t bytes)
+{
+    arena_limit = bytes < LUA_ARENA_SIZE ? bytes : LUA_ARENA_SIZE;
+}
+
+void lua_arena_get_stats(lua_arena_stats_t* stats)
+{
+    vTaskSuspendAll();
+    if (!arena_ready) arena_init();
+
+    // 空きのある一番上のリストに最大のブロックがある
+    size_t largest = 0;
+    for (int bin = BIN_COUNT - 1; bin >= 0 && largest == 0; bin--) {
+        for (block_t* b = bins[bin]; b; b = b->next) {
+            if (block_size(b) > largest) largest = block_size(b);
+        }
+    }
+
+    stats->arena_size = LUA_ARENA_SIZE;
+    stats->limit = arena_limit;
+    stats->live = live_bytes;
+    stats->peak = peak_bytes;
+    stats->used = used_bytes;
+    stats->free = free_bytes;
+    stats->largest_free = largest;
+    stats->allocs = alloc_count;
+    stats->frees = free_count;
+    stats->failures = failure_count;
+    xTaskResumeAll();
+}
+
+void lua_arena_print(void)
+{
+    lua_arena_stats_t stats;
+    char line[128];
+
+    lua_arena_get_stats(&stats);
+    // 断片化: 空きのうち最大ブロックに入っていない割合
+    unsigned fragmentation = stats.free ? (unsigned)(100 - stats.largest_free * 100 / stats.free) : 0;
+
+    snprintf(line, sizeof(line), "Lua heap: %u live, %u peak, %u limit (arena %u)\r\n",
+             (unsigned)stats.live, (unsigned)stats.peak, (unsigned)stats.limit, (unsigned)stats.arena_size);
+    tud_cdc_write_str(line);
+    snprintf(line, sizeof(line), "  blocks %u used, %u free, largest %u, fragmentation %u%%\r\n",
+             (unsigned)stats.used, (unsigned)stats.free, (unsigned)stats.largest_free, fragmentation);
+    tud_cdc_write_str(line);
+    snprintf(line, sizeof(line), "  %lu allocs, %lu frees, %lu failures\r\n",
+             (unsigned long)stats.allocs, (unsigned long)stats.frees, (unsigned long)stats.failures);
+    tud_cdc_write_str(line);
+    tud_cdc_write_flush();
+}
@@ -0,0 +1,66 @@
+#ifndef LUAARENA_H
+#define LUAARENA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "lua.h"
+
+//--------------------------------------------------------------------+
+// Lua VM 専用のアリーナアロケータ
+//
+// newlib の realloc（FreeRTOS や LittleFS と共有するヒープ）の代わりに、固定サイズの
+// 静的アリーナから Lua のメモリを取る。GC のたびに他のタスクのヒープを断片化させず、
+// スクリプトが大きくなっても LUA_ARENA_SIZE と上限（LUA_HEAP=）を超えない。
+// 境界タグ付きブロックを TLSF と同じように分けた空きリストで管理する:
+// LUA_ARENA_SMALL_MAX までは 8 バイトごと（TString, Table, Node, クロージャなど Lua の
+// 小さなオブジェクトはほぼ1回で見つかる）、それより上は 2 のべき乗を 4 等分。解放時に前後と結合する。
+// Lua タスク（Core0）から使う。統計は CDC タスクから読める。
+//--------------------------------------------------------------------+
+
+#ifndef LUA_ARENA_SIZE
+#define LUA_ARENA_SIZE          (96 * 1024)
+#endif
+#define LUA_ARENA_SMALL_MAX     128     // これ以下の空きリストは 8 バイトごと
+
+typedef struct {
+    size_t arena_size;      // アリーナ全体
+    size_t limit;           // Lua が使える上限（要求サイズの合計）
+    size_t live;            // 使用中（要求サイズの合計）
+    size_t peak;            // live の最大値
+    size_t used;            // 確保済みブロック（ヘッダを含む）
+    size_t free;            // 空きブロックの合計
+    size_t largest_free;    // 最大の空きブロック
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t failures;      // 上限またはアリーナ不足で確保できなかった回数
+} lua_arena_stats_t;
+
+/**
+ * lua_newstate に渡すアロケータ（lua_Alloc）
+ */
+void* lua_arena_alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+/**
+ * アリーナを使う Lua ステートを作る（luaL_newstate の代わり）
+ * @return 作成したステート、失敗した場合は NULL
+ */
+lua_State* lua_arena_newstate(void);
+
+/**
+ * Lua が使えるメモリの上限を設定する（アリーナの大きさで切り詰める）
+ * @param bytes 上限（バイト）
+ */
+void lua_arena_set_limit(size_t bytes);
+
+/**
+ * 統計を取得する（空きブロックを数えるので CDC コマンドから呼ぶ程度にする）
+ */
+void lua_arena_get_stats(lua_arena_stats_t* stats);
+
+/**
+ * 統計を CDC に表示する
+ */
+void lua_arena_print(void);
+
+#endif // LUAARENA_H
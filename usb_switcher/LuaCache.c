@@ -0,0 +1,251 @@
+#include "LuaCache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tusb.h"
+#include "lauxlib.h"
+#include "fstask.h"
+#include "CDCCmd.h"  // For fifo_push
+
+typedef struct {
+    uint32_t magic;
+    uint32_t source_size;
+    uint32_t source_hash;   // FNV-1a
+} lua_cache_header_t;
+
+// ソースの情報（ハッシュを取るときに一緒に調べる）
+typedef struct {
+    uint32_t size;
+    uint32_t hash;
+    const char* keyword;
+    size_t keyword_matched;
+    bool keyword_found;
+} lua_source_info_t;
+
+// lua_load / lua_dump とファイルの間のバッファ（Lua タスクからしか使わない）
+static lfs_file_t stream_file;
+static char stream_buffer[LUA_CACHE_CHUNK_SIZE];
+static bool stream_failed;
+
+static uint32_t cache_hits = 0;
+static uint32_t cache_compiles = 0;
+static uint32_t cache_errors = 0;   // 書き込み・読み込みに失敗した
+
+static bool cache_name(const char* filename, char* name, size_t size)
+{
+    int len = snprintf(name, size, "%s" LUA_CACHE_EXT, filename);
+    return len > 0 && (size_t)len < size;
+}
+
+// Advance a substring match by one character (the keyword is short, so the fallback is brute force)
+static size_t keyword_step(const char* keyword, size_t matched, char c)
+{
+    if (keyword[matched] == c) return matched + 1;
+    for (size_t len = matched; len > 0; len--) {
+        // keyword[0..len) が「一致していた部分 + c」の末尾と一致するか
+        if (keyword[len - 1] == c && memcmp(keyword, keyword + matched - len + 1, len - 1) == 0) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+// Read the whole source once in chunks: size, FNV-1a hash and the keyword
+static int scan_source(const char* filename, lua_source_info_t* info)
+{
+    int err = fstask_open(&stream_file, filename, false);
+    if (err < 0) return err;
+
+    info->size = 0;
+    info->hash = 2166136261u;
+    info->keyword_matched = 0;
+    info->keyword_found = false;
+
+    int bytes_read;
+    while ((bytes_read = fstask_read(&stream_file, stream_buffer, sizeof(stream_buffer))) > 0) {
+        for (int i = 0; i < bytes_read; i++) {
+            info->hash ^= (uint8_t)stream_buffer[i];
+            info->hash *= 16777619u;
+            if (info->keyword && !info->keyword_found) {
+                info->keyword_matched = keyword_step(info->keyword, info->keyword_matched, stream_buffer[i]);
+                info->keyword_found = info->keyword[info->keyword_matched] == '\0';
+            }
+        }
+        info->size += bytes_read;
+    }
+    fstask_close(&stream_file);
+    return bytes_read < 0 ? bytes_read : 0;
+}
+
+// lua_Reader: feed the lexer / lundump one chunk of the open file at a time
+static const char* file_reader(lua_State* L, void* ud, size_t* size)
+{
+    (void)L;
+    (void)ud;
+    int bytes_read = fstask_read(&stream_file, stream_buffer, sizeof(stream_buffer));
+    if (bytes_read <= 0) {
+        stream_failed = bytes_read < 0;
+        *size = 0;
+        return NULL;
+    }
+    *size = (size_t)bytes_read;
+    return stream_buffer;
+}
+
+// lua_Writer: write the bytecode straight into the cache file
+static int file_writer(lua_State* L, const void* p, size_t sz, void* ud)
+{
+    (void)L;
+    (void)ud;
+    return fstask_write(&stream_file, p, sz) == (int)sz ? 0 : 1;   // 0 以外で lua_dump を中断する
+}
+
+// Load the cached bytecode if it was compiled from this source
+static bool load_cached(lua_State* L, const char* name, const char* chunkname, const lua_source_info_t* info)
+{
+    if (fstask_open(&stream_file, name, false) < 0) return false;
+
+    bool loaded = false;
+    lua_cache_header_t header;
+    if (fstask_read(&stream_file, &header, sizeof(header)) == sizeof(header) &&
+        header.magic == LUA_CACHE_MAGIC && header.source_size == info->size && header.source_hash == info->hash) {
+        // "b": lundump only (a truncated file fails here instead of being parsed as text)
+        stream_failed = false;
+        if (lua_load(L, file_reader, NULL, chunkname, "b") == LUA_OK && !stream_failed) {
+            loaded = true;
+        } else {
+            printf("[Lua Cache] Invalid bytecode in '%s'\n", name);
+            lua_pop(L, 1);
+            cache_errors++;
+        }
+    }
+    fstask_close(&stream_file);
+    return loaded;
+}
+
+// Dump the function on top of the stack into the cache file
+static void save_cache(lua_State* L, const char* name, const lua_source_info_t* info)
+{
+    if (fstask_open(&stream_file, name, true) < 0) {
+        printf("[Lua Cache] Failed to create '%s'\n", name);
+        cache_errors++;
+        return;
+    }
+
+    lua_cache_header_t header = {
+        .magic = LUA_CACHE_MAGIC,
+        .source_size = info->size,
+        .source_hash = info->hash
+    };
+
+    // デバッグ情報は残す（エラーメッセージに行番号を出す）
+    bool saved = fstask_write(&stream_file, &header, sizeof(header)) == sizeof(header) &&
+                 lua_dump(L, file_writer, NULL, 0) == 0;
+    if (fstask_close(&stream_file) < 0) saved = false;
+
+    if (saved) {
+        printf("[Lua Cache] Compiled '%s'\n", name);
+    } else {
+        printf("[Lua Cache] Failed to write '%s'\n", name);
+        fstask_remove_file(name);   // 途中までのキャッシュを残さない
+        cache_errors++;
+    }
+}
+
+int lua_cache_load_file(lua_State* L, const char* filename, const char* keyword, bool* keyword_found)
+{
+    char name[LUA_CACHE_NAME_MAX];
+    char chunkname[LUA_CACHE_NAME_MAX];
+    lua_source_info_t info = { .keyword = keyword };
+
+    int err = scan_source(filename, &info);
+    if (keyword_found) *keyword_found = info.keyword_found;
+    if (err < 0) {
+        lua_pushfstring(L, "cannot read '%s' (error: %d)", filename, err);
+        return LUA_ERRFILE;
+    }
+
+    snprintf(chunkname, sizeof(chunkname), "@%s", filename);
+    bool cacheable = cache_name(filename, name, sizeof(name));
+
+    if (cacheable && load_cached(L, name, chunkname, &info)) {
+        cache_hits++;
+        return LUA_OK;
+    }
+
+    err = fstask_open(&stream_file, filename, false);
+    if (err < 0) {
+        lua_pushfstring(L, "cannot open '%s' (error: %d)", filename, err);
+        return LUA_ERRFILE;
+    }
+    stream_failed = false;
+    int result = lua_load(L, file_reader, NULL, chunkname, "t");
+    fstask_close(&stream_file);
+    if (result == LUA_OK && stream_failed) {
+        lua_pop(L, 1);
+        lua_pushfstring(L, "read error in '%s'", filename);
+        result = LUA_ERRFILE;
+    }
+
+    if (result == LUA_OK && cacheable) {
+        cache_compiles++;
+        save_cache(L, name, &info);
+    }
+    return result;
+}
+
+bool lua_cache_compile_file(lua_State* L, const char* filename)
+{
+    bool result = lua_cache_load_file(L, filename, NULL, NULL) == LUA_OK;
+    if (!result) {
+        // 構文エラーは実行したときと同じように CDC にも出す
+        const char* error_msg = lua_tostring(L, -1);
+        printf("[Lua Cache] %s\n", error_msg);
+        if (tud_cdc_connected()) {
+            char full_error[256];
+            snprintf(full_error, sizeof(full_error), "[Lua Cache] %s\r\n", error_msg);
+            tud_cdc_write_str(full_error);
+            tud_cdc_write_flush();
+        }
+    }
+    lua_pop(L, 1);  // コンパイルしたチャンク、またはエラーメッセージ
+    return result;
+}
+
+// *.lua and the macro files run by the gamepad (Pad-N) and META keys (Meta-X)
+static bool is_lua_source(const char* filename)
+{
+    size_t len = strlen(filename);
+    return (len > 4 && strcmp(filename + len - 4, ".lua") == 0) ||
+           strncmp(filename, "Pad-", 4) == 0 || strncmp(filename, "Meta-", 5) == 0;
+}
+
+void lua_cache_schedule(const char* filename)
+{
+    char command[LUA_CACHE_NAME_MAX];
+
+    if (!is_lua_source(filename)) return;
+    if (snprintf(command, sizeof(command), "COMPILE:%s", filename) >= (int)sizeof(command)) return;
+    if (!fifo_push(command)) {
+        // 最初の実行時にコンパイルされる
+        printf("[Lua Cache] Queue full, '%s' will be compiled on first run\n", filename);
+    }
+}
+
+void lua_cache_remove(const char* filename)
+{
+    char name[LUA_CACHE_NAME_MAX];
+
+    if (cache_name(filename, name, sizeof(name)) && fstask_get_file_size(name) >= 0) {
+        fstask_remove_file(name);
+    }
+}
+
+void lua_cache_print(void)
+{
+    char line[96];
+    snprintf(line, sizeof(line), "Lua cache: %lu hits, %lu compiles, %lu errors\r\n",
+             (unsigned long)cache_hits, (unsigned long)cache_compiles, (unsigned long)cache_errors);
+    tud_cdc_write_str(line);
+    tud_cdc_write_flush();
+}
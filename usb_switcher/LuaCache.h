@@ -0,0 +1,60 @@
+#ifndef LUACACHE_H
+#define LUACACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "lua.h"
+
+//--------------------------------------------------------------------+
+// コンパイル済み Lua バイトコードのキャッシュ（LittleFS）
+//
+// <ファイル名>.luac に lua_dump の結果を保存し、次回からは字句解析・構文解析を
+// せずに lundump で読み込む。先頭のヘッダにソースのサイズとハッシュ（FNV-1a）を持ち、
+// ソースと一致しなければコンパイルし直す。
+// ソース・キャッシュとも LittleFS から LUA_CACHE_CHUNK_SIZE ずつ lua_load / lua_dump に
+// 流すので、スクリプトの大きさはフラッシュの空きだけで決まり、読み込み中のメモリは
+// ファイルの大きさによらない（コンパイル結果の関数を除く）。
+// コンパイルはアップロード時（prog / receive / Raw HID / リンクのファイル転送の後に
+// Lua タスクのキューに入れる）か、最初の実行時に行う。
+// すべて Lua タスク（Core0）から呼ぶ。TUD タスクも同時に LittleFS へ書くが、
+// lfs_* の呼び出しは fstask.c のミューテックス（LFS_THREADSAFE）で排他される。
+//--------------------------------------------------------------------+
+
+#define LUA_CACHE_EXT       ".luac"
+#define LUA_CACHE_MAGIC     0x3143424Cu     // "LBC1"
+#define LUA_CACHE_NAME_MAX  64              // キャッシュのファイル名（拡張子を含む）
+#define LUA_CACHE_CHUNK_SIZE 256            // lua_load に渡す1回分
+
+/**
+ * ソースファイルをキャッシュ経由で読み込み、チャンクをスタックに積む（luaL_loadfile と同じ）
+ * キャッシュが無い・古い・壊れている場合はソースをコンパイルしてキャッシュを作り直す
+ * @param filename ソースのファイル名（エラーメッセージのチャンク名にも使う）
+ * @param keyword ハッシュを取るときにソースから探す文字列（NULL 可）
+ * @param keyword_found keyword がソースに含まれていたか（NULL 可）
+ * @return LUA_OK: 成功, それ以外: エラー（エラーメッセージをスタックに積む）
+ */
+int lua_cache_load_file(lua_State* L, const char* filename, const char* keyword, bool* keyword_found);
+
+/**
+ * ソースファイルを読んでコンパイルし、キャッシュを作る（キューの "COMPILE:<ファイル名>"）
+ * @return true: 成功（キャッシュが最新だった場合も含む）
+ */
+bool lua_cache_compile_file(lua_State* L, const char* filename);
+
+/**
+ * アップロードしたファイルが Lua ソース（*.lua, Pad-N, Meta-X）なら、コンパイルを Lua タスクのキューに入れる
+ */
+void lua_cache_schedule(const char* filename);
+
+/**
+ * ソースを削除したときにキャッシュも削除する
+ */
+void lua_cache_remove(const char* filename);
+
+/**
+ * キャッシュの命中数などを CDC に表示する
+ */
+void lua_cache_print(void);
+
+#endif // LUACACHE_H
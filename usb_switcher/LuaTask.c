@@ -2,15 +2,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include "tusb.h"
 #include "pico/stdlib.h"
+#include "pico/util/queue.h"
+#include "hardware/sync.h"
 #include "hardware/uart.h"        // For UART1 communication
 #include "fstask.h"
 #include "USBtask.h"
+#include "USBDeviceTask.h"
 #include "CDCCmd.h"
 #include "GamepadReportParser.h"  // For gamepad control functions
 #include "OLEDtask.h"             // For OLED display functions
 #include "base64.h"               // For base64 encoding
+#include "LinkMux.h"              // For link output queue
+#include "LuaCache.h"             // For compiled bytecode cache
+#include "LuaArena.h"             // For the Lua VM heap
+#include "KeyTimeline.h"           // For frame-paced type()
+#include "InputEvents.h"           // For wait_key / wait_button / wait_axis_change
+#include "KeyLayout.h"             // For character to keycode tables
 
 /*
  * Lua Keyboard Sample Code Examples
@@ -66,6 +76,17 @@
  * type("Hello", 10)     -- Type "Hello" with 10ms delays
  * type("Hello!", 50)    -- Type "Hello!" with 50ms delays (! requires shift)
  * type("User@123", 100) -- Type "User@123" with 100ms delays (@ requires shift)
+ * type(long_text, 0)    -- One report per USB frame (about 1000 reports/s)
+ * 
+ * Example 5b: Key sequence (keycodes, or tables of keys pressed together)
+ * -----------------------------------------------------------------------
+ * type_keys({0x0B, 0x08, 0x0F, 0x0F, 0x12})  -- "hello"
+ * type_keys({{0xE0, 0x04}, {0xE0, 0x06}}, 20) -- Ctrl+A, Ctrl+C, each held 20ms
+ * 
+ * Example 5c: Batch of report operations (checked first, one report per device between sleeps)
+ * ------------------------------------------------------------------------------------------
+ * batch("+E0 +04 w20 -04 -E0")                       -- Ctrl+A held 20ms
+ * batch({{"mouse_press", 1}, {"mouse_move", 40, 0}, {"sleep", 10}, {"mouse_release", 1}})
  * 
  * Gamepad Functions Sample Code Examples
  * ======================================
@@ -186,7 +207,7 @@
 #define lua_writestring(s,l)   cdc_write_string((s), (l))
 #define lua_writeline()        cdc_write_line()
 
-uint8_t USB_output_switch = 0; // USB出力切替 0:USB1, 1:UART経由
+uint8_t USB_output_switch = 0; // USB出力切替 0:USB1, USB_OUTPUT_DEVICE2:USB2, それ以外:リンク経由で出力するノードのアドレス
 
 //--------------------------------------------------------------------+
 // CDC Output Functions for Lua
@@ -233,302 +254,240 @@ void cdc_write_line(void) {
 }
 
 //--------------------------------------------------------------------+
-// Lua Custom Functions
+// Macro Scheduler
 //--------------------------------------------------------------------+
 
-// Global keyboard state to track pressed keys
-static uint8_t lua_keyboard_modifier = 0;
-static uint8_t lua_keyboard_keycodes[6] = {0}; // HID allows up to 6 simultaneous keys
-static bool lua_keyboard_dirty = false; // Flag to indicate state change
-
-// Global mouse state for Lua control
-static uint8_t lua_mouse_buttons = 0;
-static int8_t lua_mouse_x = 0;
-static int8_t lua_mouse_y = 0;
-static int8_t lua_mouse_wheel = 0;
-static int8_t lua_mouse_pan = 0;
-static bool lua_mouse_dirty = false; // Flag to indicate state change
+// Macro execution tracking
+#define MAX_MACRO_NAME_LENGTH 32
+#define MAX_QUEUED_MACROS 16
+#define MAX_RUNNING_MACROS 24   // 同時に実行できるマクロ
+#define MACRO_HOOK_COUNT 1000   // 命令数フックの間隔（命令）
+#define MAX_WAIT_SPECS 8        // wait_any() に渡せる条件
 
-// Global gamepad output state for Lua control
-static int8_t lua_gamepad_x = 0;
-static int8_t lua_gamepad_y = 0;
-static int8_t lua_gamepad_z = 0;
-static int8_t lua_gamepad_rz = 0;
-static uint8_t lua_gamepad_hat = 0;
-static uint16_t lua_gamepad_buttons = 0;
-static bool lua_gamepad_dirty = false; // Flag to indicate state change
-static bool lua_gamepad_active = false; // Flag to indicate Lua gamepad control is active
-static bool lua_gamepad_force_zero = false; // Flag to force sending zero report once
+// 入力待ちの条件1つ
+typedef struct {
+    uint8_t type;           // INPUT_EVENT_*
+    int16_t code;           // キーコード・ボタン（0: どれでも）、軸はしきい値
+} wait_spec_t;
 
-// Keyboard language settings
+// マクロを止めた理由
 typedef enum {
-    KEYBOARD_LANG_US,  // US English 104-key
-    KEYBOARD_LANG_JA   // Japanese 109-key
-} keyboard_language_t;
+    MACRO_ABORT_NONE = 0,
+    MACRO_ABORT_KILL,       // kill コマンド / Meta+K
+    MACRO_ABORT_BUDGET      // 譲らずに CPU 時間の上限を超えた
+} macro_abort_t;
 
-static keyboard_language_t current_keyboard_lang = KEYBOARD_LANG_US; // Default to US English
+// 実行中のマクロ: fifo_lua_state のスレッド（コルーチン）1つ。RTOS のタスクやスタックは持たない
+typedef struct {
+    lua_State *co;          // NULL: 空き
+    int ref;                // レジストリの参照（実行中に GC されないように）
+    TickType_t wake;        // この時刻を過ぎたら再開する
+    bool is_file;
+    bool uses_gamepad;      // 終わったらゲームパッドの状態を戻す
+    volatile bool cancel;   // 次に再開する代わりに止める
+    macro_abort_t abort;    // 止めた理由（kill・上限超過なら出力を全部離す）
+    uint32_t resumes;       // 再開した回数
+    uint32_t kinstructions; // 実行した命令数（1000 命令単位、フックで数える）
+    uint64_t cpu_us;        // lua_resume の中で走った時間の合計（待った時間は除く）
+    uint32_t slice_max_us;  // 1回の再開で譲らずに走った最長時間
+    uint8_t wait_count;     // 入力待ちの条件の数（0: 入力を待っていない）
+    bool wait_forever;      // 時間切れなし（wake を見ない）
+    bool wait_fired;        // 条件に合うイベントが来た（wait_event）
+    uint64_t wait_since_us; // これより前のイベントは見ない
+    int8_t wait_axes[4];    // 待ち始めの軸の値（X, Y, Z, RZ）
+    wait_spec_t wait_specs[MAX_WAIT_SPECS];
+    input_event_t wait_event;
+    char name[MAX_MACRO_NAME_LENGTH];
+} macro_slot_t;
+
+static macro_slot_t macro_slots[MAX_RUNNING_MACROS];
+static macro_slot_t *running_slot = NULL;   // lua_resume 中のマクロ
+static uint64_t slice_start_us;             // running_slot を再開した時刻（待った時間だけ後ろにずらす）
+static uint32_t cpu_budget_us = LUA_CPU_BUDGET_DEFAULT_MS * 1000;   // 0: 上限なし
+
+// kill の要求（CDC タスク・Core1 の Meta キーから kill_queue で渡す。Lua タスクが止まっていても
+// 命令数フックが見るので、while true do end のマクロも止められる）
+#define MAX_KILL_REQUESTS 8
 
-// Character to HID keycode mapping structure
 typedef struct {
-    char character;
-    uint8_t keycode;
-    bool needs_shift;
-} char_keycode_map_t;
-
-// US English keyboard layout mapping
-static const char_keycode_map_t char_to_keycode_us[] = {
-    // Lowercase letters (a-z)
-    {'a', 0x04, false}, {'b', 0x05, false}, {'c', 0x06, false}, {'d', 0x07, false},
-    {'e', 0x08, false}, {'f', 0x09, false}, {'g', 0x0A, false}, {'h', 0x0B, false},
-    {'i', 0x0C, false}, {'j', 0x0D, false}, {'k', 0x0E, false}, {'l', 0x0F, false},
-    {'m', 0x10, false}, {'n', 0x11, false}, {'o', 0x12, false}, {'p', 0x13, false},
-    {'q', 0x14, false}, {'r', 0x15, false}, {'s', 0x16, false}, {'t', 0x17, false},
-    {'u', 0x18, false}, {'v', 0x19, false}, {'w', 0x1A, false}, {'x', 0x1B, false},
-    {'y', 0x1C, false}, {'z', 0x1D, false},
-    
-    // Uppercase letters (A-Z) - require shift
-    {'A', 0x04, true}, {'B', 0x05, true}, {'C', 0x06, true}, {'D', 0x07, true},
-    {'E', 0x08, true}, {'F', 0x09, true}, {'G', 0x0A, true}, {'H', 0x0B, true},
-    {'I', 0x0C, true}, {'J', 0x0D, true}, {'K', 0x0E, true}, {'L', 0x0F, true},
-    {'M', 0x10, true}, {'N', 0x11, true}, {'O', 0x12, true}, {'P', 0x13, true},
-    {'Q', 0x14, true}, {'R', 0x15, true}, {'S', 0x16, true}, {'T', 0x17, true},
-    {'U', 0x18, true}, {'V', 0x19, true}, {'W', 0x1A, true}, {'X', 0x1B, true},
-    {'Y', 0x1C, true}, {'Z', 0x1D, true},
-    
-    // Numbers (0-9)
-    {'1', 0x1E, false}, {'2', 0x1F, false}, {'3', 0x20, false}, {'4', 0x21, false},
-    {'5', 0x22, false}, {'6', 0x23, false}, {'7', 0x24, false}, {'8', 0x25, false},
-    {'9', 0x26, false}, {'0', 0x27, false},
-    
-    // Special characters that require shift (US layout)
-    {'!', 0x1E, true},  // Shift + 1
-    {'@', 0x1F, true},  // Shift + 2
-    {'#', 0x20, true},  // Shift + 3
-    {'$', 0x21, true},  // Shift + 4
-    {'%', 0x22, true},  // Shift + 5
-    {'^', 0x23, true},  // Shift + 6
-    {'&', 0x24, true},  // Shift + 7
-    {'*', 0x25, true},  // Shift + 8
-    {'(', 0x26, true},  // Shift + 9
-    {')', 0x27, true},  // Shift + 0
-    
-    // Common punctuation and symbols (US layout)
-    {' ', 0x2C, false}, // Space
-    {'\t', 0x2B, false}, // Tab
-    {'\n', 0x28, false}, // Enter
-    {'-', 0x2D, false}, // Hyphen
-    {'=', 0x2E, false}, // Equal
-    {'[', 0x2F, false}, // Left bracket
-    {']', 0x30, false}, // Right bracket
-    {'\\', 0x31, false}, // Backslash
-    {';', 0x33, false}, // Semicolon
-    {'\'', 0x34, false}, // Apostrophe
-    {'`', 0x35, false}, // Grave accent
-    {',', 0x36, false}, // Comma
-    {'.', 0x37, false}, // Period
-    {'/', 0x38, false}, // Slash
-    
-    // Shifted punctuation (US layout)
-    {'_', 0x2D, true},  // Shift + Hyphen
-    {'+', 0x2E, true},  // Shift + Equal
-    {'{', 0x2F, true},  // Shift + Left bracket
-    {'}', 0x30, true},  // Shift + Right bracket
-    {'|', 0x31, true},  // Shift + Backslash
-    {':', 0x33, true},  // Shift + Semicolon
-    {'"', 0x34, true},  // Shift + Apostrophe
-    {'~', 0x35, true},  // Shift + Grave accent
-    {'<', 0x36, true},  // Shift + Comma
-    {'>', 0x37, true},  // Shift + Period
-    {'?', 0x38, true},  // Shift + Slash
-};
+    char name[MAX_MACRO_NAME_LENGTH];   // 空文字列: すべて
+} kill_request_t;
+
+static queue_t kill_queue;
+static volatile bool kill_pending = false;  // kill_queue に入れた後に立てる（フックはこれだけ見る）
+
+// Lua タスクが取り出した kill の対象（Lua タスクだけが触る）
+static bool kill_all = false;
+static bool kill_all_hit = false;
+static char kill_names[MAX_KILL_REQUESTS][MAX_MACRO_NAME_LENGTH];
+static bool kill_name_hit[MAX_KILL_REQUESTS];   // 対象を見つけた（終わっていても数える）
+static int kill_name_count = 0;
+static bool kill_release = false;           // kill したマクロが終わった: 出力を全部離す
+
+// sleep や送信待ちをスケジューラに譲れるか（マクロ自身のコルーチンで、C 呼び出しの境界の内側でない）
+// 譲れない場所（table.sort の比較関数など）では従来どおり vTaskDelay で待つ
+static bool macro_can_yield(lua_State *L) {
+    return running_slot != NULL && running_slot->co == L && lua_isyieldable(L);
+}
 
-// Japanese 109-key keyboard layout mapping
-static const char_keycode_map_t char_to_keycode_ja[] = {
-    // Lowercase letters (a-z) - same as US
-    {'a', 0x04, false}, {'b', 0x05, false}, {'c', 0x06, false}, {'d', 0x07, false},
-    {'e', 0x08, false}, {'f', 0x09, false}, {'g', 0x0A, false}, {'h', 0x0B, false},
-    {'i', 0x0C, false}, {'j', 0x0D, false}, {'k', 0x0E, false}, {'l', 0x0F, false},
-    {'m', 0x10, false}, {'n', 0x11, false}, {'o', 0x12, false}, {'p', 0x13, false},
-    {'q', 0x14, false}, {'r', 0x15, false}, {'s', 0x16, false}, {'t', 0x17, false},
-    {'u', 0x18, false}, {'v', 0x19, false}, {'w', 0x1A, false}, {'x', 0x1B, false},
-    {'y', 0x1C, false}, {'z', 0x1D, false},
-    
-    // Uppercase letters (A-Z) - same as US
-    {'A', 0x04, true}, {'B', 0x05, true}, {'C', 0x06, true}, {'D', 0x07, true},
-    {'E', 0x08, true}, {'F', 0x09, true}, {'G', 0x0A, true}, {'H', 0x0B, true},
-    {'I', 0x0C, true}, {'J', 0x0D, true}, {'K', 0x0E, true}, {'L', 0x0F, true},
-    {'M', 0x10, true}, {'N', 0x11, true}, {'O', 0x12, true}, {'P', 0x13, true},
-    {'Q', 0x14, true}, {'R', 0x15, true}, {'S', 0x16, true}, {'T', 0x17, true},
-    {'U', 0x18, true}, {'V', 0x19, true}, {'W', 0x1A, true}, {'X', 0x1B, true},
-    {'Y', 0x1C, true}, {'Z', 0x1D, true},
-    
-    // Numbers (0-9) - same as US
-    {'1', 0x1E, false}, {'2', 0x1F, false}, {'3', 0x20, false}, {'4', 0x21, false},
-    {'5', 0x22, false}, {'6', 0x23, false}, {'7', 0x24, false}, {'8', 0x25, false},
-    {'9', 0x26, false}, {'0', 0x27, false},
-    
-    // Special characters for Japanese layout (different from US)
-    {'!', 0x1E, true},  // Shift + 1
-    {'"', 0x1F, true},  // Shift + 2 (Japanese: " instead of @)
-    {'#', 0x20, true},  // Shift + 3
-    {'$', 0x21, true},  // Shift + 4
-    {'%', 0x22, true},  // Shift + 5
-    {'&', 0x23, true},  // Shift + 6 (Japanese: & instead of ^)
-    {'\'', 0x24, true}, // Shift + 7 (Japanese: ' instead of &)
-    {'(', 0x25, true},  // Shift + 8 (Japanese: ( instead of *)
-    {')', 0x26, true},  // Shift + 9 (Japanese: ) instead of ()
-    {' ', 0x27, true},  // Shift + 0 (Japanese: space character)
-    
-    // Common punctuation and symbols (Japanese layout)
-    {' ', 0x2C, false}, // Space
-    {'\t', 0x2B, false}, // Tab
-    {'\n', 0x28, false}, // Enter
-    {'-', 0x2D, false}, // Hyphen (minus)
-    {'^', 0x2E, false}, // Equal key position (Japanese: ^ instead of =)
-    {'@', 0x2F, false}, // Left bracket key position (Japanese: @ instead of [)
-    {'[', 0x30, false}, // Right bracket key position (Japanese: [ instead of ])
-    {';', 0x31, false}, // Backslash key position (Japanese: ; instead of \)
-    {'+', 0x33, false}, // Semicolon key position (Japanese: + instead of ;)
-    {':', 0x34, false}, // Apostrophe key position (Japanese: : instead of ')
-    {'*', 0x35, false}, // Grave accent key position (Japanese: * instead of `)
-    {',', 0x36, false}, // Comma - same
-    {'.', 0x37, false}, // Period - same
-    {'/', 0x38, false}, // Slash - same
-    
-    // Shifted punctuation for Japanese layout
-    {'=', 0x2D, true},  // Shift + Hyphen (Japanese: = instead of _)
-    {'~', 0x2E, true},  // Shift + ^ key (Japanese: ~ instead of +)
-    {'`', 0x2F, true},  // Shift + @ key (Japanese: ` instead of {)
-    {'{', 0x30, true},  // Shift + [ key (Japanese: { instead of })
-    {'*', 0x31, true},  // Shift + ; key (Japanese: * instead of |)
-    {'*', 0x33, true},  // Shift + + key 
-    {'*', 0x34, true},  // Shift + : key
-    {'+', 0x35, true},  // Shift + * key (Japanese: + instead of ~)
-    {'<', 0x36, true},  // Shift + Comma - same
-    {'>', 0x37, true},  // Shift + Period - same  
-    {'?', 0x38, true},  // Shift + Slash - same
-    
-    // Additional Japanese-specific keys
-    {'\\', 0x89, false}, // Yen/Backslash key (0x89 = International3)
-    {'|', 0x89, true},   // Shift + Yen key
-    {']', 0x8A, false},  // Right bracket (0x8A = International1) 
-    {'}', 0x8A, true},   // Shift + Right bracket
-    {'_', 0x87, false},  // Underscore (0x87 = International4)
-};
+// ms 後に k から再開するように譲る（k が NULL なら呼び出し元の Lua に戻る）
+static int macro_yield(lua_State *L, uint32_t ms, lua_KFunction k, lua_KContext ctx) {
+    running_slot->wake = xTaskGetTickCount() + pdMS_TO_TICKS(ms);
+    return lua_yieldk(L, 0, ctx, k);
+}
 
-// Helper function to find keycode in current pressed keys
-static int find_keycode_index(uint8_t keycode) {
-    for (int i = 0; i < 6; i++) {
-        if (lua_keyboard_keycodes[i] == keycode) {
-            return i;
-        }
-    }
-    return -1;
+// 譲れない場所で ms 待つ（待った時間は CPU 時間の上限に数えない）
+static void macro_block(uint32_t ms) {
+    uint64_t start = time_us_64();
+    vTaskDelay(pdMS_TO_TICKS(ms));
+    slice_start_us += time_us_64() - start;
 }
 
-// Helper function to find empty slot in keycode array
-static int find_empty_slot(void) {
-    for (int i = 0; i < 6; i++) {
-        if (lua_keyboard_keycodes[i] == 0) {
-            return i;
+// 届いた kill の要求を取り出す。先にフラグを下ろしてから取り出すので、
+// 取り出している間に入った要求は次の呼び出しで見る
+static void collect_kill_requests(void) {
+    if (!kill_pending) {
+        return;
+    }
+    kill_pending = false;
+    __dmb();
+    
+    kill_request_t request;
+    while (queue_try_remove(&kill_queue, &request)) {
+        if (request.name[0] == '\0') {
+            kill_all = true;
+            continue;
+        }
+        bool known = false;
+        for (int i = 0; i < kill_name_count && !known; i++) {
+            known = strcmp(kill_names[i], request.name) == 0;
+        }
+        if (!known && kill_name_count < MAX_KILL_REQUESTS) {
+            strcpy(kill_names[kill_name_count], request.name);
+            kill_name_hit[kill_name_count] = false;
+            kill_name_count++;
         }
     }
-    return -1;
 }
 
-// Helper function to get current keyboard layout mapping
-static const char_keycode_map_t* get_current_keymap(size_t* map_size) {
-    if (current_keyboard_lang == KEYBOARD_LANG_JA) {
-        *map_size = sizeof(char_to_keycode_ja) / sizeof(char_keycode_map_t);
-        return char_to_keycode_ja;
-    } else {
-        *map_size = sizeof(char_to_keycode_us) / sizeof(char_keycode_map_t);
-        return char_to_keycode_us;
+static bool kill_requested(const macro_slot_t *slot) {
+    if (kill_all) {
+        kill_all_hit = true;
+        return true;
     }
+    for (int i = 0; i < kill_name_count; i++) {
+        if (strcmp(slot->name, kill_names[i]) == 0) {
+            kill_name_hit[i] = true;
+            return true;
+        }
+    }
+    return false;
 }
 
-// Helper function to find keycode for a character
-static bool find_char_keycode(char c, uint8_t* keycode, bool* needs_shift) {
-    size_t map_size;
-    const char_keycode_map_t* keymap = get_current_keymap(&map_size);
-    
-    for (size_t i = 0; i < map_size; i++) {
-        if (keymap[i].character == c) {
-            *keycode = keymap[i].keycode;
-            *needs_shift = keymap[i].needs_shift;
-            return true;
+// 命令数フック（MACRO_HOOK_COUNT 命令ごと）: 命令数を数え、kill と CPU 時間の上限を確かめる
+static void macro_hook(lua_State *L, lua_Debug *ar) {
+    (void)ar;
+    macro_slot_t *slot = running_slot;
+    if (slot == NULL) {
+        return;  // lua_closethread の __close など、再開中でないとき
+    }
+    slot->kinstructions++;
+    
+    if (slot->abort == MACRO_ABORT_NONE) {
+        collect_kill_requests();
+        if (kill_requested(slot)) {
+            slot->abort = MACRO_ABORT_KILL;
+        } else if (cpu_budget_us > 0 && time_us_64() - slice_start_us > cpu_budget_us) {
+            slot->abort = MACRO_ABORT_BUDGET;
+        } else {
+            return;
         }
     }
-    return false; // Character not found
+    
+    // スケジューラに譲れば次のパスで end_macro が閉じる（pcall の中からでも抜ける）。
+    // 譲れない場所ではエラーにし、譲れるところまで戻るまでフックのたびに繰り返す
+    slot->cancel = true;
+    if (macro_can_yield(L)) {
+        lua_yield(L, 0);
+        return;
+    }
+    luaL_error(L, slot->abort == MACRO_ABORT_KILL ? "macro killed" : "macro exceeded its CPU budget");
 }
 
+//--------------------------------------------------------------------+
+// Lua Custom Functions
+//--------------------------------------------------------------------+
+
+// Global keyboard state to track pressed keys
+static keyboard_bitmap_t lua_keyboard = {0}; // NKRO bitmap: no limit on simultaneous keys
+static bool lua_keyboard_dirty = false; // Flag to indicate state change
+
+// Global mouse state for Lua control
+static uint16_t lua_mouse_buttons = 0; // 16 buttons, as in the mouse report descriptor
+static int16_t lua_mouse_x = 0;
+static int16_t lua_mouse_y = 0;
+static int8_t lua_mouse_wheel = 0;
+static int8_t lua_mouse_pan = 0;
+static bool lua_mouse_dirty = false; // Flag to indicate state change
+
+// Global gamepad output state for Lua control
+static int8_t lua_gamepad_x = 0;
+static int8_t lua_gamepad_y = 0;
+static int8_t lua_gamepad_z = 0;
+static int8_t lua_gamepad_rz = 0;
+static uint8_t lua_gamepad_hat = 0;
+static uint16_t lua_gamepad_buttons = 0;
+static bool lua_gamepad_dirty = false; // Flag to indicate state change
+static bool lua_gamepad_active = false; // Flag to indicate Lua gamepad control is active
+static bool lua_gamepad_force_zero = false; // Flag to force sending zero report once
+
 // Forward declarations
 static void send_gamepad_report(void);
 
 // Helper function to send current keyboard state
 static void send_keyboard_report(void) {
-    if (USB_output_switch == 0) {
-        // USB output mode - send to USB device
-        while (tud_hid_n_ready(0) == 0) { // Check if HID interface 0 (keyboard) is ready
-            vTaskDelay(pdMS_TO_TICKS(1)); // 1ms wait time
+    if (usb_output_is_local()) {
+        // USB output mode - send to USB device (USB1 or USB2)
+        while (usb_device_ready(0) == 0) { // Check if HID interface 0 (keyboard) is ready
+            macro_block(1); // 1ms wait time
         }
-        if(tud_hid_n_ready(0)) {
-            tud_hid_n_keyboard_report(0, 1, lua_keyboard_modifier, lua_keyboard_keycodes);
+        if(usb_device_ready(0)) {
+            usb_device_keyboard_bitmap_report(&lua_keyboard);
             lua_keyboard_dirty = false;
         } else {
             printf("Warning: HID interface not ready\n");
         }
     } else {
-        // UART output mode - send to UART1
-        // Create keyboard report structure (same as USBHostTask.c)
-        typedef struct {
-            uint8_t modifier;
-            uint8_t reserved;
-            uint8_t keycode[6];
-        } __attribute__((packed)) hid_keyboard_report_t;
-        
-        hid_keyboard_report_t keyboard_report;
-        keyboard_report.modifier = lua_keyboard_modifier;
-        keyboard_report.reserved = 0;
-        memcpy(keyboard_report.keycode, lua_keyboard_keycodes, 6);
-        
-        // Encode to base64 and send to UART1 (same format as USBHostTask.c)
-        uint8_t base64_output[16];
-        base64_output[0] = 'K';
-        base64_output[1] = '0' + USB_output_switch;
-        
-        base64_encode((uint8_t*)&keyboard_report, sizeof(hid_keyboard_report_t), (char*)&(base64_output[2]), sizeof(base64_output) - 3);
-        base64_output[14] = '\n';
-        base64_output[15] = 0;
-        
-        uart_puts(uart1, (char*)base64_output);
+        // Link output mode - send to the node selected by USB_output_switch
+        // (N frame: the whole key bitmap)
+        link_send_keyboard_nkro(USB_output_switch, (const uint8_t*)&lua_keyboard);
         lua_keyboard_dirty = false;
     }
 }
 
 // Helper function to send current mouse state
 static void send_mouse_report(void) {
-    if (USB_output_switch == 0) {
-        // USB output mode - send to USB device
-        while (tud_hid_n_ready(1) == 0) { // Check if HID interface 1 (mouse) is ready
-            vTaskDelay(pdMS_TO_TICKS(1)); // 1ms wait time
+    if (usb_output_is_local()) {
+        // USB output mode - send to USB device (USB1 or USB2)
+        while (usb_device_ready(1) == 0) { // Check if HID interface 1 (mouse) is ready
+            macro_block(1); // 1ms wait time
         }
-        if(tud_hid_n_ready(1)) {
-            tud_hid_n_mouse_report(1, 2, lua_mouse_buttons, lua_mouse_x, lua_mouse_y, lua_mouse_wheel, lua_mouse_pan);
+        if(usb_device_ready(1)) {
+            mouse_report_t mouse_report;
+            mouse_report.buttons = lua_mouse_buttons;
+            mouse_report.x = lua_mouse_x;
+            mouse_report.y = lua_mouse_y;
+            mouse_report.wheel = lua_mouse_wheel;
+            mouse_report.pan = lua_mouse_pan;
+            usb_device_mouse_report(&mouse_report);
             lua_mouse_dirty = false;
+            lua_mouse_x = lua_mouse_y = lua_mouse_wheel = 0;  // Motion sent (macros add to it until then)
         } else {
             printf("Warning: Mouse HID interface not ready\n");
         }
     } else {
-        // UART output mode - send to UART1 (same format as USBHostTask.c)
-        typedef struct {
-            uint8_t buttons;
-            int8_t x;
-            int8_t y;
-            int8_t wheel;
-            int8_t pan;
-        } __attribute__((packed)) mouse_report_t;
-        
+        // Link output mode - send to the node selected by USB_output_switch
+        // (same 8-byte mouse_report_t as USBHostTask.c)
         mouse_report_t mouse_report;
         mouse_report.buttons = lua_mouse_buttons;
         mouse_report.x = lua_mouse_x;
@@ -536,80 +495,276 @@ static void send_mouse_report(void) {
         mouse_report.wheel = lua_mouse_wheel;
         mouse_report.pan = lua_mouse_pan;
         
-        // Encode to base64 and send to UART1
-        uint8_t base64_output[16];
-        base64_output[0] = 'M';
-        base64_output[1] = '0' + USB_output_switch;
-        
-        base64_encode((uint8_t*)&mouse_report, sizeof(mouse_report_t), (char*)&(base64_output[2]), sizeof(base64_output) - 3);
-        base64_output[14] = '\n';
-        base64_output[15] = 0;
-        
-        uart_puts(uart1, (char*)base64_output);
+        link_send_mouse(USB_output_switch, &mouse_report);
         lua_mouse_dirty = false;
+        lua_mouse_x = lua_mouse_y = lua_mouse_wheel = 0;
     }
 }
 
-// Helper function to type a single character with timing
-static void type_character(char c, int delay_ms) {
-    uint8_t keycode;
-    bool needs_shift;
-    
-    if (!find_char_keycode(c, &keycode, &needs_shift)) {
-        // Character not found in mapping table
-        printf("Warning: Unknown character '%c' (0x%02X) - skipping\n", c, (unsigned char)c);
-        return;
+// Send the keyboard (instance 0) or mouse (instance 1) report once the endpoint is free.
+// Inside a macro coroutine the wait yields to the other macros instead of blocking them.
+static int send_report_k(lua_State *L, int status, lua_KContext instance) {
+    (void)status;
+    while (usb_output_is_local() &&
+           (!usb_device_ready((uint8_t)instance) || (instance == 0 && key_timeline_busy()))) {
+        if (macro_can_yield(L)) {
+            return macro_yield(L, 1, send_report_k, instance);
+        }
+        macro_block(1);
     }
     
-    // Find empty slot for the keycode
-    int slot = find_empty_slot();
-    if (slot < 0) {
-        printf("Warning: Cannot type character - maximum simultaneous keys reached\n");
-        return;
+    if (instance == 0) {
+        send_keyboard_report();
+    } else {
+        send_mouse_report();
     }
-    
-    // Set up modifier and keycode simultaneously for proper shift handling
-    uint8_t original_modifier = lua_keyboard_modifier;
-    
-    if (needs_shift) {
-        lua_keyboard_modifier |= 0x02; // Left Shift (bit 1)
+    return 0;
+}
+
+// Number of characters / entries of the text or key sequence at stack 1
+static lua_Integer typing_length(lua_State *L) {
+    return (lua_Integer)lua_rawlen(L, 1);
+}
+
+// Keys of entry i (0-based) at stack 1: a character of the text, or a keycode / a table of
+// keycodes pressed together. Returns false if there is nothing to press (unknown character)
+static bool typing_chord(lua_State *L, lua_Integer i, keyboard_bitmap_t* chord) {
+    memset(chord, 0, sizeof(*chord));
+    
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        const char* text = lua_tostring(L, 1);
+        const key_stroke_t* stroke = key_layout_lookup((uint8_t)text[i]);
+        if (stroke == NULL) {
+            // Character not in the current keyboard layout
+            printf("Warning: Unknown character '%c' (0x%02X) - skipping\n", text[i], (unsigned char)text[i]);
+            return false;
+        }
+        keyboard_bitmap_set(chord, stroke->keycode, true);
+        chord->modifier |= stroke->modifier;  // Shift / AltGr
+        return true;
     }
     
-    // Press the key (with shift if needed)
-    lua_keyboard_keycodes[slot] = keycode;
-    lua_keyboard_dirty = true;
-    send_keyboard_report();
-    
-    // Add small delay to ensure the key press is registered
-    vTaskDelay(pdMS_TO_TICKS(5)); // 10ms minimum press time
-    
-    // Hold for specified duration
-    if (delay_ms > 5) {
-        vTaskDelay(pdMS_TO_TICKS(delay_ms - 5));
+    // Key sequence (checked by lua_type_keys)
+    lua_rawgeti(L, 1, i + 1);
+    if (lua_istable(L, -1)) {
+        lua_Integer n = (lua_Integer)lua_rawlen(L, -1);
+        for (lua_Integer k = 1; k <= n; k++) {
+            lua_rawgeti(L, -1, k);
+            keyboard_bitmap_set(chord, (uint8_t)lua_tointeger(L, -1), true);
+            lua_pop(L, 1);
+        }
+    } else {
+        keyboard_bitmap_set(chord, (uint8_t)lua_tointeger(L, -1), true);
     }
+    lua_pop(L, 1);
+    return true;
+}
+
+//--------------------------------------------------------------------+
+// type() / type_keys() on the local USB port: the whole text is turned into a report
+// timeline (KeyTimeline.c) and Core1 plays it at one report per USB frame
+//--------------------------------------------------------------------+
+
+static lua_State *typing_owner = NULL;      // 1つのマクロだけが積む（文字が混ざらないように）
+static keyboard_bitmap_t typing_last;       // 最後に積んだ文字のキー
+
+enum {
+    PLAYBACK_ACQUIRE,   // Wait until no other macro is typing
+    PLAYBACK_QUEUE,     // Queue the reports while there is room
+    PLAYBACK_DRAIN      // Wait until Core1 has played them all
+};
+
+// Queue the reports of one entry. A gap report (key released, new modifiers) goes first when
+// the same key repeats or the modifiers change, so the host sees the release / Shift before the key
+static void playback_push_chord(const keyboard_bitmap_t* chord, uint16_t hold) {
+    keyboard_bitmap_t report = lua_keyboard;  // Keys held with keypress() stay down
+    bool gap = chord->modifier != typing_last.modifier;
     
-    // Release the key first, then modifier
-    lua_keyboard_keycodes[slot] = 0;
-    lua_keyboard_dirty = true;
-    send_keyboard_report();
-    
-    // Add small delay between key release and modifier release
-    vTaskDelay(pdMS_TO_TICKS(5));
-    
-    // Restore original modifier state
-    lua_keyboard_modifier = original_modifier;
-    send_keyboard_report();
+    for (int k = 0; k < KEYBOARD_BITMAP_SIZE; k++) {
+        if (chord->keys[k] & typing_last.keys[k]) gap = true;
+    }
+    report.modifier |= chord->modifier;
+    if (gap) {
+        key_timeline_push(&report, 1);
+    }
+    for (int k = 0; k < KEYBOARD_BITMAP_SIZE; k++) {
+        report.keys[k] |= chord->keys[k];
+    }
+    key_timeline_push(&report, hold);
+    typing_last = *chord;
+}
+
+// Timeline continuation: stack 1 = text / key sequence, 2 = hold (ms = frames), 3 = entry index
+static int playback_k(lua_State *L, int status, lua_KContext step) {
+    (void)status;
+    lua_Integer len = typing_length(L);
+    lua_Integer hold = lua_tointeger(L, 2);
+    if (hold < 1) hold = 1;
+    
+    while (true) {
+        if (step == PLAYBACK_ACQUIRE) {
+            if (typing_owner == NULL && !key_timeline_busy()) {
+                typing_owner = L;
+                memset(&typing_last, 0, sizeof(typing_last));
+                step = PLAYBACK_QUEUE;
+                continue;
+            }
+            if (typing_owner != NULL && !macro_can_yield(L)) {
+                // Blocking here would stop the macro that owns the timeline
+                return luaL_error(L, "type: another macro is typing");
+            }
+        } else if (step == PLAYBACK_QUEUE) {
+            // Up to 2 reports per entry, then 1 to release the last key
+            lua_Integer i = lua_tointeger(L, 3);
+            while (i < len && key_timeline_space() >= 2) {
+                keyboard_bitmap_t chord;
+                if (typing_chord(L, i, &chord)) {
+                    playback_push_chord(&chord, (uint16_t)hold);
+                }
+                i++;
+            }
+            lua_pushinteger(L, i);
+            lua_replace(L, 3);
+            if (i >= len && key_timeline_space() >= 1) {
+                key_timeline_push(&lua_keyboard, 1);
+                step = PLAYBACK_DRAIN;
+                continue;
+            }
+        } else {
+            if (!key_timeline_busy()) {
+                typing_owner = NULL;
+                return 0;  // No return values
+            }
+        }
+        
+        // Core1 plays one report per frame meanwhile
+        if (macro_can_yield(L)) {
+            return macro_yield(L, 1, playback_k, step);
+        }
+        macro_block(1);
+    }
+}
+
+// Stop the timeline of a macro that is being stopped (keys it pressed are released)
+static void playback_cancel(lua_State *L) {
+    if (typing_owner == L) {
+        key_timeline_cancel(&lua_keyboard);
+        typing_owner = NULL;
+    }
+}
+
+//--------------------------------------------------------------------+
+// type() / type_keys() over the link: one report at a time, as before
+//--------------------------------------------------------------------+
+
+// Steps of type() for each character (each send step waits for the endpoint)
+enum {
+    TYPE_PRESS,         // Set the key (and Shift if needed)
+    TYPE_PRESS_SEND,    // then hold it for the delay (at least 5ms)
+    TYPE_RELEASE,       // Release the key first,
+    TYPE_RELEASE_SEND,  // wait 5ms,
+    TYPE_RESTORE,       // then restore the modifier
+    TYPE_RESTORE_SEND   // and wait before the next character
+};
+
+// type() continuation: stack 1 = text / key sequence, 2 = delay, 3 = entry index, 4 = original modifier
+static int type_text_k(lua_State *L, int status, lua_KContext step) {
+    (void)status;
+    lua_Integer len = typing_length(L);
+    int delay_ms = (int)lua_tointeger(L, 2);
     
-    // Wait before next character
-    if (delay_ms > 5) {
-        vTaskDelay(pdMS_TO_TICKS(delay_ms - 5));
+    while (true) {
+        lua_Integer i = lua_tointeger(L, 3);
+        uint32_t wait_ms = 0;
+        keyboard_bitmap_t chord;
+        
+        switch (step) {
+            case TYPE_PRESS: {
+                if (i >= len) {
+                    return 0;  // No return values
+                }
+                if (!typing_chord(L, i, &chord)) {
+                    lua_pushinteger(L, i + 1);
+                    lua_replace(L, 3);
+                    continue;
+                }
+                // Set up modifier and keycode simultaneously for proper shift handling
+                lua_pushinteger(L, lua_keyboard.modifier);
+                lua_replace(L, 4);
+                lua_keyboard.modifier |= chord.modifier;
+                for (int k = 0; k < KEYBOARD_BITMAP_SIZE; k++) {
+                    lua_keyboard.keys[k] |= chord.keys[k];
+                }
+                lua_keyboard_dirty = true;
+                step = TYPE_PRESS_SEND;
+                continue;
+            }
+            case TYPE_RELEASE: {
+                typing_chord(L, i, &chord);
+                for (int k = 0; k < KEYBOARD_BITMAP_SIZE; k++) {
+                    lua_keyboard.keys[k] &= ~chord.keys[k];
+                }
+                lua_keyboard_dirty = true;
+                step = TYPE_RELEASE_SEND;
+                continue;
+            }
+            case TYPE_RESTORE:
+                lua_keyboard.modifier = (uint8_t)lua_tointeger(L, 4);
+                step = TYPE_RESTORE_SEND;
+                continue;
+            default:
+                break;
+        }
+        
+        // Send steps
+        if (usb_output_is_local() && !usb_device_ready(0)) {
+            wait_ms = 1;  // Endpoint busy: try the same step again
+        } else {
+            send_keyboard_report();
+            if (step == TYPE_PRESS_SEND) {
+                wait_ms = delay_ms > 5 ? delay_ms : 5;  // minimum press time
+                step = TYPE_RELEASE;
+            } else if (step == TYPE_RELEASE_SEND) {
+                wait_ms = 5;
+                step = TYPE_RESTORE;
+            } else {
+                wait_ms = delay_ms > 5 ? delay_ms - 5 : 0;
+                step = TYPE_PRESS;
+                lua_pushinteger(L, i + 1);
+                lua_replace(L, 3);
+            }
+        }
+        
+        if (wait_ms > 0) {
+            if (macro_can_yield(L)) {
+                return macro_yield(L, wait_ms, type_text_k, step);
+            }
+            macro_block(wait_ms);
+        }
+    }
+}
+
+// Start typing stack 1 with the delay / hold at stack 2
+static int start_typing(lua_State *L) {
+    lua_settop(L, 2);
+    lua_pushinteger(L, 0);  // Entry index (kept on the stack across yields)
+    lua_pushinteger(L, 0);  // Original modifier (link)
+    if (usb_output_is_local()) {
+        return playback_k(L, LUA_OK, PLAYBACK_ACQUIRE);
     }
+    return type_text_k(L, LUA_OK, TYPE_PRESS);
 }
 
 // Custom sleep function for Lua (sleep for specified milliseconds)
 int lua_sleep(lua_State *L) {
     int ms = (int)luaL_checknumber(L, 1);  // Get milliseconds from Lua
-    vTaskDelay(pdMS_TO_TICKS(ms));         // FreeRTOS delay
+    if (ms < 0) {
+        ms = 0;
+    }
+    if (macro_can_yield(L)) {
+        return macro_yield(L, (uint32_t)ms, NULL, 0);  // Other macros run meanwhile
+    }
+    macro_block(ms);         // FreeRTOS delay
     return 0;  // No return values
 }
 
@@ -623,32 +778,18 @@ int lua_switch(lua_State *L) {
 int lua_keypress(lua_State *L) {
     int keycode = (int)luaL_checknumber(L, 1);  // Get keycode from Lua
     
-    // Validate keycode range (HID keycodes are typically 0-255)
-    if (keycode < 0 || keycode > 255) {
-        luaL_error(L, "Invalid keycode: %d (must be 0-255)", keycode);
-        return 0;
-    }
-    
-    // Check if key is already pressed
-    if (find_keycode_index((uint8_t)keycode) >= 0) {
-        // Key already pressed, just return
-        return 0;
-    }
-    
-    // Find empty slot to add the key
-    int slot = find_empty_slot();
-    if (slot < 0) {
-        luaL_error(L, "Cannot press more keys: maximum 6 simultaneous keys reached");
+    // Validate keycode range (key usages 0x00-0xDF, modifiers 0xE0-0xE7)
+    if (keycode < 0 || keycode > HID_KEY_GUI_RIGHT) {
+        luaL_error(L, "Invalid keycode: %d (must be 0-231)", keycode);
         return 0;
     }
     
-    // Add keycode to pressed keys
-    lua_keyboard_keycodes[slot] = (uint8_t)keycode;
+    // Add keycode to pressed keys (NKRO: no limit on simultaneous keys)
+    keyboard_bitmap_set(&lua_keyboard, (uint8_t)keycode, true);
     lua_keyboard_dirty = true;
     
     // Send the keyboard report
-    send_keyboard_report();
-    return 0;  // No return values
+    return send_report_k(L, LUA_OK, 0);  // No return values
 }
 
 // Lua function to release a keyboard key
@@ -656,73 +797,48 @@ int lua_keyrelease(lua_State *L) {
     int keycode = (int)luaL_checknumber(L, 1);  // Get keycode from Lua
     
     // Validate keycode range
-    if (keycode < 0 || keycode > 255) {
-        luaL_error(L, "Invalid keycode: %d (must be 0-255)", keycode);
-        return 0;
-    }
-    
-    // Find the key in currently pressed keys
-    int index = find_keycode_index((uint8_t)keycode);
-    if (index < 0) {
-        // Key not currently pressed, just return
+    if (keycode < 0 || keycode > HID_KEY_GUI_RIGHT) {
+        luaL_error(L, "Invalid keycode: %d (must be 0-231)", keycode);
         return 0;
     }
     
     // Remove keycode from pressed keys
-    lua_keyboard_keycodes[index] = 0;
+    keyboard_bitmap_set(&lua_keyboard, (uint8_t)keycode, false);
     lua_keyboard_dirty = true;
     
     // Send the keyboard report
-    send_keyboard_report();
-    return 0;  // No return values
+    return send_report_k(L, LUA_OK, 0);  // No return values
 }
 
-// Lua function to set keyboard language
+// Lua function to set keyboard language: lang("us" / "ja" / <name> of a <name>.kbd layout file)
 int lua_set_language(lua_State *L) {
     const char* lang = luaL_checkstring(L, 1);
     
-    if (strcmp(lang, "us") == 0 || strcmp(lang, "en") == 0) {
-        current_keyboard_lang = KEYBOARD_LANG_US;
-        printf("Keyboard language set to US English (104-key)\n");
-        
-        if (tud_cdc_connected()) {
-            tud_cdc_write_str("Keyboard language: US English (104-key)\r\n");
-            tud_cdc_write_flush();
-        }
-    } else if (strcmp(lang, "ja") == 0 || strcmp(lang, "jp") == 0) {
-        current_keyboard_lang = KEYBOARD_LANG_JA;
-        printf("Keyboard language set to Japanese (109-key)\n");
-        
-        if (tud_cdc_connected()) {
-            tud_cdc_write_str("Keyboard language: Japanese (109-key)\r\n");
-            tud_cdc_write_flush();
-        }
-    } else {
-        luaL_error(L, "Invalid language: %s (supported: us, en, ja, jp)", lang);
-        return 0;
+    if (key_layout_select(lang) < 0) {
+        return luaL_error(L, "Invalid language: %s (built in: us, en, ja, jp; others need %s%s)",
+                          lang, lang, KEY_LAYOUT_FILE_SUFFIX);
     }
+    printf("Keyboard language set to %s\n", key_layout_name());
     
+    if (tud_cdc_connected()) {
+        tud_cdc_write_str("Keyboard language: ");
+        tud_cdc_write_str(key_layout_name());
+        tud_cdc_write_str("\r\n");
+        tud_cdc_write_flush();
+    }
     return 0; // No return values
 }
 
 // Lua function to get current keyboard language
 int lua_get_language(lua_State *L) {
-    const char* lang_str;
-    
-    if (current_keyboard_lang == KEYBOARD_LANG_JA) {
-        lang_str = "ja";
-    } else {
-        lang_str = "us";
-    }
-    
-    lua_pushstring(L, lang_str);
+    lua_pushstring(L, key_layout_name());
     return 1; // Return language string
 }
 
 // Lua function to type a string with timing
 int lua_type_text(lua_State *L) {
     // Get string and delay from Lua
-    const char* text = luaL_checkstring(L, 1);
+    luaL_checkstring(L, 1);
     int delay_ms = (int)luaL_checknumber(L, 2);
     
     // Validate delay
@@ -731,30 +847,55 @@ int lua_type_text(lua_State *L) {
         return 0;
     }
     
-    // Type each character in the string
-    size_t len = strlen(text);
-    for (size_t i = 0; i < len; i++) {
-        char c = text[i];
-        type_character(c, delay_ms);
-        
-        // Check for special escape sequences
-        if (c == '\\' && i + 1 < len) {
-            char next_char = text[i + 1];
-            switch (next_char) {
-                case 'n':
-                    // Already handled by \n in mapping table
-                    break;
-                case 't':
-                    // Already handled by \t in mapping table  
-                    break;
-                default:
-                    // Unknown escape sequence, continue normally
-                    break;
+    // Type each character in the string (each held for the delay, 0 = one frame)
+    lua_settop(L, 2);
+    lua_pushinteger(L, delay_ms);
+    lua_replace(L, 2);
+    return start_typing(L);
+}
+
+// Check the keycode at the top of the stack (entry i of a type_keys() sequence)
+static void check_sequence_key(lua_State *L, lua_Integer i) {
+    int isnum;
+    lua_Integer keycode = lua_tointegerx(L, -1, &isnum);
+    if (!isnum || keycode < 0 || keycode > HID_KEY_GUI_RIGHT) {
+        luaL_error(L, "Invalid keycode in entry %d (must be 0-231)", (int)i);
+    }
+}
+
+// Lua function to type a key sequence: each entry is a keycode or a table of keycodes
+// pressed together, held for hold_ms (default: one frame)
+int lua_type_keys(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int hold_ms = (int)luaL_optinteger(L, 2, 0);
+    
+    // Validate hold time
+    if (hold_ms < 0 || hold_ms > 10000) {
+        luaL_error(L, "Invalid hold time: %d (must be 0-10000 ms)", hold_ms);
+        return 0;
+    }
+    
+    // Validate every entry before anything is sent
+    lua_Integer len = (lua_Integer)lua_rawlen(L, 1);
+    for (lua_Integer i = 1; i <= len; i++) {
+        lua_rawgeti(L, 1, i);
+        if (lua_istable(L, -1)) {
+            lua_Integer keys = (lua_Integer)lua_rawlen(L, -1);
+            for (lua_Integer k = 1; k <= keys; k++) {
+                lua_rawgeti(L, -1, k);
+                check_sequence_key(L, i);
+                lua_pop(L, 1);
             }
+        } else {
+            check_sequence_key(L, i);
         }
+        lua_pop(L, 1);
     }
     
-    return 0;  // No return values
+    lua_settop(L, 2);
+    lua_pushinteger(L, hold_ms);
+    lua_replace(L, 2);
+    return start_typing(L);
 }
 
 // Lua function to set various parameters
@@ -778,73 +919,70 @@ int lua_set(lua_State *L) {
     return 0;  // No return values
 }
 
+static int clamp_motion(int value) {
+    return value > 32767 ? 32767 : value < -32767 ? -32767 : value;
+}
+
 // Lua function to move mouse
 int lua_mouse_move(lua_State *L) {
     int x = (int)luaL_checknumber(L, 1);  // Get X movement from Lua
     int y = (int)luaL_checknumber(L, 2);  // Get Y movement from Lua
     
-    // Validate movement range (-127 to 127)
-    if (x < -127 || x > 127) {
-        luaL_error(L, "Invalid X movement: %d (must be -127 to 127)", x);
+    // Validate movement range (16-bit report; split automatically in boot protocol)
+    if (x < -32767 || x > 32767) {
+        luaL_error(L, "Invalid X movement: %d (must be -32767 to 32767)", x);
         return 0;
     }
-    if (y < -127 || y > 127) {
-        luaL_error(L, "Invalid Y movement: %d (must be -127 to 127)", y);
+    if (y < -32767 || y > 32767) {
+        luaL_error(L, "Invalid Y movement: %d (must be -32767 to 32767)", y);
         return 0;
     }
     
-    lua_mouse_x = (int8_t)x;
-    lua_mouse_y = (int8_t)y;
+    // Add to the motion not sent yet (another macro may be waiting for the endpoint)
+    lua_mouse_x = (int16_t)clamp_motion(lua_mouse_x + x);
+    lua_mouse_y = (int16_t)clamp_motion(lua_mouse_y + y);
     lua_mouse_dirty = true;
     
-    // Send the mouse report
-    send_mouse_report();
-    
-    // Reset movement values after sending
-    lua_mouse_x = 0;
-    lua_mouse_y = 0;
-    
-    return 0;  // No return values
+    // Send the mouse report (motion is reset once sent)
+    return send_report_k(L, LUA_OK, 1);  // No return values
 }
 
 // Lua function to press mouse button
 int lua_mouse_press(lua_State *L) {
     int button = (int)luaL_checknumber(L, 1);  // Get button number from Lua (1=left, 2=right, 3=middle)
     
-    // Validate button number (1-8)
-    if (button < 1 || button > 8) {
-        luaL_error(L, "Invalid button number: %d (must be 1-8)", button);
+    // Validate button number (1-16)
+    if (button < 1 || button > 16) {
+        luaL_error(L, "Invalid button number: %d (must be 1-16)", button);
         return 0;
     }
     
     // Set button bit
-    uint8_t button_mask = 1 << (button - 1);
+    uint16_t button_mask = 1 << (button - 1);
     lua_mouse_buttons |= button_mask;
     lua_mouse_dirty = true;
     
     // Send the mouse report
-    send_mouse_report();
-    return 0;  // No return values
+    return send_report_k(L, LUA_OK, 1);  // No return values
 }
 
 // Lua function to release mouse button
 int lua_mouse_release(lua_State *L) {
     int button = (int)luaL_checknumber(L, 1);  // Get button number from Lua
     
-    // Validate button number (1-8)
-    if (button < 1 || button > 8) {
-        luaL_error(L, "Invalid button number: %d (must be 1-8)", button);
+    // Validate button number (1-16)
+    if (button < 1 || button > 16) {
+        luaL_error(L, "Invalid button number: %d (must be 1-16)", button);
         return 0;
     }
     
     // Clear button bit
-    uint8_t button_mask = 1 << (button - 1);
+    uint16_t button_mask = 1 << (button - 1);
     lua_mouse_buttons &= ~button_mask;
     lua_mouse_dirty = true;
     
     // Send the mouse report
-    send_mouse_report();
-    return 0;  // No return values
+    return send_report_k(L, LUA_OK, 1);  // No return values
 }
 
 // Lua function to scroll mouse wheel
@@ -857,18 +995,44 @@ int lua_mouse_scroll(lua_State *L) {
         return 0;
     }
     
-    lua_mouse_wheel = (int8_t)wheel;
+    int total = lua_mouse_wheel + wheel;
+    lua_mouse_wheel = (int8_t)(total > 127 ? 127 : total < -127 ? -127 : total);
     lua_mouse_dirty = true;
     
-    // Send the mouse report
-    send_mouse_report();
+    // Send the mouse report (wheel is reset once sent)
+    return send_report_k(L, LUA_OK, 1);  // No return values
+}
+
+// Lua function to move the pointer to an absolute position (0-32767 on each axis)
+int lua_mouse_warp(lua_State *L) {
+    int x = (int)luaL_checknumber(L, 1);
+    int y = (int)luaL_checknumber(L, 2);
     
-    // Reset wheel value after sending
-    lua_mouse_wheel = 0;
+    if (x < 0 || x > POINTER_ABS_MAX || y < 0 || y > POINTER_ABS_MAX) {
+        luaL_error(L, "Invalid pointer position: %d, %d (must be 0 to %d)", x, y, POINTER_ABS_MAX);
+        return 0;
+    }
     
+    if (usb_output_is_local()) {
+        if (!usb_device_pointer_warp((uint16_t)x, (uint16_t)y)) {
+            printf("Warning: Pointer warp needs report protocol on USB1\n");
+        }
+    } else {
+        // Link output mode - the selected node moves its own virtual cursor
+        link_send_pointer_warp(USB_output_switch, (uint16_t)x, (uint16_t)y);
+    }
     return 0;  // No return values
 }
 
+// Lua function to get the virtual cursor position of this node (x, y)
+int lua_mouse_position(lua_State *L) {
+    uint16_t x, y;
+    usb_device_pointer_get(&x, &y);
+    lua_pushinteger(L, x);
+    lua_pushinteger(L, y);
+    return 2;
+}
+
 // Lua function to check if specific gamepad button is pressed
 int lua_gamepad_get_button(lua_State *L) {
     const char *button_str = luaL_checkstring(L, 1);  // Get button string from Lua
@@ -1095,50 +1259,486 @@ int lua_gamepad_reset(lua_State *L) {
 }
 
 //--------------------------------------------------------------------+
-// OLED Display Functions for Lua
+// batch(): report operations checked up front and sent as one unit. The operations between
+// two sleeps are merged into one report per device; a keyboard-only batch on the local USB
+// port goes to the report timeline (KeyTimeline.c) in one piece
 //--------------------------------------------------------------------+
 
-// Lua function to display text at specified coordinates
-int lua_oled_text(lua_State *L) {
-    int x = (int)luaL_checknumber(L, 1);        // X coordinate
-    int y = (int)luaL_checknumber(L, 2);        // Y coordinate
-    int scale = (int)luaL_checknumber(L, 3);    // Scale factor
-    const char* text = luaL_checkstring(L, 4);  // Text to display
-    
-    // Validate coordinates (assuming 128x32 display)
-    if (x < 0 || x > 127) {
-        luaL_error(L, "Invalid X coordinate: %d (must be 0-127)", x);
-        return 0;
-    }
-    if (y < 0 || y > 31) {
-        luaL_error(L, "Invalid Y coordinate: %d (must be 0-31)", y);
-        return 0;
-    }
-    
-    // Validate scale factor
-    if (scale < 1 || scale > 4) {
-        luaL_error(L, "Invalid scale factor: %d (must be 1-4)", scale);
-        return 0;
+#define BATCH_MAX_OPS 256   // 1回の batch() に渡せる操作
+
+enum {
+    BATCH_KEY_PRESS,
+    BATCH_KEY_RELEASE,
+    BATCH_MOUSE_PRESS,
+    BATCH_MOUSE_RELEASE,
+    BATCH_MOUSE_MOVE,
+    BATCH_MOUSE_SCROLL,
+    BATCH_GAMEPAD_PRESS,
+    BATCH_GAMEPAD_RELEASE,
+    BATCH_GAMEPAD_ANALOG,
+    BATCH_GAMEPAD_HAT,
+    BATCH_SLEEP,
+    BATCH_OP_COUNT
+};
+
+// Devices changed by a segment (batch_k context while their reports wait for the endpoint)
+#define BATCH_KEYBOARD  0x01
+#define BATCH_MOUSE     0x02
+#define BATCH_GAMEPAD   0x04
+
+// One checked operation
+typedef struct {
+    uint8_t op;         // BATCH_*
+    uint8_t axis;       // gamepad_set_analog: 0 x, 1 y, 2 z, 3 rz
+    int16_t value;      // Keycode / button / x movement / wheel / analog or hat value / sleep ms
+    int16_t y;          // mouse_move: y movement
+} batch_op_t;
+
+// Name in the table form (same as the single call) and range of the value
+static const struct {
+    const char* name;
+    int16_t min;
+    int16_t max;
+} batch_ops[BATCH_OP_COUNT] = {
+    [BATCH_KEY_PRESS]       = { "keypress",               0, HID_KEY_GUI_RIGHT },
+    [BATCH_KEY_RELEASE]     = { "keyrelease",             0, HID_KEY_GUI_RIGHT },
+    [BATCH_MOUSE_PRESS]     = { "mouse_press",            1, 16 },
+    [BATCH_MOUSE_RELEASE]   = { "mouse_release",          1, 16 },
+    [BATCH_MOUSE_MOVE]      = { "mouse_move",        -32767, 32767 },
+    [BATCH_MOUSE_SCROLL]    = { "mouse_scroll",        -127, 127 },
+    [BATCH_GAMEPAD_PRESS]   = { "gamepad_press_button",   1, 16 },
+    [BATCH_GAMEPAD_RELEASE] = { "gamepad_release_button", 1, 16 },
+    [BATCH_GAMEPAD_ANALOG]  = { "gamepad_set_analog",  -127, 127 },
+    [BATCH_GAMEPAD_HAT]     = { "gamepad_set_hat",        0, 15 },
+    [BATCH_SLEEP]           = { "sleep",                  0, 10000 },
+};
+
+static const char* const batch_axes[4] = { "x", "y", "z", "rz" };
+
+// Check the value of entry (1-based) against the range of op
+static int16_t batch_check(lua_State *L, int entry, uint8_t op, lua_Integer value) {
+    if (value < batch_ops[op].min || value > batch_ops[op].max) {
+        luaL_error(L, "batch: invalid value %I in entry %d (%s: %d to %d)",
+                   value, entry, batch_ops[op].name, batch_ops[op].min, batch_ops[op].max);
     }
-    
-    // Call OLED function
-    oled_display_text((uint32_t)x, (uint32_t)y, (uint32_t)scale, text);
-    
-    return 0;  // No return values
+    return (int16_t)value;
 }
 
-// Lua function to display centered text
-int lua_oled_centered(lua_State *L) {
-    int y = (int)luaL_checknumber(L, 1);        // Y coordinate
-    int scale = (int)luaL_checknumber(L, 2);    // Scale factor
-    const char* text = luaL_checkstring(L, 3);  // Text to display
-    
-    // Validate Y coordinate
-    if (y < 0 || y > 31) {
-        luaL_error(L, "Invalid Y coordinate: %d (must be 0-31)", y);
-        return 0;
+// Value n of the entry table at the top of the stack
+static int16_t batch_table_value(lua_State *L, int entry, uint8_t op, int n) {
+    int isnum;
+    lua_rawgeti(L, -1, n);
+    lua_Integer value = lua_tointegerx(L, -1, &isnum);
+    lua_pop(L, 1);
+    if (!isnum) {
+        luaL_error(L, "batch: entry %d (%s) needs a number as value %d", entry, batch_ops[op].name, n - 1);
     }
-    
+    return batch_check(L, entry, op, value);
+}
+
+// Table form: {{"keypress", 0xE0}, {"keypress", 0x04}, {"sleep", 20}, {"mouse_move", 10, -5}, ...}
+static void batch_parse_table(lua_State *L, batch_op_t *ops, int count) {
+    for (int i = 0; i < count; i++) {
+        int entry = i + 1;
+        batch_op_t *op = &ops[i];
+        
+        if (lua_rawgeti(L, 1, entry) != LUA_TTABLE) {
+            luaL_error(L, "batch: entry %d is not a table", entry);
+        }
+        lua_rawgeti(L, -1, 1);
+        const char* name = lua_tostring(L, -1);
+        op->op = BATCH_OP_COUNT;
+        for (uint8_t k = 0; name != NULL && k < BATCH_OP_COUNT; k++) {
+            if (strcmp(name, batch_ops[k].name) == 0) {
+                op->op = k;
+                break;
+            }
+        }
+        if (op->op == BATCH_OP_COUNT) {
+            luaL_error(L, "batch: unknown operation '%s' in entry %d", name ? name : "?", entry);
+        }
+        lua_pop(L, 1);
+        
+        int n = 2;
+        if (op->op == BATCH_GAMEPAD_ANALOG) {
+            lua_rawgeti(L, -1, n++);
+            const char* axis = lua_tostring(L, -1);
+            op->axis = 4;
+            for (uint8_t a = 0; axis != NULL && a < 4; a++) {
+                if (strcmp(axis, batch_axes[a]) == 0) op->axis = a;
+            }
+            if (op->axis == 4) {
+                luaL_error(L, "batch: invalid axis in entry %d (must be 'x', 'y', 'z', or 'rz')", entry);
+            }
+            lua_pop(L, 1);
+        }
+        op->value = batch_table_value(L, entry, op->op, n);
+        if (op->op == BATCH_MOUSE_MOVE) {
+            op->y = batch_table_value(L, entry, op->op, n + 1);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+// Number at *p (no leading blanks), *p moves past it
+static bool batch_number(const char **p, int base, lua_Integer *value) {
+    const char *start = *p;
+    char *end;
+    if (*start == '\0' || isspace((unsigned char)*start)) {
+        return false;
+    }
+    *value = strtol(start, &end, base);
+    *p = end;
+    return end != start;
+}
+
+static int batch_count_tokens(const char *p) {
+    int count = 0;
+    while (*p != '\0') {
+        while (isspace((unsigned char)*p)) p++;
+        if (*p != '\0') count++;
+        while (*p != '\0' && !isspace((unsigned char)*p)) p++;
+    }
+    return count;
+}
+
+// String form, tokens separated by blanks:
+//   +E0 / -E0  keypress / keyrelease (hex keycode)   +m1 / -m1  mouse_press / mouse_release
+//   +g3 / -g3  gamepad_press_button / _release        m10,-5     mouse_move
+//   s-1        mouse_scroll                           x=100      gamepad_set_analog (x y z rz)
+//   h1         gamepad_set_hat                        w20        sleep (ms)
+static void batch_parse_string(lua_State *L, const char *p, batch_op_t *ops, int count) {
+    for (int i = 0; i < count; i++) {
+        batch_op_t *op = &ops[i];
+        lua_Integer value = 0;
+        lua_Integer y = 0;
+        bool ok;
+        
+        while (isspace((unsigned char)*p)) p++;
+        const char *token = p;
+        memset(op, 0, sizeof(*op));
+        
+        if (*p == '+' || *p == '-') {
+            bool press = *p++ == '+';
+            if (*p == 'm') {
+                p++;
+                op->op = press ? BATCH_MOUSE_PRESS : BATCH_MOUSE_RELEASE;
+                ok = batch_number(&p, 10, &value);
+            } else if (*p == 'g') {
+                p++;
+                op->op = press ? BATCH_GAMEPAD_PRESS : BATCH_GAMEPAD_RELEASE;
+                ok = batch_number(&p, 10, &value);
+            } else {
+                op->op = press ? BATCH_KEY_PRESS : BATCH_KEY_RELEASE;
+                ok = batch_number(&p, 16, &value);
+            }
+        } else if (*p == 'm') {
+            p++;
+            op->op = BATCH_MOUSE_MOVE;
+            ok = batch_number(&p, 10, &value) && *p == ',';
+            if (ok) {
+                p++;
+                ok = batch_number(&p, 10, &y);
+            }
+        } else if (*p == 's' || *p == 'h' || *p == 'w') {
+            op->op = *p == 's' ? BATCH_MOUSE_SCROLL : *p == 'h' ? BATCH_GAMEPAD_HAT : BATCH_SLEEP;
+            p++;
+            ok = batch_number(&p, 10, &value);
+        } else {
+            op->op = BATCH_GAMEPAD_ANALOG;
+            ok = false;
+            for (uint8_t a = 0; a < 4; a++) {
+                size_t len = strlen(batch_axes[a]);
+                if (strncmp(p, batch_axes[a], len) == 0 && p[len] == '=') {
+                    op->axis = a;
+                    p += len + 1;
+                    ok = batch_number(&p, 10, &value);
+                    break;
+                }
+            }
+        }
+        
+        if (!ok || (*p != '\0' && !isspace((unsigned char)*p))) {
+            char text[16];
+            snprintf(text, sizeof(text), "%.*s", (int)strcspn(token, " \t\r\n"), token);
+            luaL_error(L, "batch: invalid token %d '%s'", i + 1, text);
+        }
+        op->value = batch_check(L, i + 1, op->op, value);
+        if (op->op == BATCH_MOUSE_MOVE) {
+            op->y = batch_check(L, i + 1, op->op, y);
+        }
+    }
+}
+
+// Apply one operation to the Lua output state; returns the device it changed
+static uint8_t batch_apply(const batch_op_t *op) {
+    switch (op->op) {
+        case BATCH_KEY_PRESS:
+        case BATCH_KEY_RELEASE:
+            keyboard_bitmap_set(&lua_keyboard, (uint8_t)op->value, op->op == BATCH_KEY_PRESS);
+            lua_keyboard_dirty = true;
+            return BATCH_KEYBOARD;
+        case BATCH_MOUSE_PRESS:
+            lua_mouse_buttons |= 1 << (op->value - 1);
+            break;
+        case BATCH_MOUSE_RELEASE:
+            lua_mouse_buttons &= ~(1 << (op->value - 1));
+            break;
+        case BATCH_MOUSE_MOVE:
+            lua_mouse_x = (int16_t)clamp_motion(lua_mouse_x + op->value);
+            lua_mouse_y = (int16_t)clamp_motion(lua_mouse_y + op->y);
+            break;
+        case BATCH_MOUSE_SCROLL: {
+            int total = lua_mouse_wheel + op->value;
+            lua_mouse_wheel = (int8_t)(total > 127 ? 127 : total < -127 ? -127 : total);
+            break;
+        }
+        case BATCH_GAMEPAD_PRESS:
+            lua_gamepad_buttons |= 1 << (op->value - 1);
+            lua_gamepad_active = true;
+            lua_gamepad_dirty = true;
+            return BATCH_GAMEPAD;
+        case BATCH_GAMEPAD_RELEASE:
+            lua_gamepad_buttons &= ~(1 << (op->value - 1));
+            lua_gamepad_dirty = true;
+            return BATCH_GAMEPAD;
+        case BATCH_GAMEPAD_ANALOG: {
+            int8_t *axes[4] = { &lua_gamepad_x, &lua_gamepad_y, &lua_gamepad_z, &lua_gamepad_rz };
+            *axes[op->axis] = (int8_t)op->value;
+            lua_gamepad_active = true;
+            lua_gamepad_dirty = true;
+            return BATCH_GAMEPAD;
+        }
+        case BATCH_GAMEPAD_HAT:
+            lua_gamepad_hat = (uint8_t)op->value;
+            lua_gamepad_active = true;
+            lua_gamepad_dirty = true;
+            return BATCH_GAMEPAD;
+        default:
+            return 0;
+    }
+    lua_mouse_dirty = true;
+    return BATCH_MOUSE;
+}
+
+// Apply the operations from *i up to the next sleep; returns the devices they changed
+static uint8_t batch_apply_segment(const batch_op_t *ops, int count, int *i) {
+    // Buttons inherit the analog values of the real gamepad like gamepad_press_button(),
+    // unless the segment sets the axes itself
+    bool buttons = false;
+    bool analog = false;
+    for (int k = *i; k < count && ops[k].op != BATCH_SLEEP; k++) {
+        buttons |= ops[k].op == BATCH_GAMEPAD_PRESS || ops[k].op == BATCH_GAMEPAD_RELEASE;
+        analog |= ops[k].op == BATCH_GAMEPAD_ANALOG;
+    }
+    if (buttons && !analog) {
+        lua_gamepad_x = current_gamepad_state.x;
+        lua_gamepad_y = current_gamepad_state.y;
+        lua_gamepad_z = current_gamepad_state.z;
+        lua_gamepad_rz = current_gamepad_state.rz;
+    }
+    
+    uint8_t devices = 0;
+    while (*i < count && ops[*i].op != BATCH_SLEEP) {
+        devices |= batch_apply(&ops[(*i)++]);
+    }
+    return devices;
+}
+
+// Send the reports of the devices in pending whose endpoint is free; returns those still waiting
+static uint8_t batch_send(uint8_t pending) {
+    bool local = usb_output_is_local();
+    if ((pending & BATCH_KEYBOARD) && (!local || (usb_device_ready(0) && !key_timeline_busy()))) {
+        send_keyboard_report();
+        pending &= ~BATCH_KEYBOARD;
+    }
+    if ((pending & BATCH_MOUSE) && (!local || usb_device_ready(1))) {
+        send_mouse_report();
+        pending &= ~BATCH_MOUSE;
+    }
+    if (pending & BATCH_GAMEPAD) {
+        send_gamepad_report();  // USB output: USBDeviceTask.c sends the dirty state
+        pending &= ~BATCH_GAMEPAD;
+    }
+    return pending;
+}
+
+// batch() continuation: stack 1 = operations, 2 = checked operations (userdata),
+// 3 = index of the next operation; pending = devices whose report waits for the endpoint
+static int batch_k(lua_State *L, int status, lua_KContext pending) {
+    (void)status;
+    const batch_op_t *ops = (const batch_op_t*)lua_touserdata(L, 2);
+    int count = (int)(lua_rawlen(L, 2) / sizeof(batch_op_t));
+    
+    while (true) {
+        uint32_t wait_ms = 0;
+        if (pending == 0) {
+            int i = (int)lua_tointeger(L, 3);
+            if (i >= count) {
+                return 0;  // No return values
+            }
+            if (ops[i].op == BATCH_SLEEP) {
+                wait_ms = (uint32_t)ops[i++].value;
+            } else {
+                pending = batch_apply_segment(ops, count, &i);
+            }
+            lua_pushinteger(L, i);
+            lua_replace(L, 3);
+        }
+        
+        pending = batch_send((uint8_t)pending);
+        if (pending != 0) {
+            wait_ms = 1;  // Endpoint busy: try again
+        }
+        if (wait_ms > 0) {
+            if (macro_can_yield(L)) {
+                return macro_yield(L, wait_ms, batch_k, pending);
+            }
+            macro_block(wait_ms);
+        }
+    }
+}
+
+// Keyboard-only batch on the local USB port (stack as batch_k): each sleep becomes the hold
+// time of the report before it, and Core1 plays the whole batch frame by frame
+static int batch_timeline_k(lua_State *L, int status, lua_KContext step) {
+    (void)status;
+    const batch_op_t *ops = (const batch_op_t*)lua_touserdata(L, 2);
+    int count = (int)(lua_rawlen(L, 2) / sizeof(batch_op_t));
+    
+    while (true) {
+        if (step == PLAYBACK_ACQUIRE) {
+            if (typing_owner == NULL && !key_timeline_busy()) {
+                typing_owner = L;
+                step = PLAYBACK_QUEUE;
+                continue;
+            }
+            if (typing_owner != NULL && !macro_can_yield(L)) {
+                return luaL_error(L, "batch: another macro is typing");
+            }
+        } else if (step == PLAYBACK_QUEUE) {
+            int i = (int)lua_tointeger(L, 3);
+            while (i < count && key_timeline_space() >= 1) {
+                if (ops[i].op == BATCH_SLEEP) {
+                    key_timeline_push(&lua_keyboard, ops[i].value > 1 ? (uint16_t)ops[i].value : 1);
+                } else {
+                    batch_apply(&ops[i]);
+                    if (i + 1 == count) {
+                        key_timeline_push(&lua_keyboard, 1);  // Last segment, no sleep after it
+                    }
+                }
+                i++;
+            }
+            lua_pushinteger(L, i);
+            lua_replace(L, 3);
+            if (i >= count) {
+                lua_keyboard_dirty = false;
+                step = PLAYBACK_DRAIN;
+                continue;
+            }
+        } else {
+            if (!key_timeline_busy()) {
+                typing_owner = NULL;
+                return 0;  // No return values
+            }
+        }
+        
+        if (macro_can_yield(L)) {
+            return macro_yield(L, 1, batch_timeline_k, step);
+        }
+        macro_block(1);
+    }
+}
+
+// Lua function to send a batch of report operations: batch({{"keypress", 0xE0}, ...}) or
+// batch("+E0 +04 w20 -04 -E0"). Every operation is checked before anything is sent
+int lua_batch(lua_State *L) {
+    int count;
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        count = batch_count_tokens(lua_tostring(L, 1));
+    } else {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        lua_Unsigned len = (lua_Unsigned)lua_rawlen(L, 1);
+        count = len > BATCH_MAX_OPS ? BATCH_MAX_OPS + 1 : (int)len;
+    }
+    if (count > BATCH_MAX_OPS) {
+        return luaL_error(L, "batch: too many operations (max %d)", BATCH_MAX_OPS);
+    }
+    if (count == 0) {
+        return 0;  // No return values
+    }
+    
+    lua_settop(L, 1);
+    batch_op_t *ops = (batch_op_t*)lua_newuserdatauv(L, count * sizeof(batch_op_t), 0);
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        batch_parse_string(L, lua_tostring(L, 1), ops, count);
+    } else {
+        batch_parse_table(L, ops, count);
+    }
+    
+    uint8_t devices = 0;
+    for (int i = 0; i < count; i++) {
+        uint8_t op = ops[i].op;
+        devices |= op <= BATCH_KEY_RELEASE ? BATCH_KEYBOARD :
+                   op <= BATCH_MOUSE_SCROLL ? BATCH_MOUSE :
+                   op <= BATCH_GAMEPAD_HAT ? BATCH_GAMEPAD : 0;
+    }
+    if ((devices & BATCH_GAMEPAD) && running_slot != NULL) {
+        running_slot->uses_gamepad = true;  // Reset the gamepad when the macro ends
+    }
+    
+    lua_pushinteger(L, 0);  // Operation index (kept on the stack across yields)
+    if (usb_output_is_local() && devices == BATCH_KEYBOARD) {
+        return batch_timeline_k(L, LUA_OK, PLAYBACK_ACQUIRE);
+    }
+    return batch_k(L, LUA_OK, 0);
+}
+
+//--------------------------------------------------------------------+
+// OLED Display Functions for Lua
+//--------------------------------------------------------------------+
+
+// Lua function to display text at specified coordinates
+int lua_oled_text(lua_State *L) {
+    int x = (int)luaL_checknumber(L, 1);        // X coordinate
+    int y = (int)luaL_checknumber(L, 2);        // Y coordinate
+    int scale = (int)luaL_checknumber(L, 3);    // Scale factor
+    const char* text = luaL_checkstring(L, 4);  // Text to display
+    
+    // Validate coordinates (assuming 128x32 display)
+    if (x < 0 || x > 127) {
+        luaL_error(L, "Invalid X coordinate: %d (must be 0-127)", x);
+        return 0;
+    }
+    if (y < 0 || y > 31) {
+        luaL_error(L, "Invalid Y coordinate: %d (must be 0-31)", y);
+        return 0;
+    }
+    
+    // Validate scale factor
+    if (scale < 1 || scale > 4) {
+        luaL_error(L, "Invalid scale factor: %d (must be 1-4)", scale);
+        return 0;
+    }
+    
+    // Call OLED function
+    oled_display_text((uint32_t)x, (uint32_t)y, (uint32_t)scale, text);
+    
+    return 0;  // No return values
+}
+
+// Lua function to display centered text
+int lua_oled_centered(lua_State *L) {
+    int y = (int)luaL_checknumber(L, 1);        // Y coordinate
+    int scale = (int)luaL_checknumber(L, 2);    // Scale factor
+    const char* text = luaL_checkstring(L, 3);  // Text to display
+    
+    // Validate Y coordinate
+    if (y < 0 || y > 31) {
+        luaL_error(L, "Invalid Y coordinate: %d (must be 0-31)", y);
+        return 0;
+    }
+    
     // Validate scale factor
     if (scale < 1 || scale > 4) {
         luaL_error(L, "Invalid scale factor: %d (must be 1-4)", scale);
@@ -1172,8 +1772,8 @@ int lua_oled_present(lua_State *L) {
 
 // Helper function to send current gamepad state
 static void send_gamepad_report(void) {
-    if (USB_output_switch != 0) {
-        // UART output mode - send to UART1 (same format as GamepadReportParser.c)
+    if (!usb_output_is_local()) {
+        // Link output mode (same 8-byte layout as GamepadReportParser.c)
         // Pack gamepad data into 8 bytes: x, y, z, rz, hat, buttons(2 bytes), reserved
         uint8_t gamepad_data[8];
         gamepad_data[0] = (uint8_t)lua_gamepad_x;     // X axis
@@ -1185,20 +1785,8 @@ static void send_gamepad_report(void) {
         gamepad_data[6] = (uint8_t)((lua_gamepad_buttons >> 8) & 0xFF); // Buttons high byte
         gamepad_data[7] = 0;                          // Reserved/unused
 
-        // Encode to base64
-        char base64_output[16]; // 8 bytes -> 12 chars base64 + null terminator + padding
-        int encoded_length = base64_encode(gamepad_data, sizeof(gamepad_data), base64_output, sizeof(base64_output));
-        
-        if (encoded_length > 0) {
-            // Send gamepad report to UART1 in format: "G<switch_value><base64_data>\n"
-            char uart_message[32];
-            snprintf(uart_message, sizeof(uart_message), "G%d%s\n", USB_output_switch, base64_output);
-            
-            // Send to UART1
-            uart_puts(uart1, uart_message);
-        } else {
-            printf("UART1: Failed to encode gamepad data to base64\n");
-        }
+        // Send gamepad report to the selected node: "G<dst><base64_data>\n"
+        link_send_gamepad(USB_output_switch, gamepad_data);
     }
     // Note: USB output mode is handled by USBDeviceTask.c via get_lua_gamepad_state()
 }
@@ -1218,6 +1806,222 @@ void get_lua_gamepad_state(int8_t* x, int8_t* y, int8_t* z, int8_t* rz,
     lua_gamepad_force_zero = false; // Clear force zero flag after reading
 }
 
+// peer_log() continuation: wait (up to 1s) while a previous log message is still being sent
+static int peer_log_k(lua_State *L, int status, lua_KContext tries) {
+    (void)status;
+    while (tries < 100 && link_bulk_busy(LINK_CH_BULK_LOG)) {
+        tries++;
+        if (macro_can_yield(L)) {
+            return macro_yield(L, 10, peer_log_k, tries);
+        }
+        macro_block(10);
+    }
+    
+    lua_pushboolean(L, link_log(lua_tostring(L, 1)));
+    return 1;  // Return boolean value
+}
+
+// Lua function to send a log line to the other Pico over the link bulk channel
+int lua_peer_log(lua_State *L) {
+    luaL_checkstring(L, 1);
+    return peer_log_k(L, LUA_OK, 0);
+}
+
+//--------------------------------------------------------------------+
+// Input Event Waits for Lua
+//--------------------------------------------------------------------+
+
+static const char* const axis_names[4] = { "x", "y", "z", "rz" };
+
+// Tell Core1 which input events any macro is waiting for (none: Core1 queues nothing)
+static void update_input_mask(void) {
+    uint8_t mask = 0;
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+        macro_slot_t *slot = &macro_slots[i];
+        if (slot->co != NULL && !slot->wait_fired) {
+            for (uint8_t j = 0; j < slot->wait_count; j++) {
+                mask |= slot->wait_specs[j].type;
+            }
+        }
+    }
+    input_events_set_mask(mask);
+}
+
+static bool wait_spec_matches(const macro_slot_t *slot, const wait_spec_t *spec, const input_event_t *event) {
+    if (spec->type != event->type) {
+        return false;
+    }
+    switch (event->type) {
+        case INPUT_EVENT_KEY:
+        case INPUT_EVENT_BUTTON:
+            return event->value != 0 && (spec->code == 0 || spec->code == event->code);  // Presses only
+        case INPUT_EVENT_AXIS:
+            return abs(event->value - slot->wait_axes[event->code]) >= spec->code;
+        default:
+            return false;
+    }
+}
+
+// Hand the queued input events to the waiting macros (they resume on this scheduler pass)
+static void dispatch_input_events(void) {
+    input_event_t event;
+    
+    while (input_events_pop(&event)) {
+        for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+            macro_slot_t *slot = &macro_slots[i];
+            if (slot->co == NULL || slot->wait_count == 0 || slot->wait_fired || event.time_us < slot->wait_since_us) {
+                continue;
+            }
+            for (uint8_t j = 0; j < slot->wait_count; j++) {
+                if (wait_spec_matches(slot, &slot->wait_specs[j], &event)) {
+                    slot->wait_event = event;
+                    slot->wait_fired = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Input wait continuation: resumed by a matching event (event table, time_us) or the timeout (nil)
+static int wait_input_k(lua_State *L, int status, lua_KContext ctx) {
+    (void)status;
+    (void)ctx;
+    macro_slot_t *slot = running_slot;
+    bool fired = slot->wait_fired;
+    const input_event_t *event = &slot->wait_event;
+    slot->wait_count = 0;
+    slot->wait_fired = false;
+    
+    if (!fired) {
+        lua_pushnil(L);
+        return 1;  // Timed out
+    }
+    
+    lua_newtable(L);
+    if (event->type == INPUT_EVENT_AXIS) {
+        lua_pushstring(L, "axis");
+        lua_setfield(L, -2, "type");
+        lua_pushstring(L, axis_names[event->code]);
+        lua_setfield(L, -2, "code");
+        lua_pushinteger(L, event->value);
+        lua_setfield(L, -2, "value");
+    } else {
+        lua_pushstring(L, event->type == INPUT_EVENT_KEY ? "key" : "button");
+        lua_setfield(L, -2, "type");
+        lua_pushinteger(L, event->code);
+        lua_setfield(L, -2, "code");
+        lua_pushboolean(L, event->value != 0);
+        lua_setfield(L, -2, "pressed");
+    }
+    lua_pushinteger(L, (lua_Integer)event->time_us);
+    return 2;  // Event table, time (us) the input was processed
+}
+
+// Start waiting for the slot's wait_specs (timeout_ms < 0: no timeout)
+static int wait_input(lua_State *L, lua_Integer timeout_ms) {
+    macro_slot_t *slot = running_slot;
+    
+    slot->wait_fired = false;
+    slot->wait_forever = timeout_ms < 0;
+    slot->wait_since_us = time_us_64();
+    slot->wait_axes[0] = current_gamepad_state.x;
+    slot->wait_axes[1] = current_gamepad_state.y;
+    slot->wait_axes[2] = current_gamepad_state.z;
+    slot->wait_axes[3] = current_gamepad_state.rz;
+    update_input_mask();
+    return macro_yield(L, timeout_ms < 0 ? 0 : (uint32_t)timeout_ms, wait_input_k, 0);
+}
+
+// Input waits suspend the macro's coroutine; they cannot block the whole Lua task
+static void check_wait_context(lua_State *L, const char *name) {
+    if (!macro_can_yield(L)) {
+        luaL_error(L, "%s() cannot wait here (inside a C call such as a table.sort comparator)", name);
+    }
+}
+
+static lua_Integer opt_timeout(lua_State *L, int arg) {
+    return lua_isnoneornil(L, arg) ? -1 : luaL_checkinteger(L, arg);
+}
+
+// Lua function to wait for a key press: wait_key(keycode [, timeout_ms]) (keycode 0 / nil: any key)
+int lua_wait_key(lua_State *L) {
+    check_wait_context(L, "wait_key");
+    lua_Integer code = luaL_optinteger(L, 1, 0);
+    luaL_argcheck(L, code >= 0 && code <= 0xE7, 1, "keycode must be 0x00-0xE7");
+    
+    running_slot->wait_specs[0].type = INPUT_EVENT_KEY;
+    running_slot->wait_specs[0].code = (int16_t)code;
+    running_slot->wait_count = 1;
+    return wait_input(L, opt_timeout(L, 2));
+}
+
+// Lua function to wait for a gamepad button press: wait_button(n [, timeout_ms]) (n 0 / nil: any button)
+int lua_wait_button(lua_State *L) {
+    check_wait_context(L, "wait_button");
+    lua_Integer button = luaL_optinteger(L, 1, 0);
+    luaL_argcheck(L, button >= 0 && button <= 16, 1, "button must be 1-16");
+    
+    running_slot->wait_specs[0].type = INPUT_EVENT_BUTTON;
+    running_slot->wait_specs[0].code = (int16_t)button;
+    running_slot->wait_count = 1;
+    return wait_input(L, opt_timeout(L, 2));
+}
+
+// Lua function to wait until a gamepad axis moves: wait_axis_change(threshold [, timeout_ms])
+int lua_wait_axis_change(lua_State *L) {
+    check_wait_context(L, "wait_axis_change");
+    lua_Integer threshold = luaL_optinteger(L, 1, 1);
+    luaL_argcheck(L, threshold >= 1 && threshold <= 255, 1, "threshold must be 1-255");
+    
+    running_slot->wait_specs[0].type = INPUT_EVENT_AXIS;
+    running_slot->wait_specs[0].code = (int16_t)threshold;
+    running_slot->wait_count = 1;
+    return wait_input(L, opt_timeout(L, 2));
+}
+
+// Lua function to wait for the first of several inputs:
+// wait_any({key = code}, {button = n}, {axis = threshold}, ... [, timeout_ms])
+int lua_wait_any(lua_State *L) {
+    check_wait_context(L, "wait_any");
+    int top = lua_gettop(L);
+    lua_Integer timeout_ms = -1;
+    if (top > 0 && !lua_istable(L, top)) {
+        timeout_ms = opt_timeout(L, top);
+        top--;
+    }
+    luaL_argcheck(L, top >= 1 && top <= MAX_WAIT_SPECS, 1, "1-8 conditions ({key=}, {button=}, {axis=}) expected");
+    
+    // Check every condition before waiting
+    wait_spec_t specs[MAX_WAIT_SPECS];
+    for (int i = 1; i <= top; i++) {
+        luaL_checktype(L, i, LUA_TTABLE);
+        wait_spec_t *spec = &specs[i - 1];
+        lua_Integer value;
+        if (lua_getfield(L, i, "key") != LUA_TNIL) {
+            value = luaL_checkinteger(L, -1);
+            luaL_argcheck(L, value >= 0 && value <= 0xE7, i, "key must be 0x00-0xE7");
+            spec->type = INPUT_EVENT_KEY;
+        } else if (lua_getfield(L, i, "button") != LUA_TNIL) {
+            value = luaL_checkinteger(L, -1);
+            luaL_argcheck(L, value >= 0 && value <= 16, i, "button must be 0-16");
+            spec->type = INPUT_EVENT_BUTTON;
+        } else if (lua_getfield(L, i, "axis") != LUA_TNIL) {
+            value = luaL_checkinteger(L, -1);
+            luaL_argcheck(L, value >= 1 && value <= 255, i, "axis threshold must be 1-255");
+            spec->type = INPUT_EVENT_AXIS;
+        } else {
+            return luaL_argerror(L, i, "condition needs key, button or axis");
+        }
+        spec->code = (int16_t)value;
+        lua_settop(L, top);
+    }
+    
+    memcpy(running_slot->wait_specs, specs, sizeof(specs[0]) * top);
+    running_slot->wait_count = (uint8_t)top;
+    return wait_input(L, timeout_ms);
+}
+
 // Register custom functions with Lua
 void register_lua_functions(lua_State *L) {
     lua_pushcfunction(L, lua_sleep);
@@ -1232,15 +2036,37 @@ void register_lua_functions(lua_State *L) {
     lua_pushcfunction(L, lua_type_text);
     lua_setglobal(L, "type");  // Make function available as "type(text, delay_ms)" in Lua
     
+    lua_pushcfunction(L, lua_type_keys);
+    lua_setglobal(L, "type_keys");  // Make function available as "type_keys({keycode, {keycode, ...}, ...}, hold_ms)" in Lua
+    
     lua_pushcfunction(L, lua_set_language);
     lua_setglobal(L, "lang");  // Make function available as "lang(language)" in Lua
     
     lua_pushcfunction(L, lua_get_language);
     lua_setglobal(L, "getlang");  // Make function available as "getlang()" in Lua
 
+    lua_pushcfunction(L, lua_stop);
+    lua_setglobal(L, "stop");  // Make function available as "stop(name)" in Lua
+    
+    // Input event waits (the macro sleeps until the input arrives)
+    lua_pushcfunction(L, lua_wait_key);
+    lua_setglobal(L, "wait_key");  // Make function available as "wait_key(keycode, timeout_ms)" in Lua
+    
+    lua_pushcfunction(L, lua_wait_button);
+    lua_setglobal(L, "wait_button");  // Make function available as "wait_button(n, timeout_ms)" in Lua
+    
+    lua_pushcfunction(L, lua_wait_axis_change);
+    lua_setglobal(L, "wait_axis_change");  // Make function available as "wait_axis_change(threshold, timeout_ms)" in Lua
+    
+    lua_pushcfunction(L, lua_wait_any);
+    lua_setglobal(L, "wait_any");  // Make function available as "wait_any({key=}, {button=}, {axis=}, ..., timeout_ms)" in Lua
+    
     lua_pushcfunction(L, lua_switch);
     lua_setglobal(L, "switch");  // Make function available as "switch()" in Lua
 
+    lua_pushinteger(L, USB_OUTPUT_DEVICE2);
+    lua_setglobal(L, "USB2");  // "switch(USB2)" selects the second (PIO-USB) device port
+
     lua_pushcfunction(L, lua_set);
     lua_setglobal(L, "set");  // Make function available as "set(param_name, value)" in Lua
     
@@ -1257,6 +2083,12 @@ void register_lua_functions(lua_State *L) {
     lua_pushcfunction(L, lua_mouse_scroll);
     lua_setglobal(L, "mouse_scroll");  // Make function available as "mouse_scroll(wheel)" in Lua
     
+    lua_pushcfunction(L, lua_mouse_warp);
+    lua_setglobal(L, "mouse_warp");  // Make function available as "mouse_warp(x, y)" in Lua
+    
+    lua_pushcfunction(L, lua_mouse_position);
+    lua_setglobal(L, "mouse_position");  // Make function available as "x, y = mouse_position()" in Lua
+    
     lua_pushcfunction(L, lua_gamepad_get_button);
     lua_setglobal(L, "gamepad_get_button");  // Make function available as "gamepad_get_button(button)" in Lua
     
@@ -1293,6 +2125,9 @@ void register_lua_functions(lua_State *L) {
     lua_pushcfunction(L, lua_gamepad_reset);
     lua_setglobal(L, "gamepad_reset");  // Make function available as "gamepad_reset()" in Lua
     
+    lua_pushcfunction(L, lua_batch);
+    lua_setglobal(L, "batch");  // Make function available as "batch({{op, value}, ...})" / "batch(\"+E0 +04 w20 -04 -E0\")" in Lua
+    
     // OLED display functions
     lua_pushcfunction(L, lua_oled_text);
     lua_setglobal(L, "oled_text");  // Make function available as "oled_text(x, y, scale, text)" in Lua
@@ -1308,17 +2143,16 @@ void register_lua_functions(lua_State *L) {
     
     lua_pushcfunction(L, lua_oled_present);
     lua_setglobal(L, "oled_present");  // Make function available as "oled_present()" in Lua
+
+    // Register link functions
+    lua_pushcfunction(L, lua_peer_log);
+    lua_setglobal(L, "peer_log");  // Make function available as "peer_log(text)" in Lua
 }
 
 //--------------------------------------------------------------------+
 // FIFO Queue Processing
 //--------------------------------------------------------------------+
 
-// Macro execution tracking
-#define MAX_MACRO_NAME_LENGTH 32
-#define MAX_QUEUED_MACROS 16
-
-static char currently_executing_macro[MAX_MACRO_NAME_LENGTH] = {0};
 static char queued_macros[MAX_QUEUED_MACROS][MAX_MACRO_NAME_LENGTH];
 static uint8_t queued_macro_count = 0;
 
@@ -1341,8 +2175,12 @@ static void extract_macro_name(const char* command, char* macro_name, size_t max
 
 // Check if macro is currently being executed
 static bool is_macro_executing(const char* macro_name) {
-    return (currently_executing_macro[0] != '\0' && 
-            strcmp(currently_executing_macro, macro_name) == 0);
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+        if (macro_slots[i].co != NULL && strcmp(macro_slots[i].name, macro_name) == 0) {
+            return true;
+        }
+    }
+    return false;
 }
 
 // Check if macro is in the queue
@@ -1382,17 +2220,6 @@ static void remove_macro_from_queue_list(const char* macro_name) {
     }
 }
 
-// Set currently executing macro
-static void set_executing_macro(const char* macro_name) {
-    strncpy(currently_executing_macro, macro_name, MAX_MACRO_NAME_LENGTH - 1);
-    currently_executing_macro[MAX_MACRO_NAME_LENGTH - 1] = '\0';
-}
-
-// Clear currently executing macro
-static void clear_executing_macro(void) {
-    currently_executing_macro[0] = '\0';
-}
-
 // Check if macro can be executed (not already running or queued)
 static bool can_execute_macro(const char* macro_name) {
     if (macro_name[0] == '\0') {
@@ -1408,7 +2235,7 @@ static lua_State *fifo_lua_state = NULL;
 // Initialize Lua state for FIFO commands
 void init_fifo_lua_state(void) {
     if (fifo_lua_state == NULL) {
-        fifo_lua_state = luaL_newstate();
+        fifo_lua_state = lua_arena_newstate();
         if (fifo_lua_state != NULL) {
             luaL_openlibs(fifo_lua_state);
             register_lua_functions(fifo_lua_state);
@@ -1419,152 +2246,334 @@ void init_fifo_lua_state(void) {
     }
 }
 
-// Execute Lua script from FIFO command
-void execute_lua_command(const char* lua_command) {
+// Print a macro message to the debug UART and the CDC console
+static void macro_message(const char* message) {
+    printf("%s\n", message);
+    
+    if (tud_cdc_connected()) {
+        tud_cdc_write_str(message);
+        tud_cdc_write_str("\r\n");
+        tud_cdc_write_flush();
+    }
+}
+
+// Create the macro's thread and anchor it in the registry (called protected: may run out of memory)
+static int new_macro_thread(lua_State *L) {
+    lua_newthread(L);
+    lua_pushvalue(L, -1);
+    lua_pushinteger(L, luaL_ref(L, LUA_REGISTRYINDEX));
+    return 2;  // thread, registry reference
+}
+
+// Take a free slot and give it a new coroutine (the chunk is loaded onto it by the caller)
+static macro_slot_t* new_macro(const char* name, bool is_file) {
+    char message[96];
+    
     if (fifo_lua_state == NULL) {
         printf("FIFO Lua state not initialized\n");
-        return;
+        return NULL;
     }
     
-    // Extract macro name for tracking
-    char macro_name[MAX_MACRO_NAME_LENGTH];
-    extract_macro_name(lua_command, macro_name, sizeof(macro_name));
-    
-    // Set as currently executing
-    set_executing_macro(macro_name);
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+        macro_slot_t *slot = &macro_slots[i];
+        if (slot->co != NULL) {
+            continue;
+        }
+        
+        lua_pushcfunction(fifo_lua_state, new_macro_thread);
+        if (lua_pcall(fifo_lua_state, 0, 2, 0) != LUA_OK) {
+            lua_pop(fifo_lua_state, 1);  // Remove error message from stack
+            snprintf(message, sizeof(message), "[Lua] Not enough memory to start '%s'", name);
+            macro_message(message);
+            return NULL;
+        }
+        slot->co = lua_tothread(fifo_lua_state, -2);
+        slot->ref = (int)lua_tointeger(fifo_lua_state, -1);
+        lua_pop(fifo_lua_state, 2);
+        
+        strncpy(slot->name, name, MAX_MACRO_NAME_LENGTH - 1);
+        slot->name[MAX_MACRO_NAME_LENGTH - 1] = '\0';
+        slot->is_file = is_file;
+        slot->uses_gamepad = false;
+        slot->cancel = false;
+        slot->abort = MACRO_ABORT_NONE;
+        slot->resumes = 0;
+        slot->kinstructions = 0;
+        slot->cpu_us = 0;
+        slot->slice_max_us = 0;
+        slot->wait_count = 0;
+        slot->wait_fired = false;
+        slot->wake = xTaskGetTickCount();
+        
+        // コルーチンの中で作ったコルーチン（coroutine.create）にもフックは引き継がれる
+        lua_sethook(slot->co, macro_hook, LUA_MASKCOUNT, MACRO_HOOK_COUNT);
+        return slot;
+    }
     
-    printf("[Lua] Executing: %s\n", lua_command);
+    snprintf(message, sizeof(message), "[Lua] %d macros already running - skipping '%s'", MAX_RUNNING_MACROS, name);
+    macro_message(message);
+    return NULL;
+}
+
+static bool gamepad_macro_running(void) {
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+        if (macro_slots[i].co != NULL && macro_slots[i].uses_gamepad) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool any_macro_running(void) {
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+        if (macro_slots[i].co != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Release the keys and buttons a stopped macro may have left pressed
+static void release_lua_outputs(void) {
+    keyboard_bitmap_t released = {0};
+    if (memcmp(&lua_keyboard, &released, sizeof(released)) != 0) {
+        lua_keyboard = released;
+        lua_keyboard_dirty = true;
+        if (usb_output_is_local() && key_timeline_busy()) {
+            key_timeline_cancel(&lua_keyboard);  // After the report a stopped type() left on Core1
+        } else {
+            send_keyboard_report();
+        }
+    }
+    if (lua_mouse_buttons != 0) {
+        lua_mouse_buttons = 0;
+        lua_mouse_dirty = true;
+        send_mouse_report();
+    }
+}
+
+// Free the slot; the thread is closed (to-be-closed variables) and left to the GC
+static void end_macro(macro_slot_t *slot) {
+    playback_cancel(slot->co);
+    lua_closethread(slot->co, fifo_lua_state);
+    luaL_unref(fifo_lua_state, LUA_REGISTRYINDEX, slot->ref);
+    slot->co = NULL;
+    if (slot->abort != MACRO_ABORT_NONE) {
+        kill_release = true;
+    }
     
-    // Execute the Lua command
-    int result = luaL_dostring(fifo_lua_state, lua_command);
+    // Automatically reset gamepad state after gamepad-related macros
+    // This ensures that user gamepad input will work again (unless another gamepad macro is still running)
+    if (slot->uses_gamepad && !gamepad_macro_running()) {
+        internal_gamepad_reset();
+    }
+}
+
+// Report how a macro finished (return value or error)
+static void finish_macro(macro_slot_t *slot, int result) {
+    lua_State *co = slot->co;
+    const char* tag = slot->is_file ? "Lua File" : "Lua";
     
     if (result != LUA_OK) {
         // Handle Lua error
-        const char* error_msg = lua_tostring(fifo_lua_state, -1);
-        printf("[Lua Error] %s\n", error_msg);
-        
-        // Output error to CDC if connected
-        if (tud_cdc_connected()) {
-            char full_error[128];
-            snprintf(full_error, sizeof(full_error), "[Lua Error] %s\r\n", error_msg);
-            tud_cdc_write_str(full_error);
-            tud_cdc_write_flush();
-        }
-        
-        lua_pop(fifo_lua_state, 1);  // Remove error message from stack
-    } else {
+        char full_error[256];
+        const char* error_msg = lua_tostring(co, -1);
+        snprintf(full_error, sizeof(full_error), "[%s Error] %s", tag, error_msg ? error_msg : "(error object is not a string)");
+        macro_message(full_error);
+    } else if (lua_gettop(co) > 0) {
         // Check if there's a return value
-        if (lua_gettop(fifo_lua_state) > 0) {
-            if (lua_isnumber(fifo_lua_state, -1)) {
-                double return_value = lua_tonumber(fifo_lua_state, -1);
-                printf("[Lua] Returned: %f\n", return_value);
-            } else if (lua_isstring(fifo_lua_state, -1)) {
-                const char* return_str = lua_tostring(fifo_lua_state, -1);
-                printf("[Lua] Returned: %s\n", return_str);
-            }
-            lua_pop(fifo_lua_state, 1);  // Remove return value from stack
+        if (lua_isnumber(co, -1)) {
+            printf("[%s] Returned: %f\n", tag, lua_tonumber(co, -1));
+        } else if (lua_isstring(co, -1)) {
+            printf("[%s] Returned: %s\n", tag, lua_tostring(co, -1));
         }
     }
+    end_macro(slot);
+}
+
+// Run the macro until its next sleep / report wait, or to the end
+static void resume_macro(macro_slot_t *slot) {
+    int nresults;
     
-    // Clear currently executing macro
-    clear_executing_macro();
+    running_slot = slot;
+    slice_start_us = time_us_64();
+    int result = lua_resume(slot->co, fifo_lua_state, 0, &nresults);
+    uint32_t slice_us = (uint32_t)(time_us_64() - slice_start_us);
+    running_slot = NULL;
     
-    // Automatically reset gamepad state after gamepad-related command execution
-    // This ensures that user gamepad input will work again after any gamepad command
-    if (strstr(lua_command, "gamepad_") != NULL) {
-        internal_gamepad_reset();
+    slot->resumes++;
+    slot->cpu_us += slice_us;
+    if (slice_us > slot->slice_max_us) {
+        slot->slice_max_us = slice_us;
+    }
+    
+    if (result == LUA_YIELD) {
+        lua_pop(slot->co, nresults);  // coroutine.yield() at the top level: resume on the next pass
+    } else {
+        finish_macro(slot, result);
+    }
+}
+
+// Start a Lua command from the FIFO as a macro coroutine
+void execute_lua_command(const char* lua_command) {
+    // Extract macro name for tracking
+    char macro_name[MAX_MACRO_NAME_LENGTH];
+    extract_macro_name(lua_command, macro_name, sizeof(macro_name));
+    
+    macro_slot_t *slot = new_macro(macro_name, false);
+    if (slot == NULL) {
+        return;
+    }
+    
+    printf("[Lua] Executing: %s\n", lua_command);
+    
+    // Reset gamepad state after gamepad-related commands
+    slot->uses_gamepad = strstr(lua_command, "gamepad_") != NULL;
+    
+    int result = luaL_loadstring(slot->co, lua_command);
+    if (result == LUA_OK) {
+        resume_macro(slot);
+    } else {
+        finish_macro(slot, result);
     }
 }
 
-// Execute Lua script from LittleFS file
+// Start a Lua script file from LittleFS as a macro coroutine
 void execute_lua_file(const char* filename) {
-    if (fifo_lua_state == NULL) {
-        printf("FIFO Lua state not initialized\n");
+    macro_slot_t *slot = new_macro(filename, true);
+    if (slot == NULL) {
         return;
     }
     
-    // Set as currently executing
-    set_executing_macro(filename);
+    // Stream the script from LittleFS in small chunks (compiled bytecode from <filename>.luac
+    // when it matches the source); the source scan also tells whether it uses gamepad_ functions
+    bool uses_gamepad = false;
+    int result = lua_cache_load_file(slot->co, filename, "gamepad_", &uses_gamepad);
     
-    // Try to read the file from LittleFS
-    char* file_buffer = malloc(8192); // 8KB buffer for Lua script files
-    if (!file_buffer) {
-        printf("[Lua File Error] Failed to allocate memory for file reading\n");
-        if (tud_cdc_connected()) {
-            tud_cdc_write_str("[Lua File Error] Failed to allocate memory for file reading\r\n");
-            tud_cdc_write_flush();
+    // Reset gamepad state after macros run by the gamepad / META keys or using gamepad_ functions
+    slot->uses_gamepad = (strstr(filename, "Pad-") != NULL || 
+                          strstr(filename, "Meta-") != NULL || 
+                          uses_gamepad);
+    
+    if (result == LUA_OK) {
+        resume_macro(slot);
+    } else {
+        finish_macro(slot, result);
+    }
+}
+
+// Stop running macros by name ("" or "*": all of them); they end on the next scheduler pass
+static void stop_macros(const char* name) {
+    bool all = name[0] == '\0' || strcmp(name, "*") == 0;
+    bool found = false;
+    
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+        macro_slot_t *slot = &macro_slots[i];
+        if (slot->co != NULL && (all || strcmp(slot->name, name) == 0)) {
+            slot->cancel = true;
+            found = true;
         }
-        clear_executing_macro();
-        return;
     }
     
-    int bytes_read = fstask_read_file(filename, file_buffer, 8191);
-    if (bytes_read < 0) {
-        printf("[Lua File Error] Failed to read file '%s' (error: %d)\n", filename, bytes_read);
-        if (tud_cdc_connected()) {
-            char error_msg[128];
-            snprintf(error_msg, sizeof(error_msg), "[Lua File Error] Failed to read file '%s' (error: %d)\r\n", filename, bytes_read);
-            tud_cdc_write_str(error_msg);
-            tud_cdc_write_flush();
+    if (!found) {
+        char message[96];
+        snprintf(message, sizeof(message), "[Lua] Macro '%s' is not running", name);
+        macro_message(message);
+    }
+}
+
+// Whether the macro should resume now: its wake time has come, or the input it waits for arrived
+static bool macro_due(const macro_slot_t *slot, TickType_t now) {
+    if (slot->wait_count > 0) {
+        if (slot->wait_fired) {
+            return true;
+        }
+        if (slot->wait_forever) {
+            return false;
         }
-        free(file_buffer);
-        clear_executing_macro();
+    }
+    return (int32_t)(now - slot->wake) >= 0;
+}
+
+// Mark the macros named by a kill request (the running one was already caught by the hook)
+static void take_kill_request(void) {
+    collect_kill_requests();
+    if (!kill_all && kill_name_count == 0) {
         return;
     }
     
-    // Null terminate the file content
-    file_buffer[bytes_read] = '\0';
-    
-    // printf("[Lua File] File loaded successfully (%d bytes)\n", bytes_read);
-    
-    // Execute the Lua script
-    int result = luaL_dostring(fifo_lua_state, file_buffer);
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+        macro_slot_t *slot = &macro_slots[i];
+        if (slot->co != NULL && kill_requested(slot)) {
+            if (slot->abort == MACRO_ABORT_NONE) {
+                slot->abort = MACRO_ABORT_KILL;
+            }
+            slot->cancel = true;
+        }
+    }
     
-    if (result != LUA_OK) {
-        // Handle Lua error
-        const char* error_msg = lua_tostring(fifo_lua_state, -1);
-        printf("[Lua File Error] %s\n", error_msg);
-        
-        // Output error to CDC if connected
-        if (tud_cdc_connected()) {
-            char full_error[256];
-            snprintf(full_error, sizeof(full_error), "[Lua File Error] %s\r\n", error_msg);
-            tud_cdc_write_str(full_error);
-            tud_cdc_write_flush();
+    char message[96];
+    if (kill_all) {
+        if (!kill_all_hit) {
+            macro_message("[Lua] Macro '*' is not running");
         }
-        
-        lua_pop(fifo_lua_state, 1);  // Remove error message from stack
     } else {
-        // Check if there's a return value
-        if (lua_gettop(fifo_lua_state) > 0) {
-            if (lua_isnumber(fifo_lua_state, -1)) {
-                double return_value = lua_tonumber(fifo_lua_state, -1);
-                printf("[Lua File] Returned: %f\n", return_value);
-            } else if (lua_isstring(fifo_lua_state, -1)) {
-                const char* return_str = lua_tostring(fifo_lua_state, -1);
-                printf("[Lua File] Returned: %s\n", return_str);
+        for (int i = 0; i < kill_name_count; i++) {
+            if (!kill_name_hit[i]) {
+                snprintf(message, sizeof(message), "[Lua] Macro '%s' is not running", kill_names[i]);
+                macro_message(message);
             }
-            lua_pop(fifo_lua_state, 1);  // Remove return value from stack
         }
     }
+    kill_all = false;
+    kill_all_hit = false;
+    kill_name_count = 0;
+}
+
+// Resume every macro whose wake time has come (and end the stopped ones)
+void resume_macros(void) {
+    TickType_t now = xTaskGetTickCount();
+    bool stopped = false;
     
-    // Check if this file contains gamepad commands before cleanup
-    bool contains_gamepad_commands = (strstr(filename, "Pad-") != NULL || 
-                                     strstr(filename, "Meta-") != NULL || 
-                                     strstr(file_buffer, "gamepad_") != NULL);
+    take_kill_request();
+    dispatch_input_events();
     
-    // Clean up
-    free(file_buffer);
-    clear_executing_macro();
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+        macro_slot_t *slot = &macro_slots[i];
+        if (slot->co == NULL) {
+            continue;
+        }
+        
+        if (slot->cancel) {
+            char message[128];
+            if (slot->abort == MACRO_ABORT_BUDGET) {
+                snprintf(message, sizeof(message), "[Lua] Stopped '%s': ran %lu ms without sleeping (budget %lu ms)",
+                         slot->name, (unsigned long)(slot->slice_max_us / 1000), (unsigned long)(cpu_budget_us / 1000));
+            } else {
+                snprintf(message, sizeof(message), "[Lua] %s '%s'",
+                         slot->abort == MACRO_ABORT_KILL ? "Killed" : "Stopped", slot->name);
+            }
+            macro_message(message);
+            end_macro(slot);
+            stopped = true;
+        } else if (macro_due(slot, now)) {
+            resume_macro(slot);
+        }
+    }
+    update_input_mask();
     
-    // Automatically reset gamepad state after macro execution for gamepad-related files
-    // This ensures that user gamepad input will work again after any macro
-    if (contains_gamepad_commands) {
+    // Keys held by a stopped macro would stay pressed; a killed macro releases everything
+    // right away, including the gamepad, even while other macros keep running
+    if (kill_release) {
+        kill_release = false;
+        release_lua_outputs();
         internal_gamepad_reset();
+    } else if (stopped && !any_macro_running()) {
+        release_lua_outputs();
     }
 }
 
-// Check FIFO queue and execute commands as Lua scripts
+// Check FIFO queue and start commands as Lua macros
 void process_fifo_commands(void) {
     char command[64];  // Match MAX_COMMAND_LENGTH from USBtask.c
     
@@ -1583,18 +2592,91 @@ void process_fifo_commands(void) {
                 const char* filename = command + 5;
                 execute_lua_file(filename);
                 
+            } else if (strncmp(command, "COMPILE:", 8) == 0) {
+                // Uploaded script: build the bytecode cache before the first run
+                lua_cache_compile_file(fifo_lua_state, command + 8);
+                
+            } else if (strncmp(command, "STOP:", 5) == 0) {
+                // Cancel running macros (console "stop" command)
+                stop_macros(command + 5);
+                
             } else {
                 // Execute command as direct Lua script
                 execute_lua_command(command);
                 
             }
-            
-            // Add small delay to avoid overwhelming system
-            vTaskDelay(pdMS_TO_TICKS(50)); // 50ms delay (reduced for better responsiveness)
         }
     }
 }
 
+// Kill running macros by name (NULL, "" or "*": all of them). Safe to call from the CDC task
+// and from Core1: the instruction hook aborts the macro even if it never yields
+void lua_kill_macros(const char* name) {
+    kill_request_t request = {0};
+    if (name != NULL && strcmp(name, "*") != 0) {
+        strncpy(request.name, name, MAX_MACRO_NAME_LENGTH - 1);
+    }
+    // 名前をキューに入れてからフラグを立てる（フックはフラグを見てから取り出す）
+    if (!queue_try_add(&kill_queue, &request)) {
+        printf("[Lua] Too many pending kill requests\n");
+    }
+    __dmb();
+    kill_pending = true;
+}
+
+void lua_task_init(void) {
+    queue_init(&kill_queue, sizeof(kill_request_t), MAX_KILL_REQUESTS);
+}
+
+// Longest time a macro may run without sleeping / waiting before it is stopped (0: no limit)
+void lua_set_cpu_budget(uint32_t ms) {
+    cpu_budget_us = ms * 1000;
+}
+
+// Lua function to stop a running macro by name (stop() or stop("*"): all macros, including the caller)
+int lua_stop(lua_State *L) {
+    stop_macros(luaL_optstring(L, 1, ""));
+    return 0;  // No return values
+}
+
+// Show the running macros and how long until each one resumes (called from the CDC task)
+void print_running_macros(void) {
+    char line[128];
+    TickType_t now = xTaskGetTickCount();
+    int count = 0;
+    
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+        if (macro_slots[i].co != NULL) {
+            count++;
+        }
+    }
+    snprintf(line, sizeof(line), "Running macros: %d/%d (CPU budget %lu ms)\r\n", count, MAX_RUNNING_MACROS,
+             (unsigned long)(cpu_budget_us / 1000));
+    tud_cdc_write_str(line);
+    if (count > 0) {
+        tud_cdc_write_str("  Name                            Wait     CPU ms  Max ms  Kinstr  Resumes\r\n");
+    }
+    
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+        macro_slot_t *slot = &macro_slots[i];
+        if (slot->co == NULL) {
+            continue;
+        }
+        int32_t wait_ms = (int32_t)(slot->wake - now) * portTICK_PERIOD_MS;
+        char wait[12];
+        if (slot->wait_count > 0 && slot->wait_forever) {
+            snprintf(wait, sizeof(wait), "input");  // wait_key() etc. without a timeout
+        } else {
+            snprintf(wait, sizeof(wait), "%ldms", (long)(wait_ms > 0 ? wait_ms : 0));
+        }
+        snprintf(line, sizeof(line), "  %-31s %8s %7lu %7lu %7lu %8lu\r\n", slot->name,
+                 wait, (unsigned long)(slot->cpu_us / 1000),
+                 (unsigned long)(slot->slice_max_us / 1000), (unsigned long)slot->kinstructions,
+                 (unsigned long)slot->resumes);
+        tud_cdc_write_str(line);
+    }
+}
+
 // External interface functions for duplicate checking
 bool can_execute_macro_external(const char* command) {
     char macro_name[MAX_MACRO_NAME_LENGTH];
@@ -1652,7 +2734,7 @@ void task_lua_function(void *pvParameters)
     
     printf("Lua Task started\n");
 
-    lua_State *L = luaL_newstate();
+    lua_State *L = lua_arena_newstate();
     if (L == NULL) {
         printf("Failed to create Lua state\n");
     }
@@ -1684,10 +2766,14 @@ void task_lua_function(void *pvParameters)
     // Main task loop - monitor FIFO queue and process commands
     while (1)
     {
-        // Check and process any commands in the FIFO queue
+        // Check and process any commands in the FIFO queue (new macros start right away)
         process_fifo_commands();
         
-        // Delay before next check (1ms for responsive command processing)
-        vTaskDelay(pdMS_TO_TICKS(1));
+        // Resume the macros whose sleep / report wait is over
+        resume_macros();
+        
+        // Wait up to 1ms for the next check (sleep() resolution); input events that a macro
+        // waits for (wait_key etc.) wake the task right away
+        input_events_wait(1);
     }
 }
\ No newline at end of file
@@ -21,13 +21,37 @@ void cdc_write_line(void);
 // Lua Task Functions
 //--------------------------------------------------------------------+
 
-// Custom sleep function for Lua
+// Custom sleep function for Lua (yields to the other macros)
 int lua_sleep(lua_State *L);
 
+// Stop a running macro by name (no name: all macros)
+int lua_stop(lua_State *L);
+
+// Kill running macros by name (NULL, "" or "*": all) even if they never yield; held keys,
+// buttons and gamepad state are released. Callable from the CDC task and from Core1
+void lua_kill_macros(const char* name);
+
+// Set up the queues shared with the other tasks and Core1 (call before launching Core1)
+void lua_task_init(void);
+
+// Longest CPU time a macro may run without sleeping / waiting (ms, 0: no limit)
+#define LUA_CPU_BUDGET_DEFAULT_MS 500
+void lua_set_cpu_budget(uint32_t ms);
+
+// Input event waits for Lua (suspend the macro until the key / button / axis input arrives)
+int lua_wait_key(lua_State *L);
+int lua_wait_button(lua_State *L);
+int lua_wait_axis_change(lua_State *L);
+int lua_wait_any(lua_State *L);
+
 // Keyboard control functions for Lua
 int lua_keypress(lua_State *L);
 int lua_keyrelease(lua_State *L);
 int lua_type_text(lua_State *L);
+int lua_type_keys(lua_State *L);
+
+// Batched report operations for Lua (checked up front, one report per device between sleeps)
+int lua_batch(lua_State *L);
 
 // Keyboard language functions for Lua  
 int lua_set_language(lua_State *L);
@@ -57,13 +81,21 @@ void get_lua_gamepad_state(int8_t* x, int8_t* y, int8_t* z, int8_t* rz,
 void register_lua_functions(lua_State *L);
 
 // FIFO Lua state management functions
+// Each command / file runs as a coroutine of the FIFO Lua state; these start it and
+// return at its first sleep() or report wait
 void init_fifo_lua_state(void);
 void execute_lua_command(const char* lua_command);
 void execute_lua_file(const char* filename);
 
-// FIFO queue processing function
+// FIFO queue processing function ("STOP:<name>" cancels running macros)
 void process_fifo_commands(void);
 
+// Resume the macros whose wake time has come (Lua task loop)
+void resume_macros(void);
+
+// Show the running macros on CDC
+void print_running_macros(void);
+
 // Macro duplicate checking functions
 bool can_execute_macro_external(const char* command);
 bool add_macro_to_queue_list_external(const char* command);
@@ -71,6 +103,14 @@ bool add_macro_to_queue_list_external(const char* command);
 // Main Lua task function
 void task_lua_function(void *pvParameters);
 
-extern uint8_t USB_output_switch; // USB出力切替 0:USB1, 1:UART経由
+extern uint8_t USB_output_switch; // USB出力切替 0:USB1, USB_OUTPUT_DEVICE2:USB2, それ以外:リンク経由で出力するノードのアドレス
+
+#define USB_OUTPUT_DEVICE2  0xFE    // PIO-USB の2つ目のデバイスポート（PioUsbDevice.h）
+
+// 自ノードの USB（USB1 / USB2）に出力するか
+static inline bool usb_output_is_local(void)
+{
+    return USB_output_switch == 0 || USB_output_switch == USB_OUTPUT_DEVICE2;
+}
 
 #endif // LUATASK_H
\ No newline at end of file
@@ -0,0 +1,810 @@
+#include "MacroRecorder.h"
+#include <stdio.h>
+#include <string.h>
+#include "tusb.h"
+#include "pico/time.h"
+#include "pico/util/queue.h"
+#include "hardware/sync.h"
+#include "hardware/flash.h"
+#include "fstask.h"
+#include "LinkMux.h"
+
+#define REC_MAGIC           "HREC"
+#define REC_VERSION         1
+#define REC_HEADER_SIZE     5
+#define REC_EVENT_MAX       (1 + 5 + 2 + KEYBOARD_NKRO_USAGES)    // キーを全部押したキーボード
+#define FEED_BUFFER_SIZE    512
+
+#define MACRO_SPEED_MIN     10
+#define MACRO_SPEED_MAX     1000
+
+// 再生するイベント（ファイルから戻したもの）
+typedef struct {
+    uint32_t delta_us;
+    char type;                  // 'N', 'U', 'M', 'G'
+    uint8_t wheel_resolution;
+    union {
+        keyboard_bitmap_t keyboard;
+        struct {
+            uint16_t consumer[USB_CONSUMER_KEYS];
+            uint8_t system;
+        } control;
+        mouse_report_t mouse;
+        parsed_gamepad_report_t gamepad;
+    } data;
+} rec_event_t;
+
+// 再生で出力したもの（終わったときに離す）
+#define PLAYED_KEYBOARD     0x01
+#define PLAYED_CONTROL      0x02
+#define PLAYED_MOUSE        0x04
+#define PLAYED_GAMEPAD      0x08
+
+//--------------------------------------------------------------------+
+// 記録（Core1 -> リングバッファ -> Core0 -> ステージング領域 -> LittleFS）
+//--------------------------------------------------------------------+
+
+// Core0 の記録の状態
+typedef enum {
+    REC_IDLE,
+    REC_PREPARING,      // ステージング領域を1セクタずつ消去している
+    REC_RECORDING,      // リングバッファを1ページずつステージング領域に書く
+    REC_STOPPING,       // 残りを書く
+    REC_SAVING,         // ステージング領域から LittleFS のファイルに写す
+} rec_state_t;
+
+static uint8_t rec_buffer[MACRO_REC_BUFFER_SIZE];
+static volatile uint32_t rec_head = 0;          // Core1 が書く（入れた合計バイト数）
+static volatile uint32_t rec_tail = 0;          // Core0 が書く（ファイルに書いた合計バイト数）
+static volatile bool recording = false;
+
+// Core1
+static bool rec_first = true;
+static uint64_t rec_last_us;
+static parsed_gamepad_report_t rec_gamepad;     // 変わったときだけ記録する
+static uint32_t rec_events = 0;
+static uint32_t rec_dropped = 0;                // バッファが満杯で捨てた
+
+// Core0
+static rec_state_t rec_state = REC_IDLE;
+static lfs_file_t rec_file;
+static uint32_t rec_stop_us;
+static char rec_filename[32];
+static uint32_t rec_erase_pos = 0;              // 次に消去するセクタ
+static uint32_t rec_erased = 0;                 // 消去したセクタ数
+static uint32_t rec_staged = 0;                 // ステージング領域に書いたバイト数
+static uint32_t rec_saved = 0;                  // LittleFS に写したバイト数
+static uint32_t rec_bytes = 0;                  // ファイルの大きさ（ヘッダを含む）
+static uint8_t rec_page[FLASH_PAGE_SIZE];
+static fstask_lockout_stats_t rec_lockout;      // 記録中に Core1 を止めた時間
+
+//--------------------------------------------------------------------+
+// 再生（LittleFS -> Core0 -> キュー -> Core1）
+//--------------------------------------------------------------------+
+
+static queue_t play_queue;                      // rec_event_t, Core0 -> Core1
+static volatile bool play_active = false;       // Core0 が立て、Core1 が終わったら下ろす
+static volatile bool play_input_done = false;   // 最後のイベントまで積んだ
+static volatile bool play_stop_request = false;
+static volatile uint8_t play_target = 0;
+static volatile uint16_t play_speed = 100;
+
+// Core0
+static lfs_file_t play_file;
+static bool play_file_open = false;
+static char play_filename[32];
+static uint8_t feed_buffer[FEED_BUFFER_SIZE];
+static uint32_t feed_pos = 0;
+static uint32_t feed_len = 0;
+static bool feed_eof = false;
+static uint16_t play_loops = 0;                 // 0: 止めるまで
+static uint16_t play_loop = 0;
+
+// Core1
+static bool player_started = false;
+static bool player_has_event = false;
+static rec_event_t player_event;
+static uint64_t player_due_us;
+static uint8_t player_played = 0;
+static uint8_t player_releasing = 0;            // まだ離していないもの
+static int16_t player_wheel_remainder = 0;      // リンクはノッチ単位
+static int16_t player_pan_remainder = 0;
+static uint32_t play_events = 0;
+static uint32_t play_late_max = 0;
+static uint64_t play_late_sum = 0;
+
+// Meta キーの要求（Core1 -> Core0）
+static volatile bool meta_record_request = false;
+static volatile bool meta_play_request = false;
+
+void macro_recorder_init(void)
+{
+    queue_init(&play_queue, sizeof(rec_event_t), MACRO_PLAY_QUEUE_DEPTH);
+}
+
+//--------------------------------------------------------------------+
+// 符号化
+//--------------------------------------------------------------------+
+
+static uint32_t put_varint(uint8_t* p, uint32_t value)
+{
+    uint32_t n = 0;
+    while (value >= 0x80) {
+        p[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (uint8_t)value;
+    return n;
+}
+
+// @return 読んだバイト数、0: 途中で終わっている
+static uint32_t get_varint(const uint8_t* p, uint32_t len, uint32_t* value)
+{
+    uint32_t result = 0;
+    for (uint32_t n = 0; n < len && n < 5; n++) {
+        result |= (uint32_t)(p[n] & 0x7F) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            *value = result;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+static inline uint32_t zigzag_encode(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t zigzag_decode(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// 種類と時間を書く（時間はイベントがバッファに入ったときに進める）
+static uint32_t rec_begin(uint8_t* p, char type, uint64_t now)
+{
+    uint64_t delta = rec_first ? 0 : now - rec_last_us;
+    p[0] = (uint8_t)type;
+    return 1 + put_varint(p + 1, delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta);
+}
+
+// イベントをリングバッファに入れる（Core1。満杯なら捨てる）
+static void rec_commit(const uint8_t* event, uint32_t len, uint64_t now)
+{
+    uint32_t head = rec_head;
+    if (MACRO_REC_BUFFER_SIZE - (head - rec_tail) < len) {
+        rec_dropped++;
+        return;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        rec_buffer[(head + i) % MACRO_REC_BUFFER_SIZE] = event[i];
+    }
+    __dmb();
+    rec_head = head + len;
+    rec_first = false;
+    rec_last_us = now;
+    rec_events++;
+}
+
+void macro_rec_keyboard(const keyboard_bitmap_t* state)
+{
+    if (!recording) return;
+
+    uint8_t event[REC_EVENT_MAX];
+    uint64_t now = time_us_64();
+    uint32_t n = rec_begin(event, 'N', now);
+    uint8_t* count = &event[n + 1];
+    event[n] = state->modifier;
+    n += 2;
+    *count = 0;
+    for (uint16_t keycode = HID_KEY_A; keycode < KEYBOARD_NKRO_USAGES; keycode++) {
+        if (keyboard_bitmap_test(state, (uint8_t)keycode)) {
+            event[n++] = (uint8_t)keycode;
+            (*count)++;
+        }
+    }
+    rec_commit(event, n, now);
+}
+
+void macro_rec_control(const uint16_t* consumer, uint8_t system)
+{
+    if (!recording) return;
+
+    uint8_t event[16 + USB_CONSUMER_KEYS * 2];
+    uint64_t now = time_us_64();
+    uint32_t n = rec_begin(event, 'U', now);
+    uint8_t* count = &event[n++];
+    *count = 0;
+    for (int i = 0; i < USB_CONSUMER_KEYS && consumer[i] != 0; i++) {
+        event[n++] = consumer[i] & 0xFF;
+        event[n++] = consumer[i] >> 8;
+        (*count)++;
+    }
+    event[n++] = system;
+    rec_commit(event, n, now);
+}
+
+void macro_rec_mouse(const mouse_report_t* report, uint8_t wheel_resolution)
+{
+    if (!recording) return;
+
+    uint8_t event[32];
+    uint64_t now = time_us_64();
+    uint32_t n = rec_begin(event, 'M', now);
+    n += put_varint(&event[n], report->buttons);
+    n += put_varint(&event[n], zigzag_encode(report->x));
+    n += put_varint(&event[n], zigzag_encode(report->y));
+    event[n++] = (uint8_t)report->wheel;
+    event[n++] = (uint8_t)report->pan;
+    event[n++] = wheel_resolution;
+    rec_commit(event, n, now);
+}
+
+void macro_rec_gamepad(const parsed_gamepad_report_t* report)
+{
+    if (!recording) return;
+
+    // ゲームパッドは変わらなくても毎回レポートが来る
+    if (!rec_first && memcmp(report, &rec_gamepad, sizeof(*report)) == 0) return;
+    rec_gamepad = *report;
+
+    uint8_t event[16];
+    uint64_t now = time_us_64();
+    uint32_t n = rec_begin(event, 'G', now);
+    event[n++] = (uint8_t)report->x;
+    event[n++] = (uint8_t)report->y;
+    event[n++] = (uint8_t)report->z;
+    event[n++] = (uint8_t)report->rz;
+    event[n++] = report->hat;
+    event[n++] = report->buttons & 0xFF;
+    event[n++] = report->buttons >> 8;
+    rec_commit(event, n, now);
+}
+
+// イベントを1つ戻す
+// @return 読んだバイト数、0: 途中で終わっている、負の値: 壊れている
+static int decode_event(const uint8_t* p, uint32_t len, rec_event_t* event)
+{
+    if (len < 2) return 0;
+
+    memset(event, 0, sizeof(*event));
+    event->type = (char)p[0];
+    uint32_t n = 1;
+    uint32_t used = get_varint(p + n, len - n, &event->delta_us);
+    if (used == 0) return len - n >= 5 ? -1 : 0;
+    n += used;
+
+    switch (event->type) {
+        case 'N': {
+            if (len - n < 2) return 0;
+            event->data.keyboard.modifier = p[n];
+            uint8_t count = p[n + 1];
+            n += 2;
+            if (len - n < count) return 0;
+            for (uint8_t i = 0; i < count; i++) {
+                keyboard_bitmap_set(&event->data.keyboard, p[n + i], true);
+            }
+            n += count;
+            break;
+        }
+        case 'U': {
+            if (len - n < 1) return 0;
+            uint8_t count = p[n++];
+            if (count > USB_CONSUMER_KEYS) return -1;
+            if (len - n < (uint32_t)count * 2 + 1) return 0;
+            for (uint8_t i = 0; i < count; i++) {
+                event->data.control.consumer[i] = p[n] | (p[n + 1] << 8);
+                n += 2;
+            }
+            event->data.control.system = p[n++];
+            break;
+        }
+        case 'M': {
+            uint32_t value;
+            if ((used = get_varint(p + n, len - n, &value)) == 0) return 0;
+            event->data.mouse.buttons = (uint16_t)value;
+            n += used;
+            if ((used = get_varint(p + n, len - n, &value)) == 0) return 0;
+            event->data.mouse.x = (int16_t)zigzag_decode(value);
+            n += used;
+            if ((used = get_varint(p + n, len - n, &value)) == 0) return 0;
+            event->data.mouse.y = (int16_t)zigzag_decode(value);
+            n += used;
+            if (len - n < 3) return 0;
+            event->data.mouse.wheel = (int8_t)p[n];
+            event->data.mouse.pan = (int8_t)p[n + 1];
+            event->wheel_resolution = p[n + 2] ? p[n + 2] : 1;
+            n += 3;
+            break;
+        }
+        case 'G':
+            if (len - n < 7) return 0;
+            event->data.gamepad.x = (int8_t)p[n];
+            event->data.gamepad.y = (int8_t)p[n + 1];
+            event->data.gamepad.z = (int8_t)p[n + 2];
+            event->data.gamepad.rz = (int8_t)p[n + 3];
+            event->data.gamepad.hat = p[n + 4];
+            event->data.gamepad.buttons = p[n + 5] | (p[n + 6] << 8);
+            n += 7;
+            break;
+        default:
+            return -1;
+    }
+    return (int)n;
+}
+
+//--------------------------------------------------------------------+
+// 記録（Core0）
+//--------------------------------------------------------------------+
+
+int macro_rec_start(const char* filename)
+{
+    if (rec_state != REC_IDLE || play_active || play_file_open) return -1;
+
+    // ファイルは先に開いておく（名前が使えないならここでエラーにする）
+    int result = fstask_open(&rec_file, filename, true);
+    if (result < 0) return result;
+    const uint8_t header[REC_HEADER_SIZE] = { 'H', 'R', 'E', 'C', REC_VERSION };
+    result = fstask_write(&rec_file, header, sizeof(header));
+    if (result < 0) {
+        fstask_close(&rec_file);
+        return result;
+    }
+
+    // 記録はステージング領域の消去が終わってから始める（macro_recorder_task）
+    snprintf(rec_filename, sizeof(rec_filename), "%s", filename);
+    rec_state = REC_PREPARING;
+    rec_erase_pos = 0;
+    rec_erased = 0;
+    rec_staged = 0;
+    rec_saved = 0;
+    rec_bytes = REC_HEADER_SIZE;
+    rec_events = 0;
+    rec_dropped = 0;
+    memset(&rec_lockout, 0, sizeof(rec_lockout));
+    return 0;
+}
+
+void macro_rec_stop(void)
+{
+    if (rec_state == REC_PREPARING) {
+        // まだ何も記録していない: ヘッダだけのファイルになる
+        rec_state = REC_SAVING;
+        return;
+    }
+    if (rec_state != REC_RECORDING) return;
+    recording = false;
+    // Core1 が書きかけのイベントを入れ終わるのを待ってから残りを書く（macro_recorder_task）
+    rec_state = REC_STOPPING;
+    rec_stop_us = time_us_32();
+}
+
+// 消去済みのステージング領域のセクタを1つ消す。全部消えたら記録を始める
+static bool rec_prepare(void)
+{
+    if (rec_erase_pos < FSTASK_STAGING_SIZE) {
+        int result = fstask_staging_erase_sector(rec_erase_pos);
+        if (result < 0) return false;
+        rec_erased += (uint32_t)result;
+        rec_erase_pos += FLASH_SECTOR_SIZE;
+        return true;
+    }
+
+    // ここから先の flash の操作は1ページの書き込みだけ（LittleFS を使う他のタスクの分は別）
+    fstask_reset_lockout_stats();
+    rec_state = REC_RECORDING;
+    rec_first = true;
+    rec_tail = rec_head;
+    __dmb();
+    recording = true;
+    printf("Recording input to '%s' (%lu sectors erased)\n", rec_filename, (unsigned long)rec_erased);
+    return true;
+}
+
+// リングバッファから1ページ書く（1回に1ページだけ: Core1 を止めるのは1ページの書き込みの間）
+// all: 1ページに満たない残りも 0xFF で埋めて書く
+// @return false: 書き込みエラー
+static bool rec_program_page(bool all)
+{
+    uint32_t level = rec_head - rec_tail;
+    if (level == 0 || (!all && level < FLASH_PAGE_SIZE)) return true;
+    if (level > FLASH_PAGE_SIZE) level = FLASH_PAGE_SIZE;
+
+    __dmb();
+    memset(rec_page, 0xFF, sizeof(rec_page));
+    for (uint32_t i = 0; i < level; i++) {
+        rec_page[i] = rec_buffer[(rec_tail + i) % MACRO_REC_BUFFER_SIZE];
+    }
+    if (fstask_staging_program_page(rec_staged - rec_staged % FLASH_PAGE_SIZE, rec_page) < 0) return false;
+    rec_tail += level;
+    rec_staged += level;
+    rec_bytes += level;
+    return true;
+}
+
+// ステージング領域から LittleFS のファイルに MACRO_REC_SAVE_SIZE ずつ写す
+// @return false: 書き込みエラー
+static bool rec_save(void)
+{
+    uint32_t chunk = rec_staged - rec_saved;
+    if (chunk > MACRO_REC_SAVE_SIZE) chunk = MACRO_REC_SAVE_SIZE;
+    if (chunk > 0 && fstask_write(&rec_file, fstask_staging_data() + rec_saved, chunk) < 0) return false;
+    rec_saved += chunk;
+    return true;
+}
+
+static void rec_close(void)
+{
+    recording = false;
+    rec_state = REC_IDLE;
+    fstask_close(&rec_file);
+    printf("Recorded %lu events (%lu bytes, %lu dropped) to '%s', Core1 stopped %lu times for max %lu us\n",
+           (unsigned long)rec_events, (unsigned long)rec_bytes, (unsigned long)rec_dropped, rec_filename,
+           (unsigned long)rec_lockout.count, (unsigned long)rec_lockout.max_us);
+}
+
+//--------------------------------------------------------------------+
+// 再生（Core0: ファイルを読んでキューに積む）
+//--------------------------------------------------------------------+
+
+// ファイルを（もう一度）開いてヘッダを確かめる
+static int feed_open(void)
+{
+    uint8_t header[REC_HEADER_SIZE];
+
+    int result = fstask_open(&play_file, play_filename, false);
+    if (result < 0) return result;
+    play_file_open = true;
+    if (fstask_read(&play_file, header, sizeof(header)) != REC_HEADER_SIZE ||
+        memcmp(header, REC_MAGIC, 4) != 0 || header[4] != REC_VERSION) {
+        return -1;
+    }
+    feed_pos = feed_len = 0;
+    feed_eof = false;
+    return 0;
+}
+
+static void feed_close(void)
+{
+    if (play_file_open) {
+        fstask_close(&play_file);
+        play_file_open = false;
+    }
+}
+
+int macro_play_start(const char* filename, uint16_t loops, uint16_t speed_percent, uint8_t target)
+{
+    if (rec_state != REC_IDLE || play_active || play_file_open) return -1;
+
+    snprintf(play_filename, sizeof(play_filename), "%s", filename);
+    int result = feed_open();
+    if (result < 0) {
+        feed_close();
+        return result;
+    }
+
+    rec_event_t dropped;
+    while (queue_try_remove(&play_queue, &dropped)) {}
+    if (speed_percent < MACRO_SPEED_MIN) speed_percent = MACRO_SPEED_MIN;
+    if (speed_percent > MACRO_SPEED_MAX) speed_percent = MACRO_SPEED_MAX;
+    play_loops = loops;
+    play_loop = 1;
+    play_speed = speed_percent;
+    play_target = target;
+    play_events = 0;
+    play_late_max = 0;
+    play_late_sum = 0;
+    play_input_done = false;
+    play_stop_request = false;
+    __dmb();
+    play_active = true;
+    printf("Playing '%s' (loops %u, speed %u%%, target %02X)\n", play_filename, loops, speed_percent, target);
+    return 0;
+}
+
+void macro_play_stop(void)
+{
+    if (play_active) play_stop_request = true;
+}
+
+// キューの空きだけイベントを積む。ファイルの終わりで繰り返すか、最後まで積んだら閉じる
+static void feed_task(void)
+{
+    while (!play_input_done && !queue_is_full(&play_queue)) {
+        // 残りが最大のイベントより短くなったら読み足す
+        if (!feed_eof && feed_len - feed_pos < REC_EVENT_MAX) {
+            memmove(feed_buffer, &feed_buffer[feed_pos], feed_len - feed_pos);
+            feed_len -= feed_pos;
+            feed_pos = 0;
+            int n = fstask_read(&play_file, &feed_buffer[feed_len], sizeof(feed_buffer) - feed_len);
+            if (n <= 0) {
+                feed_eof = true;
+            } else {
+                feed_len += (uint32_t)n;
+            }
+        }
+
+        rec_event_t event;
+        int used = decode_event(&feed_buffer[feed_pos], feed_len - feed_pos, &event);
+        if (used > 0) {
+            queue_try_add(&play_queue, &event);
+            feed_pos += (uint32_t)used;
+            continue;
+        }
+        if (used < 0 || feed_pos != feed_len) {
+            printf("Playback: '%s' is corrupted at event %lu\n", play_filename, (unsigned long)play_events);
+        } else if (feed_eof && (play_loops == 0 || play_loop < play_loops)) {
+            // 次の回
+            feed_close();
+            if (feed_open() == 0) {
+                play_loop++;
+                continue;
+            }
+        } else if (!feed_eof) {
+            continue;
+        }
+        feed_close();
+        play_input_done = true;
+    }
+}
+
+//--------------------------------------------------------------------+
+// 再生（Core1: 時刻になったイベントを出力する）
+//--------------------------------------------------------------------+
+
+// @return false: 出力先が空いていない（次のループでもう一度）
+static bool player_emit(const rec_event_t* event)
+{
+    uint8_t target = play_target;
+    bool local = target == 0;
+
+    switch (event->type) {
+        case 'N':
+            player_played |= PLAYED_KEYBOARD;
+            if (!local) return link_send_keyboard_nkro(target, (const uint8_t*)&event->data.keyboard);
+            return usb_device_ready(0) && usb_device_keyboard_bitmap_report(&event->data.keyboard);
+
+        case 'U':
+            player_played |= PLAYED_CONTROL;
+            if (!local) return link_send_control_keys(target, event->data.control.consumer, event->data.control.system);
+            usb_device_control_report(event->data.control.consumer, event->data.control.system);
+            return true;    // Boot プロトコルなどで送れないときは待たない
+
+        case 'M': {
+            player_played |= PLAYED_MOUSE;
+            if (local) return usb_device_mouse_report_scaled(&event->data.mouse, event->wheel_resolution);
+            // リンクはノッチ単位なので、高解像度の端数は次のレポートへ持ち越す
+            mouse_report_t report = event->data.mouse;
+            int16_t wheel = player_wheel_remainder + report.wheel;
+            int16_t pan = player_pan_remainder + report.pan;
+            report.wheel = (int8_t)(wheel / event->wheel_resolution);
+            report.pan = (int8_t)(pan / event->wheel_resolution);
+            if (!link_send_mouse(target, &report)) return false;
+            player_wheel_remainder = wheel - report.wheel * event->wheel_resolution;
+            player_pan_remainder = pan - report.pan * event->wheel_resolution;
+            return true;
+        }
+
+        case 'G': {
+            player_played |= PLAYED_GAMEPAD;
+            const parsed_gamepad_report_t* gamepad = &event->data.gamepad;
+            if (!local) {
+                uint8_t data[8] = {
+                    (uint8_t)gamepad->x, (uint8_t)gamepad->y, (uint8_t)gamepad->z, (uint8_t)gamepad->rz,
+                    gamepad->hat, gamepad->buttons & 0xFF, gamepad->buttons >> 8, 0
+                };
+                return link_send_gamepad(target, data);
+            }
+            // UART（リンク）から受け取ったときと同じく、hid_task が送る
+            current_gamepad_state = *gamepad;
+            gamepad_state_updated = true;
+            has_gamepad_key = true;
+            return true;
+        }
+
+        default:
+            return true;
+    }
+}
+
+// 再生で押したものを1つずつ離す
+// @return true: 全部離した
+static bool player_release(void)
+{
+    rec_event_t release;
+    memset(&release, 0, sizeof(release));
+    release.wheel_resolution = 1;
+
+    static const struct { uint8_t played; char type; } order[] = {
+        { PLAYED_KEYBOARD, 'N' }, { PLAYED_CONTROL, 'U' }, { PLAYED_MOUSE, 'M' }, { PLAYED_GAMEPAD, 'G' }
+    };
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        if (!(player_releasing & order[i].played)) continue;
+        release.type = order[i].type;
+        if (!player_emit(&release)) return false;
+        player_releasing &= ~order[i].played;
+    }
+    return true;
+}
+
+void macro_player_task(void)
+{
+    if (!play_active) return;
+
+    if (player_releasing == 0 && (play_stop_request || (play_input_done && !player_has_event &&
+                                                        queue_is_empty(&play_queue)))) {
+        // 終わり（止めたときは残りを捨てる）: 押したものを離してから play_active を下ろす
+        rec_event_t dropped;
+        while (queue_try_remove(&play_queue, &dropped)) {}
+        player_has_event = false;
+        player_releasing = player_played ? player_played : 0x80;
+    }
+    if (player_releasing) {
+        player_releasing &= ~0x80;
+        if (!player_release()) return;
+        player_played = 0;
+        player_started = false;
+        player_wheel_remainder = player_pan_remainder = 0;
+        __dmb();
+        play_active = false;
+        return;
+    }
+
+    uint64_t now = time_us_64();
+    while (true) {
+        if (!player_has_event) {
+            if (!queue_try_remove(&play_queue, &player_event)) return;
+            player_has_event = true;
+            if (!player_started) {
+                player_started = true;
+                player_due_us = now;
+            } else {
+                player_due_us += (uint64_t)player_event.delta_us * 100 / play_speed;
+            }
+        }
+        if (now < player_due_us) return;
+        if (!player_emit(&player_event)) return;
+
+        uint32_t late = (uint32_t)(now - player_due_us);
+        if (late > play_late_max) play_late_max = late;
+        play_late_sum += late;
+        play_events++;
+        player_has_event = false;
+    }
+}
+
+//--------------------------------------------------------------------+
+// Core0 のループ・Meta キー・表示
+//--------------------------------------------------------------------+
+
+void macro_recorder_meta_record(void)
+{
+    meta_record_request = true;
+}
+
+void macro_recorder_meta_play(void)
+{
+    meta_play_request = true;
+}
+
+void macro_recorder_task(void)
+{
+    if (meta_record_request) {
+        meta_record_request = false;
+        if (rec_state != REC_IDLE) {
+            macro_rec_stop();
+        } else if (macro_rec_start(MACRO_REC_DEFAULT_FILE) < 0) {
+            printf("META+R: cannot start recording\n");
+        }
+    }
+    if (meta_play_request) {
+        meta_play_request = false;
+        if (play_active) {
+            macro_play_stop();
+        } else if (macro_play_start(MACRO_REC_DEFAULT_FILE, 1, 100, 0) < 0) {
+            printf("META+P: cannot play '%s'\n", MACRO_REC_DEFAULT_FILE);
+        }
+    }
+
+    switch (rec_state) {
+        case REC_PREPARING:
+            if (!rec_prepare()) {
+                printf("Recording: cannot erase the staging area, stopped\n");
+                rec_close();
+            }
+            break;
+        case REC_RECORDING:
+            // 止めたときにリングバッファの残りが入るだけ空けておく
+            if (rec_staged + FLASH_PAGE_SIZE + MACRO_REC_BUFFER_SIZE > FSTASK_STAGING_SIZE) {
+                printf("Recording: %u KB limit reached, stopped\n", MACRO_REC_MAX_SIZE / 1024);
+                macro_rec_stop();
+            } else if (!rec_program_page(false)) {
+                printf("Recording: write error, stopped\n");
+                rec_close();
+            }
+            break;
+        case REC_STOPPING:
+            // 書きかけのイベントは数 µs で入り終わる
+            if (time_us_32() - rec_stop_us < 1000) break;
+            if (rec_head != rec_tail) {
+                if (!rec_program_page(true)) {
+                    printf("Recording: write error, stopped\n");
+                    rec_close();
+                }
+                break;
+            }
+            fstask_get_lockout_stats(&rec_lockout);
+            rec_state = REC_SAVING;
+            break;
+        case REC_SAVING:
+            if (!rec_save()) {
+                printf("Recording: cannot write '%s'\n", rec_filename);
+                rec_close();
+            } else if (rec_saved == rec_staged) {
+                rec_close();
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (play_file_open) {
+        if (play_active && !play_stop_request) {
+            feed_task();
+        } else {
+            feed_close();
+        }
+    }
+}
+
+void macro_recorder_print(void)
+{
+    char line[128];
+
+    switch (rec_state) {
+        case REC_PREPARING:
+            snprintf(line, sizeof(line), "Recording '%s': erasing the staging area (%lu/%u KB)\r\n",
+                     rec_filename, (unsigned long)(rec_erase_pos / 1024), FSTASK_STAGING_SIZE / 1024);
+            break;
+        case REC_RECORDING:
+        case REC_STOPPING:
+            snprintf(line, sizeof(line), "Recording '%s': %lu events, %lu/%u bytes written, %lu buffered, %lu dropped\r\n",
+                     rec_filename, (unsigned long)rec_events, (unsigned long)rec_bytes, MACRO_REC_MAX_SIZE,
+                     (unsigned long)(rec_head - rec_tail), (unsigned long)rec_dropped);
+            break;
+        case REC_SAVING:
+            snprintf(line, sizeof(line), "Recording '%s': saving (%lu/%lu bytes)\r\n",
+                     rec_filename, (unsigned long)rec_saved, (unsigned long)rec_staged);
+            break;
+        default:
+            snprintf(line, sizeof(line), "Recording: off (last '%s': %lu events, %lu bytes, %lu dropped)\r\n",
+                     rec_filename, (unsigned long)rec_events, (unsigned long)rec_bytes, (unsigned long)rec_dropped);
+            break;
+    }
+    tud_cdc_write_str(line);
+
+    // 記録中は今までの分、終わったあとは記録していた間の分
+    fstask_lockout_stats_t lockout = rec_lockout;
+    if (rec_state == REC_RECORDING || rec_state == REC_STOPPING) fstask_get_lockout_stats(&lockout);
+    if (lockout.count > 0) {
+        snprintf(line, sizeof(line), "  Core1 stopped by flash writes: %lu times, max %lu us, total %lu us\r\n",
+                 (unsigned long)lockout.count, (unsigned long)lockout.max_us, (unsigned long)lockout.total_us);
+        tud_cdc_write_str(line);
+    }
+
+    if (play_active) {
+        snprintf(line, sizeof(line), "Playing '%s': loop %u/%u, speed %u%%, target %02X\r\n",
+                 play_filename, play_loop, play_loops, play_speed, play_target);
+    } else {
+        snprintf(line, sizeof(line), "Playback: off\r\n");
+    }
+    tud_cdc_write_str(line);
+    if (play_events > 0) {
+        snprintf(line, sizeof(line), "  %lu events played, late avg %lu us, max %lu us\r\n",
+                 (unsigned long)play_events, (unsigned long)(play_late_sum / play_events),
+                 (unsigned long)play_late_max);
+        tud_cdc_write_str(line);
+    }
+    tud_cdc_write_flush();
+}
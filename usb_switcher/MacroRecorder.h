@@ -0,0 +1,95 @@
+#ifndef MACRORECORDER_H
+#define MACRORECORDER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "USBDeviceTask.h"          // For keyboard_bitmap_t, mouse_report_t
+#include "GamepadReportParser.h"    // For parsed_gamepad_report_t
+#include "fstask.h"                 // For FSTASK_STAGING_SIZE
+
+//--------------------------------------------------------------------+
+// 入力の記録と再生（バイナリのタイムラインファイル）
+//
+// 記録: USB ホストの入力（キーボード・メディアキー・マウス・ゲームパッド）を Core1 で
+// イベントに符号化して固定サイズのリングバッファに入れる（満杯のときはイベントを捨てて数える）。
+// Core0 は記録を始めるときに LittleFS の後ろのステージング領域（fstask.h）を消去しておき、
+// 記録中はリングバッファを1ページ（256バイト）ずつそこに書く。止めたら LittleFS のファイルに写す。
+// flash に書いている間は Core1 も止まる（multicore_lockout）。記録中に止まるのは1回に1ページの
+// 書き込みの間だけ（W25Q のデータシートで通常 0.4ms、最大 3ms）で、消去（セクタごとに数十 ms）はしない。
+// 止まっている間の入力は Core1 が戻ってから読むので、その分イベントの時刻が遅れる。
+// 止まった回数・最大時間は `rec` で表示する（他のタスクが LittleFS に書いた分も含む）。
+//
+// 再生: Core0 がファイルを読んでイベントに戻してキューに積み、Core1 のループが
+// time_us_64 で再開時刻を見て出力する（Lua はイベントごとに動かない）。
+// 繰り返し・速度・出力先（このノードの USB / リンク先のノード）を指定できる。
+// 終わったとき・止めたときは再生で押したキー・ボタンを離す。
+//
+// ファイル形式:
+//   "HREC" + バージョン(1バイト、1)
+//   イベント: 種類(1) + 前のイベントからの時間（µs、LEB128） + 内容
+//   'N' キーボード: 修飾キー(1) + キー数(1) + キーコード...
+//   'U' メディアキー: キー数(1) + Consumer(2, LE)... + System(1)
+//   'M' マウス: ボタン(LEB128) + X, Y（zigzag LEB128） + ホイール(1) + パン(1) + ホイールの分解能(1)
+//   'G' ゲームパッド: X, Y, Z, RZ, ハット(各1) + ボタン(2, LE)
+//--------------------------------------------------------------------+
+
+#define MACRO_REC_BUFFER_SIZE   8192    // Core1 -> Core0 のリングバッファ
+#define MACRO_REC_SAVE_SIZE     1024    // 止めたあと LittleFS に1回に写す量
+#define MACRO_REC_MAX_SIZE      (FSTASK_STAGING_SIZE - MACRO_REC_BUFFER_SIZE)   // 記録の大きさの上限
+#define MACRO_PLAY_QUEUE_DEPTH  64      // Core0 -> Core1 の再生キュー（イベント）
+#define MACRO_REC_DEFAULT_FILE  "macro.rec" // Meta+R / Meta+P のファイル
+
+/**
+ * キューを初期化する（multicore_launch_core1 の前に呼ぶ）
+ */
+void macro_recorder_init(void);
+
+/**
+ * 入力を記録する（Core1 の入力処理から呼ぶ。記録中でなければ何もしない）
+ */
+void macro_rec_keyboard(const keyboard_bitmap_t* state);
+void macro_rec_control(const uint16_t* consumer, uint8_t system);     // USB_CONSUMER_KEYS 個
+void macro_rec_mouse(const mouse_report_t* report, uint8_t wheel_resolution);
+void macro_rec_gamepad(const parsed_gamepad_report_t* report);
+
+/**
+ * 記録を始める / 止める（Core0）
+ * 始めてからステージング領域の消去が終わるまでは記録しない（前の記録で使った分だけ消す）
+ * @return 0: 成功, 負の値: エラー（ファイルを開けない、記録中・再生中）
+ */
+int macro_rec_start(const char* filename);
+void macro_rec_stop(void);
+
+/**
+ * 再生を始める / 止める（Core0）
+ * @param loops 繰り返す回数（0: 止めるまで）
+ * @param speed_percent 速度（100: 記録どおり、200: 2倍速）
+ * @param target 出力先（0: このノードの USB、それ以外: リンク先のノードのアドレス）
+ * @return 0: 成功, 負の値: エラー
+ */
+int macro_play_start(const char* filename, uint16_t loops, uint16_t speed_percent, uint8_t target);
+void macro_play_stop(void);
+
+/**
+ * Meta+R（記録の開始/停止）・Meta+P（再生の開始/停止）を受け付ける（Core1 から呼ぶ。
+ * ファイルは次の macro_recorder_task で開く）
+ */
+void macro_recorder_meta_record(void);
+void macro_recorder_meta_play(void);
+
+/**
+ * 記録の準備・書き込み・保存を1段進め、再生するイベントをキューに積む（Core0 のループから呼ぶ）
+ */
+void macro_recorder_task(void);
+
+/**
+ * 再生（Core1 のループから呼ぶ）
+ */
+void macro_player_task(void);
+
+/**
+ * 記録・再生の状態と統計を CDC に表示する
+ */
+void macro_recorder_print(void);
+
+#endif // MACRORECORDER_H
@@ -21,6 +21,7 @@ typedef struct{
     uint16_t pan_index; // 0xffff if not valid
     uint8_t  pan_bitpos;
     uint8_t  pan_size;
+    uint8_t  wheel_resolution; // wheel/pan counts per detent (0 or 1: detents)
 } mouse_report_parser_info_t;
 
 typedef struct {
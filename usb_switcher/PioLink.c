@@ -0,0 +1,267 @@
+#include "PioLink.h"
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/clocks.h"
+#include "pio_link.pio.h"
+
+#define PIO_LINK_RX_RING_WORDS  ((1u << PIO_LINK_RX_RING_BITS) / sizeof(uint32_t))
+#define PIO_LINK_FRAME_WORDS    ((LINK_FRAME_MAX + 3) / 4)
+#define PIO_LINK_TXSTALL_BIT    (PIO_FDEBUG_TXSTALL_LSB + tx_sm)
+
+static PIO link_pio = NULL;
+static int tx_sm = -1;
+static int rx_sm = -1;
+static int tx_dma = -1;
+static int rx_dma = -1;
+
+// 送信バッファ（DMA 転送中は触らない）
+static uint32_t tx_words[1 + PIO_LINK_FRAME_WORDS];
+
+// 受信リングバッファ（DMA の write ring でラップするのでサイズ境界に揃える）
+static uint32_t rx_ring[PIO_LINK_RX_RING_WORDS] __attribute__((aligned(1u << PIO_LINK_RX_RING_BITS)));
+static uint32_t rx_read = 0;
+
+// 送信側: 最後のビットを送り終えてクロックが止まった時刻（フレーム間の休止の起点）
+static bool tx_stall_armed = false;
+static bool tx_gap_started = false;
+static uint32_t tx_gap_start = 0;
+
+// 受信側: 壊れたヘッダを見つけてから、クロックが止まるのを待っている間
+static bool rx_resync_pending = false;
+static uint32_t rx_resync_write = 0;
+static uint32_t rx_resync_since = 0;
+
+// 統計（errors は再同期の回数）
+static link_transport_stats_t pio_link_stats;
+
+// 受信側ステートマシンと DMA を先頭からやり直す
+// クロックが止まっている間に再開すればワード境界が揃う
+static void pio_link_rx_restart(void)
+{
+    rx_resync_pending = false;
+
+    pio_sm_set_enabled(link_pio, rx_sm, false);
+    dma_channel_abort(rx_dma);
+    pio_sm_clear_fifos(link_pio, rx_sm);
+    pio_sm_restart(link_pio, rx_sm);
+
+    // RP2040 では約40億ワード、RP2350 では上位4bit が ENDLESS モードになる
+    dma_channel_set_write_addr(rx_dma, rx_ring, false);
+    dma_channel_set_trans_count(rx_dma, 0xFFFFFFFF, true);
+    rx_read = 0;
+
+    pio_sm_set_enabled(link_pio, rx_sm, true);
+}
+
+static bool pio_link_claim(PIO pio)
+{
+    if (!pio_can_add_program(pio, &pio_link_tx_program) || !pio_can_add_program(pio, &pio_link_rx_program)) {
+        return false;
+    }
+    int tx = pio_claim_unused_sm(pio, false);
+    int rx = pio_claim_unused_sm(pio, false);
+    if (tx < 0 || rx < 0) {
+        if (tx >= 0) pio_sm_unclaim(pio, tx);
+        if (rx >= 0) pio_sm_unclaim(pio, rx);
+        return false;
+    }
+    link_pio = pio;
+    tx_sm = tx;
+    rx_sm = rx;
+    return true;
+}
+
+int pio_link_init(void)
+{
+    // PIO0 は PIO USB、PIO1 は ws2812 と下流ポートの PIO UART が使う
+#if NUM_PIOS > 2
+    if (!pio_link_claim(pio2) && !pio_link_claim(pio1)) {
+#else
+    if (!pio_link_claim(pio1)) {
+#endif
+        printf("PIO link: no free PIO state machines\n");
+        return -1;
+    }
+
+    tx_dma = dma_claim_unused_channel(false);
+    rx_dma = dma_claim_unused_channel(false);
+    if (tx_dma < 0 || rx_dma < 0) {
+        printf("PIO link: no free DMA channels\n");
+        if (tx_dma >= 0) dma_channel_unclaim(tx_dma);
+        if (rx_dma >= 0) dma_channel_unclaim(rx_dma);
+        pio_sm_unclaim(link_pio, tx_sm);
+        pio_sm_unclaim(link_pio, rx_sm);
+        return -1;
+    }
+
+    // TX: 1ビット = 2命令。受信側は1ビットに3命令以上かかるので、クロックの
+    // High/Low がそれぞれ4サイクル以上になるよう整数分周にする
+    uint32_t div = (clock_get_hz(clk_sys) + 2 * PIO_LINK_BITRATE - 1) / (2 * PIO_LINK_BITRATE);
+    if (div < 4) div = 4;
+
+    uint tx_offset = pio_add_program(link_pio, &pio_link_tx_program);
+    uint32_t tx_mask = (1u << PIO_LINK_TX_DATA_PIN) | (1u << PIO_LINK_TX_CLK_PIN);
+    pio_sm_set_pins_with_mask(link_pio, tx_sm, 0, tx_mask);
+    pio_sm_set_pindirs_with_mask(link_pio, tx_sm, tx_mask, tx_mask);
+    pio_gpio_init(link_pio, PIO_LINK_TX_DATA_PIN);
+    pio_gpio_init(link_pio, PIO_LINK_TX_CLK_PIN);
+
+    pio_sm_config tx_config = pio_link_tx_program_get_default_config(tx_offset);
+    sm_config_set_out_pins(&tx_config, PIO_LINK_TX_DATA_PIN, 1);
+    sm_config_set_sideset_pins(&tx_config, PIO_LINK_TX_CLK_PIN);
+    sm_config_set_out_shift(&tx_config, false, true, 32);   // MSB first, autopull
+    sm_config_set_fifo_join(&tx_config, PIO_FIFO_JOIN_TX);
+    sm_config_set_clkdiv(&tx_config, (float)div);
+    pio_sm_init(link_pio, tx_sm, tx_offset, &tx_config);
+    pio_sm_set_enabled(link_pio, tx_sm, true);
+
+    // RX: 全速で回してクロックの立ち上がりでサンプリングする
+    uint rx_offset = pio_add_program(link_pio, &pio_link_rx_program);
+    pio_sm_set_consecutive_pindirs(link_pio, rx_sm, PIO_LINK_RX_DATA_PIN, 2, false);
+    pio_gpio_init(link_pio, PIO_LINK_RX_DATA_PIN);
+    pio_gpio_init(link_pio, PIO_LINK_RX_CLK_PIN);
+    gpio_pull_down(PIO_LINK_RX_CLK_PIN);    // 相手が未接続の間はクロックを止めておく
+
+    pio_sm_config rx_config = pio_link_rx_program_get_default_config(rx_offset);
+    sm_config_set_in_pins(&rx_config, PIO_LINK_RX_DATA_PIN);
+    sm_config_set_in_shift(&rx_config, false, true, 32);    // MSB first, autopush
+    sm_config_set_fifo_join(&rx_config, PIO_FIFO_JOIN_RX);
+    sm_config_set_clkdiv(&rx_config, 1.0f);
+    pio_sm_init(link_pio, rx_sm, rx_offset, &rx_config);
+
+    // TX DMA: tx_words -> TX FIFO
+    dma_channel_config tx_dma_config = dma_channel_get_default_config(tx_dma);
+    channel_config_set_transfer_data_size(&tx_dma_config, DMA_SIZE_32);
+    channel_config_set_read_increment(&tx_dma_config, true);
+    channel_config_set_write_increment(&tx_dma_config, false);
+    channel_config_set_dreq(&tx_dma_config, pio_get_dreq(link_pio, tx_sm, true));
+    dma_channel_configure(tx_dma, &tx_dma_config, &link_pio->txf[tx_sm], tx_words, 0, false);
+
+    // RX DMA: RX FIFO -> rx_ring（リングで折り返し続ける）
+    dma_channel_config rx_dma_config = dma_channel_get_default_config(rx_dma);
+    channel_config_set_transfer_data_size(&rx_dma_config, DMA_SIZE_32);
+    channel_config_set_read_increment(&rx_dma_config, false);
+    channel_config_set_write_increment(&rx_dma_config, true);
+    channel_config_set_ring(&rx_dma_config, true, PIO_LINK_RX_RING_BITS);
+    channel_config_set_dreq(&rx_dma_config, pio_get_dreq(link_pio, rx_sm, false));
+    dma_channel_configure(rx_dma, &rx_dma_config, rx_ring, &link_pio->rxf[rx_sm], 0, false);
+
+    pio_link_rx_restart();
+
+    printf("PIO link initialized on PIO%d (SM%d/SM%d, DMA %d/%d)\n",
+           pio_get_index(link_pio), tx_sm, rx_sm, tx_dma, rx_dma);
+    printf("TX Pins: %d/%d, RX Pins: %d/%d, %lu bit/s\n",
+           PIO_LINK_TX_DATA_PIN, PIO_LINK_TX_CLK_PIN, PIO_LINK_RX_DATA_PIN, PIO_LINK_RX_CLK_PIN,
+           (unsigned long)(clock_get_hz(clk_sys) / (2 * div)));
+    return 0;
+}
+
+static bool pio_link_can_send(void)
+{
+    // DMA が FIFO へ書き終えても、ステートマシンが最後のワードを送り終えるまでは送らない
+    if (dma_channel_is_busy(tx_dma) || !pio_sm_is_tx_fifo_empty(link_pio, tx_sm)) return false;
+    if (!tx_stall_armed) {
+        // FIFO が空になってから TXSTALL をクリアし、OSR の最後のワードを
+        // 送り終えて次の autopull で止まったときにセットされるのを待つ
+        link_pio->fdebug = 1u << PIO_LINK_TXSTALL_BIT;
+        tx_stall_armed = true;
+        return false;
+    }
+    if (!(link_pio->fdebug & (1u << PIO_LINK_TXSTALL_BIT))) return false;
+
+    // クロックを PIO_LINK_MIN_GAP_US 止めてから次のフレームを送る
+    // （受信側はこの休止の間にワード境界を合わせ直す）
+    uint32_t now = time_us_32();
+    if (!tx_gap_started) {
+        tx_gap_started = true;
+        tx_gap_start = now;
+    }
+    return now - tx_gap_start >= PIO_LINK_MIN_GAP_US;
+}
+
+static bool pio_link_send_frame(const char* frame, size_t len)
+{
+    if (len >= LINK_FRAME_MAX || !pio_link_can_send()) return false;
+
+    tx_words[0] = ((uint32_t)PIO_LINK_MAGIC << 16) | (uint32_t)len;
+    size_t words = (len + 3) / 4;
+    for (size_t i = 0; i < words; i++) {
+        uint32_t word = 0;
+        for (size_t j = 0; j < 4; j++) {
+            size_t index = i * 4 + j;
+            word = (word << 8) | (index < len ? (uint8_t)frame[index] : 0);
+        }
+        tx_words[1 + i] = word;
+    }
+
+    tx_stall_armed = false;
+    tx_gap_started = false;
+    dma_channel_transfer_from_buffer_now(tx_dma, tx_words, 1 + words);
+    pio_link_stats.frames_sent++;
+    pio_link_stats.bytes_sent += (1 + words) * sizeof(uint32_t);
+    return true;
+}
+
+static size_t pio_link_poll_frame(char* frame, size_t size)
+{
+    // RP2040 で転送回数を使い切った場合は再開する（書き込み位置はそのまま）
+    if (!dma_channel_is_busy(rx_dma)) {
+        dma_channel_set_trans_count(rx_dma, 0xFFFFFFFF, true);
+    }
+
+    uint32_t write = ((uintptr_t)dma_hw->ch[rx_dma].write_addr - (uintptr_t)rx_ring) / sizeof(uint32_t);
+
+    if (rx_resync_pending) {
+        // 送信側はフレーム間で必ずクロックを止めるので、ワードが届かない時間が
+        // PIO_LINK_RESYNC_IDLE_US 続いたらフレーム間の休止中とみなして再開する。
+        // 休止を取り逃して途中から再開した場合は、次のヘッダで再びここへ来る
+        uint32_t now = time_us_32();
+        if (write != rx_resync_write) {
+            rx_resync_write = write;
+            rx_resync_since = now;
+        } else if (now - rx_resync_since >= PIO_LINK_RESYNC_IDLE_US && !gpio_get(PIO_LINK_RX_CLK_PIN)) {
+            pio_link_rx_restart();
+        }
+        return 0;
+    }
+
+    uint32_t available = (write - rx_read) & (PIO_LINK_RX_RING_WORDS - 1);
+    if (available == 0) return 0;
+
+    uint32_t header = rx_ring[rx_read];
+    size_t len = header & 0xFFFF;
+    if ((header >> 16) != PIO_LINK_MAGIC || len == 0 || len >= size) {
+        // ワード境界がずれているか壊れたフレーム。送信中に再開すると
+        // またずれるので、クロックが止まるまで待ってからやり直す
+        pio_link_stats.errors++;
+        rx_resync_pending = true;
+        rx_resync_write = write;
+        rx_resync_since = time_us_32();
+        return 0;
+    }
+
+    size_t words = (len + 3) / 4;
+    if (available < 1 + words) return 0;   // フレームの残りを待つ
+
+    for (size_t i = 0; i < len; i++) {
+        uint32_t word = rx_ring[(rx_read + 1 + i / 4) & (PIO_LINK_RX_RING_WORDS - 1)];
+        frame[i] = (char)(word >> (24 - 8 * (i % 4)));
+    }
+    frame[len] = '\0';
+
+    rx_read = (rx_read + 1 + words) & (PIO_LINK_RX_RING_WORDS - 1);
+    pio_link_stats.frames_received++;
+    pio_link_stats.bytes_received += (1 + words) * sizeof(uint32_t);
+    return len;
+}
+
+const link_transport_t pio_link_transport = {
+    .name = "pio-link",
+    .can_send = pio_link_can_send,
+    .send_frame = pio_link_send_frame,
+    .poll_frame = pio_link_poll_frame,
+    .stats = &pio_link_stats,
+};
@@ -0,0 +1,39 @@
+#ifndef PIOLINK_H
+#define PIOLINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "LinkTransport.h"
+
+//--------------------------------------------------------------------+
+// PIO 同期シリアルリンク（UART1 の代わりに Pico 間の上流ポートとして使う）
+//
+// データ線とクロック線を片方向ずつ、計4本で接続する（TX 側と RX 側をクロスさせる）。
+// 1フレーム = ヘッダワード（マジック + 長さ）+ ペイロード（32bit ワード単位）
+// 送受信とも DMA で、CPU は FIFO を触らない。
+// フレームの間は必ずクロックを PIO_LINK_MIN_GAP_US 以上止める。受信側はヘッダが
+// 壊れていたら、ワードが PIO_LINK_RESYNC_IDLE_US 届かなくなる（休止に入る）のを
+// 待ってから受信をやり直し、ワード境界を合わせ直す。
+//--------------------------------------------------------------------+
+
+#define PIO_LINK_TX_DATA_PIN    2
+#define PIO_LINK_TX_CLK_PIN     3
+#define PIO_LINK_RX_DATA_PIN    6
+#define PIO_LINK_RX_CLK_PIN     7       // RX_DATA_PIN + 1 であること
+#define PIO_LINK_BITRATE        20000000
+
+#define PIO_LINK_MAGIC          0x4C4B  // "LK"
+#define PIO_LINK_RX_RING_BITS   10      // 受信リングバッファ 1KB（256ワード）
+#define PIO_LINK_MIN_GAP_US     10      // フレーム間でクロックを止める時間（20Mbit/s で約6ワード分）
+#define PIO_LINK_RESYNC_IDLE_US 4       // 再同期: これだけワードが届かなければ休止中とみなす
+
+/**
+ * PIO 同期リンクの初期化（ステートマシン2つと DMA チャネル2つを確保する）
+ * @return 0: 成功, 負の値: エラー（PIO / DMA の空きがない）
+ */
+int pio_link_init(void);
+
+// LinkMux の上流ポート用トランスポート
+extern const link_transport_t pio_link_transport;
+
+#endif // PIOLINK_H
@@ -0,0 +1,122 @@
+#include "PioUart.h"
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "hardware/clocks.h"
+#include "UARTtask.h"
+#include "pio_uart.pio.h"
+
+static PIO pio_uart_pio = NULL;
+static int pio_uart_tx_sm = -1;
+static int pio_uart_rx_sm = -1;
+
+int pio_uart_init(void)
+{
+    PIO pio = pio1;    // PIO0 は PIO USB が使用している
+
+    if (!pio_can_add_program(pio, &uart_tx_program) || !pio_can_add_program(pio, &uart_rx_program)) {
+        printf("PIO UART: not enough PIO1 instruction memory\n");
+        return -1;
+    }
+
+    int tx_sm = pio_claim_unused_sm(pio, false);
+    int rx_sm = pio_claim_unused_sm(pio, false);
+    if (tx_sm < 0 || rx_sm < 0) {
+        printf("PIO UART: no free PIO1 state machine\n");
+        if (tx_sm >= 0) pio_sm_unclaim(pio, tx_sm);
+        if (rx_sm >= 0) pio_sm_unclaim(pio, rx_sm);
+        return -1;
+    }
+
+    // 8 PIOクロックで1ビット
+    float div = (float)clock_get_hz(clk_sys) / (8 * UART_BAUD_RATE);
+
+    // TX: アイドル状態（High）から開始
+    uint tx_offset = pio_add_program(pio, &uart_tx_program);
+    pio_sm_set_pins_with_mask(pio, tx_sm, 1u << PIO_UART_TX_PIN, 1u << PIO_UART_TX_PIN);
+    pio_sm_set_pindirs_with_mask(pio, tx_sm, 1u << PIO_UART_TX_PIN, 1u << PIO_UART_TX_PIN);
+    pio_gpio_init(pio, PIO_UART_TX_PIN);
+
+    pio_sm_config tx_config = uart_tx_program_get_default_config(tx_offset);
+    sm_config_set_out_shift(&tx_config, true, false, 32);   // LSB first, 手動 pull
+    sm_config_set_out_pins(&tx_config, PIO_UART_TX_PIN, 1);
+    sm_config_set_sideset_pins(&tx_config, PIO_UART_TX_PIN);
+    sm_config_set_fifo_join(&tx_config, PIO_FIFO_JOIN_TX);
+    sm_config_set_clkdiv(&tx_config, div);
+    pio_sm_init(pio, tx_sm, tx_offset, &tx_config);
+    pio_sm_set_enabled(pio, tx_sm, true);
+
+    // RX
+    uint rx_offset = pio_add_program(pio, &uart_rx_program);
+    pio_sm_set_consecutive_pindirs(pio, rx_sm, PIO_UART_RX_PIN, 1, false);
+    pio_gpio_init(pio, PIO_UART_RX_PIN);
+    gpio_pull_up(PIO_UART_RX_PIN);
+
+    pio_sm_config rx_config = uart_rx_program_get_default_config(rx_offset);
+    sm_config_set_in_pins(&rx_config, PIO_UART_RX_PIN);
+    sm_config_set_jmp_pin(&rx_config, PIO_UART_RX_PIN);
+    sm_config_set_in_shift(&rx_config, true, false, 32);    // LSB first, 手動 push
+    sm_config_set_fifo_join(&rx_config, PIO_FIFO_JOIN_RX);
+    sm_config_set_clkdiv(&rx_config, div);
+    pio_sm_init(pio, rx_sm, rx_offset, &rx_config);
+    pio_sm_set_enabled(pio, rx_sm, true);
+
+    pio_uart_pio = pio;
+    pio_uart_tx_sm = tx_sm;
+    pio_uart_rx_sm = rx_sm;
+
+    printf("PIO UART initialized on PIO1 (SM%d/SM%d)\n", tx_sm, rx_sm);
+    printf("TX Pin: %d, RX Pin: %d, Baud: %d\n", PIO_UART_TX_PIN, PIO_UART_RX_PIN, UART_BAUD_RATE);
+    return 0;
+}
+
+static bool pio_uart_is_writable(void)
+{
+    return !pio_sm_is_tx_fifo_full(pio_uart_pio, pio_uart_tx_sm);
+}
+
+static void pio_uart_putc(char c)
+{
+    pio_sm_put(pio_uart_pio, pio_uart_tx_sm, (uint8_t)c);
+}
+
+static bool pio_uart_is_readable(void)
+{
+    return !pio_sm_is_rx_fifo_empty(pio_uart_pio, pio_uart_rx_sm);
+}
+
+static char pio_uart_getc(void)
+{
+    // 受信バイトは ISR の上位8ビットに入っている
+    return (char)(pio_sm_get(pio_uart_pio, pio_uart_rx_sm) >> 24);
+}
+
+static link_stream_t pio_uart_stream = {
+    .is_writable = pio_uart_is_writable,
+    .putc = pio_uart_putc,
+    .is_readable = pio_uart_is_readable,
+    .getc = pio_uart_getc,
+};
+
+static bool pio_uart_can_send(void)
+{
+    return link_stream_can_send(&pio_uart_stream);
+}
+
+static bool pio_uart_send_frame(const char* frame, size_t len)
+{
+    return link_stream_send(&pio_uart_stream, frame, len);
+}
+
+static size_t pio_uart_poll_frame(char* frame, size_t size)
+{
+    return link_stream_poll(&pio_uart_stream, frame, size);
+}
+
+const link_transport_t pio_uart_transport = {
+    .name = "pio-uart",
+    .can_send = pio_uart_can_send,
+    .send_frame = pio_uart_send_frame,
+    .poll_frame = pio_uart_poll_frame,
+    .stats = &pio_uart_stream.stats,
+};
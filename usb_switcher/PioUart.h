@@ -0,0 +1,24 @@
+#ifndef PIOUART_H
+#define PIOUART_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "LinkTransport.h"
+
+//--------------------------------------------------------------------+
+// 下流リンクポート用の PIO UART（PIO1、ws2812 の空きステートマシンを使用）
+//--------------------------------------------------------------------+
+
+#define PIO_UART_TX_PIN     8
+#define PIO_UART_RX_PIN     9
+
+/**
+ * PIO UART の初期化（TX/RX に PIO1 のステートマシンを2つ使う）
+ * @return 0: 成功, 負の値: エラー（ステートマシンや命令メモリが足りない）
+ */
+int pio_uart_init(void);
+
+// LinkMux の下流ポート用トランスポート
+extern const link_transport_t pio_uart_transport;
+
+#endif // PIOUART_H
@@ -0,0 +1,312 @@
+#include "PioUsbDevice.h"
+#include <stdio.h>
+#include <string.h>
+#include "tusb.h"
+#include "pio_usb.h"
+#include "hardware/gpio.h"
+#include "pico/critical_section.h"
+#include "pico/util/queue.h"
+
+#define USB2_VID    0xCa07
+#define USB2_PID    0x010b      // 本体（USB_PID 0x000c）とインターフェース構成が違うので別の PID
+
+#define EPNUM2_KEYBOARD 0x81
+#define EPNUM2_MOUSE    0x82
+#define EPNUM2_GAMEPAD  0x83
+
+//--------------------------------------------------------------------+
+// Descriptors
+//--------------------------------------------------------------------+
+
+static tusb_desc_device_t const desc2_device =
+{
+    .bLength            = sizeof(tusb_desc_device_t),
+    .bDescriptorType    = TUSB_DESC_DEVICE,
+    .bcdUSB             = 0x0110,
+
+    .bDeviceClass       = 0x00,
+    .bDeviceSubClass    = 0x00,
+    .bDeviceProtocol    = 0x00,
+
+    .bMaxPacketSize0    = 64,
+
+    .idVendor           = USB2_VID,
+    .idProduct          = USB2_PID,
+    .bcdDevice          = 0x0100,
+
+    .iManufacturer      = 0x01,
+    .iProduct           = 0x02,
+    .iSerialNumber      = 0x00,
+
+    .bNumConfigurations = 0x01
+};
+
+// Report ID なし（PIO 側は SET_PROTOCOL を処理しないので、Boot と同じ形式だけを使う）
+static uint8_t const desc2_hid_keyboard_report[] =
+{
+  TUD_HID_REPORT_DESC_KEYBOARD()
+};
+
+static uint8_t const desc2_hid_mouse_report[] =
+{
+  TUD_HID_REPORT_DESC_MOUSE()
+};
+
+static uint8_t const desc2_hid_gamepad_report[] =
+{
+  TUD_HID_REPORT_DESC_GAMEPAD()
+};
+
+// インターフェース番号の順（pio_usb_device.c は wIndex で引く）
+static const uint8_t* desc2_hid_reports[] =
+{
+  desc2_hid_keyboard_report,
+  desc2_hid_mouse_report,
+  desc2_hid_gamepad_report,
+};
+
+#define CONFIG2_TOTAL_LEN   (TUD_CONFIG_DESC_LEN + 3 * TUD_HID_DESC_LEN)
+
+static uint8_t const desc2_configuration[] =
+{
+  TUD_CONFIG_DESCRIPTOR(1, 3, 0, CONFIG2_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
+
+  TUD_HID_DESCRIPTOR(PIO_USB_DEVICE2_KEYBOARD, 0, HID_ITF_PROTOCOL_KEYBOARD, sizeof(desc2_hid_keyboard_report), EPNUM2_KEYBOARD, 8, 1),
+  TUD_HID_DESCRIPTOR(PIO_USB_DEVICE2_MOUSE, 0, HID_ITF_PROTOCOL_MOUSE, sizeof(desc2_hid_mouse_report), EPNUM2_MOUSE, 8, 1),
+  TUD_HID_DESCRIPTOR(PIO_USB_DEVICE2_GAMEPAD, 0, HID_ITF_PROTOCOL_NONE, sizeof(desc2_hid_gamepad_report), EPNUM2_GAMEPAD, 16, 1),
+};
+
+// pio_usb_device.c は長さ 255 までしか送れない
+TU_VERIFY_STATIC(sizeof(desc2_configuration) < 256, "PIO device config descriptor too long");
+
+static string_descriptor_t const desc2_strings[] =
+{
+  { 4, TUSB_DESC_STRING, { 0x09, 0x04 } },
+  { 18, TUSB_DESC_STRING, { 'T', 0, 'i', 0, 'n', 0, 'y', 0, 'U', 0, 'S', 0, 'B', 0, '2', 0 } },
+  { 30, TUSB_DESC_STRING, { 'U', 0, 'S', 0, 'B', 0, ' ', 0, 'S', 0, 'w', 0, 'i', 0, 't', 0,
+                            'c', 0, 'h', 0, 'e', 0, 'r', 0, ' ', 0, '2', 0 } },
+};
+
+//--------------------------------------------------------------------+
+// State
+//--------------------------------------------------------------------+
+
+typedef struct {
+    uint16_t buttons;
+    int32_t x;
+    int32_t y;
+    int32_t wheel;      // 1/MOUSE_WHEEL_UNITS ノッチ単位
+    int32_t pan;
+} mouse2_state_t;
+
+static bool device2_enabled = false;
+static uint8_t device2_pin_dp;
+static usb_device_t* usb_device2 = NULL;       // Core1 で初期化するまで NULL
+
+static critical_section_t keyboard_lock;
+static queue_t keyboard_queue;                  // hid_keyboard_report_t, Core0 / Core1 -> Core1
+static uint8_t keyboard_sent_keys[6];           // 6KRO に変換するときの押しっぱなしのキー
+
+static critical_section_t mouse_lock;
+static mouse2_state_t mouse_pending;
+static bool mouse_dirty = false;                // mouse_pending に未送信の変化がある
+
+static critical_section_t gamepad_lock;
+static hid_gamepad_report_t gamepad_pending;
+static bool gamepad_dirty = false;
+
+// 送信中のデータ（転送が終わるまで保持する）
+static hid_keyboard_report_t keyboard_buffer;
+static hid_mouse_report_t mouse_buffer;
+static hid_gamepad_report_t gamepad_buffer;
+
+bool pio_usb_device2_init(uint8_t pin_dp)
+{
+    queue_init(&keyboard_queue, sizeof(hid_keyboard_report_t), PIO_USB_DEVICE2_KEY_QUEUE_DEPTH);
+    critical_section_init(&keyboard_lock);
+    critical_section_init(&mouse_lock);
+    critical_section_init(&gamepad_lock);
+
+    device2_pin_dp = pin_dp;
+    gpio_set_function(pin_dp  , GPIO_FUNC_PIO0);  // PIOに強制的に切り替える
+    gpio_set_function(pin_dp+1, GPIO_FUNC_PIO0);
+    device2_enabled = true;
+    return true;
+}
+
+// パケット受信の割り込みは初期化したコアで動くので、PIO の初期化は Core1 で行う
+static void device2_start(void)
+{
+    pio_usb_configuration_t pio_cfg = PIO_USB_DEFAULT_CONFIG;
+    pio_cfg.pin_dp = device2_pin_dp;
+    pio_cfg.pio_tx_num = 0;     // ホストと同じ PIO0 / SM1-3 を使う
+    pio_cfg.sm_tx = 1;
+    pio_cfg.pio_rx_num = 0;
+    pio_cfg.sm_rx = 2;
+    pio_cfg.sm_eop = 3;
+
+    static usb_descriptor_buffers_t const buffers = {
+        .device = (const uint8_t*)&desc2_device,
+        .config = desc2_configuration,
+        .hid_report = desc2_hid_reports,
+        .string = desc2_strings,
+    };
+
+    usb_device2 = pio_usb_device_init(&pio_cfg, &buffers);
+    printf("USB Device 2 started on GPIO %d/%d\n", device2_pin_dp, device2_pin_dp + 1);
+}
+
+bool pio_usb_device2_enabled(void)
+{
+    return device2_enabled;
+}
+
+// IN エンドポイント（PC に認識される前は NULL か is_tx が false）
+static endpoint_t* device2_endpoint(uint8_t instance)
+{
+    if (usb_device2 == NULL) return NULL;
+    endpoint_t* ep = pio_usb_get_endpoint(usb_device2, instance + 1);
+    if (ep == NULL || !ep->is_tx) return NULL;
+    return ep;
+}
+
+bool pio_usb_device2_ready(uint8_t instance)
+{
+    if (device2_endpoint(instance) == NULL) return false;
+
+    switch (instance) {
+        case PIO_USB_DEVICE2_KEYBOARD: return !queue_is_full(&keyboard_queue);
+        case PIO_USB_DEVICE2_MOUSE:    return !mouse_dirty;
+        case PIO_USB_DEVICE2_GAMEPAD:  return true;
+        default:                       return false;
+    }
+}
+
+//--------------------------------------------------------------------+
+// Reports
+//--------------------------------------------------------------------+
+
+bool pio_usb_device2_keyboard_report(const keyboard_bitmap_t* state)
+{
+    if (!device2_enabled) return false;
+
+    bool result;
+    hid_keyboard_report_t report;
+    memset(&report, 0, sizeof(report));
+    report.modifier = state->modifier;
+
+    critical_section_enter_blocking(&keyboard_lock);
+    keyboard_bitmap_to_keys(state, keyboard_sent_keys, report.keycode);
+    result = queue_try_add(&keyboard_queue, &report);
+    if (result) memcpy(keyboard_sent_keys, report.keycode, 6);
+    critical_section_exit(&keyboard_lock);
+
+    return result;
+}
+
+static int32_t clamp_pending(int32_t value, int32_t limit)
+{
+    if (value > limit) return limit;
+    if (value < -limit) return -limit;
+    return value;
+}
+
+bool pio_usb_device2_mouse_report(const mouse_report_t* report, uint8_t wheel_resolution)
+{
+    if (!device2_enabled) return false;
+
+    bool result = true;
+    int32_t units = MOUSE_WHEEL_UNITS / (wheel_resolution ? wheel_resolution : 1);
+
+    critical_section_enter_blocking(&mouse_lock);
+    if (mouse_dirty && report->buttons != mouse_pending.buttons) {
+        // 前の移動を送り切るまでボタンの変化は受け付けない
+        result = false;
+    } else {
+        mouse_pending.buttons = report->buttons;
+        mouse_pending.x = clamp_pending(mouse_pending.x + report->x, 32767);
+        mouse_pending.y = clamp_pending(mouse_pending.y + report->y, 32767);
+        mouse_pending.wheel = clamp_pending(mouse_pending.wheel + report->wheel * units, 127 * MOUSE_WHEEL_UNITS);
+        mouse_pending.pan = clamp_pending(mouse_pending.pan + report->pan * units, 127 * MOUSE_WHEEL_UNITS);
+        mouse_dirty = true;
+    }
+    critical_section_exit(&mouse_lock);
+
+    return result;
+}
+
+bool pio_usb_device2_gamepad_report(const hid_standard_gamepad_report_t* report)
+{
+    if (!device2_enabled) return false;
+
+    critical_section_enter_blocking(&gamepad_lock);
+    gamepad_pending.x = report->x;
+    gamepad_pending.y = report->y;
+    gamepad_pending.z = report->z;
+    gamepad_pending.rz = report->rz;
+    gamepad_pending.hat = report->hat;
+    gamepad_pending.buttons = report->buttons;
+    gamepad_dirty = true;
+    critical_section_exit(&gamepad_lock);
+
+    return true;
+}
+
+static void send_keyboard(endpoint_t* ep)
+{
+    if (ep->has_transfer || !queue_try_peek(&keyboard_queue, &keyboard_buffer)) return;
+
+    if (pio_usb_set_out_data(ep, (const uint8_t*)&keyboard_buffer, sizeof(keyboard_buffer)) == 0) {
+        hid_keyboard_report_t sent;
+        queue_try_remove(&keyboard_queue, &sent);
+    }
+}
+
+// 8ビットに収まる分だけ送り、残りは次のレポートへ持ち越す
+static void send_mouse(endpoint_t* ep)
+{
+    if (ep->has_transfer || !mouse_dirty) return;
+
+    critical_section_enter_blocking(&mouse_lock);
+    mouse_buffer.buttons = (uint8_t)mouse_pending.buttons;
+    mouse_buffer.x = (int8_t)clamp_pending(mouse_pending.x, 127);
+    mouse_buffer.y = (int8_t)clamp_pending(mouse_pending.y, 127);
+    mouse_buffer.wheel = (int8_t)(mouse_pending.wheel / MOUSE_WHEEL_UNITS);
+    mouse_buffer.pan = (int8_t)(mouse_pending.pan / MOUSE_WHEEL_UNITS);
+    if (pio_usb_set_out_data(ep, (const uint8_t*)&mouse_buffer, sizeof(mouse_buffer)) == 0) {
+        mouse_pending.x -= mouse_buffer.x;
+        mouse_pending.y -= mouse_buffer.y;
+        mouse_pending.wheel -= mouse_buffer.wheel * MOUSE_WHEEL_UNITS;
+        mouse_pending.pan -= mouse_buffer.pan * MOUSE_WHEEL_UNITS;
+        // ノッチ未満のホイールの端数は次の入力まで持ち越す
+        mouse_dirty = mouse_pending.x != 0 || mouse_pending.y != 0 ||
+                      mouse_pending.wheel / MOUSE_WHEEL_UNITS != 0 ||
+                      mouse_pending.pan / MOUSE_WHEEL_UNITS != 0;
+    }
+    critical_section_exit(&mouse_lock);
+}
+
+static void send_gamepad(endpoint_t* ep)
+{
+    if (ep->has_transfer || !gamepad_dirty) return;
+
+    critical_section_enter_blocking(&gamepad_lock);
+    gamepad_buffer = gamepad_pending;
+    if (pio_usb_set_out_data(ep, (const uint8_t*)&gamepad_buffer, sizeof(gamepad_buffer)) == 0) {
+        gamepad_dirty = false;
+    }
+    critical_section_exit(&gamepad_lock);
+}
+
+void pio_usb_device2_task(void)
+{
+    if (!device2_enabled) return;
+    if (usb_device2 == NULL) device2_start();
+
+    pio_usb_device_task();
+
+    endpoint_t* ep;
+    if ((ep = device2_endpoint(PIO_USB_DEVICE2_KEYBOARD)) != NULL) send_keyboard(ep);
+    if ((ep = device2_endpoint(PIO_USB_DEVICE2_MOUSE)) != NULL) send_mouse(ep);
+    if ((ep = device2_endpoint(PIO_USB_DEVICE2_GAMEPAD)) != NULL) send_gamepad(ep);
+}
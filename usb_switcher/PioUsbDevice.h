@@ -0,0 +1,73 @@
+#ifndef PIOUSBDEVICE_H
+#define PIOUSBDEVICE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "USBDeviceTask.h"  // For keyboard_bitmap_t, mouse_report_t
+
+//--------------------------------------------------------------------+
+// PIO-USB による2つ目の USB デバイスポート（フルスピード）
+//
+// usb_switcher.c で USBDevice2_Pin_DP を定義すると、PIO ポートをホストではなく
+// デバイスとして使い、キーボード・マウス・ゲームパッドを2台目の PC に出力する。
+// USB_output_switch = USB_OUTPUT_DEVICE2 で出力先をこのポートに切り替える。
+//
+// 制限:
+// - pico_pio_usb はホストとデバイスを同時に動かせない（PIO ポート・ルートポート 0・
+//   エンドポイントプールを共有する）ため、このポートを使うノードには USB ホストがない。
+//   入力はリンク（UART）と Lua から受け取る。
+// - PIO のデバイス側は SET_PROTOCOL / SET_REPORT を処理しないので、
+//   レポートは常に Boot 互換の形式（6KRO キーボード、8ビットのマウス）で送る。
+//   メディアキー・絶対座標ポインタ・高解像度ホイールはない。
+// - D+ に外付けの 1.5kΩ プルアップが必要。
+//--------------------------------------------------------------------+
+
+#define PIO_USB_DEVICE2_KEYBOARD    0
+#define PIO_USB_DEVICE2_MOUSE       1
+#define PIO_USB_DEVICE2_GAMEPAD     2
+
+#define PIO_USB_DEVICE2_KEY_QUEUE_DEPTH 16
+
+/**
+ * 2つ目のデバイスポートを有効にする（tuh_init の代わりに、multicore_launch_core1 の前に呼ぶ）
+ * PIO の初期化は Core1 の最初の pio_usb_device2_task で行う（パケットの割り込みを Core1 で受ける）
+ * @param pin_dp D+ のピン（D- は pin_dp + 1）
+ * @return true: 成功
+ */
+bool pio_usb_device2_init(uint8_t pin_dp);
+
+/**
+ * @return true: 2つ目のデバイスポートが有効（USBDevice2_Pin_DP が定義されている）
+ */
+bool pio_usb_device2_enabled(void);
+
+/**
+ * PIO-USB のデバイス処理と、溜まったレポートの送信（Core1 のループから呼ぶ）
+ */
+void pio_usb_device2_task(void);
+
+/**
+ * @param instance PIO_USB_DEVICE2_KEYBOARD / MOUSE / GAMEPAD
+ * @return true: PC に認識されていて、次のレポートを受け付けられる
+ */
+bool pio_usb_device2_ready(uint8_t instance);
+
+/**
+ * キーボードのレポートをキューに積む（6KRO に変換する）
+ * @return false: キューが満杯
+ */
+bool pio_usb_device2_keyboard_report(const keyboard_bitmap_t* state);
+
+/**
+ * マウスの移動量を積算する（8ビットを超える分は次のレポートで送る）
+ * @param wheel_resolution wheel/pan の1ノッチあたりのカウント数（1: ノッチ単位）
+ * @return false: 前のレポートを送信中にボタンが変わった（呼び出し側で再送する）
+ */
+bool pio_usb_device2_mouse_report(const mouse_report_t* report, uint8_t wheel_resolution);
+
+/**
+ * ゲームパッドの状態を更新する（最新の状態だけを送る）
+ */
+bool pio_usb_device2_gamepad_report(const hid_standard_gamepad_report_t* report);
+
+#endif // PIOUSBDEVICE_H
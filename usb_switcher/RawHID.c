@@ -0,0 +1,313 @@
+#include "RawHID.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tusb.h"
+#include "bsp/board.h"
+#include "pico/util/queue.h"
+#include "fstask.h"
+#include "CDCCmd.h"
+#include "LinkMux.h"
+#include "USBHostTask.h"    // For VERSION_STRING
+#include "LuaCache.h"       // For compiling uploaded scripts
+
+#define RAW_HID_INSTANCE    3
+
+typedef struct {
+    uint8_t data[RAW_HID_REPORT_SIZE];
+} raw_hid_packet_t;
+
+static queue_t rx_queue;    // Core1 -> Core0
+static queue_t tx_queue;    // Core0 / Core1 -> Core1
+static bool raw_hid_initialized = false;
+static volatile bool stream_enabled = false;
+
+static volatile uint32_t rx_packets = 0;
+static volatile uint32_t tx_packets = 0;
+static volatile uint32_t dropped_packets = 0;
+
+// ファイル転送（同時に1つ、Core0 のみ）
+typedef enum {
+    TRANSFER_IDLE,
+    TRANSFER_WRITE,
+    TRANSFER_READ
+} transfer_state_t;
+
+static transfer_state_t transfer_state = TRANSFER_IDLE;
+static char transfer_filename[64];
+static uint8_t* transfer_buffer = NULL;
+static uint32_t transfer_size = 0;
+static uint32_t transfer_written = 0;       // 書き込み: 先頭から切れ目なく受け取ったバイト数
+
+void raw_hid_init(void)
+{
+    queue_init(&rx_queue, sizeof(raw_hid_packet_t), RAW_HID_RX_QUEUE_DEPTH);
+    queue_init(&tx_queue, sizeof(raw_hid_packet_t), RAW_HID_TX_QUEUE_DEPTH);
+    raw_hid_initialized = true;
+}
+
+//--------------------------------------------------------------------+
+// Core1
+//--------------------------------------------------------------------+
+
+void raw_hid_receive(const uint8_t* buffer, uint16_t len)
+{
+    if (!raw_hid_initialized || len == 0) return;
+
+    raw_hid_packet_t packet;
+    memset(&packet, 0, sizeof(packet));
+    memcpy(packet.data, buffer, len < sizeof(packet.data) ? len : sizeof(packet.data));
+    if (queue_try_add(&rx_queue, &packet)) {
+        rx_packets++;
+    } else {
+        dropped_packets++;
+    }
+}
+
+void raw_hid_task(void)
+{
+    if (!raw_hid_initialized || !tud_hid_n_ready(RAW_HID_INSTANCE)) return;
+
+    raw_hid_packet_t packet;
+    if (queue_try_remove(&tx_queue, &packet)) {
+        tud_hid_n_report(RAW_HID_INSTANCE, 0, packet.data, sizeof(packet.data));
+        tx_packets++;
+    }
+}
+
+void raw_hid_stream_input(char type, const void* data, uint8_t len)
+{
+    if (!stream_enabled || !raw_hid_initialized || !tud_mounted()) return;
+    if (len > RAW_HID_DATA_SIZE) len = RAW_HID_DATA_SIZE;
+
+    // キューの半分はコマンドの応答用に残す
+    if (queue_get_level(&tx_queue) >= RAW_HID_TX_QUEUE_DEPTH / 2) {
+        dropped_packets++;
+        return;
+    }
+
+    raw_hid_packet_t packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.data[0] = RAW_HID_EVT_INPUT;
+    packet.data[1] = (uint8_t)type;
+    packet.data[2] = len;
+    memcpy(&packet.data[3], data, len);
+    if (!queue_try_add(&tx_queue, &packet)) {
+        dropped_packets++;
+    }
+}
+
+//--------------------------------------------------------------------+
+// Core0: commands
+//--------------------------------------------------------------------+
+
+static uint32_t get_u32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_u32(uint8_t* p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+// NUL 終端されていない引数でも読めるようにファイル名を取り出す
+static bool get_filename(const uint8_t* arg, size_t arg_len, char* filename, size_t size)
+{
+    size_t len = strnlen((const char*)arg, arg_len);
+    if (len == 0 || len >= size) return false;
+    memcpy(filename, arg, len);
+    filename[len] = '\0';
+    return true;
+}
+
+static void transfer_close(void)
+{
+    if (transfer_buffer) {
+        free(transfer_buffer);
+        transfer_buffer = NULL;
+    }
+    transfer_size = 0;
+    transfer_written = 0;
+    transfer_state = TRANSFER_IDLE;
+}
+
+static uint8_t cmd_run(const uint8_t* arg)
+{
+    char filename[48];
+    if (!get_filename(arg, RAW_HID_REPORT_SIZE - 2, filename, sizeof(filename))) return RAW_HID_ERR_ARG;
+
+    char file_command[64];
+    snprintf(file_command, sizeof(file_command), "FILE:%s", filename);
+    return fifo_push_with_duplicate_check(file_command) ? RAW_HID_OK : RAW_HID_ERR_BUSY;
+}
+
+static uint8_t cmd_write_open(const uint8_t* arg)
+{
+    uint32_t size = get_u32(arg);
+    if (size > RAW_HID_FILE_MAX) return RAW_HID_ERR_ARG;
+
+    transfer_close();
+    if (!get_filename(&arg[4], RAW_HID_REPORT_SIZE - 6, transfer_filename, sizeof(transfer_filename))) {
+        return RAW_HID_ERR_ARG;
+    }
+    transfer_buffer = malloc(size > 0 ? size : 1);
+    if (!transfer_buffer) return RAW_HID_ERR_NOMEM;
+    transfer_size = size;
+    transfer_state = TRANSFER_WRITE;
+    return RAW_HID_OK;
+}
+
+static uint8_t cmd_write_data(const uint8_t* arg)
+{
+    if (transfer_state != TRANSFER_WRITE) return RAW_HID_ERR_STATE;
+
+    uint32_t offset = get_u32(arg);
+    uint8_t len = arg[4];
+    if (len > RAW_HID_REPORT_SIZE - 7 || offset > transfer_size || len > transfer_size - offset) {
+        return RAW_HID_ERR_ARG;
+    }
+    // 受け取っていない所を飛ばした書き込みは受け付けない（書き直しはよい）
+    if (offset > transfer_written) return RAW_HID_ERR_ARG;
+    memcpy(&transfer_buffer[offset], &arg[5], len);
+    if (offset + len > transfer_written) transfer_written = offset + len;
+    return RAW_HID_OK;
+}
+
+static uint8_t cmd_read_open(const uint8_t* arg, uint8_t* data)
+{
+    transfer_close();
+    if (!get_filename(arg, RAW_HID_REPORT_SIZE - 2, transfer_filename, sizeof(transfer_filename))) {
+        return RAW_HID_ERR_ARG;
+    }
+
+    lfs_ssize_t size = fstask_get_file_size(transfer_filename);
+    if (size < 0) return RAW_HID_ERR_FS;
+    if (size > RAW_HID_FILE_MAX) return RAW_HID_ERR_ARG;
+
+    // fstask_read_file は NUL 終端の分を残して buffer_size - 1 バイトまで読む
+    transfer_buffer = malloc(size + 1);
+    if (!transfer_buffer) return RAW_HID_ERR_NOMEM;
+    int bytes_read = fstask_read_file(transfer_filename, (char*)transfer_buffer, size + 1);
+    if (bytes_read < 0) {
+        transfer_close();
+        return RAW_HID_ERR_FS;
+    }
+    transfer_size = bytes_read;
+    transfer_state = TRANSFER_READ;
+    put_u32(data, transfer_size);
+    return RAW_HID_OK;
+}
+
+static uint8_t cmd_read_data(const uint8_t* arg, uint8_t* data)
+{
+    if (transfer_state != TRANSFER_READ) return RAW_HID_ERR_STATE;
+
+    uint32_t offset = get_u32(arg);
+    if (offset > transfer_size) return RAW_HID_ERR_ARG;
+    uint32_t len = transfer_size - offset;
+    if (len > RAW_HID_DATA_SIZE - 1) len = RAW_HID_DATA_SIZE - 1;
+    data[0] = (uint8_t)len;
+    memcpy(&data[1], &transfer_buffer[offset], len);
+    return RAW_HID_OK;
+}
+
+static uint8_t cmd_close(void)
+{
+    uint8_t result = RAW_HID_OK;
+    if (transfer_state == TRANSFER_IDLE) return RAW_HID_ERR_STATE;
+    if (transfer_state == TRANSFER_WRITE && transfer_written != transfer_size) {
+        // 足りない分はバッファの中身が不定なので保存しない
+        printf("Raw HID: '%s' not saved (%lu of %lu bytes received)\n", transfer_filename,
+               (unsigned long)transfer_written, (unsigned long)transfer_size);
+        result = RAW_HID_ERR_INCOMPLETE;
+    } else if (transfer_state == TRANSFER_WRITE) {
+        if (fstask_write_file(transfer_filename, transfer_buffer, transfer_size) < 0) {
+            result = RAW_HID_ERR_FS;
+        } else {
+            printf("Raw HID: saved '%s' (%lu bytes)\n", transfer_filename, (unsigned long)transfer_size);
+            lua_cache_schedule(transfer_filename);
+        }
+    }
+    transfer_close();
+    return result;
+}
+
+static void cmd_counters(uint8_t* data)
+{
+    uint32_t counters[RAW_HID_COUNTER_COUNT];
+    memset(counters, 0, sizeof(counters));
+
+    counters[RAW_HID_COUNTER_UPTIME_MS] = board_millis();
+    counters[RAW_HID_COUNTER_RX] = rx_packets;
+    counters[RAW_HID_COUNTER_TX] = tx_packets;
+    counters[RAW_HID_COUNTER_DROPPED] = dropped_packets;
+    counters[RAW_HID_COUNTER_LUA_QUEUE] = fifo_get_count();
+
+    const link_transport_stats_t* up = link_port_stats(LINK_PORT_UP);
+    if (up) {
+        counters[RAW_HID_COUNTER_UP_FRAMES_TX] = up->frames_sent;
+        counters[RAW_HID_COUNTER_UP_FRAMES_RX] = up->frames_received;
+        counters[RAW_HID_COUNTER_UP_ERRORS] = up->errors;
+    }
+    const link_transport_stats_t* down = link_port_stats(LINK_PORT_DOWN);
+    if (down) {
+        counters[RAW_HID_COUNTER_DOWN_FRAMES_TX] = down->frames_sent;
+        counters[RAW_HID_COUNTER_DOWN_FRAMES_RX] = down->frames_received;
+        counters[RAW_HID_COUNTER_DOWN_ERRORS] = down->errors;
+    }
+
+    for (int i = 0; i < RAW_HID_COUNTER_COUNT; i++) {
+        put_u32(&data[i * 4], counters[i]);
+    }
+}
+
+void raw_hid_cmd_task(void)
+{
+    if (!raw_hid_initialized) return;
+
+    raw_hid_packet_t request;
+    // 応答を置く場所がなければ次の呼び出しまで待つ
+    while (!queue_is_full(&tx_queue) && queue_try_remove(&rx_queue, &request)) {
+        const uint8_t* arg = &request.data[2];
+
+        raw_hid_packet_t response;
+        memset(&response, 0, sizeof(response));
+        response.data[0] = request.data[0];
+        response.data[1] = request.data[1];
+        uint8_t* data = &response.data[3];
+        uint8_t result;
+
+        switch (request.data[0]) {
+            case RAW_HID_CMD_VERSION:
+                strncpy((char*)data, VERSION_STRING, RAW_HID_DATA_SIZE - 1);
+                result = RAW_HID_OK;
+                break;
+            case RAW_HID_CMD_RUN:        result = cmd_run(arg); break;
+            case RAW_HID_CMD_WRITE_OPEN: result = cmd_write_open(arg); break;
+            case RAW_HID_CMD_WRITE_DATA: result = cmd_write_data(arg); break;
+            case RAW_HID_CMD_READ_OPEN:  result = cmd_read_open(arg, data); break;
+            case RAW_HID_CMD_READ_DATA:  result = cmd_read_data(arg, data); break;
+            case RAW_HID_CMD_CLOSE:      result = cmd_close(); break;
+            case RAW_HID_CMD_COUNTERS:
+                cmd_counters(data);
+                result = RAW_HID_OK;
+                break;
+            case RAW_HID_CMD_STREAM:
+                stream_enabled = arg[0] != 0;
+                result = RAW_HID_OK;
+                break;
+            default:
+                result = RAW_HID_ERR_UNKNOWN;
+                break;
+        }
+        response.data[2] = result;
+
+        if (!queue_try_add(&tx_queue, &response)) {
+            dropped_packets++;
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef RAWHID_H
+#define RAWHID_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//--------------------------------------------------------------------+
+// ベンダー定義の Raw HID インターフェース（HID インスタンス 3）
+//
+// PC 側ツール用のバイナリコマンド。ドライバ不要で、CDC は人が使うコンソールのまま残る。
+// パケットは 64 バイト固定（Report ID なし）。
+//   OUT : [0]=コマンド [1]=シーケンス番号 [2..63]=引数
+//   IN  : [0]=コマンド [1]=シーケンス番号 [2]=結果 [3..63]=データ
+//   入力ストリーム（RAW_HID_CMD_STREAM で有効化）:
+//         [0]=RAW_HID_EVT_INPUT [1]=種別 [2]=長さ [3..]=データ
+//         N: keyboard_bitmap_t（全キーボードの合成）, M: mouse_report_t,
+//         U: u16 Consumer Usage x USB_CONSUMER_KEYS (0: none) + u8 System Usage, G: parsed_gamepad_report_t
+// 数値はすべてリトルエンディアン。
+//
+// 受信は Core1（tud_task）でキューに積み、コマンドの実行（LittleFS、Lua キュー）は
+// Core0 の raw_hid_cmd_task で行う。送信は Core1 の raw_hid_task がまとめて行う。
+//--------------------------------------------------------------------+
+
+#define RAW_HID_REPORT_SIZE     64
+#define RAW_HID_DATA_SIZE       (RAW_HID_REPORT_SIZE - 3)
+#define RAW_HID_FILE_MAX        32768   // 1回のファイル転送の最大サイズ
+#define RAW_HID_RX_QUEUE_DEPTH  8
+#define RAW_HID_TX_QUEUE_DEPTH  16
+
+// コマンド
+#define RAW_HID_CMD_VERSION     0x01    // -> バージョン文字列
+#define RAW_HID_CMD_RUN         0x02    // 引数: ファイル名 -> Lua のキューに入れる
+#define RAW_HID_CMD_WRITE_OPEN  0x10    // 引数: u32 サイズ, ファイル名
+#define RAW_HID_CMD_WRITE_DATA  0x11    // 引数: u32 オフセット（受け取った所まで）, u8 長さ, データ（最大 57 バイト）
+#define RAW_HID_CMD_READ_OPEN   0x18    // 引数: ファイル名 -> u32 サイズ
+#define RAW_HID_CMD_READ_DATA   0x19    // 引数: u32 オフセット -> u8 長さ, データ（最大 60 バイト）
+#define RAW_HID_CMD_CLOSE       0x1F    // 書き込み中なら（サイズ分を全部受け取っていれば）保存し、転送を終える
+#define RAW_HID_CMD_COUNTERS    0x20    // -> u32 × RAW_HID_COUNTER_COUNT
+#define RAW_HID_CMD_STREAM      0x30    // 引数: u8 0/1 -> 入力ストリームの停止/開始
+#define RAW_HID_EVT_INPUT       0xE0
+
+// 結果
+#define RAW_HID_OK              0x00
+#define RAW_HID_ERR_ARG         0x01
+#define RAW_HID_ERR_BUSY        0x02    // Lua のキューが満杯・同じマクロを実行中
+#define RAW_HID_ERR_FS          0x03
+#define RAW_HID_ERR_NOMEM       0x04
+#define RAW_HID_ERR_STATE       0x05    // 転送を開いていない
+#define RAW_HID_ERR_INCOMPLETE  0x06    // CLOSE: WRITE_OPEN のサイズまで書いていない（保存しない）
+#define RAW_HID_ERR_UNKNOWN     0xFF
+
+// RAW_HID_CMD_COUNTERS の並び
+enum {
+    RAW_HID_COUNTER_UPTIME_MS = 0,
+    RAW_HID_COUNTER_RX,             // 受信パケット
+    RAW_HID_COUNTER_TX,             // 送信パケット
+    RAW_HID_COUNTER_DROPPED,        // キュー満杯で捨てたパケット
+    RAW_HID_COUNTER_LUA_QUEUE,
+    RAW_HID_COUNTER_UP_FRAMES_TX,
+    RAW_HID_COUNTER_UP_FRAMES_RX,
+    RAW_HID_COUNTER_UP_ERRORS,
+    RAW_HID_COUNTER_DOWN_FRAMES_TX,
+    RAW_HID_COUNTER_DOWN_FRAMES_RX,
+    RAW_HID_COUNTER_DOWN_ERRORS,
+    RAW_HID_COUNTER_COUNT
+};
+
+/**
+ * キューを初期化する（multicore_launch_core1 の前に呼ぶ）
+ */
+void raw_hid_init(void);
+
+/**
+ * OUT レポートを受け取る（tud_hid_set_report_cb から呼ぶ、Core1）
+ */
+void raw_hid_receive(const uint8_t* buffer, uint16_t len);
+
+/**
+ * キューに溜まった IN レポートを送る（Core1 のループと送信完了コールバックから呼ぶ）
+ */
+void raw_hid_task(void);
+
+/**
+ * 受信したコマンドを実行する（Core0 のタスクから呼ぶ）
+ */
+void raw_hid_cmd_task(void);
+
+/**
+ * デコード済みの入力をストリームに流す（有効なときだけ、満杯なら捨てる）
+ * @param type フレーム種別（N/M/U/G）
+ * @param data データ（最大 RAW_HID_DATA_SIZE バイト）
+ */
+void raw_hid_stream_input(char type, const void* data, uint8_t len);
+
+#endif // RAWHID_H
@@ -0,0 +1,217 @@
+#include "SofScheduler.h"
+#include <stdio.h>
+#include <string.h>
+#include "tusb.h"
+#include "pico/time.h"
+
+typedef struct {
+    // タイミング（Core1 のみ）
+    int32_t  phase_us;          // SOF から取り出しまでの平均（1/8 の移動平均）
+    int32_t  guard_us;
+    bool     armed;
+    bool     armed_late;        // 取り出し位相を過ぎてから渡した（次のフレームで取り出される）
+    uint32_t armed_us;
+    uint32_t armed_sof;         // 渡したときの SOF の数（UINT32_MAX: SOF なし）
+    uint32_t last_armed_sof;    // 1フレームに1回だけ渡す
+    bool     arrived;           // まだ渡していない入力
+    uint32_t arrival_us;
+    uint32_t arrival_sof;
+    bool     carried;           // 渡したレポートに入っている入力
+    uint32_t carried_us;
+
+    // 統計
+    uint32_t hits;              // 渡したフレームで取り出された
+    uint32_t misses;            // 次のフレーム以降に取り出された（ガード時間を広げた）
+    uint32_t late;              // 取り出し位相を過ぎてから渡した
+    uint32_t unsynced;          // SOF なしで渡した
+    uint32_t picked;
+    uint64_t wait_sum;          // 渡してから取り出しまで
+    uint32_t wait_max;
+    uint32_t latency_count;     // 到着から取り出しまで
+    uint64_t latency_sum;
+    uint32_t latency_max;
+} sof_sched_state_t;
+
+static const char* const ep_names[SOF_SCHED_COUNT] = { "mouse", "gamepad" };
+
+static bool sof_sync = true;
+static sof_sched_state_t states[SOF_SCHED_COUNT];
+static uint32_t sof_us = 0;
+static uint32_t sof_count = 0;
+static uint32_t last_frame = 0;
+
+static void reset_state(sof_sched_state_t* state)
+{
+    memset(state, 0, sizeof(*state));
+    state->guard_us = SOF_SCHED_GUARD_INIT_US;
+    state->last_armed_sof = UINT32_MAX;
+}
+
+void sof_sched_set_enabled(bool enabled)
+{
+    static bool initialized = false;
+    if (!initialized) {
+        for (int i = 0; i < SOF_SCHED_COUNT; i++) reset_state(&states[i]);
+        initialized = true;
+    }
+    sof_sync = enabled;
+    tud_sof_cb_enable(enabled);
+}
+
+bool sof_sched_enabled(void)
+{
+    return sof_sync;
+}
+
+void sof_sched_on_sof(uint32_t frame_count)
+{
+    sof_us = time_us_32();
+    sof_count++;
+    last_frame = frame_count;
+}
+
+// SOF が最近来ているか（来ていなければ同期しない）
+static bool sof_running(void)
+{
+    return sof_count > 0 && time_us_32() - sof_us < 2 * SOF_SCHED_FRAME_US;
+}
+
+bool sof_sched_due(sof_sched_ep_t ep)
+{
+    if (!sof_sync || !sof_running()) return true;
+
+    sof_sched_state_t* state = &states[ep];
+    if (state->last_armed_sof == sof_count) return false;   // 1フレームに1回
+
+    int32_t elapsed = (int32_t)(time_us_32() - sof_us);
+    int32_t offset = state->phase_us - state->guard_us;
+    if (elapsed < offset) return false;
+    if (elapsed <= state->phase_us + state->guard_us) return true;
+
+    // このフレームの IN トークンはもう過ぎているので、次のフレームの送信時刻まで待つ
+    // （前のフレームから待っている入力があれば、取りこぼさないようにすぐ渡す）
+    return !state->arrived || state->arrival_sof != sof_count;
+}
+
+void sof_sched_arrival(sof_sched_ep_t ep)
+{
+    sof_sched_state_t* state = &states[ep];
+    if (state->arrived) return;
+    state->arrived = true;
+    state->arrival_us = time_us_32();
+    state->arrival_sof = sof_count;
+}
+
+void sof_sched_armed(sof_sched_ep_t ep)
+{
+    sof_sched_state_t* state = &states[ep];
+    uint32_t now = time_us_32();
+
+    state->armed = true;
+    state->armed_us = now;
+    state->carried = state->arrived;
+    state->carried_us = state->arrival_us;
+    state->arrived = false;
+
+    if (sof_sync && sof_running()) {
+        state->armed_sof = sof_count;
+        state->last_armed_sof = sof_count;
+        state->armed_late = (int32_t)(now - sof_us) > state->phase_us + state->guard_us;
+    } else {
+        state->armed_sof = UINT32_MAX;
+        state->armed_late = false;
+        state->unsynced++;
+    }
+}
+
+void sof_sched_picked_up(sof_sched_ep_t ep)
+{
+    sof_sched_state_t* state = &states[ep];
+    if (!state->armed) return;
+    state->armed = false;
+
+    uint32_t now = time_us_32();
+    uint32_t wait = now - state->armed_us;
+    state->picked++;
+    state->wait_sum += wait;
+    if (wait > state->wait_max) state->wait_max = wait;
+
+    if (state->carried) {
+        uint32_t latency = now - state->carried_us;
+        state->latency_count++;
+        state->latency_sum += latency;
+        if (latency > state->latency_max) state->latency_max = latency;
+        state->carried = false;
+    }
+
+    if (state->armed_sof == UINT32_MAX || !sof_running()) return;
+
+    // 取り出しは必ず直前の SOF のあとなので、位相のサンプルになる
+    int32_t phase = (int32_t)(now - sof_us);
+    if (phase < SOF_SCHED_FRAME_US) {
+        state->phase_us += (phase - state->phase_us) / 8;
+    }
+
+    if (state->armed_late) {
+        state->late++;
+    } else if (sof_count != state->armed_sof) {
+        // IN トークンが送信時刻より前に来ていた
+        state->misses++;
+        state->guard_us += SOF_SCHED_GUARD_STEP_US;
+        if (state->guard_us > SOF_SCHED_GUARD_MAX_US) state->guard_us = SOF_SCHED_GUARD_MAX_US;
+    } else {
+        state->hits++;
+        if (state->guard_us > SOF_SCHED_GUARD_MIN_US) state->guard_us--;
+    }
+}
+
+void sof_sched_reset(void)
+{
+    for (int i = 0; i < SOF_SCHED_COUNT; i++) {
+        sof_sched_state_t* state = &states[i];
+        state->hits = 0;
+        state->misses = 0;
+        state->late = 0;
+        state->unsynced = 0;
+        state->picked = 0;
+        state->wait_sum = 0;
+        state->wait_max = 0;
+        state->latency_count = 0;
+        state->latency_sum = 0;
+        state->latency_max = 0;
+    }
+}
+
+void sof_sched_print(void)
+{
+    char line[160];
+
+    snprintf(line, sizeof(line), "SOF sync: %s, %s (frame %lu, %lu SOFs)\r\n",
+             sof_sync ? "ON" : "OFF", sof_running() ? "running" : "no SOF",
+             (unsigned long)last_frame, (unsigned long)sof_count);
+    tud_cdc_write_str(line);
+
+    for (int i = 0; i < SOF_SCHED_COUNT; i++) {
+        const sof_sched_state_t* state = &states[i];
+        snprintf(line, sizeof(line),
+                 "  %-7s: phase %ld us, guard %ld us, hit %lu, miss %lu, late %lu, unsynced %lu\r\n",
+                 ep_names[i], (long)state->phase_us, (long)state->guard_us,
+                 (unsigned long)state->hits, (unsigned long)state->misses,
+                 (unsigned long)state->late, (unsigned long)state->unsynced);
+        tud_cdc_write_str(line);
+        if (state->picked > 0) {
+            snprintf(line, sizeof(line), "           armed to pickup: n=%lu avg=%lu max=%lu us\r\n",
+                     (unsigned long)state->picked, (unsigned long)(state->wait_sum / state->picked),
+                     (unsigned long)state->wait_max);
+            tud_cdc_write_str(line);
+        }
+        if (state->latency_count > 0) {
+            snprintf(line, sizeof(line), "           input to pickup: n=%lu avg=%lu max=%lu us\r\n",
+                     (unsigned long)state->latency_count,
+                     (unsigned long)(state->latency_sum / state->latency_count),
+                     (unsigned long)state->latency_max);
+            tud_cdc_write_str(line);
+        }
+    }
+    tud_cdc_write_flush();
+}
@@ -0,0 +1,76 @@
+#ifndef SOFSCHEDULER_H
+#define SOFSCHEDULER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//--------------------------------------------------------------------+
+// SOF に同期したレポート送信のタイミング
+//
+// マウスとゲームパッドは最新の状態をまとめて持っておき、PC の IN トークンの
+// 直前にエンドポイントへ渡す（渡したあとに届いた入力は次のフレームまで待たずに済む）。
+//
+// IN トークンの位置は直接見えないので、送信完了（tud_hid_report_complete_cb）の
+// 時刻と直前の SOF の時刻の差を「取り出し位相」として平均する。送信は
+// SOF + 取り出し位相 - ガード時間 で行う。取り出し位相 + ガード時間を過ぎてから届いた入力は
+// 次のフレームの送信時刻まで待ってまとめる（前のフレームから待っている入力はすぐ渡す）。
+// 渡したフレームで取り出されなかった（間に SOF が入った）場合はガード時間を広げ、
+// 取り出された場合は少しずつ縮めて、渡してから取り出されるまでの時間を短く保つ。
+// SOF が来ていない（サスペンド中など）ときはすぐに渡す。
+//
+// 時刻はどちらも tud_task の中で取るので、tud_task の遅れは両方に同じように乗る。
+//--------------------------------------------------------------------+
+
+#define SOF_SCHED_FRAME_US      1000    // フルスピードの1フレーム
+#define SOF_SCHED_GUARD_MIN_US  50
+#define SOF_SCHED_GUARD_MAX_US  800
+#define SOF_SCHED_GUARD_INIT_US 200
+#define SOF_SCHED_GUARD_STEP_US 100     // 取りこぼしたときに広げる幅
+
+// 対象のエンドポイント
+typedef enum {
+    SOF_SCHED_MOUSE = 0,
+    SOF_SCHED_GAMEPAD,
+    SOF_SCHED_COUNT
+} sof_sched_ep_t;
+
+/**
+ * SOF 同期の有効/無効（config の SOF_SYNC=ON/OFF、既定は ON）
+ * tud_sof_cb を有効にするので、tusb_init の後に呼ぶ
+ */
+void sof_sched_set_enabled(bool enabled);
+bool sof_sched_enabled(void);
+
+/**
+ * SOF を受け取った（tud_sof_cb から呼ぶ、Core1）
+ */
+void sof_sched_on_sof(uint32_t frame_count);
+
+/**
+ * いまエンドポイントに渡すべきか
+ * @return true: このフレームの送信時刻になった（または SOF が来ていない）
+ */
+bool sof_sched_due(sof_sched_ep_t ep);
+
+/**
+ * まとめ待ちの入力が届いた（次に渡すまでの最初の1回を到着時刻として記録する）
+ */
+void sof_sched_arrival(sof_sched_ep_t ep);
+
+/**
+ * エンドポイントに渡した（tud_hid_n_report が成功した直後に呼ぶ）
+ */
+void sof_sched_armed(sof_sched_ep_t ep);
+
+/**
+ * PC に取り出された（tud_hid_report_complete_cb から呼ぶ）
+ */
+void sof_sched_picked_up(sof_sched_ep_t ep);
+
+/**
+ * 位相・ガード時間・遅延を CDC に表示する / 統計をクリアする
+ */
+void sof_sched_print(void);
+void sof_sched_reset(void);
+
+#endif // SOFSCHEDULER_H
@@ -1,11 +1,15 @@
 #include "UARTtask.h"
 #include "USBtask.h"
+#include "USBDeviceTask.h"
 #include "MouseReportParser.h"
 #include "LuaTask.h"
+#include "LinkMux.h"
+#include "InputEvents.h"
+
+#include <ctype.h>
+#include <stdlib.h>
 
 // Static variables for UART task
-static uint8_t uart_buffer[UART_BUFFER_SIZE];
-static uint16_t uart_buffer_index = 0;
 static bool uart_initialized = false;
 
 // Initialize UART1 for communication
@@ -39,201 +43,187 @@ void uart_task(void)
         return;
     }
     
-    // Process any received UART data
-    uart_process_received_data();
+    // Receive, route and forward link frames, then push queued lines to each port
+    link_task();
 }
 
-// Process received UART data
-void uart_process_received_data(void)
+//--------------------------------------------------------------------+
+// UART1 port for the link layer (upstream side)
+//--------------------------------------------------------------------+
+
+static bool uart_link_is_writable(void)
 {
-    // Check if data is available on UART1
-    while (uart_is_readable(UART_ID))
-    {
-        uint8_t received_char = uart_getc(UART_ID);
-        /* if(tud_cdc_connected())
-        {
-            char buffer[256];
-            snprintf(buffer, sizeof(buffer), "%c", received_char);
-            buffer[2] = '\0';
-            tud_cdc_write_str(buffer);
-            tud_cdc_write_flush();
-        } */
+    return uart_is_writable(UART_ID);
+}
 
-        // Add character to buffer
-        if (uart_buffer_index < UART_BUFFER_SIZE - 1) {
-            uart_buffer[uart_buffer_index] = received_char;
-            uart_buffer_index++;
-            
-            // Check for complete message (newline or carriage return)
-            if (received_char == '\n' || received_char == '\r' || received_char == '\0') {
-                // Null-terminate the message
-                uart_buffer[uart_buffer_index - 1] = '\0';
-                
-                // Process the complete message if it's not empty
-                if (uart_buffer_index > 1) {
-                    uint8_t* base64_data_input = uart_buffer[15];
-                    uint8_t decoded_data[8];
-                    int decoded_length = base64_decode((char*)&(uart_buffer[2]), uart_buffer_index-3, decoded_data, sizeof(decoded_data));
+static void uart_link_putc(char c)
+{
+    uart_putc_raw(UART_ID, c);
+}
 
-                    /*
-                    if(tud_cdc_connected())
-                    {
-                        char buffer[256];
-                        snprintf(buffer, sizeof(buffer), "UART: received HID report: %s %d %d\r\n", uart_buffer, uart_buffer_index, decoded_length);
-                        tud_cdc_write_str(buffer);
-                        
-                        for(int i = 0; i < decoded_length; i++) {
-                            snprintf(buffer, sizeof(buffer), " %02X", decoded_data[i]);
-                            tud_cdc_write_str(buffer);
-                        }
-                        tud_cdc_write_str("\r\n");
-                        tud_cdc_write_flush();
-                    }
-                    */
+static bool uart_link_is_readable(void)
+{
+    return uart_is_readable(UART_ID);
+}
 
-                    // Check if this is a keyboard message starting with "K"
-                    if (uart_buffer[0] == '0')
-                    {
-                        hid_keyboard_report_t keyboard_report;
-                        uint8_t nokey[13] = "AAAAAAAAAAA=";
-                        /* if (uart_parse_keyboard_message((char*)&(uart_buffer[2]), &keyboard_report))
-                        {
-                            tud_cdc_write_str("UART: reset all key\n");
-                            tud_hid_n_keyboard_report(0, 1, keyboard_report.modifier, keyboard_report.keycode);
-                        } */
-                    }
-                    int dev_id = uart_buffer[1] - '0';
-                    /* if(tud_cdc_connected())
-                    {
-                        char buffer[256];
-                        snprintf(buffer, sizeof(buffer), "UART: dev_id=%d, device_id=%d, buffer=%s\r\n", dev_id, device_id, uart_buffer);
-                        tud_cdc_write_str(buffer);
-                        tud_cdc_write_flush();
-                    } */
-                    
-                    // DeviceID check: process if device_id is 0xFF (accept all) or matches the received dev_id or dev_id is 0
-                    if (device_id != 0xFF && dev_id != device_id && dev_id != 0) {
-                        // Not for this device ID and not in accept-all mode
-                        uart_buffer_index = 0;
-                        continue;
-                    }
+static char uart_link_getc(void)
+{
+    return uart_getc(UART_ID);
+}
 
-                    // Check if this is a keyboard message starting with "K"
-                    if (uart_buffer[0] == 'K')
-                    {
-                        /* if(tud_cdc_connected())
-                        {
-                            tud_cdc_write_str("UART: received keyboard report\n");
-                            tud_cdc_write_flush();
-                        } */
+static link_stream_t uart_stream = {
+    .is_writable = uart_link_is_writable,
+    .putc = uart_link_putc,
+    .is_readable = uart_link_is_readable,
+    .getc = uart_link_getc,
+};
 
-                        hid_keyboard_report_t keyboard_report;
-                        
-                        // Use the already decoded data directly
-                        if (decoded_length == 8) {
-                            keyboard_report.modifier = decoded_data[0];
-                            keyboard_report.reserved = decoded_data[1];
-                            for (int i = 0; i < 6; i++) {
-                                keyboard_report.keycode[i] = decoded_data[2 + i];
-                            }
-                             // Send keyboard report to host
-                            tud_hid_n_keyboard_report(0, 1, keyboard_report.modifier, keyboard_report.keycode);
-                            /* printf("UART: Keyboard report sent to host\n");
-                            if(tud_cdc_connected())
-                            {
-                                char buffer[256];
-                                snprintf(buffer, sizeof(buffer), "UART: Keyboard report sent - mod:0x%02X keys:", keyboard_report.modifier);
-                                tud_cdc_write_str(buffer);
-                                for(int i = 0; i < 6; i++) {
-                                    snprintf(buffer, sizeof(buffer), " 0x%02X", keyboard_report.keycode[i]);
-                                    tud_cdc_write_str(buffer);
-                                }
-                                tud_cdc_write_str("\r\n");
-                                tud_cdc_write_flush();
-                            } */
-                            setLEDStateActive();
-                        } else {
-                            /* printf("UART: Invalid keyboard data length: %d\n", decoded_length);
-                            if(tud_cdc_connected())
-                            {
-                                char buffer[256];
-                                snprintf(buffer, sizeof(buffer), "UART: Invalid keyboard data length: %d\r\n", decoded_length);
-                                tud_cdc_write_str(buffer);
-                                tud_cdc_write_flush();
-                            } */
-                        }
-                    }
+static bool uart_link_can_send(void)
+{
+    return link_stream_can_send(&uart_stream);
+}
 
-                    // Check if this is a mouse message starting with "M"
-                    if (uart_buffer[0] == 'M')
-                    {
-                        mouse_report_t mouse_report;
-                        if (uart_parse_mouse_message((char*)&(uart_buffer[2]), &mouse_report)) {
-                            // Send mouse report to host
-                            tud_hid_n_mouse_report(1, 2, mouse_report.buttons,
-                                mouse_report.x, mouse_report.y,
-                                mouse_report.wheel, mouse_report.pan);
-                            /* printf("UART: Mouse report sent to host\n");
-                            tud_cdc_write_str("UART: Mouse report sent to host\n");
-                            tud_cdc_write_flush(); */
-                            setLEDStateActive();
+static bool uart_link_send_frame(const char* frame, size_t len)
+{
+    return link_stream_send(&uart_stream, frame, len);
+}
 
-                        } else {
-                            printf("UART: Failed to parse mouse message: %s\n", uart_buffer);
-                            tud_cdc_write_str("UART: Failed to parse mouse message\n");
-                            tud_cdc_write_flush();
+static size_t uart_link_poll_frame(char* frame, size_t size)
+{
+    return link_stream_poll(&uart_stream, frame, size);
+}
 
-                        }
-                    }
+const link_transport_t uart_link_transport = {
+    .name = "uart1",
+    .can_send = uart_link_can_send,
+    .send_frame = uart_link_send_frame,
+    .poll_frame = uart_link_poll_frame,
+    .stats = &uart_stream.stats,
+};
 
-                    // Check if this is a gamepad message starting with "G"
-                    if (uart_buffer[0] == 'G')
-                    {
-                        parsed_gamepad_report_t gamepad_report;
-                        if (uart_parse_gamepad_message((char*)&(uart_buffer[2]), &gamepad_report)) {
-                            // Update global gamepad state
-                            current_gamepad_state = gamepad_report;
-                            gamepad_state_updated = true;
-                            has_gamepad_key = true;
-                            
-                            /* printf("UART: Gamepad report received - X:%d Y:%d Z:%d RZ:%d Hat:%u Buttons:0x%04X\n",
-                                   gamepad_report.x, gamepad_report.y, gamepad_report.z, gamepad_report.rz,
-                                   gamepad_report.hat, gamepad_report.buttons); */
-                            setLEDStateActive();
+// Process a frame addressed to this node ("<type><dst:2 hex><payload>", no newline)
+void uart_process_frame(const char* line)
+{
+    if (!line || strlen(line) < 3) return;
 
-                        } else {
-                            printf("UART: Failed to parse gamepad message: %s\n", uart_buffer);
-                            tud_cdc_write_str("UART: Failed to parse gamepad message\n");
-                            tud_cdc_write_flush();
-                        }
-                    }
+    const char* payload = &line[3];
 
-                    // Check if this is a control message starting with "C"
-                    if (uart_buffer[0] == 'C')
-                    {
-                        if (strncmp((char*)uart_buffer, "C10", 3) == 0) {
-                            // Set USB_output_switch to 1 (UART mode)
-                            USB_output_switch = 1;
-                            printf("UART: Received C10, USB_output_switch set to 1 (UART mode)\n");
-                        } else if (strncmp((char*)uart_buffer, "C11", 3) == 0) {
-                            // Set USB_output_switch to 0 (USB mode)  
-                            USB_output_switch = 0;
-                            printf("UART: Received C11, USB_output_switch set to 0 (USB mode)\n");
-                        }
-                    }
+    // All keys released: nothing to do, the next K frame carries the new state
+    if (line[0] == '0') {
+        return;
+    }
 
+    // Check if this is a keyboard message starting with "K"
+    if (line[0] == 'K')
+    {
+        hid_keyboard_report_t keyboard_report;
+        if (uart_parse_keyboard_message(payload, &keyboard_report)) {
+            keyboard_bitmap_t keyboard_state;
+            keyboard_bitmap_from_keys(&keyboard_state, keyboard_report.modifier, keyboard_report.keycode);
+            input_events_link_keyboard(&keyboard_state); // Key presses for Lua wait_key() / wait_any()
+            usb_device_wake_keyboard(&keyboard_state);
+            // Send keyboard report to host
+            usb_device_keyboard_report(keyboard_report.modifier, keyboard_report.keycode);
+            setLEDStateActive();
+        }
+        return;
+    }
 
+    // Check if this is an NKRO keyboard message starting with "N"
+    if (line[0] == 'N')
+    {
+        keyboard_bitmap_t keyboard_state;
+        if (base64_decode(payload, strlen(payload), (uint8_t*)&keyboard_state, sizeof(keyboard_state)) == sizeof(keyboard_state)) {
+            input_events_link_keyboard(&keyboard_state);
+            usb_device_wake_keyboard(&keyboard_state);
+            usb_device_keyboard_bitmap_report(&keyboard_state);
+            setLEDStateActive();
+        } else {
+            printf("UART: Failed to parse NKRO keyboard message: %s\n", line);
+        }
+        return;
+    }
 
-                }
-                
-                // Reset buffer for next message
-                uart_buffer_index = 0;
+    // Check if this is a media / system key message starting with "U"
+    if (line[0] == 'U')
+    {
+        // Consumer の Usage を USB_CONSUMER_KEYS 個 + System（3バイトなら以前の1個だけの形式）
+        uint8_t data[USB_CONSUMER_KEYS * 2 + 1];
+        int len = base64_decode(payload, strlen(payload), data, sizeof(data));
+        if (len == sizeof(data) || len == 3) {
+            uint16_t consumer[USB_CONSUMER_KEYS] = { 0 };
+            int keys = (len - 1) / 2;
+            for (int i = 0; i < keys; i++) {
+                consumer[i] = data[i * 2] | (data[i * 2 + 1] << 8);
             }
+            usb_device_wake_control(consumer, data[len - 1]);
+            usb_device_control_report(consumer, data[len - 1]);
+            setLEDStateActive();
+        } else {
+            printf("UART: Failed to parse media key message: %s\n", line);
+        }
+        return;
+    }
+
+    // Check if this is a mouse message starting with "M"
+    if (line[0] == 'M')
+    {
+        mouse_report_t mouse_report;
+        if (uart_parse_mouse_message(payload, &mouse_report)) {
+            usb_device_wake_mouse(&mouse_report);
+            // Send mouse report to host
+            usb_device_mouse_report(&mouse_report);
+            setLEDStateActive();
+        } else {
+            printf("UART: Failed to parse mouse message: %s\n", line);
+            tud_cdc_write_str("UART: Failed to parse mouse message\n");
+            tud_cdc_write_flush();
+        }
+        return;
+    }
+
+    // Check if this is an absolute pointer (warp) message starting with "A"
+    if (line[0] == 'A')
+    {
+        uint8_t data[4];
+        if (base64_decode(payload, strlen(payload), data, sizeof(data)) == sizeof(data)) {
+            usb_device_pointer_warp(data[0] | (data[1] << 8), data[2] | (data[3] << 8));
+            setLEDStateActive();
+        } else {
+            printf("UART: Failed to parse pointer message: %s\n", line);
+        }
+        return;
+    }
+
+    // Check if this is a gamepad message starting with "G"
+    if (line[0] == 'G')
+    {
+        parsed_gamepad_report_t gamepad_report;
+        if (uart_parse_gamepad_message(payload, &gamepad_report)) {
+            input_events_link_gamepad(&gamepad_report); // Buttons and axes for Lua wait_button() / wait_axis_change()
+            // Update global gamepad state
+            current_gamepad_state = gamepad_report;
+            gamepad_state_updated = true;
+            has_gamepad_key = true;
+            setLEDStateActive();
         } else {
-            // Buffer overflow - reset buffer
-            printf("UART buffer overflow, resetting\n");
-            uart_buffer_index = 0;
+            printf("UART: Failed to parse gamepad message: %s\n", line);
+            tud_cdc_write_str("UART: Failed to parse gamepad message\n");
+            tud_cdc_write_flush();
         }
+        return;
+    }
+
+    // Check if this is a control message starting with "C"
+    if (line[0] == 'C')
+    {
+        // "S<value:2 hex>": set USB_output_switch (0 = local USB, otherwise target node)
+        if (payload[0] == 'S' && isxdigit((unsigned char)payload[1]) && isxdigit((unsigned char)payload[2])) {
+            char hex[3] = { payload[1], payload[2], '\0' };
+            USB_output_switch = (int)strtol(hex, NULL, 16);
+            printf("UART: Received switch command, USB_output_switch set to %d\n", USB_output_switch);
+        }
+        return;
     }
 }
 
@@ -12,6 +12,7 @@
 #include "base64.h"
 #include "MouseReportParser.h"
 #include "GamepadReportParser.h"
+#include "LinkMux.h"
 
 // UART configuration
 #define UART_ID uart1
@@ -44,9 +45,12 @@ typedef struct {
 // Function declarations
 void uart_task_init(void);
 void uart_task(void);
-void uart_process_received_data(void);
+void uart_process_frame(const char* line);
 bool uart_parse_mouse_message(const char* message, mouse_report_t* mouse_report);
 bool uart_parse_keyboard_message(const char* message, hid_keyboard_report_t* keyboard_report);
 bool uart_parse_gamepad_message(const char* message, parsed_gamepad_report_t* gamepad_report);
 
+// UART1 port for the link layer (LINK_PORT_UP)
+extern const link_transport_t uart_link_transport;
+
 #endif // UARTTASK_H
\ No newline at end of file
@@ -2,13 +2,680 @@
 #include "GamepadReportParser.h"
 #include "LuaTask.h"  // For Lua gamepad control functions
 #include "USBHostTask.h"  // For send_keyboard_led_state function
+#include "RawHID.h"      // For raw HID command packets
+#include "PioUsbDevice.h" // For the second device port
+#include "SofScheduler.h" // For SOF-synchronised mouse / gamepad reports
+#include "LinkLatency.h"  // For link latency samples taken when a report is submitted
 #include <stdlib.h>
 #include <string.h>
 
+#include "pico/critical_section.h"
+
 // External variables that need to be accessed from USBDeviceTask.c
 extern bool has_gamepad_key;
 extern uint8_t hid_protocol[3];
 
+// Mouse output state (shared between Core0 Lua and Core1, guarded by mouse_lock)
+// wheel/pan are kept in 1/MOUSE_WHEEL_UNITS detents so that detent and
+// high-resolution sources can be mixed and sent in whatever the host negotiated
+typedef struct {
+    uint16_t buttons;
+    int32_t x;
+    int32_t y;
+    int32_t wheel;
+    int32_t pan;
+    // virtual cursor (absolute position * screen size, integrated from relative motion)
+    int32_t cursor_x;
+    int32_t cursor_y;
+} mouse_state_t;
+
+static critical_section_t mouse_lock;
+static mouse_state_t mouse_pending;         // motion not yet sent
+static bool mouse_in_flight = false;        // the rest is sent from tud_hid_report_complete_cb
+static volatile uint8_t mouse_resolution = 0;   // Resolution Multiplier feature (bit0-1: wheel, bit2-3: pan)
+static bool pointer_absolute = false;       // send relative motion as absolute reports
+static bool pointer_warp_pending = false;   // absolute report to send on the next completion
+static int32_t pointer_width = POINTER_DEFAULT_WIDTH;
+static int32_t pointer_height = POINTER_DEFAULT_HEIGHT;
+
+// Keyboard output state
+static critical_section_t keyboard_lock;
+static bool keyboard_nkro = true;
+static uint8_t keyboard_sent_keys[6];       // last 6KRO keycodes (keeps held keys stable on fallback)
+
+// Consumer / System Control reports waiting for the keyboard endpoint
+#define CONTROL_QUEUE_SIZE  8
+typedef struct {
+    uint8_t report_id;      // 6: Consumer, 7: System
+    uint16_t usages[USB_CONSUMER_KEYS];     // System は usages[0] だけ
+} control_report_t;
+static control_report_t control_queue[CONTROL_QUEUE_SIZE];
+static uint8_t control_head = 0;
+static uint8_t control_count = 0;
+static uint16_t control_consumer[USB_CONSUMER_KEYS];    // last queued state
+static uint8_t control_system = 0;
+
+// Last state sent to USB1, answered on GET_REPORT (hosts poll it on resume)
+static keyboard_bitmap_t keyboard_snapshot;     // guarded by keyboard_lock
+static hid_standard_gamepad_report_t gamepad_snapshot;  // Core1 only
+
+// Remote wakeup: only a real input edge while the bus is suspended wakes the PC
+static uint8_t wake_sources = USB_WAKE_ALL;
+static uint16_t wake_motion = USB_WAKE_MOTION_DEFAULT;
+static volatile uint8_t wake_pending = 0;       // USB_WAKE_* that fired since the last hid_task
+static keyboard_bitmap_t wake_keyboard;         // previous input, to find newly pressed keys
+static uint16_t wake_consumer[USB_CONSUMER_KEYS];
+static uint8_t wake_system = 0;
+static uint16_t wake_buttons = 0;
+static int32_t wake_motion_sum = 0;
+static uint32_t wake_motion_ms = 0;
+static parsed_gamepad_report_t wake_gamepad;
+
+// USB_output_switch で PIO-USB の2つ目のデバイスポートが選ばれているか
+static bool output_device2(void)
+{
+    return USB_output_switch == USB_OUTPUT_DEVICE2 && pio_usb_device2_enabled();
+}
+
+bool usb_device_ready(uint8_t instance)
+{
+    if (output_device2()) return pio_usb_device2_ready(instance);
+    return tud_connected() && tud_hid_n_ready(instance);
+}
+
+void usb_device_task_init(void)
+{
+    mouse_pending.cursor_x = (POINTER_ABS_MAX / 2) * pointer_width;
+    mouse_pending.cursor_y = (POINTER_ABS_MAX / 2) * pointer_height;
+    critical_section_init(&mouse_lock);
+    critical_section_init(&keyboard_lock);
+    sof_sched_set_enabled(true);
+}
+
+//--------------------------------------------------------------------+
+// Keyboard
+//--------------------------------------------------------------------+
+
+void usb_device_set_nkro(bool enabled)
+{
+    keyboard_nkro = enabled;
+}
+
+void keyboard_bitmap_set(keyboard_bitmap_t* state, uint8_t keycode, bool pressed)
+{
+    if (keycode >= HID_KEY_CONTROL_LEFT && keycode <= HID_KEY_GUI_RIGHT) {
+        uint8_t bit = 1 << (keycode - HID_KEY_CONTROL_LEFT);
+        state->modifier = pressed ? (state->modifier | bit) : (state->modifier & ~bit);
+    } else if (keycode >= HID_KEY_A && keycode < KEYBOARD_NKRO_USAGES) {
+        // 0x01-0x03 are error codes, not keys
+        uint8_t bit = 1 << (keycode & 7);
+        if (pressed) state->keys[keycode >> 3] |= bit;
+        else state->keys[keycode >> 3] &= ~bit;
+    }
+}
+
+void keyboard_bitmap_from_keys(keyboard_bitmap_t* state, uint8_t modifier, const uint8_t keycode[6])
+{
+    memset(state, 0, sizeof(*state));
+    state->modifier = modifier;
+    for (int i = 0; i < 6; i++) {
+        keyboard_bitmap_set(state, keycode[i], true);
+    }
+}
+
+bool keyboard_bitmap_test(const keyboard_bitmap_t* state, uint8_t keycode)
+{
+    return keycode < KEYBOARD_NKRO_USAGES && (state->keys[keycode >> 3] & (1 << (keycode & 7)));
+}
+
+uint8_t keyboard_bitmap_to_keys(const keyboard_bitmap_t* state, const uint8_t prev[6], uint8_t keycode[6])
+{
+    uint8_t count = 0;
+    uint8_t total = 0;
+
+    memset(keycode, 0, 6);
+
+    // Keys that are still held keep their slots
+    if (prev) {
+        for (int i = 0; i < 6; i++) {
+            if (prev[i] != HID_KEY_NONE && keyboard_bitmap_test(state, prev[i])) {
+                keycode[count++] = prev[i];
+            }
+        }
+    }
+
+    for (uint16_t usage = HID_KEY_A; usage < KEYBOARD_NKRO_USAGES; usage++) {
+        if (!keyboard_bitmap_test(state, (uint8_t)usage)) continue;
+        total++;
+        if (count >= 6 || memchr(keycode, usage, count) != NULL) continue;
+        keycode[count++] = (uint8_t)usage;
+    }
+    return total;
+}
+
+// Send 6KRO keycodes: Report ID 1 in report protocol, no ID in boot protocol
+static bool send_keyboard_keys(uint8_t modifier, const uint8_t keycode[6])
+{
+    uint8_t report_id = tud_hid_n_get_protocol(0) == HID_PROTOCOL_BOOT ? 0 : 1;
+    if (!tud_hid_n_keyboard_report(0, report_id, modifier, keycode)) return false;
+    memcpy(keyboard_sent_keys, keycode, 6);
+    return true;
+}
+
+static bool keyboard_use_nkro(void)
+{
+    return keyboard_nkro && tud_hid_n_get_protocol(0) == HID_PROTOCOL_REPORT;
+}
+
+bool usb_device_keyboard_report(uint8_t modifier, const uint8_t keycode[6])
+{
+    bool result;
+
+    if (output_device2()) {
+        keyboard_bitmap_t state;
+        keyboard_bitmap_from_keys(&state, modifier, keycode);
+        return pio_usb_device2_keyboard_report(&state);
+    }
+
+    critical_section_enter_blocking(&keyboard_lock);
+    if (keyboard_use_nkro()) {
+        keyboard_bitmap_t state;
+        keyboard_bitmap_from_keys(&state, modifier, keycode);
+        result = tud_hid_n_report(0, 4, &state, sizeof(state));
+    } else {
+        result = send_keyboard_keys(modifier, keycode);
+    }
+    if (result) keyboard_bitmap_from_keys(&keyboard_snapshot, modifier, keycode);
+    critical_section_exit(&keyboard_lock);
+
+    return result;
+}
+
+bool usb_device_keyboard_bitmap_report(const keyboard_bitmap_t* state)
+{
+    bool result;
+
+    if (output_device2()) return pio_usb_device2_keyboard_report(state);
+
+    critical_section_enter_blocking(&keyboard_lock);
+    if (keyboard_use_nkro()) {
+        result = tud_hid_n_report(0, 4, state, sizeof(*state));
+    } else {
+        uint8_t keycode[6];
+        keyboard_bitmap_to_keys(state, keyboard_sent_keys, keycode);
+        result = send_keyboard_keys(state->modifier, keycode);
+    }
+    if (result) keyboard_snapshot = *state;
+    critical_section_exit(&keyboard_lock);
+
+    return result;
+}
+
+// Send the oldest queued control report if the keyboard endpoint is free (keyboard_lock held)
+static void send_control_queue(void)
+{
+    if (control_count == 0 || !tud_hid_n_ready(0)) return;
+
+    const control_report_t* control = &control_queue[control_head];
+    bool sent;
+    if (control->report_id == 6) {
+        sent = tud_hid_n_report(0, 6, control->usages, sizeof(control->usages));
+    } else {
+        // System Control は Logical 1-3 = Usage 0x81-0x83
+        uint8_t value = control->usages[0] ? (uint8_t)(control->usages[0] - 0x80) : 0;
+        sent = tud_hid_n_report(0, 7, &value, sizeof(value));
+    }
+    if (sent) {
+        control_head = (control_head + 1) % CONTROL_QUEUE_SIZE;
+        control_count--;
+    }
+}
+
+static bool queue_control_report(uint8_t report_id, const uint16_t* usages, uint8_t count)
+{
+    if (control_count >= CONTROL_QUEUE_SIZE) return false;
+    control_report_t* control = &control_queue[(control_head + control_count) % CONTROL_QUEUE_SIZE];
+    control->report_id = report_id;
+    memset(control->usages, 0, sizeof(control->usages));
+    memcpy(control->usages, usages, count * sizeof(usages[0]));
+    control_count++;
+    return true;
+}
+
+bool usb_device_control_report(const uint16_t* consumer, uint8_t system)
+{
+    bool result = true;
+
+    if (output_device2() || tud_hid_n_get_protocol(0) == HID_PROTOCOL_BOOT) return false;
+
+    critical_section_enter_blocking(&keyboard_lock);
+    if (memcmp(consumer, control_consumer, sizeof(control_consumer)) != 0) {
+        if (queue_control_report(6, consumer, USB_CONSUMER_KEYS)) {
+            memcpy(control_consumer, consumer, sizeof(control_consumer));
+        } else {
+            result = false;
+        }
+    }
+    if (system != control_system) {
+        uint16_t usage = system;
+        if (queue_control_report(7, &usage, 1)) control_system = system;
+        else result = false;
+    }
+    send_control_queue();
+    critical_section_exit(&keyboard_lock);
+
+    return result;
+}
+
+//--------------------------------------------------------------------+
+// Mouse
+//--------------------------------------------------------------------+
+
+static int32_t clamp_axis(int32_t value, int32_t limit)
+{
+    if (value > limit) return limit;
+    if (value < -limit) return -limit;
+    return value;
+}
+
+// wheel/pan units per report count
+static int32_t scroll_step(bool hires)
+{
+    return hires ? MOUSE_WHEEL_UNITS / MOUSE_WHEEL_MULTIPLIER : MOUSE_WHEEL_UNITS;
+}
+
+// Report counts to send for an accumulated scroll amount
+static int32_t scroll_counts(int32_t amount, bool hires)
+{
+    int32_t counts = amount / scroll_step(hires);
+    if (hires) {
+        // 1ノッチ分を一度に送らず半分ずつ送って滑らかにする（残りは次のレポートで送る）
+        if (counts > 1) counts = (counts + 1) / 2;
+        else if (counts < -1) counts = (counts - 1) / 2;
+    }
+    return clamp_axis(counts, 127);
+}
+
+// A mouse / gamepad report went to the endpoint: SOF phase tracking and the link latency sample
+static void report_armed(sof_sched_ep_t ep)
+{
+    sof_sched_armed(ep);
+    link_latency_submitted(ep == SOF_SCHED_MOUSE ? 'M' : 'G');
+}
+
+static bool mouse_has_pending(const mouse_state_t* state)
+{
+    bool boot = tud_hid_n_get_protocol(1) == HID_PROTOCOL_BOOT;
+    if (pointer_absolute && !boot) {
+        // the absolute report has no pan and scrolls in detents
+        return state->x != 0 || state->y != 0 || scroll_counts(state->wheel, false) != 0;
+    }
+    bool wheel_hires = !boot && (mouse_resolution & 0x03);
+    bool pan_hires = !boot && (mouse_resolution & 0x0C);
+
+    return state->x != 0 || state->y != 0 ||
+           scroll_counts(state->wheel, wheel_hires) != 0 ||
+           scroll_counts(state->pan, pan_hires) != 0;
+}
+
+// Move the virtual cursor by delta pixels on a screen of the given size
+static int32_t cursor_move(int32_t cursor, int32_t delta, int32_t size)
+{
+    int64_t value = (int64_t)cursor + (int64_t)delta * POINTER_ABS_MAX;
+    int64_t limit = (int64_t)POINTER_ABS_MAX * size;
+    if (value < 0) return 0;
+    if (value > limit) return (int32_t)limit;
+    return (int32_t)value;
+}
+
+// Send the virtual cursor position as an absolute pointer report
+static bool send_pointer_report(mouse_state_t* state)
+{
+    int32_t wheel = scroll_counts(state->wheel, false);
+    hid_abs_pointer_report_t pointer_report = {
+        .buttons = (uint8_t)state->buttons,
+        .x = (uint16_t)(state->cursor_x / pointer_width),
+        .y = (uint16_t)(state->cursor_y / pointer_height),
+        .wheel = (int8_t)wheel
+    };
+    if (!tud_hid_n_report(1, 5, &pointer_report, sizeof(pointer_report))) return false;
+
+    // the position already includes the pending motion
+    state->x = 0;
+    state->y = 0;
+    state->wheel -= wheel * MOUSE_WHEEL_UNITS;
+    state->pan = 0;
+    return true;
+}
+
+// Send one mouse report and subtract what was sent from *state
+static bool send_mouse_chunk(mouse_state_t* state)
+{
+    bool boot = tud_hid_n_get_protocol(1) == HID_PROTOCOL_BOOT;
+    if (pointer_absolute && !boot) {
+        return send_pointer_report(state);
+    }
+
+    bool wheel_hires = !boot && (mouse_resolution & 0x03);
+    bool pan_hires = !boot && (mouse_resolution & 0x0C);
+    int32_t wheel = scroll_counts(state->wheel, wheel_hires);
+    int32_t pan = scroll_counts(state->pan, pan_hires);
+    int32_t x, y;
+
+    if (boot) {
+        // Boot protocol: no report ID, 8-bit axes
+        x = clamp_axis(state->x, 127);
+        y = clamp_axis(state->y, 127);
+        hid_mouse_report_t boot_report = {
+            .buttons = (uint8_t)state->buttons,
+            .x = (int8_t)x,
+            .y = (int8_t)y,
+            .wheel = (int8_t)wheel,
+            .pan = (int8_t)pan
+        };
+        if (!tud_hid_n_report(1, 0, &boot_report, sizeof(boot_report))) return false;
+    } else {
+        x = clamp_axis(state->x, 32767);
+        y = clamp_axis(state->y, 32767);
+        hid_mouse16_report_t mouse16_report = {
+            .buttons = state->buttons,
+            .x = (int16_t)x,
+            .y = (int16_t)y,
+            .wheel = (int8_t)wheel,
+            .pan = (int8_t)pan
+        };
+        if (!tud_hid_n_report(1, 2, &mouse16_report, sizeof(mouse16_report))) return false;
+    }
+
+    state->x -= x;
+    state->y -= y;
+    state->wheel -= wheel * scroll_step(wheel_hires);
+    state->pan -= pan * scroll_step(pan_hires);
+    return true;
+}
+
+bool usb_device_mouse_report_scaled(const mouse_report_t* report, uint8_t wheel_resolution)
+{
+    bool result = true;
+    int32_t units = MOUSE_WHEEL_UNITS / (wheel_resolution ? wheel_resolution : 1);
+
+    if (output_device2()) {
+        result = pio_usb_device2_mouse_report(report, wheel_resolution);
+        if (result) link_latency_submitted('M');
+        return result;
+    }
+
+    critical_section_enter_blocking(&mouse_lock);
+    mouse_state_t next = mouse_pending;
+    next.buttons = report->buttons;
+    next.x = clamp_axis(next.x + report->x, 32767);
+    next.y = clamp_axis(next.y + report->y, 32767);
+    next.wheel = clamp_axis(next.wheel + report->wheel * units, 127 * MOUSE_WHEEL_UNITS);
+    next.pan = clamp_axis(next.pan + report->pan * units, 127 * MOUSE_WHEEL_UNITS);
+    // 1カウント = 1ピクセルとして仮想カーソルに積算する
+    next.cursor_x = cursor_move(next.cursor_x, report->x, pointer_width);
+    next.cursor_y = cursor_move(next.cursor_y, report->y, pointer_height);
+
+    if (mouse_in_flight && (mouse_has_pending(&mouse_pending) || pointer_warp_pending)) {
+        // Previous motion is still being sent: merge unless the buttons changed
+        if (report->buttons == mouse_pending.buttons) {
+            mouse_pending = next;
+            sof_sched_arrival(SOF_SCHED_MOUSE);
+        } else {
+            result = false;
+        }
+    } else if (sof_sched_enabled() && report->buttons == mouse_pending.buttons) {
+        // Motion only: usb_device_schedule_task sends it just before the next IN token
+        // (button changes are not held back)
+        mouse_pending = next;
+        sof_sched_arrival(SOF_SCHED_MOUSE);
+    } else if (send_mouse_chunk(&next)) {
+        mouse_pending = next;
+        mouse_in_flight = true;
+        sof_sched_arrival(SOF_SCHED_MOUSE);
+        report_armed(SOF_SCHED_MOUSE);
+    } else {
+        result = false;
+    }
+    critical_section_exit(&mouse_lock);
+
+    return result;
+}
+
+bool usb_device_mouse_report(const mouse_report_t* report)
+{
+    return usb_device_mouse_report_scaled(report, 1);
+}
+
+void usb_device_pointer_set_mode(bool absolute)
+{
+    pointer_absolute = absolute;
+}
+
+void usb_device_pointer_set_screen(uint16_t width, uint16_t height)
+{
+    if (width == 0 || height == 0) return;
+
+    critical_section_enter_blocking(&mouse_lock);
+    // keep the cursor at the same absolute position
+    mouse_pending.cursor_x = mouse_pending.cursor_x / pointer_width * width;
+    mouse_pending.cursor_y = mouse_pending.cursor_y / pointer_height * height;
+    pointer_width = width;
+    pointer_height = height;
+    critical_section_exit(&mouse_lock);
+}
+
+bool usb_device_pointer_warp(uint16_t x, uint16_t y)
+{
+    if (output_device2() || tud_hid_n_get_protocol(1) == HID_PROTOCOL_BOOT) return false;
+    if (x > POINTER_ABS_MAX) x = POINTER_ABS_MAX;
+    if (y > POINTER_ABS_MAX) y = POINTER_ABS_MAX;
+
+    critical_section_enter_blocking(&mouse_lock);
+    mouse_pending.cursor_x = (int32_t)x * pointer_width;
+    mouse_pending.cursor_y = (int32_t)y * pointer_height;
+    mouse_pending.x = 0;
+    mouse_pending.y = 0;
+    if (!mouse_in_flight && send_pointer_report(&mouse_pending)) {
+        mouse_in_flight = true;
+        report_armed(SOF_SCHED_MOUSE);
+    } else {
+        pointer_warp_pending = true;
+    }
+    critical_section_exit(&mouse_lock);
+
+    return true;
+}
+
+void usb_device_pointer_get(uint16_t* x, uint16_t* y)
+{
+    critical_section_enter_blocking(&mouse_lock);
+    *x = (uint16_t)(mouse_pending.cursor_x / pointer_width);
+    *y = (uint16_t)(mouse_pending.cursor_y / pointer_height);
+    critical_section_exit(&mouse_lock);
+}
+
+// Send the gamepad state when it changed (Lua control or the attached gamepad)
+static void gamepad_task(void)
+{
+    // use to avoid send multiple consecutive zero report
+    static bool has_gamepad_key_last = false;
+
+    hid_standard_gamepad_report_t report =
+    {
+        .x = 0, .y = 0, .z = 0, .rz = 0,
+        .hat = 0, .buttons = 0
+    };
+
+    bool send_report = false;
+
+    // Check for Lua gamepad control first
+    int8_t lua_x, lua_y, lua_z, lua_rz;
+    uint8_t lua_hat;
+    uint16_t lua_buttons;
+    bool lua_active, lua_dirty;
+    
+    get_lua_gamepad_state(&lua_x, &lua_y, &lua_z, &lua_rz, 
+                         &lua_hat, &lua_buttons, &lua_active, &lua_dirty);
+    
+    if (lua_active) {
+        // Use Lua-controlled gamepad state with real gamepad analog values
+        // Analog values: use real gamepad input if available, otherwise use Lua values
+        if (has_gamepad_key && !gamepad_state_updated) {
+            // Use real gamepad analog values when real gamepad is present
+            report.x = current_gamepad_state.x;
+            report.y = current_gamepad_state.y;
+            report.z = current_gamepad_state.z;
+            report.rz = current_gamepad_state.rz;
+        } else {
+            // Use Lua analog values when no real gamepad or during gamepad updates
+            report.x = lua_x;
+            report.y = lua_y;
+            report.z = lua_z;
+            report.rz = lua_rz;
+        }
+        
+        // Hat and buttons: use Lua-controlled values
+        report.hat = lua_hat;
+        report.buttons = lua_buttons;
+        
+        send_report = lua_dirty || has_gamepad_key_last != lua_active;
+        has_gamepad_key = true;
+    }
+    // Check if we have new gamepad data from USB host
+    else if (gamepad_state_updated) {
+        // Copy the received gamepad data to the report
+        report.x = current_gamepad_state.x;
+        report.y = current_gamepad_state.y;
+        report.z = current_gamepad_state.z;
+        report.rz = current_gamepad_state.rz;
+        report.hat = current_gamepad_state.hat;
+        report.buttons = current_gamepad_state.buttons;
+        
+        send_report = true;
+        gamepad_state_updated = false; // Mark as processed
+        has_gamepad_key = true;
+    }
+    // Send zero report if gamepad was disconnected or no data
+    else if (has_gamepad_key_last && !has_gamepad_key) {
+        // Send zero report to clear previous state
+        send_report = true;
+    }
+
+    if ( send_report )
+    {
+        // Send gamepad report to USB device interface
+        if (output_device2()) {
+            if (pio_usb_device2_gamepad_report(&report)) link_latency_submitted('G');
+        } else if (tud_hid_n_report(2, 3, &report, sizeof(report))) {
+            report_armed(SOF_SCHED_GAMEPAD);
+            gamepad_snapshot = report;
+        }
+        has_gamepad_key_last = has_gamepad_key;
+    }
+}
+
+// Hand the coalesced mouse motion and gamepad state to the endpoints just before
+// the host's next IN token (SofScheduler.c decides when). Called from the Core1 loop.
+void usb_device_schedule_task(void)
+{
+    if (!sof_sched_enabled() || output_device2()) return;
+
+    /*------------- Mouse -------------*/
+    if (!mouse_in_flight && tud_hid_n_ready(1) && sof_sched_due(SOF_SCHED_MOUSE)) {
+        critical_section_enter_blocking(&mouse_lock);
+        if (!mouse_in_flight) {
+            if (pointer_warp_pending) {
+                pointer_warp_pending = false;
+                mouse_in_flight = send_pointer_report(&mouse_pending);
+            } else {
+                mouse_in_flight = mouse_has_pending(&mouse_pending) && send_mouse_chunk(&mouse_pending);
+            }
+            if (mouse_in_flight) report_armed(SOF_SCHED_MOUSE);
+        }
+        critical_section_exit(&mouse_lock);
+    }
+
+    /*------------- Gamepad -------------*/
+    if (tud_hid_n_ready(2) && sof_sched_due(SOF_SCHED_GAMEPAD)) {
+        gamepad_task();
+    }
+}
+
+//--------------------------------------------------------------------+
+// Remote wakeup
+//--------------------------------------------------------------------+
+
+void usb_device_set_wake(uint8_t sources, uint16_t motion)
+{
+    wake_sources = sources;
+    wake_motion = motion;
+}
+
+// Record a wake edge (acted on by hid_task while USB1 is suspended)
+static void wake_request(uint8_t source)
+{
+    if ((wake_sources & source) && !output_device2() && tud_suspended()) {
+        wake_pending |= source;
+    }
+}
+
+void usb_device_wake_keyboard(const keyboard_bitmap_t* state)
+{
+    bool pressed = (state->modifier & ~wake_keyboard.modifier) != 0;
+    for (int i = 0; i < KEYBOARD_BITMAP_SIZE && !pressed; i++) {
+        pressed = (state->keys[i] & ~wake_keyboard.keys[i]) != 0;
+    }
+    wake_keyboard = *state;
+    if (pressed) wake_request(USB_WAKE_KEY);
+}
+
+void usb_device_wake_control(const uint16_t* consumer, uint8_t system)
+{
+    bool pressed = system != 0 && system != wake_system;
+    for (int i = 0; i < USB_CONSUMER_KEYS && !pressed; i++) {
+        if (consumer[i] == 0) continue;
+        pressed = true;     // 前回押されていなかった Usage があれば起こす
+        for (int k = 0; k < USB_CONSUMER_KEYS; k++) {
+            if (wake_consumer[k] == consumer[i]) pressed = false;
+        }
+    }
+    memcpy(wake_consumer, consumer, sizeof(wake_consumer));
+    wake_system = system;
+    if (pressed) wake_request(USB_WAKE_KEY);
+}
+
+void usb_device_wake_mouse(const mouse_report_t* report)
+{
+    if (report->buttons & ~wake_buttons) wake_request(USB_WAKE_BUTTON);
+    wake_buttons = report->buttons;
+
+    if (report->wheel != 0 || report->pan != 0) wake_request(USB_WAKE_WHEEL);
+
+    // センサーの揺れで起こさないよう、USB_WAKE_MOTION_WINDOW_MS 以内に続けて
+    // wake_motion カウント以上動いたときだけ起こす
+    if (report->x != 0 || report->y != 0) {
+        uint32_t now = board_millis();
+        if (now - wake_motion_ms > USB_WAKE_MOTION_WINDOW_MS) wake_motion_sum = 0;
+        wake_motion_ms = now;
+        wake_motion_sum += abs(report->x) + abs(report->y);
+        if (wake_motion_sum >= wake_motion) {
+            wake_motion_sum = 0;
+            wake_request(USB_WAKE_MOTION);
+        }
+    }
+}
+
+// The attached (or linked) gamepad: a newly pressed button or hat direction (sticks drift)
+static void wake_check_gamepad(void)
+{
+    parsed_gamepad_report_t state = current_gamepad_state;
+    if ((state.buttons & ~wake_gamepad.buttons) || (state.hat != 0 && state.hat != wake_gamepad.hat)) {
+        wake_request(USB_WAKE_GAMEPAD);
+    }
+    wake_gamepad = state;
+}
+
 // Every 10ms, we will sent 1 report for each HID profile (keyboard, mouse etc ..)
 // tud_hid_report_complete_cb() is used to send the next report after previous one is complete
 void hid_task(void)
@@ -20,20 +687,32 @@ void hid_task(void)
     if ( board_millis() - start_ms < interval_ms) return; // not enough time
     start_ms += interval_ms;
 
-    // Remote wakeup
-    if ( tud_suspended() )
+    wake_check_gamepad();
+
+    // Remote wakeup (USB1 only; the PIO port has no suspend handling)
+    if ( !output_device2() && tud_suspended() )
     {
-        // Wake up host if we are in suspend mode
-        // and REMOTE_WAKEUP feature is enabled by host
-        tud_remote_wakeup();
+        // Wake up host only on an input edge that passed the WAKE= filter
+        // (tud_remote_wakeup does nothing unless the host enabled REMOTE_WAKEUP)
+        uint8_t sources = wake_pending;
+        if (sources) {
+            wake_pending = 0;
+            printf("Remote wakeup (source 0x%02X)\n", sources);
+            tud_remote_wakeup();
+        }
         return;
     }
+    wake_pending = 0;
 
     /*------------- Keyboard -------------*/
     if ( tud_hid_n_ready(0) )
     {
         // Keyboard interface is ready - USBHostTask will send reports directly
         // This section ensures the interface stays responsive
+        // (and flushes media keys that were queued while the host was not polling)
+        critical_section_enter_blocking(&keyboard_lock);
+        send_control_queue();
+        critical_section_exit(&keyboard_lock);
     }
 
     /*------------- Mouse -------------*/
@@ -43,78 +722,10 @@ void hid_task(void)
     }
 
     /*------------- Gamepad -------------*/
-    if ( tud_hid_n_ready(2) )
+    // (with SOF sync usb_device_schedule_task sends it once per frame instead)
+    if ( (!sof_sched_enabled() || output_device2()) && usb_device_ready(2) )
     {
-        // use to avoid send multiple consecutive zero report
-        static bool has_gamepad_key_last = false;
-
-        hid_standard_gamepad_report_t report =
-        {
-            .x = 0, .y = 0, .z = 0, .rz = 0,
-            .hat = 0, .buttons = 0
-        };
-
-        bool send_report = false;
-
-        // Check for Lua gamepad control first
-        int8_t lua_x, lua_y, lua_z, lua_rz;
-        uint8_t lua_hat;
-        uint16_t lua_buttons;
-        bool lua_active, lua_dirty;
-        
-        get_lua_gamepad_state(&lua_x, &lua_y, &lua_z, &lua_rz, 
-                             &lua_hat, &lua_buttons, &lua_active, &lua_dirty);
-        
-        if (lua_active) {
-            // Use Lua-controlled gamepad state with real gamepad analog values
-            // Analog values: use real gamepad input if available, otherwise use Lua values
-            if (has_gamepad_key && !gamepad_state_updated) {
-                // Use real gamepad analog values when real gamepad is present
-                report.x = current_gamepad_state.x;
-                report.y = current_gamepad_state.y;
-                report.z = current_gamepad_state.z;
-                report.rz = current_gamepad_state.rz;
-            } else {
-                // Use Lua analog values when no real gamepad or during gamepad updates
-                report.x = lua_x;
-                report.y = lua_y;
-                report.z = lua_z;
-                report.rz = lua_rz;
-            }
-            
-            // Hat and buttons: use Lua-controlled values
-            report.hat = lua_hat;
-            report.buttons = lua_buttons;
-            
-            send_report = lua_dirty || has_gamepad_key_last != lua_active;
-            has_gamepad_key = true;
-        }
-        // Check if we have new gamepad data from USB host
-        else if (gamepad_state_updated) {
-            // Copy the received gamepad data to the report
-            report.x = current_gamepad_state.x;
-            report.y = current_gamepad_state.y;
-            report.z = current_gamepad_state.z;
-            report.rz = current_gamepad_state.rz;
-            report.hat = current_gamepad_state.hat;
-            report.buttons = current_gamepad_state.buttons;
-            
-            send_report = true;
-            gamepad_state_updated = false; // Mark as processed
-            has_gamepad_key = true;
-        }
-        // Send zero report if gamepad was disconnected or no data
-        else if (has_gamepad_key_last && !has_gamepad_key) {
-            // Send zero report to clear previous state
-            send_report = true;
-        }
-
-        if ( send_report )
-        {
-            // Send gamepad report to USB device interface
-            tud_hid_n_report(2, 3, &report, sizeof(report));
-            has_gamepad_key_last = has_gamepad_key;
-        }
+        gamepad_task();
     }
 }
 
@@ -129,7 +740,115 @@ void tud_hid_report_complete_cb(uint8_t instance, uint8_t const* report, uint16_
 {
     (void) len;
     (void) report;
-    
+
+    // Media / system keys queued while the keyboard endpoint was busy
+    if (instance == 0) {
+        critical_section_enter_blocking(&keyboard_lock);
+        send_control_queue();
+        critical_section_exit(&keyboard_lock);
+    }
+
+    // Next queued raw HID packet (command responses and the input stream)
+    if (instance == 3) {
+        raw_hid_task();
+    }
+
+    // Continue mouse motion that did not fit into one report
+    // (with SOF sync the rest waits for usb_device_schedule_task)
+    if (instance == 1) {
+        critical_section_enter_blocking(&mouse_lock);
+        sof_sched_picked_up(SOF_SCHED_MOUSE);
+        if (sof_sched_enabled()) {
+            mouse_in_flight = false;
+        } else if (pointer_warp_pending) {
+            pointer_warp_pending = false;
+            mouse_in_flight = send_pointer_report(&mouse_pending);
+        } else {
+            mouse_in_flight = mouse_has_pending(&mouse_pending) && send_mouse_chunk(&mouse_pending);
+        }
+        if (mouse_in_flight) report_armed(SOF_SCHED_MOUSE);
+        critical_section_exit(&mouse_lock);
+    }
+
+    if (instance == 2) {
+        sof_sched_picked_up(SOF_SCHED_GAMEPAD);
+    }
+}
+
+// Invoked on every start of frame while sof_sched_set_enabled(true)
+void tud_sof_cb(uint32_t frame_count)
+{
+    sof_sched_on_sof(frame_count);
+}
+
+// Invoked when the device is configured by a host: features start from their defaults
+void tud_mount_cb(void)
+{
+    mouse_resolution = 0;
+    control_count = 0;
+    memset(control_consumer, 0, sizeof(control_consumer));
+    control_system = 0;
+    memset(&keyboard_snapshot, 0, sizeof(keyboard_snapshot));
+    memset(&gamepad_snapshot, 0, sizeof(gamepad_snapshot));
+}
+
+// Copy a snapshot into the GET_REPORT buffer (the stack has already put the report ID in front)
+static uint16_t snapshot_copy(uint8_t* buffer, uint16_t reqlen, const void* report, uint16_t len)
+{
+    if (len > reqlen) len = reqlen;
+    memcpy(buffer, report, len);
+    return len;
+}
+
+static uint16_t keyboard_snapshot_report(uint8_t report_id, uint8_t* buffer, uint16_t reqlen)
+{
+    uint16_t len = 0;
+
+    critical_section_enter_blocking(&keyboard_lock);
+    if (report_id == 0 || report_id == 1) {
+        // 6KRO (Report ID 1, or no ID in boot protocol)
+        hid_keyboard_report_t report = { .modifier = keyboard_snapshot.modifier };
+        keyboard_bitmap_to_keys(&keyboard_snapshot, keyboard_sent_keys, report.keycode);
+        len = snapshot_copy(buffer, reqlen, &report, sizeof(report));
+    } else if (report_id == 4) {
+        len = snapshot_copy(buffer, reqlen, &keyboard_snapshot, sizeof(keyboard_snapshot));
+    } else if (report_id == 6) {
+        len = snapshot_copy(buffer, reqlen, control_consumer, sizeof(control_consumer));
+    } else if (report_id == 7) {
+        uint8_t value = control_system ? (uint8_t)(control_system - 0x80) : 0;
+        len = snapshot_copy(buffer, reqlen, &value, sizeof(value));
+    }
+    critical_section_exit(&keyboard_lock);
+
+    return len;
+}
+
+// Relative reports carry the buttons only: motion is never reported twice
+static uint16_t mouse_snapshot_report(uint8_t report_id, uint8_t* buffer, uint16_t reqlen)
+{
+    critical_section_enter_blocking(&mouse_lock);
+    mouse_state_t state = mouse_pending;
+    int32_t width = pointer_width;
+    int32_t height = pointer_height;
+    critical_section_exit(&mouse_lock);
+
+    if (report_id == 0) {
+        hid_mouse_report_t report = { .buttons = (uint8_t)state.buttons };
+        return snapshot_copy(buffer, reqlen, &report, sizeof(report));
+    }
+    if (report_id == 2) {
+        hid_mouse16_report_t report = { .buttons = state.buttons };
+        return snapshot_copy(buffer, reqlen, &report, sizeof(report));
+    }
+    if (report_id == 5) {
+        hid_abs_pointer_report_t report = {
+            .buttons = (uint8_t)state.buttons,
+            .x = (uint16_t)(state.cursor_x / width),
+            .y = (uint16_t)(state.cursor_y / height)
+        };
+        return snapshot_copy(buffer, reqlen, &report, sizeof(report));
+    }
+    return 0;
 }
 
 // Invoked when received GET_REPORT control request
@@ -137,12 +856,19 @@ void tud_hid_report_complete_cb(uint8_t instance, uint8_t const* report, uint16_
 // Return zero will cause the stack to STALL request
 uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen)
 {
-    // TODO not Implemented
-    (void) instance;
-    (void) report_id;
-    (void) report_type;
-    (void) buffer;
-    (void) reqlen;
+    // Mouse Resolution Multiplier feature
+    if (instance == 1 && report_id == 2 && report_type == HID_REPORT_TYPE_FEATURE && reqlen >= 1) {
+        buffer[0] = mouse_resolution;
+        return 1;
+    }
+
+    // Input reports: the last state sent (Core1, same as the IN endpoint)
+    if (report_type != HID_REPORT_TYPE_INPUT) return 0;
+    if (instance == 0) return keyboard_snapshot_report(report_id, buffer, reqlen);
+    if (instance == 1) return mouse_snapshot_report(report_id, buffer, reqlen);
+    if (instance == 2 && report_id == 3) {
+        return snapshot_copy(buffer, reqlen, &gamepad_snapshot, sizeof(gamepad_snapshot));
+    }
 
     return 0;
 }
@@ -163,15 +889,15 @@ void tud_hid_set_protocol_cb(uint8_t instance, uint8_t protocol)
                 if (protocol == 0) {
                     printf("Keyboard switched to Boot mode (6-key rollover)\n");
                 } else {
-                    printf("Keyboard switched to Report mode (NKRO capable)\n");
+                    printf("Keyboard switched to Report mode (%s)\n", keyboard_nkro ? "NKRO bitmap" : "6-key rollover");
                 }
                 break;
                 
             case 1: // Mouse
                 if (protocol == 0) {
-                    printf("Mouse switched to Boot mode (3-button + wheel)\n");
+                    printf("Mouse switched to Boot mode (8-bit axes, large moves are split)\n");
                 } else {
-                    printf("Mouse switched to Report mode (extended features)\n");
+                    printf("Mouse switched to Report mode (16-bit axes, 16 buttons)\n");
                 }
                 break;
                 
@@ -198,8 +924,13 @@ uint8_t tud_hid_get_protocol_cb(uint8_t instance)
 // received data on OUT endpoint ( Report ID = 0, Type = 0 )
 void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize)
 {
+    // Raw HID command packets (OUT endpoint)
+    if (instance == 3)
+    {
+        raw_hid_receive(buffer, bufsize);
+    }
     // Keyboard SET_REPORT handling
-    if (instance == 0) // Keyboard instance
+    else if (instance == 0) // Keyboard instance
     {
         // Handle keyboard LED output reports (typically report_type == OUTPUT)
         if (report_type == HID_REPORT_TYPE_OUTPUT && bufsize >= 1)
@@ -209,6 +940,14 @@ void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_
             send_keyboard_led_state(led_state);
         }
     }
+    // Mouse Resolution Multiplier feature (the host enables high-resolution scrolling)
+    else if (instance == 1 && report_id == 2 && report_type == HID_REPORT_TYPE_FEATURE && bufsize >= 1)
+    {
+        mouse_resolution = buffer[0] & 0x0F;
+        printf("Mouse resolution multiplier: wheel %s, pan %s\n",
+               (mouse_resolution & 0x03) ? "high-res" : "detent",
+               (mouse_resolution & 0x0C) ? "high-res" : "detent");
+    }
     // Gamepad vibration handling
     else if (instance == 2 && report_id == 3 && report_type == HID_REPORT_TYPE_OUTPUT)
     {
@@ -3,8 +3,183 @@
 
 #include "USBtask.h"
 
+#include "MouseReportParser.h"
+
+// Absolute pointer report (Report ID 5, mouse interface)
+#define POINTER_ABS_MAX         32767
+#define POINTER_DEFAULT_WIDTH   1920
+#define POINTER_DEFAULT_HEIGHT  1080
+
+typedef struct TU_ATTR_PACKED {
+    uint8_t  buttons;
+    uint16_t x;
+    uint16_t y;
+    int8_t   wheel;
+} hid_abs_pointer_report_t;
+
+// NKRO keyboard report (Report ID 4): modifiers + one bit per usage 0x00-0xDF
+#define KEYBOARD_NKRO_USAGES    0xE0
+#define KEYBOARD_BITMAP_SIZE    (KEYBOARD_NKRO_USAGES / 8)
+
+typedef struct TU_ATTR_PACKED {
+    uint8_t modifier;
+    uint8_t keys[KEYBOARD_BITMAP_SIZE];
+} keyboard_bitmap_t;
+
+// Consumer Control report (Report ID 6): up to USB_CONSUMER_KEYS media keys held together
+#define USB_CONSUMER_KEYS       4
+
+// High-resolution scrolling: counts per detent when the host enables the Resolution Multiplier
+#define MOUSE_WHEEL_MULTIPLIER  8
+// Internal wheel/pan unit (1/120 detent, divisible by the usual source resolutions)
+#define MOUSE_WHEEL_UNITS       120
+
+// Report protocol mouse report (Report ID 2, see usb_descriptors.c)
+typedef struct TU_ATTR_PACKED {
+    uint16_t buttons;
+    int16_t  x;
+    int16_t  y;
+    int8_t   wheel;
+    int8_t   pan;
+} hid_mouse16_report_t;
+
 // Function declarations for USB Device functionality
+void usb_device_task_init(void);
 void hid_task(void);
+
+/**
+ * SOF 同期が有効なとき、まとめたマウスの移動とゲームパッドの状態を
+ * PC の次の IN トークンの直前に送る（Core1 のループから呼ぶ、SofScheduler.h）
+ */
+void usb_device_schedule_task(void);
+
+/**
+ * 出力先のデバイスポートが次のレポートを受け付けられるか
+ * USB_output_switch が USB_OUTPUT_DEVICE2 なら PIO-USB の2つ目のポート（PioUsbDevice.c）、
+ * それ以外は TinyUSB のポート。以下の usb_device_* の送信関数も同じ出力先へ送る
+ * @param instance 0: キーボード, 1: マウス, 2: ゲームパッド
+ */
+bool usb_device_ready(uint8_t instance);
+
+/**
+ * NKRO レポートを使うか（config の NKRO=ON/OFF、既定は ON）
+ * OFF または Boot プロトコルでは従来の 6KRO レポートで送る
+ */
+void usb_device_set_nkro(bool enabled);
+
+/**
+ * キーボードのビットマップにキーを押す/離す（0xE0-0xE7 は modifier のビット）
+ */
+void keyboard_bitmap_set(keyboard_bitmap_t* state, uint8_t keycode, bool pressed);
+
+/**
+ * キーが押されているか（0x00-0xDF）
+ */
+bool keyboard_bitmap_test(const keyboard_bitmap_t* state, uint8_t keycode);
+
+/**
+ * 6KRO の keycode 配列をビットマップに変換する
+ */
+void keyboard_bitmap_from_keys(keyboard_bitmap_t* state, uint8_t modifier, const uint8_t keycode[6]);
+
+/**
+ * ビットマップから 6KRO の keycode 配列を作る
+ * prev に含まれるキーを優先して残すので、7キー以上押している間も押下中のキーは入れ替わらない
+ * @param prev 前回送った keycode 配列（NULL 可）
+ * @return 押されているキーの数（6 を超えた分は keycode に入らない）
+ */
+uint8_t keyboard_bitmap_to_keys(const keyboard_bitmap_t* state, const uint8_t prev[6], uint8_t keycode[6]);
+
+/**
+ * キーボードレポートをデバイス側へ送る（インスタンス0）
+ * Report プロトコルで NKRO が有効ならビットマップ（Report ID 4）、
+ * それ以外は 6KRO（Report モードは Report ID 1、Boot モードは Report ID なし）で送る
+ * @return true: 送信した, false: エンドポイントが使用中
+ */
+bool usb_device_keyboard_report(uint8_t modifier, const uint8_t keycode[6]);
+
+/**
+ * ビットマップのキーボード状態をデバイス側へ送る（6KRO に落とす場合は usb_device_keyboard_report と同じ）
+ */
+bool usb_device_keyboard_bitmap_report(const keyboard_bitmap_t* state);
+
+/**
+ * マウスレポートをデバイス側へ送る（インスタンス1）
+ * Report プロトコルでは 16bit の X/Y をそのまま送り、Boot プロトコルでは ±127 に
+ * 分割して残りを tud_hid_report_complete_cb で続けて送る。
+ * ホストが Resolution Multiplier を有効にしている間はホイールを 1/MOUSE_WHEEL_MULTIPLIER
+ * ノッチ単位で少しずつ送り、無効ならノッチ単位で送る。
+ * 分割送信中に来たレポートは残りに加算してまとめて送る（ボタンが変わった場合は false）。
+ * SOF 同期が有効なら、ボタンが変わらないレポートは加算だけして usb_device_schedule_task で送る。
+ * @return true: 送信した（または残りに加算した）, false: エンドポイントが使用中
+ */
+bool usb_device_mouse_report(const mouse_report_t* report);
+
+/**
+ * メディアキー（Consumer Control、Report ID 6）と電源・スリープ（System Control、Report ID 7）の
+ * 状態を送る。変化したものだけをキューに入れ、キーボードのエンドポイントが空き次第送る
+ * Boot プロトコルでは送らない
+ * @param consumer 押されている Consumer ページの Usage（USB_CONSUMER_KEYS 個、空きは 0）
+ * @param system 0x81: Power Down, 0x82: Sleep, 0x83: Wake Up（0: 解放）
+ * @return true: 送信またはキューに入れた, false: キューが満杯・Boot プロトコル・出力先が USB2
+ */
+bool usb_device_control_report(const uint16_t* consumer, uint8_t system);
+
+/**
+ * 絶対座標ポインタの設定（config の POINTER= / SCREEN=）
+ * 相対移動は常に仮想カーソル（0-POINTER_ABS_MAX）に積算しており、
+ * absolute が true なら相対レポートの代わりに絶対座標レポート（Report ID 5）を送る
+ * @param width, height 相対移動1カウントを1ピクセルとして換算する画面サイズ
+ */
+void usb_device_pointer_set_mode(bool absolute);
+void usb_device_pointer_set_screen(uint16_t width, uint16_t height);
+
+/**
+ * 仮想カーソルを指定位置へ移動し、絶対座標レポートを1回送る（Report プロトコルのみ）
+ * エンドポイントが使用中なら送信完了後に送る
+ * @param x, y 0-POINTER_ABS_MAX
+ * @return true: 送信した（または予約した）, false: Boot プロトコル・出力先が USB2
+ */
+bool usb_device_pointer_warp(uint16_t x, uint16_t y);
+
+/**
+ * 仮想カーソルの現在位置（0-POINTER_ABS_MAX）
+ */
+void usb_device_pointer_get(uint16_t* x, uint16_t* y);
+
+/**
+ * 高解像度ホイールのマウスからのレポートを送る
+ * @param report wheel/pan が 1/wheel_resolution ノッチ単位のレポート
+ * @param wheel_resolution 1ノッチあたりのカウント数（1 ならノッチ単位）
+ * @return usb_device_mouse_report と同じ
+ */
+bool usb_device_mouse_report_scaled(const mouse_report_t* report, uint8_t wheel_resolution);
+
+// Remote wakeup sources (config WAKE=)
+#define USB_WAKE_KEY        0x01    // キー（メディアキーを含む）を押した
+#define USB_WAKE_BUTTON     0x02    // マウスのボタンを押した
+#define USB_WAKE_WHEEL      0x04    // ホイール・チルト
+#define USB_WAKE_MOTION     0x08    // マウスの移動（USB_WAKE_MOTION_WINDOW_MS 以内に WAKE_MOTION カウント以上）
+#define USB_WAKE_GAMEPAD    0x10    // ゲームパッドのボタン・ハット（スティックは含まない）
+#define USB_WAKE_ALL        0x1F
+#define USB_WAKE_MOTION_DEFAULT     32
+#define USB_WAKE_MOTION_WINDOW_MS   100
+
+/**
+ * サスペンド中に PC を起こす入力の種類（config の WAKE= / WAKE_MOTION=、既定はすべて・32 カウント）
+ * @param sources USB_WAKE_* の組み合わせ（0: 起こさない）
+ * @param motion USB_WAKE_MOTION で起こすのに必要な移動量
+ */
+void usb_device_set_wake(uint8_t sources, uint16_t motion);
+
+/**
+ * USB ホスト側・リンクから届いた入力を渡す（USB1 に出力するときだけ呼ぶ）
+ * 前回の入力から新しく押されたものがあり、USB1 がサスペンド中なら hid_task が
+ * リモートウェイクアップを送る。ゲームパッドは current_gamepad_state を hid_task が見る。
+ */
+void usb_device_wake_keyboard(const keyboard_bitmap_t* state);
+void usb_device_wake_control(const uint16_t* consumer, uint8_t system);
+void usb_device_wake_mouse(const mouse_report_t* report);
 void vibration_control_task(void);
 
 // TinyUSB Device HID Callbacks
@@ -13,6 +188,7 @@ uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_t
 void tud_hid_set_protocol_cb(uint8_t instance, uint8_t protocol);
 uint8_t tud_hid_get_protocol_cb(uint8_t instance);
 void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize);
+void tud_sof_cb(uint32_t frame_count);
 
 // TinyUSB Device CDC Callbacks
 void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts);
@@ -1,5 +1,6 @@
 #include "USBHostTask.h"
 #include "USBtask.h"
+#include "USBDeviceTask.h"
 #include "fstask.h"
 #include "LuaTask.h"
 #include "UARTtask.h"
@@ -11,8 +12,14 @@
 #include "MouseReportParser.h"
 #include "ReportParser.h"
 #include "GamepadReportParser.h"
+#include "KeyboardReportParser.h"
 #include "USBHostTask.h"
 #include "configRead.h"
+#include "LinkMux.h"
+#include "LinkLatency.h"
+#include "RawHID.h"
+#include "MacroRecorder.h"
+#include "InputEvents.h"
 
 // External variables defined in USBtask.c
 extern bool meta;
@@ -24,6 +31,10 @@ typedef struct {
     uint8_t instance;
     bool is_keyboard;
     bool connected;
+    bool report_protocol;                   // true: decode with parser, false: boot report
+    keyboard_report_parser_info_t parser;   // from the report descriptor
+    keyboard_bitmap_t state;                // keys currently held on this interface
+    keyboard_control_state_t control;       // media / system keys held on this interface
 } keyboard_device_info_t;
 
 static keyboard_device_info_t keyboard_devices[CFG_TUH_HID];
@@ -36,13 +47,63 @@ void send_keyboard_led_state(uint8_t led_state)
         if (keyboard_devices[i].connected && keyboard_devices[i].is_keyboard) {
             uint8_t dev_addr = keyboard_devices[i].dev_addr;
             uint8_t instance = keyboard_devices[i].instance;
+            uint8_t report_id = keyboard_devices[i].report_protocol ? keyboard_devices[i].parser.led_report_id : 0;
             
-            // Send SET_REPORT request to keyboard
-            bool success = tuh_hid_set_report(dev_addr, instance, 0, HID_REPORT_TYPE_OUTPUT, &led_state, 1);
+            // Send SET_REPORT request to keyboard (the data stage starts with the report ID if it has one)
+            static uint8_t led_report[CFG_TUH_HID][2];
+            uint8_t* data = led_report[i];
+            uint16_t len = 0;
+            if (report_id != 0) data[len++] = report_id;
+            data[len++] = led_state;
+            tuh_hid_set_report(dev_addr, instance, report_id, HID_REPORT_TYPE_OUTPUT, data, len);
         }
     }
 }
 
+static keyboard_device_info_t* find_keyboard_device(uint8_t dev_addr, uint8_t instance)
+{
+    for (uint8_t i = 0; i < CFG_TUH_HID; i++) {
+        if (keyboard_devices[i].connected &&
+            keyboard_devices[i].dev_addr == dev_addr &&
+            keyboard_devices[i].instance == instance) {
+            return &keyboard_devices[i];
+        }
+    }
+    return NULL;
+}
+
+// Keys held on all connected keyboards
+static void merge_keyboard_states(keyboard_bitmap_t* merged)
+{
+    memset(merged, 0, sizeof(*merged));
+    for (uint8_t i = 0; i < CFG_TUH_HID; i++) {
+        if (!keyboard_devices[i].connected) continue;
+        merged->modifier |= keyboard_devices[i].state.modifier;
+        for (int b = 0; b < KEYBOARD_BITMAP_SIZE; b++) {
+            merged->keys[b] |= keyboard_devices[i].state.keys[b];
+        }
+    }
+}
+
+// Media / system keys of all keyboards (up to USB_CONSUMER_KEYS media keys, the first system key)
+static void merge_keyboard_controls(keyboard_control_state_t* merged)
+{
+    uint8_t count = 0;
+    memset(merged, 0, sizeof(*merged));
+    for (uint8_t i = 0; i < CFG_TUH_HID; i++) {
+        if (!keyboard_devices[i].connected) continue;
+        for (uint8_t k = 0; k < USB_CONSUMER_KEYS; k++) {
+            uint16_t usage = keyboard_devices[i].control.consumer[k];
+            bool held = usage == 0;
+            for (uint8_t m = 0; m < count && !held; m++) {
+                held = merged->consumer[m] == usage;
+            }
+            if (!held && count < USB_CONSUMER_KEYS) merged->consumer[count++] = usage;
+        }
+        if (merged->system == 0) merged->system = keyboard_devices[i].control.system;
+    }
+}
+
 // Keyboard report buffering for retry functionality
 static buffered_keyboard_report_t keyboard_report_buffer[KEYBOARD_REPORT_BUFFER_SIZE];
 static uint8_t kbd_buffer_write_index = 0;
@@ -60,7 +121,7 @@ static uint8_t mouse_buffer_count = 0;
 //--------------------------------------------------------------------+
 
 // Add keyboard report to buffer for retry
-static bool buffer_keyboard_report(const hid_keyboard_report_t* report)
+static bool buffer_keyboard_report(const keyboard_bitmap_t* report)
 {
     if (kbd_buffer_count >= KEYBOARD_REPORT_BUFFER_SIZE) {
         printf("Warning: Keyboard report buffer full, dropping oldest report\n");
@@ -98,8 +159,8 @@ void try_send_buffered_keyboard_reports(void)
         }
         
         // Try to send the report
-        if (tud_connected() && tud_hid_n_ready(0)) {
-            bool success = tud_hid_n_keyboard_report(0, 1, buffered->report.modifier, buffered->report.keycode);
+        if (usb_device_ready(0)) {
+            bool success = usb_device_keyboard_bitmap_report(&buffered->report);
             if (success) {
                 //printf("Successfully sent buffered keyboard report (remaining: %d)\n", kbd_buffer_count - 1);
                 kbd_buffer_read_index = (kbd_buffer_read_index + 1) % KEYBOARD_REPORT_BUFFER_SIZE;
@@ -116,7 +177,7 @@ void try_send_buffered_keyboard_reports(void)
 }
 
 // Add mouse report to buffer for retry
-static bool buffer_mouse_report(const mouse_report_t* report)
+static bool buffer_mouse_report(const mouse_report_t* report, uint8_t wheel_resolution)
 {
     if (mouse_buffer_count >= MOUSE_REPORT_BUFFER_SIZE) {
         printf("Warning: Mouse report buffer full, dropping oldest report\n");
@@ -126,6 +187,7 @@ static bool buffer_mouse_report(const mouse_report_t* report)
     }
     
     mouse_report_buffer[mouse_buffer_write_index].report = *report;
+    mouse_report_buffer[mouse_buffer_write_index].wheel_resolution = wheel_resolution;
     mouse_report_buffer[mouse_buffer_write_index].timestamp = board_millis();
     mouse_report_buffer[mouse_buffer_write_index].valid = true;
     
@@ -154,10 +216,8 @@ void try_send_buffered_mouse_reports(void)
         }
         
         // Try to send the report
-        if (tud_connected() && tud_hid_n_ready(1)) {
-            bool success = tud_hid_n_mouse_report(1, 2, buffered->report.buttons,
-                buffered->report.x, buffered->report.y,
-                buffered->report.wheel, buffered->report.pan);
+        if (usb_device_ready(1)) {
+            bool success = usb_device_mouse_report_scaled(&buffered->report, buffered->wheel_resolution);
             if (success) {
                 // printf("Successfully sent buffered mouse report (remaining: %d)\n", mouse_buffer_count - 1);
                 mouse_buffer_read_index = (mouse_buffer_read_index + 1) % MOUSE_REPORT_BUFFER_SIZE;
@@ -177,16 +237,6 @@ void try_send_buffered_mouse_reports(void)
 // USB Host Functions
 //--------------------------------------------------------------------+
 
-// look up new key in previous keys
-static inline bool find_key_in_report(hid_keyboard_report_t const *report, uint8_t keycode)
-{
-    for(uint8_t i=0; i<6; i++)
-    {
-        if (report->keycode[i] == keycode)  return true;
-    }
-    return false;
-}
-
 
 
 // Convert HID keycode to character for Meta key filenames
@@ -336,16 +386,32 @@ static void handle_meta_key(uint8_t keycode)
     
     // Handle special Meta key combinations for USB output switching
     if (keycode == 0x11) { // N key (keycode 0x11)
-        USB_output_switch = 1;
-        printf("META+N: USB_output_switch set to 1 (UART mode)\n");
-        // Send C11 to UART1
-        uart_puts(uart1, "C11\n");
+        // 次のノード（DEVICEID+1、未設定ならブロードキャスト）へ出力を切り替え、
+        // 相手側は自分のUSBへ出力するようにする
+        uint8_t local = link_local_address();
+        USB_output_switch = (local == LINK_ADDR_BROADCAST) ? LINK_ADDR_BROADCAST : (uint8_t)(local + 1);
+        printf("META+N: USB_output_switch set to %02X (link mode)\n", USB_output_switch);
+        link_send_switch(USB_output_switch, 0);
         return;
     } else if (keycode == 0x10) { // M key (keycode 0x10)
+        // 出力先だったノードの入力をこのノードへ転送させてから、自分のUSBへ戻す
+        uint8_t target = USB_output_switch;
         USB_output_switch = 0;
         printf("META+M: USB_output_switch set to 0 (USB mode)\n");
-        // Send C10 to UART1
-        uart_puts(uart1, "C10\n");
+        link_send_switch(target != 0 ? target : LINK_ADDR_BROADCAST, link_local_address());
+        return;
+    } else if (keycode == 0x0E) { // K key (keycode 0x0E)
+        // 実行中のマクロを全部止め、押したままのキー・ボタンを離す
+        printf("META+K: killing all macros\n");
+        lua_kill_macros(NULL);
+        return;
+    } else if (keycode == 0x15) { // R key (keycode 0x15)
+        // 入力の記録を開始/停止（macro.rec）
+        macro_recorder_meta_record();
+        return;
+    } else if (keycode == 0x13) { // P key (keycode 0x13)
+        // 記録した入力を再生/停止
+        macro_recorder_meta_play();
         return;
     }
     
@@ -395,134 +461,134 @@ typedef struct {
 } keyboard_report_t;
 
 
-// convert hid keycode to ascii and print
-void process_kbd_report(uint8_t dev_addr, hid_keyboard_report_t const *report, uint16_t len)
+// Send the merged keyboard state (all keyboards) to the selected output
+static void process_keyboard_state(const keyboard_bitmap_t* state)
 {
-    (void) len; //suppress unused variable warning
-    setLEDStateActive();
+    static keyboard_bitmap_t prev_state = { 0 }; // previous state to check key released
 
-    (void) dev_addr;
-    static hid_keyboard_report_t prev_report = { 0, 0, {0} }; // previous report to check key released
+    input_events_keyboard(state); // Key presses for Lua wait_key() / wait_any()
 
     // Check for CapsLock key press/release
-    bool capslock_pressed_now = find_key_in_report(report, 0x39); // CapsLock keycode is 0x39
-    bool capslock_pressed_prev = find_key_in_report(&prev_report, 0x39);
+    bool capslock_pressed_now = keyboard_bitmap_test(state, HID_KEY_CAPS_LOCK);
+    bool capslock_pressed_prev = keyboard_bitmap_test(&prev_state, HID_KEY_CAPS_LOCK);
     
     if (capslock_pressed_now && !capslock_pressed_prev) {
         // CapsLock pressed
-        // uart_puts(uart0, "META\r\n");
         meta = true;
     } else if (!capslock_pressed_now && capslock_pressed_prev) {
         // CapsLock released
-        // uart_puts(uart0, "meta\r\n");
         meta = false;
     }
 
     if(!meta)
     {
-        // Check all key positions and detect all keys released state
-        bool current_has_keys = false;
-        bool prev_had_keys = false;
-        
-        // Process all possible key positions (check both current and previous reports)
-        for(uint8_t i=0; i<6; i++)
-        {
-            uint8_t current_keycode = report->keycode[i];
-            uint8_t prev_keycode = prev_report.keycode[i];
-            
-            // Track if any keys are present in current or previous reports
-            if (current_keycode != 0) current_has_keys = true;
-            if (prev_keycode != 0) prev_had_keys = true;
-            
-            // Check for key press (key in current report but not in previous)
-            /* if (current_keycode && !find_key_in_report(&prev_report, current_keycode))
-            {
-                bool const is_shift = report->modifier & (KEYBOARD_MODIFIER_LEFTSHIFT | KEYBOARD_MODIFIER_RIGHTSHIFT);
-                uint8_t ch = keycode2ascii[current_keycode][is_shift ? 1 : 0];
-
-                if (ch) {
-                    printf("%c", ch);
-                } else {
-                    printf("Key pressed: [Special] (keycode: 0x%02x)\n", current_keycode);
-                }
-            } */
-        }
+        macro_rec_keyboard(state);
 
-
-        // Create modified report without CapsLock for device output
-        hid_keyboard_report_t* modified_report = (hid_keyboard_report_t*)report;
-
-        if(USB_output_switch == 0) // USB出力の場合だけ、UART出力する
+        if(usb_output_is_local()) // USB出力の場合だけ、UART出力する
         {
+            usb_device_wake_keyboard(state);
+
             // First, try to send any buffered reports
             try_send_buffered_keyboard_reports();
             
             // Now try to send the current report
-            if (tud_connected() && tud_hid_n_ready(0)) {
-                // Send modified report (without CapsLock) to HID device
-                bool success = tud_hid_n_keyboard_report(0, 1, modified_report->modifier, modified_report->keycode);
+            if (usb_device_ready(0)) {
+                bool success = usb_device_keyboard_bitmap_report(state);
                 if (!success) {
                     // printf("Warning: Failed to send keyboard report to USB host (interface busy), buffering for retry\n");
-                    buffer_keyboard_report(modified_report);
-                } else {
-                    // Optional: Debug successful transmission
-                    // printf("Keyboard report sent successfully\n");
+                    buffer_keyboard_report(state);
                 }
             } else {
-                if (!tud_connected()) {
-                    // printf("Warning: USB device not connected, buffering keyboard report\n");
-                    buffer_keyboard_report(modified_report);
-                } else {
-                    // printf("Warning: USB keyboard interface not ready, buffering keyboard report\n");
-                    buffer_keyboard_report(modified_report);
-                }
+                // USB device not connected or keyboard interface not ready
+                buffer_keyboard_report(state);
             }
         }
         else
         {
-            uint8_t base64_output[16];
-            base64_output[0] = 'K';
-            base64_output[1] = '0' + USB_output_switch;
+            link_send_keyboard_nkro(USB_output_switch, (const uint8_t*)state);
 
-            base64_encode((uint8_t*)modified_report, sizeof(hid_keyboard_report_t), (char*)&(base64_output[2]), sizeof(base64_output) - 1);
-            base64_output[14] = '\n';
-            base64_output[15] = 0;
-
-            uart_puts(uart1, (char*)base64_output);
-            /*for(int i = 0; i < sizeof(hid_keyboard_report_t); i++)
+            // Check if all keys are released
+            uint8_t keycode[6];
+            if (keyboard_bitmap_to_keys(state, NULL, keycode) == 0 && state->modifier == 0x00)
             {
-                printf("%02X ", ((uint8_t*)modified_report)[i]);
+                // Send all keys released message to the target node
+                link_send_release_all(USB_output_switch);
             }
-            printf("%s\n", base64_output);*/
-            // Check if all keys are released after processing individual keys
-            if (!current_has_keys && modified_report->modifier == 0x00)
-            {
-                //printf("All keys released\n");
-                // Send all keys released message to UART1
-                uart_puts(uart1, "0\n");
-            }
-
         }
-
-
     }
     else
     {
         // If in META mode, handle key presses for Lua script execution
-        for(uint8_t i=0; i<6; i++)
+        for (uint16_t keycode = HID_KEY_A; keycode < KEYBOARD_NKRO_USAGES; keycode++)
         {
-            uint8_t keycode = report->keycode[i];
-            if ( keycode )
+            if (keyboard_bitmap_test(state, (uint8_t)keycode) && !keyboard_bitmap_test(&prev_state, (uint8_t)keycode))
             {
-                if ( !find_key_in_report(&prev_report, keycode) )
-                {
-                    // Key pressed in META mode - check for corresponding Lua script
-                    handle_meta_key(keycode);
-                }
+                // Key pressed in META mode - check for corresponding Lua script
+                handle_meta_key((uint8_t)keycode);
             }
         }
     }
-    prev_report = *report;
+    prev_state = *state;
+}
+
+// Send the merged media / system keys to the selected output
+static void process_keyboard_controls(const keyboard_control_state_t* state)
+{
+    static keyboard_control_state_t prev_state = { 0 };
+    if (memcmp(state, &prev_state, sizeof(*state)) == 0) return;
+    macro_rec_control(state->consumer, state->system);
+
+    if (usb_output_is_local()) {
+        usb_device_wake_control(state->consumer, state->system);
+        if (!usb_device_control_report(state->consumer, state->system)) {
+            printf("Warning: media key report dropped (queue full or boot protocol)\n");
+        }
+    } else {
+        link_send_control_keys(USB_output_switch, state->consumer, state->system);
+    }
+    prev_state = *state;
+}
+
+// Decode a keyboard report (boot or report protocol) and process the merged key state.
+// Returns false if the report still has to go to the gamepad parser (not a keyboard report,
+// or a report ID that also carries sticks / buttons, e.g. the Home button of a gamepad)
+bool process_kbd_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
+{
+    keyboard_device_info_t* device = find_keyboard_device(dev_addr, instance);
+    if (device == NULL) return false;
+
+    int result = device->report_protocol
+        ? keyboard_report_parser(&device->parser, report, len, &device->state)
+        : keyboard_boot_report_parser(report, len, &device->state);
+    if (result == -1) {
+        // not a keyboard report: media keys / system control on the same interface?
+        if (!device->report_protocol ||
+            keyboard_control_report_parser(&device->parser, report, len, &device->control) != 0) {
+            return false;
+        }
+        setLEDStateActive();
+
+        keyboard_control_state_t merged;
+        merge_keyboard_controls(&merged);
+        uint8_t data[USB_CONSUMER_KEYS * 2 + 1];
+        for (int i = 0; i < USB_CONSUMER_KEYS; i++) {
+            data[i * 2] = merged.consumer[i] & 0xFF;
+            data[i * 2 + 1] = merged.consumer[i] >> 8;
+        }
+        data[USB_CONSUMER_KEYS * 2] = merged.system;
+        raw_hid_stream_input('U', data, sizeof(data));
+        process_keyboard_controls(&merged);
+        return !keyboard_report_has_other_inputs(&device->parser, report, len);
+    }
+    if (result == -2) return true;      // rollover error: keep the previous state
+
+    setLEDStateActive();
+
+    keyboard_bitmap_t merged;
+    merge_keyboard_states(&merged);
+    raw_hid_stream_input('N', &merged, sizeof(merged));
+    process_keyboard_state(&merged);
+    return !device->report_protocol || !keyboard_report_has_other_inputs(&device->parser, report, len);
 }
 
 void processed_mouse_report_print(uint8_t const * report, uint16_t len, mouse_report_t mouse_report)
@@ -578,21 +644,30 @@ void process_mouse_report(uint8_t instance, uint8_t const * report, uint16_t len
         // processed_mouse_report_print(report, len, mouse_report);
     }
     setLEDStateActive();
+    raw_hid_stream_input('M', &mouse_report, sizeof(mouse_report));
+
+    // 高解像度ホイールのマウスは wheel/pan が 1/wheel_resolution ノッチ単位
+    uint8_t wheel_resolution = 1;
+    if (interface_report_parser_info[instance].parser_info != NULL &&
+        interface_report_parser_info[instance].parser_info->wheel_resolution > 1) {
+        wheel_resolution = interface_report_parser_info[instance].parser_info->wheel_resolution;
+    }
+    macro_rec_mouse(&mouse_report, wheel_resolution);
 
-    if(USB_output_switch == 0) // USB出力の場合だけ、UART出力する
+    if(usb_output_is_local()) // USB出力の場合だけ、UART出力する
     {
+        usb_device_wake_mouse(&mouse_report);
+
         // First, try to send any buffered mouse reports
         try_send_buffered_mouse_reports();
         
         // Now try to send the current mouse report
-        if (tud_connected() && tud_hid_n_ready(1)) {
+        if (usb_device_ready(1)) {
             // send mouse report to host
-            bool success = tud_hid_n_mouse_report(1, 2, mouse_report.buttons,
-                mouse_report.x, mouse_report.y,
-                mouse_report.wheel, mouse_report.pan);
+            bool success = usb_device_mouse_report_scaled(&mouse_report, wheel_resolution);
             if (!success) {
                 // printf("Warning: Failed to send mouse report to USB host (interface busy), buffering for retry\n");
-                buffer_mouse_report(&mouse_report);
+                buffer_mouse_report(&mouse_report, wheel_resolution);
             } else {
                 // Optional: Debug successful transmission
                 // printf("Mouse report sent successfully\n");
@@ -600,27 +675,28 @@ void process_mouse_report(uint8_t instance, uint8_t const * report, uint16_t len
         } else {
             if (!tud_connected()) {
                 // printf("Warning: USB device not connected, buffering mouse report\n");
-                buffer_mouse_report(&mouse_report);
+                buffer_mouse_report(&mouse_report, wheel_resolution);
             } else {
                 // printf("Warning: USB mouse interface not ready, buffering mouse report\n");
-                buffer_mouse_report(&mouse_report);
+                buffer_mouse_report(&mouse_report, wheel_resolution);
             }
         }
     }
     else
     {
-        // send mouse report to uart1
-        uint8_t base64_output[16];
-        base64_output[0] = 'M';
-        base64_output[1] = '0' + USB_output_switch;
-        base64_encode((uint8_t*)&mouse_report, sizeof(mouse_report_t), (char*)&(base64_output[2]), sizeof(base64_output) - 1);
-        /* printf("UART: mouse report sent: %s %d\n", base64_output, sizeof(mouse_report_t)); */
-
-        base64_output[14] = '\n';
-        base64_output[15] = 0;
-        
-        uart_puts(uart1, (char*)base64_output);
-        /* printf("%s", base64_output); */
+        // send mouse report to the target node over the link
+        // （リンクはノッチ単位なので、高解像度の端数は次のレポートへ持ち越す）
+        if (wheel_resolution > 1) {
+            static int16_t wheel_remainder[CFG_TUH_HID];
+            static int16_t pan_remainder[CFG_TUH_HID];
+            wheel_remainder[instance] += mouse_report.wheel;
+            pan_remainder[instance] += mouse_report.pan;
+            mouse_report.wheel = (int8_t)(wheel_remainder[instance] / wheel_resolution);
+            mouse_report.pan = (int8_t)(pan_remainder[instance] / wheel_resolution);
+            wheel_remainder[instance] -= mouse_report.wheel * wheel_resolution;
+            pan_remainder[instance] -= mouse_report.pan * wheel_resolution;
+        }
+        link_send_mouse(USB_output_switch, &mouse_report);
     }
 }
 
@@ -651,11 +727,36 @@ void usb_host_task(void)
 unsigned int lastReceivedLengthZero[CFG_TUH_HID] = { 0 };
 
 // Invoked when device with hid interface is mounted
+// Register a keyboard interface (boot keyboard or a report descriptor with keyboard fields)
+static void register_keyboard_device(uint8_t dev_addr, uint8_t instance, bool is_keyboard,
+                                     const keyboard_report_parser_info_t* parser, bool report_protocol)
+{
+    for (uint8_t i = 0; i < CFG_TUH_HID; i++) {
+        if (!keyboard_devices[i].connected) {
+            keyboard_devices[i].dev_addr = dev_addr;
+            keyboard_devices[i].instance = instance;
+            keyboard_devices[i].is_keyboard = is_keyboard;
+            keyboard_devices[i].report_protocol = report_protocol;
+            keyboard_devices[i].parser = *parser;
+            memset(&keyboard_devices[i].state, 0, sizeof(keyboard_devices[i].state));
+            memset(&keyboard_devices[i].control, 0, sizeof(keyboard_devices[i].control));
+            keyboard_devices[i].connected = true;
+            keyboard_device_count++;
+            printf("Registered keyboard device [%u:%u] %s (total: %d)\n", dev_addr, instance,
+                   report_protocol ? "report protocol" : "boot protocol", keyboard_device_count);
+            return;
+        }
+    }
+}
+
 void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_report, uint16_t desc_len)
 {
-    (void)desc_report;
-    (void)desc_len;
     lastReceivedLengthZero[instance] = 0;
+    uint8_t protocol = default_hid_protocol;
+
+    // Keyboard fields in the report descriptor (array or bitmap, with or without report IDs)
+    static keyboard_report_parser_info_t keyboard_parser;
+    keyboard_report_descriptor_parser(desc_report, desc_len, &keyboard_parser);
 
     // Interface protocol (hid_interface_protocol_enum_t)
     uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
@@ -694,18 +795,10 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
     {
         device_type = "Keyboard";
         
-        // Register this keyboard device
-        for (uint8_t i = 0; i < CFG_TUH_HID; i++) {
-            if (!keyboard_devices[i].connected) {
-                keyboard_devices[i].dev_addr = dev_addr;
-                keyboard_devices[i].instance = instance;
-                keyboard_devices[i].is_keyboard = true;
-                keyboard_devices[i].connected = true;
-                keyboard_device_count++;
-                printf("Registered keyboard device [%u:%u] (total: %d)\n", dev_addr, instance, keyboard_device_count);
-                break;
-            }
-        }
+        // Keep keyboards in report protocol when the descriptor can be decoded (full rollover),
+        // otherwise fall back to the fixed boot report
+        protocol = keyboard_parser.valid ? HID_PROTOCOL_REPORT : HID_PROTOCOL_BOOT;
+        register_keyboard_device(dev_addr, instance, true, &keyboard_parser, keyboard_parser.valid);
         if(tud_cdc_connected() || true)
         {
             char buffer[128];
@@ -717,6 +810,14 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
     else if(itf_protocol == HID_ITF_PROTOCOL_NONE)
     {
         device_type = "Gamepad/Generic";
+        
+        // e.g. the NKRO or media key interface of a keyboard: keyboard, consumer and system control
+        // reports are decoded, the rest (and report IDs that also have sticks / buttons, like a
+        // gamepad with a Home key) go to the gamepad parser
+        if (keyboard_parser.valid || keyboard_parser.control_count > 0) {
+            device_type = "Keyboard (report protocol)";
+            register_keyboard_device(dev_addr, instance, false, &keyboard_parser, true);
+        }
         if(tud_cdc_connected())
         {
             char buffer[128];
@@ -730,7 +831,7 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
     printf("[%04x:%04x] %s on Interface%u %s%s\n", 
            vid, pid, device_type, instance,
            has_custom_parser ? "(Custom Parser) " : "",
-           tuh_hid_set_protocol(dev_addr, instance, default_hid_protocol) ? "Ready" : "Ready (Protocol warning)");
+           tuh_hid_set_protocol(dev_addr, instance, protocol) ? "Ready" : "Ready (Protocol warning)");
 
     // Start receiving reports for all HID devices
     if ( !tuh_hid_receive_report(dev_addr, instance) )
@@ -749,23 +850,30 @@ void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance)
            dev_addr, instance, protocol_str[itf_protocol]);
     
     // Handle keyboard disconnection
-    if (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD) {
-        // Remove this keyboard from our tracking
-        for (uint8_t i = 0; i < CFG_TUH_HID; i++) {
-            if (keyboard_devices[i].connected && 
-                keyboard_devices[i].dev_addr == dev_addr && 
-                keyboard_devices[i].instance == instance) {
-                keyboard_devices[i].connected = false;
-                keyboard_devices[i].is_keyboard = false;
-                keyboard_device_count--;
-                printf("Unregistered keyboard device [%u:%u] (remaining: %d)\n", dev_addr, instance, keyboard_device_count);
-                break;
-            }
+    keyboard_device_info_t* keyboard = find_keyboard_device(dev_addr, instance);
+    if (keyboard != NULL) {
+        // Remove this keyboard from our tracking and release the keys it was holding
+        uint8_t keycode[6];
+        bool had_keys = keyboard_bitmap_to_keys(&keyboard->state, NULL, keycode) > 0 ||
+                        keyboard->state.modifier != 0;
+        keyboard->connected = false;
+        keyboard->is_keyboard = false;
+        keyboard_device_count--;
+        printf("Unregistered keyboard device [%u:%u] (remaining: %d)\n", dev_addr, instance, keyboard_device_count);
+        if (had_keys) {
+            keyboard_bitmap_t merged;
+            merge_keyboard_states(&merged);
+            process_keyboard_state(&merged);
+        }
+        if (keyboard->control.consumer[0] != 0 || keyboard->control.system != 0) {
+            keyboard_control_state_t merged;
+            merge_keyboard_controls(&merged);
+            process_keyboard_controls(&merged);
         }
     }
     
-    // Handle gamepad disconnection
-    if (itf_protocol == HID_ITF_PROTOCOL_NONE) {
+    // Handle gamepad disconnection (also a gamepad whose media keys were registered as a keyboard)
+    if (itf_protocol == HID_ITF_PROTOCOL_NONE && (keyboard == NULL || keyboard->parser.has_other_inputs)) {
         has_gamepad_key = false;
         gamepad_state_updated = true; // Trigger zero report send
         printf("Gamepad disconnected - clearing state\n");
@@ -778,6 +886,8 @@ void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance)
 // Invoked when received report from device via interrupt endpoint
 void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
 {
+    link_mark_ingress(); // Ingress timestamp for link latency measurement
+
     uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
 
     // Check if device is still connected - len=0 often indicates disconnection
@@ -812,7 +922,7 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
     switch(itf_protocol)
     {
         case HID_ITF_PROTOCOL_KEYBOARD:
-            process_kbd_report(dev_addr, (hid_keyboard_report_t const*) report, len );
+            process_kbd_report(dev_addr, instance, report, len);
         break;
 
         case HID_ITF_PROTOCOL_MOUSE:
@@ -821,6 +931,11 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
 
         case HID_ITF_PROTOCOL_NONE:
         default:
+            // Keyboard / media key reports on a non-boot interface (NKRO keyboards);
+            // false if the report is not one, or also carries gamepad inputs
+            if (process_kbd_report(dev_addr, instance, report, len)) {
+                break;
+            }
             // Handle gamepad and other HID devices (usually protocol = None)
             // Try to parse as Samwa gamepad first
             {
@@ -13,6 +13,7 @@
 // HID report structures
 #include "class/hid/hid.h"
 #include "MouseReportParser.h"
+#include "USBDeviceTask.h"  // For keyboard_bitmap_t
 
 #define VERSION_STRING "USB HID Switcher v1.0.1"
 
@@ -24,13 +25,14 @@ extern uint8_t const keycode2ascii[128][2];
 #define MOUSE_REPORT_BUFFER_SIZE 8
 
 typedef struct {
-    hid_keyboard_report_t report;
+    keyboard_bitmap_t report;
     uint32_t timestamp;
     bool valid;
 } buffered_keyboard_report_t;
 
 typedef struct {
     mouse_report_t report;
+    uint8_t wheel_resolution;
     uint32_t timestamp;
     bool valid;
 } buffered_mouse_report_t;
@@ -42,7 +44,7 @@ void try_send_buffered_mouse_reports(void);
 void send_keyboard_led_state(uint8_t led_state);
 
 // HID processing functions
-void process_kbd_report(uint8_t dev_addr, hid_keyboard_report_t const* report, uint16_t len);
+bool process_kbd_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len);
 void process_mouse_report(uint8_t instance, uint8_t const* report, uint16_t len);
 
 // TinyUSB Host HID Callbacks (these must be global)
@@ -9,6 +9,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include "LEDtask.h"
+#include "RawHID.h"
+#include "PioUsbDevice.h"
+#include "KeyTimeline.h"
+#include "MacroRecorder.h"
 
 // Version information
 #define VERSION_MAJOR 1
@@ -54,6 +58,9 @@ void task1_function(void)
     while (1)
     {
         tud_task(); // tinyusb device task
+        usb_device_schedule_task(); // SOF-synchronised mouse / gamepad reports
+        key_timeline_task(); // Frame-paced keyboard reports from Lua type()
+        macro_player_task(); // Recorded input playback (time_us_64 paced)
         hid_task();
 
         tuh_task();
@@ -62,6 +69,10 @@ void task1_function(void)
 
         uart_task(); // UART task for receiving mouse data from another Pico
 
+        raw_hid_task(); // Send queued raw HID responses / input stream
+
+        pio_usb_device2_task(); // Second device port (only when USBDevice2_Pin_DP is set)
+
     }
 }
 
@@ -7,6 +7,11 @@
 #include "tusb.h" // For HID_PROTOCOL_BOOT and HID_PROTOCOL_REPORT constants
 #include "ReportParser.h"
 #include "MouseReportParser.h"
+#include "LinkMux.h"
+#include "USBDeviceTask.h"  // For MOUSE_WHEEL_UNITS, usb_device_set_nkro
+#include "SofScheduler.h"   // For sof_sched_set_enabled
+#include "LuaArena.h"       // For lua_arena_set_limit
+#include "LuaTask.h"        // For lua_set_cpu_budget
 
 // Global counter for defined_report_parser_info array
 static int defined_parser_count = 0;
@@ -19,26 +24,25 @@ extern defined_mouse_report_parser_info_t defined_report_parser_info[99];
  * @return 0: 成功, 負の値: エラー
  */
 int read_config_file(void) {
-    char config_buffer[256];
-    int bytes_read;
+    lfs_file_t file;
+    char line[CONFIG_LINE_MAX];
+    int line_len;
+    uint8_t wake_sources = USB_WAKE_ALL;
+    uint16_t wake_motion = USB_WAKE_MOTION_DEFAULT;
     
     printf("Reading configuration file...\n");
     
-    // Read the config file
-    bytes_read = fstask_read_file("config", config_buffer, sizeof(config_buffer) - 1);
+    // Read the config file line by line (comments of any length, constant memory)
+    int err = fstask_open(&file, "config", false);
     
-    if (bytes_read < 0) {
-        printf("Failed to read config file: %d\n", bytes_read);
+    if (err < 0) {
+        printf("Failed to read config file: %d\n", err);
         printf("Using default settings\n");
-        return bytes_read;
+        return err;
     }
-    
-    // Null terminate the buffer
-    config_buffer[bytes_read] = '\0';
         
-    // Parse the PROTOCOL and DEVICEID settings
-    char *line = strtok(config_buffer, "\n\r");
-    while (line != NULL) {
+    // Parse the PROTOCOL, DEVICEID, NKRO, SOF_SYNC, WAKE, WAKE_MOTION, LUA_HEAP, LUA_BUDGET, POINTER, SCREEN, LINK, DOWNLINK and ROUTE settings
+    while ((line_len = fstask_read_line(&file, line, sizeof(line))) >= 0) {
         // Skip empty lines and comments
         if (line[0] != '\0' && line[0] != '#') {
             // Look for PROTOCOL= setting
@@ -75,24 +79,254 @@ int read_config_file(void) {
                 
                 // Parse the device ID as integer
                 int parsed_id = atoi(value);
-                if (parsed_id != 0 || strcmp(value, "0") == 0) {
+                if ((parsed_id != 0 || strcmp(value, "0") == 0) && parsed_id >= 0 && parsed_id < LINK_ADDR_BROADCAST) {
                     device_id = parsed_id;
                     printf("Device ID setting: %d\n", device_id);
                 } else {
                     printf("Invalid device ID setting: %s (keeping default: %d)\n", value, device_id);
                 }
             }
+            // Look for DOWNLINK= setting (ON: forward frames to the next node on the PIO UART)
+            else if (strncmp(line, "DOWNLINK=", 9) == 0) {
+                char *value = line + 9; // Skip "DOWNLINK="
+                
+                // Remove any trailing whitespace
+                char *end = value + strlen(value) - 1;
+                while (end > value && (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')) {
+                    end--;
+                }
+                *(end + 1) = '\0';
+                
+                if (strcmp(value, "ON") == 0) {
+                    printf("Downlink setting: ON\n");
+                    link_set_downlink_enabled(true);
+                } else if (strcmp(value, "OFF") == 0) {
+                    printf("Downlink setting: OFF\n");
+                    link_set_downlink_enabled(false);
+                } else {
+                    printf("Unknown downlink setting: %s (using default OFF)\n", value);
+                }
+            }
+            // Look for NKRO= setting (OFF: always send the 6-key report)
+            else if (strncmp(line, "NKRO=", 5) == 0) {
+                char *value = line + 5; // Skip "NKRO="
+                
+                // Remove any trailing whitespace
+                char *end = value + strlen(value) - 1;
+                while (end > value && (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')) {
+                    end--;
+                }
+                *(end + 1) = '\0';
+                
+                if (strcmp(value, "ON") == 0) {
+                    printf("NKRO setting: ON\n");
+                    usb_device_set_nkro(true);
+                } else if (strcmp(value, "OFF") == 0) {
+                    printf("NKRO setting: OFF\n");
+                    usb_device_set_nkro(false);
+                } else {
+                    printf("Unknown NKRO setting: %s (using default ON)\n", value);
+                }
+            }
+            // Look for SOF_SYNC= setting (OFF: send mouse / gamepad reports as soon as they arrive)
+            else if (strncmp(line, "SOF_SYNC=", 9) == 0) {
+                char *value = line + 9; // Skip "SOF_SYNC="
+                
+                // Remove any trailing whitespace
+                char *end = value + strlen(value) - 1;
+                while (end > value && (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')) {
+                    end--;
+                }
+                *(end + 1) = '\0';
+                
+                if (strcmp(value, "ON") == 0) {
+                    printf("SOF sync setting: ON\n");
+                    sof_sched_set_enabled(true);
+                } else if (strcmp(value, "OFF") == 0) {
+                    printf("SOF sync setting: OFF\n");
+                    sof_sched_set_enabled(false);
+                } else {
+                    printf("Unknown SOF sync setting: %s (using default ON)\n", value);
+                }
+            }
+            // Look for WAKE= setting (comma separated KEY, BUTTON, WHEEL, MOTION, GAMEPAD, or ALL / OFF)
+            else if (strncmp(line, "WAKE=", 5) == 0) {
+                char *value = line + 5; // Skip "WAKE="
+                uint8_t sources = 0;
+                bool valid = true;
+                
+                // Remove any trailing whitespace
+                char *end = value + strlen(value) - 1;
+                while (end > value && (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')) {
+                    end--;
+                }
+                *(end + 1) = '\0';
+                
+                char *item = value;
+                while (valid && *item != '\0') {
+                    char *next = strchr(item, ',');
+                    if (next != NULL) *next++ = '\0';
+                    else next = item + strlen(item);
+                    
+                    if (strcmp(item, "KEY") == 0) sources |= USB_WAKE_KEY;
+                    else if (strcmp(item, "BUTTON") == 0) sources |= USB_WAKE_BUTTON;
+                    else if (strcmp(item, "WHEEL") == 0) sources |= USB_WAKE_WHEEL;
+                    else if (strcmp(item, "MOTION") == 0) sources |= USB_WAKE_MOTION;
+                    else if (strcmp(item, "GAMEPAD") == 0) sources |= USB_WAKE_GAMEPAD;
+                    else if (strcmp(item, "ALL") == 0) sources |= USB_WAKE_ALL;
+                    else if (strcmp(item, "OFF") == 0) sources = 0;
+                    else {
+                        printf("Unknown wake source: %s (using default ALL)\n", item);
+                        valid = false;
+                    }
+                    item = next;
+                }
+                
+                if (valid) {
+                    printf("Wake setting: 0x%02X\n", sources);
+                    wake_sources = sources;
+                }
+            }
+            // Look for WAKE_MOTION= setting (counts of mouse motion within 100 ms needed to wake)
+            else if (strncmp(line, "WAKE_MOTION=", 12) == 0) {
+                char *value = line + 12; // Skip "WAKE_MOTION="
+                int counts = atoi(value);
+                
+                if (counts > 0 && counts <= 65535) {
+                    printf("Wake motion setting: %d counts\n", counts);
+                    wake_motion = (uint16_t)counts;
+                } else {
+                    printf("Invalid wake motion setting: %s (using default %d)\n", value, USB_WAKE_MOTION_DEFAULT);
+                }
+            }
+            // Look for LUA_HEAP= setting (KB of the Lua arena that scripts may use)
+            else if (strncmp(line, "LUA_HEAP=", 9) == 0) {
+                char *value = line + 9; // Skip "LUA_HEAP="
+                int kb = atoi(value);
+                
+                if (kb > 0 && kb * 1024 <= LUA_ARENA_SIZE) {
+                    printf("Lua heap setting: %d KB\n", kb);
+                    lua_arena_set_limit((size_t)kb * 1024);
+                } else {
+                    printf("Invalid Lua heap setting: %s (using %d KB)\n", value, LUA_ARENA_SIZE / 1024);
+                }
+            }
+            // Look for LUA_BUDGET= setting (ms a macro may run without sleeping, 0: no limit)
+            else if (strncmp(line, "LUA_BUDGET=", 11) == 0) {
+                char *value = line + 11; // Skip "LUA_BUDGET="
+                int ms = atoi(value);
+                
+                if (ms >= 0 && (value[0] >= '0' && value[0] <= '9')) {
+                    printf("Lua CPU budget setting: %d ms\n", ms);
+                    lua_set_cpu_budget((uint32_t)ms);
+                } else {
+                    printf("Invalid Lua CPU budget setting: %s (using %d ms)\n", value, LUA_CPU_BUDGET_DEFAULT_MS);
+                }
+            }
+            // Look for POINTER= setting (ABSOLUTE: send the virtual cursor position instead of relative motion)
+            else if (strncmp(line, "POINTER=", 8) == 0) {
+                char *value = line + 8; // Skip "POINTER="
+                
+                // Remove any trailing whitespace
+                char *end = value + strlen(value) - 1;
+                while (end > value && (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')) {
+                    end--;
+                }
+                *(end + 1) = '\0';
+                
+                if (strcmp(value, "ABSOLUTE") == 0) {
+                    printf("Pointer setting: ABSOLUTE\n");
+                    usb_device_pointer_set_mode(true);
+                } else if (strcmp(value, "RELATIVE") == 0) {
+                    printf("Pointer setting: RELATIVE\n");
+                    usb_device_pointer_set_mode(false);
+                } else {
+                    printf("Unknown pointer setting: %s (using default RELATIVE)\n", value);
+                }
+            }
+            // Look for SCREEN= setting (<width>x<height> of the target, used to scale relative motion)
+            else if (strncmp(line, "SCREEN=", 7) == 0) {
+                char *value = line + 7; // Skip "SCREEN="
+                unsigned int width = 0;
+                unsigned int height = 0;
+                
+                if (sscanf(value, "%ux%u", &width, &height) == 2 &&
+                    width > 0 && width <= 65535 && height > 0 && height <= 65535) {
+                    printf("Screen setting: %ux%u\n", width, height);
+                    usb_device_pointer_set_screen((uint16_t)width, (uint16_t)height);
+                } else {
+                    printf("Invalid screen setting: %s (using default %dx%d)\n",
+                           value, POINTER_DEFAULT_WIDTH, POINTER_DEFAULT_HEIGHT);
+                }
+            }
+            // Look for LINK= setting (UART, PIO, CDC or LOOPBACK transport towards the other Pico)
+            else if (strncmp(line, "LINK=", 5) == 0) {
+                char *value = line + 5; // Skip "LINK="
+                
+                // Remove any trailing whitespace
+                char *end = value + strlen(value) - 1;
+                while (end > value && (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')) {
+                    end--;
+                }
+                *(end + 1) = '\0';
+                
+                if (strcmp(value, "PIO") == 0) {
+                    printf("Link setting: PIO synchronous link\n");
+                    link_set_uplink(LINK_UPLINK_PIO);
+                } else if (strcmp(value, "UART") == 0) {
+                    printf("Link setting: UART1\n");
+                    link_set_uplink(LINK_UPLINK_UART);
+                } else if (strcmp(value, "CDC") == 0) {
+                    printf("Link setting: USB CDC\n");
+                    link_set_uplink(LINK_UPLINK_CDC);
+                } else if (strcmp(value, "LOOPBACK") == 0) {
+                    printf("Link setting: loopback\n");
+                    link_set_uplink(LINK_UPLINK_LOOPBACK);
+                } else {
+                    printf("Unknown link setting: %s (using default UART)\n", value);
+                }
+            }
+            // Look for ROUTE=<addr hex>,<UP|DOWN|LOCAL> setting
+            else if (strncmp(line, "ROUTE=", 6) == 0) {
+                char *value = line + 6; // Skip "ROUTE="
+                char *port = strchr(value, ',');
+                unsigned int addr;
+                
+                if (port != NULL && sscanf(value, "%x", &addr) == 1 && addr < LINK_ADDR_BROADCAST) {
+                    port++;
+                    if (strncmp(port, "UP", 2) == 0) {
+                        link_route_set((uint8_t)addr, LINK_PORT_UP);
+                    } else if (strncmp(port, "DOWN", 4) == 0) {
+                        link_route_set((uint8_t)addr, LINK_PORT_DOWN);
+                    } else if (strncmp(port, "LOCAL", 5) == 0) {
+                        link_route_set((uint8_t)addr, LINK_ROUTE_LOCAL);
+                    } else {
+                        printf("Invalid route port: %s\n", port);
+                        port = NULL;
+                    }
+                    if (port != NULL) {
+                        printf("Route setting: %02X -> %s\n", addr, port);
+                    }
+                } else {
+                    printf("Invalid route setting: %s\n", value);
+                }
+            }
         }
-        line = strtok(NULL, "\n\r");
     }
+    fstask_close(&file);
+    usb_device_set_wake(wake_sources, wake_motion);
     
+    if (line_len != FSTASK_EOF) {
+        printf("Failed to read config file: %d\n", line_len);
+        return line_len;
+    }
     return 0;
 }
 
 /**
  * Parse mouse device definition file and create mouse_report_parser_info_t
  */
-int parse_mouse_definition(const char* content, uint16_t vid, uint16_t pid) {
+int parse_mouse_definition(const char* filename, uint16_t vid, uint16_t pid) {
     static mouse_report_parser_info_t mouse_parser_storage[99]; // Static storage for parsed info
     static int storage_count = 0;
     
@@ -130,19 +364,20 @@ int parse_mouse_definition(const char* content, uint16_t vid, uint16_t pid) {
     parser->pan_index = 0xffff;
     parser->pan_bitpos = 0;
     parser->pan_size = 0;
+    parser->wheel_resolution = 1;
     
     printf("Parsing mouse definition for %04x:%04x\n", vid, pid);
     
-    // Parse line by line
-    char* content_copy = malloc(strlen(content) + 1);
-    if (content_copy == NULL) {
-        printf("Failed to allocate memory for content parsing\n");
+    // Parse line by line straight from the file
+    lfs_file_t file;
+    char line[CONFIG_LINE_MAX];
+    int err = fstask_open(&file, filename, false);
+    if (err < 0) {
+        printf("Failed to read device definition file '%s': %d\n", filename, err);
         return -1;
     }
-    strcpy(content_copy, content);
     
-    char* line = strtok(content_copy, "\n\r");
-    while (line != NULL) {
+    while (fstask_read_line(&file, line, sizeof(line)) >= 0) {
         // Skip empty lines and comments
         if (line[0] == '#') {
         } else if (line[0] != '\0') {
@@ -223,6 +458,17 @@ int parse_mouse_definition(const char* content, uint16_t vid, uint16_t pid) {
                     parser->wheel_size = (uint8_t)size;
                 }
             }
+            else if (strncmp(line, "HIRES", 5) == 0) {
+                int resolution;
+                // Wheel/pan counts per detent for mice that report high-resolution scrolling
+                char* data_start = line + 5;
+                while (*data_start == ' ' || *data_start == '\t') data_start++;
+                if (sscanf(data_start, "%d", &resolution) == 1 && resolution >= 1 && resolution <= MOUSE_WHEEL_UNITS) {
+                    parser->wheel_resolution = (uint8_t)resolution;
+                } else {
+                    printf("Invalid HIRES value: %s (must be 1-%d)\n", data_start, MOUSE_WHEEL_UNITS);
+                }
+            }
             else if (strncmp(line, "PAN", 3) == 0) {
                 int index, bitpos, size;
                 // Find the first digit after PAN (skip any spaces)
@@ -235,10 +481,9 @@ int parse_mouse_definition(const char* content, uint16_t vid, uint16_t pid) {
                 }
             }
         }
-        line = strtok(NULL, "\n\r");
     }
     
-    free(content_copy);
+    fstask_close(&file);
     storage_count++;
     defined_parser_count++;
     
@@ -272,24 +517,11 @@ void device_definition_callback(const char* name, int type, lfs_size_t size, voi
                     
                     if (sscanf(vid_str, "%hx", &vid) == 1 && sscanf(pid_str, "%hx", &pid) == 1) {
                         
-                        // Allocate buffer and read the file
-                        char* buffer = malloc(size + 1);
-                        if (buffer != NULL) {
-                            int bytes_read = fstask_read_file(name, buffer, size);
-                            if (bytes_read > 0) {
-                                buffer[bytes_read] = '\0';
-                                // Parse the mouse definition and create parser
-                                int parser_index = parse_mouse_definition(buffer, vid, pid);
-                                if (parser_index >= 0) {
-                                } else {
-                                    printf("Failed to create mouse parser\n");
-                                }
-                            } else {
-                                printf("Failed to read device definition file '%s': %d\n", name, bytes_read);
-                            }
-                            free(buffer);
+                        // Parse the mouse definition and create parser
+                        int parser_index = parse_mouse_definition(name, vid, pid);
+                        if (parser_index >= 0) {
                         } else {
-                            printf("Failed to allocate memory for device definition file '%s'\n", name);
+                            printf("Failed to create mouse parser\n");
                         }
                     } else {
                         printf("Failed to parse VID/PID from filename '%s'\n", name);
@@ -311,19 +543,18 @@ void device_definition_callback(const char* name, int type, lfs_size_t size, voi
                 if (vid_len == 4 && pid_len == 4) {
                     printf("Found keyboard device definition: %s (size: %d bytes)\n", name, (int)size);
                     
-                    // Allocate buffer and read the file
-                    char* buffer = malloc(size + 1);
-                    if (buffer != NULL) {
-                        int bytes_read = fstask_read_file(name, buffer, size);
-                        if (bytes_read > 0) {
-                            buffer[bytes_read] = '\0';
-                            printf("Device definition file '%s' contents:\n%s\n", name, buffer);
-                        } else {
-                            printf("Failed to read device definition file '%s': %d\n", name, bytes_read);
+                    // Print the file line by line
+                    lfs_file_t file;
+                    char line[CONFIG_LINE_MAX];
+                    int err = fstask_open(&file, name, false);
+                    if (err >= 0) {
+                        printf("Device definition file '%s' contents:\n", name);
+                        while (fstask_read_line(&file, line, sizeof(line)) >= 0) {
+                            printf("%s\n", line);
                         }
-                        free(buffer);
+                        fstask_close(&file);
                     } else {
-                        printf("Failed to allocate memory for device definition file '%s'\n", name);
+                        printf("Failed to read device definition file '%s': %d\n", name, err);
                     }
                 }
             }
@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include "lfs.h"  // For lfs_size_t type
 
+// config / device definition files are read one line at a time (longer lines are truncated)
+#define CONFIG_LINE_MAX 128
+
 // External reference to the global variable that will be set by the config
 extern uint8_t default_hid_protocol;
 extern int device_id;
@@ -29,13 +32,13 @@ int scan_and_read_device_definitions(void);
 void* find_device_parser(uint16_t vid, uint16_t pid);
 
 /**
- * Function to parse mouse definition from content string
- * @param content The content string containing mouse definition
+ * Function to parse mouse definition file (read line by line)
+ * @param filename Definition file (MOUSE-xxxx:yyyy)
  * @param vid Vendor ID
  * @param pid Product ID
  * @return 0: 成功, 負の値: エラー
  */
-int parse_mouse_definition(const char* content, uint16_t vid, uint16_t pid);
+int parse_mouse_definition(const char* filename, uint16_t vid, uint16_t pid);
 
 /**
  * Callback function for directory listing during device definition scanning
@@ -4,22 +4,46 @@
 #include "hardware/flash.h"
 #include "hardware/sync.h"
 #include "pico/multicore.h"
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "task.h"
 #include "lfs.h"
+#include "fstask.h"
 
 // LittleFS configuration for Pico flash
 #define FLASH_TARGET_OFFSET (1024 * 1024)  // 1MB from start of flash
+#define FS_BLOCK_COUNT 128                 // 512KB filesystem
 #define SAMPLE_FILENAME "sample.txt"
 
+// Staging area right after the filesystem, programmed without LittleFS (see fstask.h)
+#define FLASH_STAGING_OFFSET (FLASH_TARGET_OFFSET + FS_BLOCK_COUNT * FLASH_SECTOR_SIZE)
+
 // Variables used by the filesystem
 static lfs_t lfs;
 static struct lfs_config cfg;
 static bool fs_mounted = false;
 
+// LittleFS は LFS_THREADSAFE でビルドし、lfs_* の呼び出しごとにこのミューテックスを取る
+// （TUD タスクと Lua タスクなど、Core0 の複数のタスクから使うため）
+static SemaphoreHandle_t fs_mutex = NULL;
+
+// How long Core1 has been locked out by flash programs and erases
+static fstask_lockout_stats_t lockout_stats;
+
+static void lockout_account(uint32_t start_us) {
+    uint32_t elapsed = time_us_32() - start_us;
+    lockout_stats.count++;
+    lockout_stats.total_us += elapsed;
+    if (elapsed > lockout_stats.max_us) {
+        lockout_stats.max_us = elapsed;
+    }
+}
+
 // Read a region in a block. Negative error codes are propagated to user.
 static int block_device_read(const struct lfs_config *c, lfs_block_t block,
         lfs_off_t off, void *buffer, lfs_size_t size) {
-    uint32_t fs_start = XIP_BASE + FLASH_TARGET_OFFSET;
-    memcpy(buffer, (unsigned char *)(fs_start + (block * c->block_size) + off), size);
+    const unsigned char *fs_start = (const unsigned char *)XIP_BASE + FLASH_TARGET_OFFSET;
+    memcpy(buffer, fs_start + (block * c->block_size) + off, size);
     return 0;
 }
 
@@ -29,11 +53,13 @@ static int block_device_prog(const struct lfs_config *c, lfs_block_t block,
         lfs_off_t off, const void *buffer, lfs_size_t size) {
     uint32_t flash_offs = FLASH_TARGET_OFFSET + (block * c->block_size) + off;
     
+    uint32_t start = time_us_32();
     multicore_lockout_start_blocking();
     uint32_t ints = save_and_disable_interrupts();
     flash_range_program(flash_offs, buffer, size);
     restore_interrupts (ints);
     multicore_lockout_end_blocking();
+    lockout_account(start);
     return 0;
 }
 
@@ -42,11 +68,13 @@ static int block_device_prog(const struct lfs_config *c, lfs_block_t block,
 static int block_device_erase(const struct lfs_config *c, lfs_block_t block) {
     uint32_t flash_offs = FLASH_TARGET_OFFSET + (block * c->block_size);
     
+    uint32_t start = time_us_32();
     multicore_lockout_start_blocking();
     uint32_t ints = save_and_disable_interrupts();
     flash_range_erase(flash_offs, c->block_size);
     restore_interrupts (ints);
     multicore_lockout_end_blocking();
+    lockout_account(start);
     return 0;
 }
 
@@ -57,6 +85,35 @@ static int block_device_sync(const struct lfs_config *c) {
     return 0;
 }
 
+// Lock the filesystem (LFS_THREADSAFE). Only Core0 tasks use LittleFS; before the
+// scheduler starts there is only one caller, so the mutex is not taken.
+static int block_device_lock(const struct lfs_config *c) {
+    (void)c;
+    if (fs_mutex && xTaskGetSchedulerState() != taskSCHEDULER_NOT_STARTED) {
+        xSemaphoreTakeRecursive(fs_mutex, portMAX_DELAY);
+    }
+    return 0;
+}
+
+static int block_device_unlock(const struct lfs_config *c) {
+    (void)c;
+    if (fs_mutex && xTaskGetSchedulerState() != taskSCHEDULER_NOT_STARTED) {
+        xSemaphoreGiveRecursive(fs_mutex);
+    }
+    return 0;
+}
+
+// Hold the filesystem lock across several lfs_* calls (the mutex is recursive,
+// so the lfs_* calls inside take it again). Streaming handles opened with
+// fstask_open may be used from any Core0 task while others use LittleFS.
+static void fstask_lock(void) {
+    block_device_lock(&cfg);
+}
+
+static void fstask_unlock(void) {
+    block_device_unlock(&cfg);
+}
+
 /**
  * Mount and initialization function called at power-on
  * @return 0: Success, negative value: Error
@@ -64,16 +121,22 @@ static int block_device_sync(const struct lfs_config *c) {
 int fstask_mount_and_init(void) {
     printf("Initializing LittleFS...\n");
     
+    if (!fs_mutex) {
+        fs_mutex = xSemaphoreCreateRecursiveMutex();
+    }
+
     // Configuration of the filesystem
     cfg.read  = block_device_read;
     cfg.prog  = block_device_prog;
     cfg.erase = block_device_erase;
     cfg.sync  = block_device_sync;
+    cfg.lock  = block_device_lock;
+    cfg.unlock = block_device_unlock;
 
     cfg.read_size = 1;
     cfg.prog_size = FLASH_PAGE_SIZE;
     cfg.block_size = FLASH_SECTOR_SIZE;
-    cfg.block_count = 128;  // 512KB filesystem
+    cfg.block_count = FS_BLOCK_COUNT;
     cfg.cache_size = FLASH_SECTOR_SIZE;
     cfg.lookahead_size = 16;
     cfg.block_cycles = 500;
@@ -120,9 +183,11 @@ int fstask_read_file(const char *filename, char *buffer, size_t buffer_size) {
         return -1;
     }
     
+    fstask_lock();
     lfs_file_t file;
     int err = lfs_file_open(&lfs, &file, filename, LFS_O_RDONLY);
     if (err < 0) {
+        fstask_unlock();
         printf("Failed to open file '%s' for reading: %d\n", filename, err);
         return err;
     }
@@ -130,6 +195,7 @@ int fstask_read_file(const char *filename, char *buffer, size_t buffer_size) {
     // Read the file content
     lfs_ssize_t bytes_read = lfs_file_read(&lfs, &file, buffer, buffer_size - 1);
     lfs_file_close(&lfs, &file);
+    fstask_unlock();
     
     if (bytes_read < 0) {
         printf("Failed to read file '%s': %ld\n", filename, bytes_read);
@@ -144,6 +210,85 @@ int fstask_read_file(const char *filename, char *buffer, size_t buffer_size) {
 }
 
 
+/**
+ * Open a file for streaming (one lfs cache buffer per open file, whatever the file size)
+ * @param file File handle to initialise
+ * @param filename Name of file to open
+ * @param write true: create / truncate for writing, false: read only
+ * @return 0: Success, negative value: Error
+ */
+int fstask_open(lfs_file_t *file, const char *filename, bool write) {
+    if (!fs_mounted) {
+        return -1;
+    }
+    
+    if (!file || !filename) {
+        return -1;
+    }
+    
+    return lfs_file_open(&lfs, file, filename, write ? (LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) : LFS_O_RDONLY);
+}
+
+/**
+ * Read the next chunk of an open file
+ * @return Number of bytes read (0 at end of file), negative value on error
+ */
+int fstask_read(lfs_file_t *file, void *buffer, size_t size) {
+    return (int)lfs_file_read(&lfs, file, buffer, size);
+}
+
+/**
+ * Read the next line of an open file (without the line ending)
+ * Lines longer than the buffer are truncated and the rest of the line is skipped
+ * @return Length of the line, FSTASK_EOF at end of file, other negative value on error
+ */
+int fstask_read_line(lfs_file_t *file, char *line, size_t size) {
+    if (size < 2) {
+        return -1;
+    }
+    
+    // The read, the seek back and the skip below are one operation on the file
+    fstask_lock();
+    lfs_ssize_t bytes_read = lfs_file_read(&lfs, file, line, size - 1);
+    if (bytes_read <= 0) {
+        fstask_unlock();
+        return bytes_read < 0 ? (int)bytes_read : FSTASK_EOF;
+    }
+    
+    lfs_ssize_t len = 0;
+    while (len < bytes_read && line[len] != '\n') len++;
+    
+    if (len < bytes_read) {
+        // Rewind to the start of the next line
+        lfs_file_seek(&lfs, file, -(lfs_soff_t)(bytes_read - len - 1), LFS_SEEK_CUR);
+    } else {
+        // No line ending in the buffer: skip the rest of the line
+        char ch;
+        while (lfs_file_read(&lfs, file, &ch, 1) == 1 && ch != '\n') {
+        }
+    }
+    fstask_unlock();
+    
+    if (len > 0 && line[len - 1] == '\r') len--;
+    line[len] = '\0';
+    return (int)len;
+}
+
+/**
+ * Append data to a file opened for writing
+ * @return Number of bytes written, negative value on error
+ */
+int fstask_write(lfs_file_t *file, const void *data, size_t size) {
+    return (int)lfs_file_write(&lfs, file, data, size);
+}
+
+/**
+ * Close a file opened with fstask_open (writes are committed here)
+ * @return 0: Success, negative value: Error
+ */
+int fstask_close(lfs_file_t *file) {
+    return lfs_file_close(&lfs, file);
+}
 
 /**
  * Function to list directory contents
@@ -162,9 +307,11 @@ int fstask_list_directory(void (*callback)(const char* name, int type, lfs_size_
         return -1;
     }
     
+    fstask_lock();
     lfs_dir_t dir;
     int err = lfs_dir_open(&lfs, &dir, "/");
     if (err < 0) {
+        fstask_unlock();
         printf("Failed to open root directory: %d\n", err);
         return err;
     }
@@ -175,6 +322,7 @@ int fstask_list_directory(void (*callback)(const char* name, int type, lfs_size_
         if (res < 0) {
             printf("Failed to read directory: %d\n", res);
             lfs_dir_close(&lfs, &dir);
+            fstask_unlock();
             return res;
         }
         
@@ -192,6 +340,7 @@ int fstask_list_directory(void (*callback)(const char* name, int type, lfs_size_
     }
     
     lfs_dir_close(&lfs, &dir);
+    fstask_unlock();
     return 0;
 }
 
@@ -212,21 +361,25 @@ int fstask_remove_file(const char *filename) {
     }
     
     // Check if file exists first
+    fstask_lock();
     struct lfs_info info;
     int err = lfs_stat(&lfs, filename, &info);
     if (err < 0) {
+        fstask_unlock();
         printf("File '%s' not found: %d\n", filename, err);
         return err;
     }
     
     // Check if it's a regular file (not a directory)
     if (info.type != LFS_TYPE_REG) {
+        fstask_unlock();
         printf("'%s' is not a regular file (type: %d)\n", filename, info.type);
         return -1;
     }
     
     // Remove the file
     err = lfs_remove(&lfs, filename);
+    fstask_unlock();
     if (err < 0) {
         printf("Failed to remove file '%s': %d\n", filename, err);
         return err;
@@ -240,7 +393,7 @@ int fstask_remove_file(const char *filename) {
  * 指定されたファイルにバイナリデータを書き込む関数
  * @param filename 書き込むファイル名
  * @param data 書き込むデータ
- * @param data_size 書き込むデータのサイズ
+ * @param data_size 書き込むデータのサイズ（0: 空のファイルを作る）
  * @return 書き込んだバイト数、エラーの場合は負の値
  */
 int fstask_write_file(const char *filename, const void *data, size_t data_size) {
@@ -249,14 +402,16 @@ int fstask_write_file(const char *filename, const void *data, size_t data_size)
         return -1;
     }
     
-    if (!filename || !data || data_size == 0) {
+    if (!filename || (!data && data_size > 0)) {
         printf("Invalid parameters\n");
         return -1;
     }
     
+    fstask_lock();
     lfs_file_t file;
     int err = lfs_file_open(&lfs, &file, filename, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
     if (err < 0) {
+        fstask_unlock();
         printf("Failed to open file '%s' for writing: %d\n", filename, err);
         return err;
     }
@@ -264,6 +419,7 @@ int fstask_write_file(const char *filename, const void *data, size_t data_size)
     // Write the data
     lfs_ssize_t bytes_written = lfs_file_write(&lfs, &file, data, data_size);
     lfs_file_close(&lfs, &file);
+    fstask_unlock();
     
     if (bytes_written < 0) {
         printf("Failed to write file '%s': %ld\n", filename, bytes_written);
@@ -310,9 +466,11 @@ lfs_ssize_t fstask_get_file_size(const char *filename) {
         return -1;
     }
     
+    fstask_lock();
     lfs_file_t file;
     int err = lfs_file_open(&lfs, &file, filename, LFS_O_RDONLY);
     if (err < 0) {
+        fstask_unlock();
         printf("Failed to open file '%s' for size check: %d\n", filename, err);
         return err;
     }
@@ -320,6 +478,7 @@ lfs_ssize_t fstask_get_file_size(const char *filename) {
     // Get file size
     lfs_ssize_t size = lfs_file_size(&lfs, &file);
     lfs_file_close(&lfs, &file);
+    fstask_unlock();
     
     if (size < 0) {
         printf("Failed to get size of file '%s': %ld\n", filename, size);
@@ -330,6 +489,84 @@ lfs_ssize_t fstask_get_file_size(const char *filename) {
     return size;
 }
 
+/**
+ * Erase one sector of the staging area, unless it is already blank
+ * @param offset Offset in the staging area (multiple of FLASH_SECTOR_SIZE)
+ * @return 1: Erased, 0: Already blank, negative value: Error
+ */
+int fstask_staging_erase_sector(uint32_t offset) {
+    if (!fs_mounted || offset % FLASH_SECTOR_SIZE != 0 || offset >= FSTASK_STAGING_SIZE) {
+        return -1;
+    }
+    
+    // Reading through XIP does not need Core1 to stop
+    const uint32_t *sector = (const uint32_t *)(fstask_staging_data() + offset);
+    bool blank = true;
+    for (size_t i = 0; i < FLASH_SECTOR_SIZE / sizeof(uint32_t) && blank; i++) {
+        blank = sector[i] == 0xFFFFFFFF;
+    }
+    if (blank) {
+        return 0;
+    }
+    
+    // The lock keeps LittleFS (and its lockouts) out while Core1 is stopped here
+    fstask_lock();
+    uint32_t start = time_us_32();
+    multicore_lockout_start_blocking();
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(FLASH_STAGING_OFFSET + offset, FLASH_SECTOR_SIZE);
+    restore_interrupts(ints);
+    multicore_lockout_end_blocking();
+    lockout_account(start);
+    fstask_unlock();
+    return 1;
+}
+
+/**
+ * Program one page of the staging area (the page must have been erased)
+ * @param offset Offset in the staging area (multiple of FLASH_PAGE_SIZE)
+ * @param page FLASH_PAGE_SIZE bytes to write
+ * @return 0: Success, negative value: Error
+ */
+int fstask_staging_program_page(uint32_t offset, const uint8_t *page) {
+    if (!fs_mounted || offset % FLASH_PAGE_SIZE != 0 || offset >= FSTASK_STAGING_SIZE) {
+        return -1;
+    }
+    
+    fstask_lock();
+    uint32_t start = time_us_32();
+    multicore_lockout_start_blocking();
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_program(FLASH_STAGING_OFFSET + offset, page, FLASH_PAGE_SIZE);
+    restore_interrupts(ints);
+    multicore_lockout_end_blocking();
+    lockout_account(start);
+    fstask_unlock();
+    return 0;
+}
+
+/**
+ * Contents of the staging area (memory mapped through XIP)
+ */
+const uint8_t *fstask_staging_data(void) {
+    return (const uint8_t *)(XIP_BASE + FLASH_STAGING_OFFSET);
+}
+
+/**
+ * Get / clear the Core1 lockout statistics
+ */
+void fstask_get_lockout_stats(fstask_lockout_stats_t *stats) {
+    fstask_lock();
+    *stats = lockout_stats;
+    fstask_unlock();
+}
+
+void fstask_reset_lockout_stats(void) {
+    fstask_lock();
+    memset(&lockout_stats, 0, sizeof(lockout_stats));
+    fstask_unlock();
+}
+
 /**
  * ファイルシステムをアンマウントする関数
  * @return 0: 成功, 負の値: エラー
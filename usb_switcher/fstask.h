@@ -2,8 +2,21 @@
 #define FSTASK_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include "lfs.h"
 
+// LittleFS の後ろのステージング領域（LittleFS を通さずにページ単位で書く。入力の記録に使う）
+// 消去を先に済ませておけば、書いている間に Core1 を止めるのは1ページの書き込みの間だけになる
+#define FSTASK_STAGING_SIZE (256 * 1024)
+
+// flash の書き込み・消去で Core1 を止めた時間（multicore_lockout の開始から終了まで）
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+} fstask_lockout_stats_t;
+
 /**
  * 電源オン時に呼ぶマウントと初期化関数
  * @return 0: 成功, 負の値: エラー
@@ -19,6 +32,45 @@ int fstask_mount_and_init(void);
  */
 int fstask_read_file(const char *filename, char *buffer, size_t buffer_size);
 
+// fstask_read_line の終端（LFS_ERR_* とも引数エラーの -1 とも重ならない値）
+#define FSTASK_EOF  (-1000)
+
+/**
+ * ファイルを開く（少しずつ読み書きする場合。ファイルの大きさによらず、開いている間の
+ * メモリは LittleFS のキャッシュ1つ分だけ）
+ * 開いたまま他のタスクが LittleFS を使ってもよい（fstask_* と lfs_* の呼び出しごとに排他する）
+ * @param file 開いたファイル（fstask_close で閉じる）
+ * @param filename ファイル名
+ * @param write true: 新規作成/上書きで書き込み, false: 読み取り
+ * @return 0: 成功, 負の値: エラー
+ */
+int fstask_open(lfs_file_t *file, const char *filename, bool write);
+
+/**
+ * 開いたファイルの続きを読み取る
+ * @return 読み取ったバイト数（0: ファイルの終わり）、エラーの場合は負の値
+ */
+int fstask_read(lfs_file_t *file, void *buffer, size_t size);
+
+/**
+ * 開いたファイルから1行読み取る（改行は含まない）
+ * バッファより長い行は切り詰め、残りは読み飛ばす
+ * @return 行の長さ、ファイルの終わりは FSTASK_EOF、エラーの場合はそれ以外の負の値
+ */
+int fstask_read_line(lfs_file_t *file, char *line, size_t size);
+
+/**
+ * 書き込みで開いたファイルに追記する
+ * @return 書き込んだバイト数、エラーの場合は負の値
+ */
+int fstask_write(lfs_file_t *file, const void *data, size_t size);
+
+/**
+ * fstask_open で開いたファイルを閉じる（書き込みはここで確定する）
+ * @return 0: 成功, 負の値: エラー
+ */
+int fstask_close(lfs_file_t *file);
+
 /**
  * ディレクトリの内容をリストする関数
  * @param callback ファイル/ディレクトリ情報を処理するコールバック関数
@@ -38,7 +90,7 @@ int fstask_remove_file(const char *filename);
  * 指定されたファイルにバイナリデータを書き込む関数
  * @param filename 書き込むファイル名
  * @param data 書き込むデータ
- * @param data_size 書き込むデータのサイズ
+ * @param data_size 書き込むデータのサイズ（0: 空のファイルを作る）
  * @return 書き込んだバイト数、エラーの場合は負の値
  */
 int fstask_write_file(const char *filename, const void *data, size_t data_size);
@@ -50,6 +102,32 @@ int fstask_write_file(const char *filename, const void *data, size_t data_size);
  */
 lfs_ssize_t fstask_get_file_size(const char *filename);
 
+/**
+ * ステージング領域の1セクタを消去する（消去済みなら何もしない）
+ * @param offset 領域の先頭からの位置（FLASH_SECTOR_SIZE の倍数）
+ * @return 1: 消去した, 0: 消去済みだった, 負の値: エラー
+ */
+int fstask_staging_erase_sector(uint32_t offset);
+
+/**
+ * ステージング領域に1ページ書く（消去済みのページにだけ書ける）
+ * @param offset 領域の先頭からの位置（FLASH_PAGE_SIZE の倍数）
+ * @param page 書き込む FLASH_PAGE_SIZE バイト
+ * @return 0: 成功, 負の値: エラー
+ */
+int fstask_staging_program_page(uint32_t offset, const uint8_t *page);
+
+/**
+ * ステージング領域の内容（XIP で読める）
+ */
+const uint8_t *fstask_staging_data(void);
+
+/**
+ * Core1 を止めた時間の統計を取得する / クリアする
+ */
+void fstask_get_lockout_stats(fstask_lockout_stats_t *stats);
+void fstask_reset_lockout_stats(void);
+
 /**
  * ファイルシステムをアンマウントする関数
  * @return 0: 成功, 負の値: エラー
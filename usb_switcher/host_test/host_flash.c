@@ -0,0 +1,79 @@
+#include "host_flash.h"
+#include <string.h>
+#include "hardware/flash.h"
+#include "pico/multicore.h"
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "task.h"
+
+uint8_t host_flash[HOST_FLASH_SIZE];
+host_flash_stats_t host_flash_stats;
+
+void host_flash_reset(void)
+{
+    memset(host_flash, 0xFF, sizeof(host_flash));
+    memset(&host_flash_stats, 0, sizeof(host_flash_stats));
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count)
+{
+    if (flash_offs % FLASH_SECTOR_SIZE != 0 || count % FLASH_SECTOR_SIZE != 0 ||
+        flash_offs + count > HOST_FLASH_SIZE) {
+        host_flash_stats.misaligned++;
+        return;
+    }
+    memset(&host_flash[flash_offs], 0xFF, count);
+    host_flash_stats.erases += count / FLASH_SECTOR_SIZE;
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t* data, size_t count)
+{
+    if (flash_offs % FLASH_PAGE_SIZE != 0 || count % FLASH_PAGE_SIZE != 0 ||
+        flash_offs + count > HOST_FLASH_SIZE) {
+        host_flash_stats.misaligned++;
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (host_flash[flash_offs + i] != 0xFF) host_flash_stats.unerased++;
+        host_flash[flash_offs + i] &= data[i];
+    }
+    host_flash_stats.programs++;
+}
+
+void multicore_lockout_start_blocking(void)
+{
+    host_flash_stats.lockouts++;
+}
+
+void multicore_lockout_end_blocking(void)
+{
+}
+
+//--------------------------------------------------------------------+
+// FreeRTOS（シングルスレッドなので取るだけ）
+//--------------------------------------------------------------------+
+
+static int mutex;
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+    return &mutex;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t handle, TickType_t ticks)
+{
+    (void)handle;
+    (void)ticks;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t handle)
+{
+    (void)handle;
+    return pdTRUE;
+}
+
+BaseType_t xTaskGetSchedulerState(void)
+{
+    return taskSCHEDULER_RUNNING;
+}
@@ -0,0 +1,30 @@
+#ifndef HOST_FLASH_H
+#define HOST_FLASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//--------------------------------------------------------------------+
+// ホスト上の flash（fstask.c をそのまま動かすためのもの）
+//
+// hardware/flash.h の flash_range_erase / flash_range_program を RAM の host_flash[] で
+// NOR flash と同じように動かす（消去で 0xFF、書き込みは 1 -> 0 だけ）。
+// multicore_lockout と fstask.c が使う FreeRTOS のミューテックスも置き換える。
+//--------------------------------------------------------------------+
+
+typedef struct {
+    unsigned long erases;           // 消去したセクタ数
+    unsigned long programs;         // flash_range_program の回数
+    unsigned long lockouts;         // multicore_lockout_start_blocking の回数
+    unsigned long misaligned;       // ページ・セクタの境界に合っていない操作
+    unsigned long unerased;         // 消去していないバイトへの書き込み
+} host_flash_stats_t;
+
+extern host_flash_stats_t host_flash_stats;
+
+/**
+ * flash を全部消去した状態にし、統計をクリアする
+ */
+void host_flash_reset(void);
+
+#endif // HOST_FLASH_H
@@ -0,0 +1,280 @@
+#include "host_node.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/util/queue.h"
+#include "tusb.h"
+#include "LinkMux.h"
+#include "UARTtask.h"
+#include "PioUart.h"
+#include "PioLink.h"
+#include "fstask.h"
+#include "LuaCache.h"
+
+//--------------------------------------------------------------------+
+// ノードの状態
+//--------------------------------------------------------------------+
+
+int device_id = 0xFF;
+
+static host_wire_t* up_tx;
+static host_wire_t* up_rx;
+static uint32_t clock_offset;
+static uint32_t now_us;
+static uint core_num = 0;
+
+static char last_frame[LINK_LINE_MAX];
+static unsigned long frame_count = 0;
+
+#define HOST_FILES 4
+
+typedef struct {
+    char name[32];
+    uint8_t* data;
+    size_t len;
+} host_file_t;
+
+static host_file_t files[HOST_FILES];
+
+void host_node_init(int id, host_wire_t* tx, host_wire_t* rx, uint32_t clock_offset_us)
+{
+    device_id = id;
+    up_tx = tx;
+    up_rx = rx;
+    clock_offset = clock_offset_us;
+    link_mux_init();
+}
+
+void host_node_set_time(uint32_t time)
+{
+    now_us = time;
+}
+
+void host_node_run(void)
+{
+    core_num = 1;
+    link_task();
+    core_num = 0;
+    link_bulk_task();
+}
+
+const char* host_node_last_frame(void)
+{
+    return last_frame;
+}
+
+unsigned long host_node_frame_count(void)
+{
+    return frame_count;
+}
+
+static host_file_t* find_file(const char* name)
+{
+    for (int i = 0; i < HOST_FILES; i++) {
+        if (files[i].data && strcmp(files[i].name, name) == 0) return &files[i];
+    }
+    return NULL;
+}
+
+void host_node_put_file(const char* name, const void* data, size_t len)
+{
+    host_file_t* file = find_file(name);
+    for (int i = 0; !file && i < HOST_FILES; i++) {
+        if (!files[i].data) file = &files[i];
+    }
+    if (!file) abort();
+
+    free(file->data);
+    snprintf(file->name, sizeof(file->name), "%s", name);
+    file->data = malloc(len ? len : 1);
+    memcpy(file->data, data, len);
+    file->len = len;
+}
+
+int host_node_get_file(const char* name, void* buffer, size_t size)
+{
+    host_file_t* file = find_file(name);
+    if (!file) return -1;
+    size_t len = file->len < size ? file->len : size;
+    memcpy(buffer, file->data, len);
+    return (int)file->len;
+}
+
+//--------------------------------------------------------------------+
+// pico-sdk の置き換え
+//--------------------------------------------------------------------+
+
+uint32_t time_us_32(void)
+{
+    return now_us + clock_offset;
+}
+
+uint64_t time_us_64(void)
+{
+    return time_us_32();
+}
+
+uint get_core_num(void)
+{
+    return core_num;
+}
+
+//--------------------------------------------------------------------+
+// CDC（未接続）
+//--------------------------------------------------------------------+
+
+bool tud_cdc_n_connected(uint8_t itf)
+{
+    (void)itf;
+    return false;
+}
+
+uint32_t tud_cdc_n_write(uint8_t itf, void const* buffer, uint32_t bufsize)
+{
+    (void)itf;
+    (void)buffer;
+    return bufsize;
+}
+
+uint32_t tud_cdc_n_write_flush(uint8_t itf)
+{
+    (void)itf;
+    return 0;
+}
+
+uint32_t tud_cdc_n_write_available(uint8_t itf)
+{
+    (void)itf;
+    return 64;
+}
+
+//--------------------------------------------------------------------+
+// トランスポート: 上流ポートは線路、PIO は使えない
+//--------------------------------------------------------------------+
+
+static link_transport_stats_t wire_stats;
+
+static bool wire_can_send(void)
+{
+    return host_wire_can_put(up_tx);
+}
+
+static bool wire_send_frame(const char* frame, size_t len)
+{
+    if (!host_wire_put(up_tx, frame, len)) {
+        wire_stats.errors++;
+        return false;
+    }
+    wire_stats.frames_sent++;
+    wire_stats.bytes_sent += len + 1;
+    return true;
+}
+
+static size_t wire_poll_frame(char* frame, size_t size)
+{
+    size_t len = host_wire_take(up_rx, frame, size);
+    if (len > 0) {
+        wire_stats.frames_received++;
+        wire_stats.bytes_received += len + 1;
+    }
+    return len;
+}
+
+const link_transport_t uart_link_transport = {
+    .name = "wire",
+    .can_send = wire_can_send,
+    .send_frame = wire_send_frame,
+    .poll_frame = wire_poll_frame,
+    .stats = &wire_stats,
+};
+
+static link_transport_stats_t unused_stats;
+
+static bool unused_can_send(void)
+{
+    return false;
+}
+
+static bool unused_send_frame(const char* frame, size_t len)
+{
+    (void)frame;
+    (void)len;
+    return false;
+}
+
+static size_t unused_poll_frame(char* frame, size_t size)
+{
+    (void)frame;
+    (void)size;
+    return 0;
+}
+
+const link_transport_t pio_uart_transport = {
+    .name = "pio-uart",
+    .can_send = unused_can_send,
+    .send_frame = unused_send_frame,
+    .poll_frame = unused_poll_frame,
+    .stats = &unused_stats,
+};
+
+const link_transport_t pio_link_transport = {
+    .name = "pio-link",
+    .can_send = unused_can_send,
+    .send_frame = unused_send_frame,
+    .poll_frame = unused_poll_frame,
+    .stats = &unused_stats,
+};
+
+int pio_uart_init(void)
+{
+    return -1;
+}
+
+int pio_link_init(void)
+{
+    return -1;
+}
+
+//--------------------------------------------------------------------+
+// 自ノード宛てフレームと LittleFS の置き換え
+//--------------------------------------------------------------------+
+
+void uart_process_frame(const char* line)
+{
+    // 実機では USB デバイスのレポートを送るので Core1 からしか呼べない
+    if (core_num != 1) {
+        fprintf(stderr, "uart_process_frame('%s') called on Core0\n", line);
+        abort();
+    }
+    snprintf(last_frame, sizeof(last_frame), "%s", line);
+    frame_count++;
+}
+
+lfs_ssize_t fstask_get_file_size(const char* filename)
+{
+    host_file_t* file = find_file(filename);
+    return file ? (lfs_ssize_t)file->len : LFS_ERR_NOENT;
+}
+
+int fstask_read_file(const char* filename, char* buffer, size_t buffer_size)
+{
+    host_file_t* file = find_file(filename);
+    if (!file) return LFS_ERR_NOENT;
+    if (buffer_size == 0) return 0;
+    size_t len = file->len < buffer_size - 1 ? file->len : buffer_size - 1;
+    memcpy(buffer, file->data, len);
+    buffer[len] = '\0';
+    return (int)len;
+}
+
+int fstask_write_file(const char* filename, const void* data, size_t data_size)
+{
+    host_node_put_file(filename, data, data_size);
+    return (int)data_size;
+}
+
+void lua_cache_schedule(const char* filename)
+{
+    (void)filename;
+}
@@ -0,0 +1,89 @@
+#ifndef HOST_NODE_H
+#define HOST_NODE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+//--------------------------------------------------------------------+
+// ホスト上で動かすリンクのノード（LinkMux のホストテスト用）
+//
+// LinkMux.c / LinkTransport.c / LinkLatency.c を共有ライブラリとしてノードごとに
+// ビルドし、テストが dlopen で2つ読み込む（static な状態がノードごとに分かれる）。
+// UART1（上流ポート）の代わりに host_wire_t でノード同士をつなぐ。
+// 時計・CDC・LittleFS は host_node.c、queue_t は host_queue.c と shim/ の置き換えで動かす。
+//--------------------------------------------------------------------+
+
+#define HOST_WIRE_DEPTH     8       // 線路上に置けるフレーム数（相手が読むまで送れない）
+#define HOST_WIRE_FRAME_MAX 80      // LINK_FRAME_MAX
+
+// 片方向の線路（送信側ノード -> 受信側ノード）
+typedef struct {
+    char frames[HOST_WIRE_DEPTH][HOST_WIRE_FRAME_MAX];
+    unsigned head;
+    unsigned tail;
+    unsigned long frames_passed;
+} host_wire_t;
+
+static inline bool host_wire_can_put(const host_wire_t* wire)
+{
+    return wire->head - wire->tail < HOST_WIRE_DEPTH;
+}
+
+static inline bool host_wire_put(host_wire_t* wire, const char* frame, size_t len)
+{
+    if (!host_wire_can_put(wire) || len >= HOST_WIRE_FRAME_MAX) return false;
+    char* slot = wire->frames[wire->head % HOST_WIRE_DEPTH];
+    memcpy(slot, frame, len);
+    slot[len] = '\0';
+    wire->head++;
+    wire->frames_passed++;
+    return true;
+}
+
+static inline size_t host_wire_take(host_wire_t* wire, char* frame, size_t size)
+{
+    if (wire->head == wire->tail) return 0;
+    const char* slot = wire->frames[wire->tail % HOST_WIRE_DEPTH];
+    size_t len = strlen(slot);
+    wire->tail++;
+    if (len >= size) return 0;
+    memcpy(frame, slot, len + 1);
+    return len;
+}
+
+/**
+ * ノードを初期化する（DEVICEID を設定して link_mux_init を呼ぶ）
+ * @param id DEVICEID
+ * @param tx 上流ポートの送信線路
+ * @param rx 上流ポートの受信線路
+ * @param clock_offset_us このノードの時計のずれ（共通の時刻に足す）
+ */
+void host_node_init(int id, host_wire_t* tx, host_wire_t* rx, uint32_t clock_offset_us);
+
+/**
+ * 共通の時刻を設定する（ノードの time_us_32 は now_us + clock_offset_us）
+ */
+void host_node_set_time(uint32_t now_us);
+
+/**
+ * 1周分動かす: Core1 の link_task と Core0 の link_bulk_task
+ */
+void host_node_run(void);
+
+/**
+ * 自ノード宛てとして処理したフレーム（uart_process_frame に渡された行）
+ * @return 最後のフレーム（なければ空文字列）
+ */
+const char* host_node_last_frame(void);
+unsigned long host_node_frame_count(void);
+
+/**
+ * ノードの LittleFS の代わりのファイル
+ * @return host_node_get_file: ファイルの長さ（なければ -1）
+ */
+void host_node_put_file(const char* name, const void* data, size_t len);
+int host_node_get_file(const char* name, void* buffer, size_t size);
+
+#endif // HOST_NODE_H
@@ -0,0 +1,15 @@
+#ifndef HOST_SHIM_FREERTOS_H
+#define HOST_SHIM_FREERTOS_H
+
+// ホストテスト用の FreeRTOS（fstask.c のミューテックスの分だけ。シングルスレッドなので何もしない）
+
+#include <stdint.h>
+
+typedef void* SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+
+#define portMAX_DELAY   ((TickType_t)0xFFFFFFFF)
+#define pdTRUE          1
+
+#endif // HOST_SHIM_FREERTOS_H
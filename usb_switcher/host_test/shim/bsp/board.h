@@ -0,0 +1,8 @@
+#ifndef HOST_SHIM_BSP_BOARD_H
+#define HOST_SHIM_BSP_BOARD_H
+
+#include <stdint.h>
+
+uint32_t board_millis(void);
+
+#endif // HOST_SHIM_BSP_BOARD_H
@@ -0,0 +1,3 @@
+#ifndef HOST_SHIM_HARDWARE_CLOCKS_H
+#define HOST_SHIM_HARDWARE_CLOCKS_H
+#endif // HOST_SHIM_HARDWARE_CLOCKS_H
@@ -0,0 +1,19 @@
+#ifndef HOST_SHIM_HARDWARE_FLASH_H
+#define HOST_SHIM_HARDWARE_FLASH_H
+
+// ホストテスト用の hardware/flash.h（flash は host_flash.c の RAM、XIP はその先頭）
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FLASH_PAGE_SIZE     256u
+#define FLASH_SECTOR_SIZE   4096u
+#define HOST_FLASH_SIZE     (2u * 1024 * 1024)
+
+extern uint8_t host_flash[HOST_FLASH_SIZE];
+#define XIP_BASE            ((uintptr_t)host_flash)
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t* data, size_t count);
+
+#endif // HOST_SHIM_HARDWARE_FLASH_H
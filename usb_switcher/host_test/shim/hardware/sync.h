@@ -0,0 +1,10 @@
+#ifndef HOST_SHIM_HARDWARE_SYNC_H
+#define HOST_SHIM_HARDWARE_SYNC_H
+
+#include <stdint.h>
+
+static inline void __dmb(void) { __sync_synchronize(); }
+static inline uint32_t save_and_disable_interrupts(void) { return 0; }
+static inline void restore_interrupts(uint32_t status) { (void)status; }
+
+#endif // HOST_SHIM_HARDWARE_SYNC_H
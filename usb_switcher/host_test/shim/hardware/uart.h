@@ -0,0 +1,8 @@
+#ifndef HOST_SHIM_HARDWARE_UART_H
+#define HOST_SHIM_HARDWARE_UART_H
+
+// UARTtask.h の UART_ID 用（ホストテストでは使わない）
+typedef struct uart_inst uart_inst_t;
+#define uart1 ((uart_inst_t*)0)
+
+#endif // HOST_SHIM_HARDWARE_UART_H
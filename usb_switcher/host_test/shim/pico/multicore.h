@@ -0,0 +1,8 @@
+#ifndef HOST_SHIM_PICO_MULTICORE_H
+#define HOST_SHIM_PICO_MULTICORE_H
+
+// Core1 の一時停止（host_flash.c が数える）
+void multicore_lockout_start_blocking(void);
+void multicore_lockout_end_blocking(void);
+
+#endif // HOST_SHIM_PICO_MULTICORE_H
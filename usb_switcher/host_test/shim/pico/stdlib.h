@@ -0,0 +1,23 @@
+#ifndef HOST_SHIM_PICO_STDLIB_H
+#define HOST_SHIM_PICO_STDLIB_H
+
+// ホストテスト用の pico/stdlib.h（リンク層が使う分だけ）
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "hardware/gpio.h"
+#include "hardware/uart.h"
+
+typedef unsigned int uint;
+
+/** ノードの時計（リンク層のテストでは host_node_set_time で設定する。他のテストは自分で定義する） */
+uint32_t time_us_32(void);
+uint64_t time_us_64(void);
+
+/** 0: FreeRTOS タスク側, 1: USB ホスト側のループ（host_node_run が link_task の間だけ 1 にする） */
+uint get_core_num(void);
+
+static inline void tight_loop_contents(void) {}
+
+#endif // HOST_SHIM_PICO_STDLIB_H
@@ -0,0 +1,6 @@
+#ifndef HOST_SHIM_PICO_TIME_H
+#define HOST_SHIM_PICO_TIME_H
+
+#include "pico/stdlib.h"
+
+#endif // HOST_SHIM_PICO_TIME_H
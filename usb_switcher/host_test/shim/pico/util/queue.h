@@ -0,0 +1,30 @@
+#ifndef HOST_SHIM_PICO_UTIL_QUEUE_H
+#define HOST_SHIM_PICO_UTIL_QUEUE_H
+
+// ホストテスト用の queue_t（固定長要素のリングバッファ、シングルスレッド）
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/stdlib.h"
+
+typedef struct {
+    uint8_t* data;
+    uint element_size;
+    uint element_count;     // 容量 + 1
+    uint wptr;
+    uint rptr;
+} queue_t;
+
+void queue_init(queue_t* q, uint element_size, uint element_count);
+void queue_free(queue_t* q);
+uint queue_get_level(queue_t* q);
+bool queue_is_empty(queue_t* q);
+bool queue_is_full(queue_t* q);
+bool queue_try_add(queue_t* q, const void* data);
+bool queue_try_remove(queue_t* q, void* data);
+bool queue_try_peek(queue_t* q, void* data);
+/** シングルスレッドでは待っても空かないので、満杯なら abort する */
+void queue_add_blocking(queue_t* q, const void* data);
+void queue_remove_blocking(queue_t* q, void* data);
+
+#endif // HOST_SHIM_PICO_UTIL_QUEUE_H
@@ -0,0 +1,10 @@
+#ifndef HOST_SHIM_SEMPHR_H
+#define HOST_SHIM_SEMPHR_H
+
+#include "FreeRTOS.h"
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t ticks);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex);
+
+#endif // HOST_SHIM_SEMPHR_H
@@ -0,0 +1,12 @@
+#ifndef HOST_SHIM_TASK_H
+#define HOST_SHIM_TASK_H
+
+#include "FreeRTOS.h"
+
+#define taskSCHEDULER_SUSPENDED     0
+#define taskSCHEDULER_NOT_STARTED   1
+#define taskSCHEDULER_RUNNING       2
+
+BaseType_t xTaskGetSchedulerState(void);
+
+#endif // HOST_SHIM_TASK_H
@@ -0,0 +1,229 @@
+// LinkMux の2ノードテスト
+//
+// 同じリンク層を2つの共有ライブラリ（ノード A, B）として読み込み、上流ポート同士を
+// host_wire_t でつないで（2台の Pico を UART1 でつないだ構成）、
+//   - ping/pong による時刻同期
+//   - アドレス付きフレームのルーティング（相手宛て・自ノード宛て・経路なし）
+//   - バルクチャネルでのファイル転送（クレジット制御を含む）
+// を確かめる。
+//
+//   test_link_mux <node_a.so> <node_b.so>
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host_node.h"
+#include "base64.h"
+
+#define NODE_A_ID       0x01
+#define NODE_B_ID       0x02
+#define NODE_B_OFFSET   5000u   // B の時計は A より 5ms 進んでいる
+#define STEP_US         50u
+#define LINK_PORT_UP    0       // LinkMux.h の link_port_id_t
+#define LINK_CH_BULK_FILE 2     // LinkMux.h の link_channel_t
+
+typedef struct {
+    const char* name;
+    void* handle;
+    void (*init)(int id, host_wire_t* tx, host_wire_t* rx, uint32_t clock_offset_us);
+    void (*set_time)(uint32_t now_us);
+    void (*run)(void);
+    const char* (*last_frame)(void);
+    unsigned long (*frame_count)(void);
+    void (*put_file)(const char* name, const void* data, size_t len);
+    int (*get_file)(const char* name, void* buffer, size_t size);
+    bool (*send_keyboard)(uint8_t dst, const uint8_t report[8]);
+    int (*push_file)(const char* filename);
+    bool (*bulk_busy)(int ch);
+    bool (*clock_to_local)(int port, uint32_t remote_time, uint32_t* local_time);
+} node_t;
+
+static node_t node_a = { .name = "A" };
+static node_t node_b = { .name = "B" };
+static host_wire_t wire_ab;
+static host_wire_t wire_ba;
+static uint32_t now_us = 0;
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            failures++; \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+        } \
+    } while (0)
+
+static void* load_symbol(node_t* node, const char* symbol)
+{
+    void* address = dlsym(node->handle, symbol);
+    if (!address) {
+        fprintf(stderr, "node %s: missing symbol %s\n", node->name, symbol);
+        exit(2);
+    }
+    return address;
+}
+
+static void load_node(node_t* node, const char* path)
+{
+    // RTLD_LOCAL: ノードごとに別のライブラリファイルなので static な状態も別になる
+    node->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!node->handle) {
+        fprintf(stderr, "node %s: %s\n", node->name, dlerror());
+        exit(2);
+    }
+    *(void**)&node->init = load_symbol(node, "host_node_init");
+    *(void**)&node->set_time = load_symbol(node, "host_node_set_time");
+    *(void**)&node->run = load_symbol(node, "host_node_run");
+    *(void**)&node->last_frame = load_symbol(node, "host_node_last_frame");
+    *(void**)&node->frame_count = load_symbol(node, "host_node_frame_count");
+    *(void**)&node->put_file = load_symbol(node, "host_node_put_file");
+    *(void**)&node->get_file = load_symbol(node, "host_node_get_file");
+    *(void**)&node->send_keyboard = load_symbol(node, "link_send_keyboard");
+    *(void**)&node->push_file = load_symbol(node, "link_push_file");
+    *(void**)&node->bulk_busy = load_symbol(node, "link_bulk_busy");
+    *(void**)&node->clock_to_local = load_symbol(node, "link_clock_to_local");
+}
+
+// 両ノードを steps 周動かす
+static void run_steps(unsigned steps)
+{
+    for (unsigned i = 0; i < steps; i++) {
+        now_us += STEP_US;
+        node_a.set_time(now_us);
+        node_b.set_time(now_us);
+        node_a.run();
+        node_b.run();
+    }
+}
+
+// フレーム "K<dst><base64>" のペイロードが report と一致するか
+static bool keyboard_frame_matches(const char* frame, uint8_t dst, const uint8_t report[8])
+{
+    char header[4];
+    snprintf(header, sizeof(header), "K%02X", dst);
+    if (strncmp(frame, header, 3) != 0 || strchr(frame, '@') != NULL) return false;
+
+    uint8_t decoded[16];
+    int len = base64_decode(frame + 3, strlen(frame + 3), decoded, sizeof(decoded));
+    return len == 8 && memcmp(decoded, report, 8) == 0;
+}
+
+static void test_clock_sync(void)
+{
+    // 同期前は換算できない
+    uint32_t local;
+    CHECK(!node_a.clock_to_local(LINK_PORT_UP, 0, &local), "A synced before any ping");
+
+    // 最初のウィンドウ（100ms 間隔の ping 8回）が埋まるまで動かす
+    run_steps(2000000 / STEP_US);
+
+    uint32_t remote = now_us + NODE_B_OFFSET;
+    CHECK(node_a.clock_to_local(LINK_PORT_UP, remote, &local), "A not synced to B after 2s");
+    int32_t error_a = (int32_t)(local - now_us);
+    CHECK(error_a >= -(int32_t)STEP_US && error_a <= (int32_t)STEP_US,
+          "A: B's clock converted with error %ld us", (long)error_a);
+
+    CHECK(node_b.clock_to_local(LINK_PORT_UP, now_us, &local), "B not synced to A after 2s");
+    int32_t error_b = (int32_t)(local - (now_us + NODE_B_OFFSET));
+    CHECK(error_b >= -(int32_t)STEP_US && error_b <= (int32_t)STEP_US,
+          "B: A's clock converted with error %ld us", (long)error_b);
+}
+
+static void test_routing(void)
+{
+    const uint8_t report_ab[8] = { 0x02, 0, 0x04, 0x05, 0, 0, 0, 0 };
+    const uint8_t report_ba[8] = { 0x00, 0, 0x1E, 0, 0, 0, 0, 0 };
+    const uint8_t report_local[8] = { 0x01, 0, 0x06, 0, 0, 0, 0, 0 };
+
+    // A -> B: 上流ポートから B へ。B は受信時刻を外して自ノードで処理する
+    unsigned long b_count = node_b.frame_count();
+    CHECK(node_a.send_keyboard(NODE_B_ID, report_ab), "A failed to send to B");
+    run_steps(4);
+    CHECK(node_b.frame_count() == b_count + 1, "B processed %lu frames, expected 1", node_b.frame_count() - b_count);
+    CHECK(keyboard_frame_matches(node_b.last_frame(), NODE_B_ID, report_ab), "B got '%s'", node_b.last_frame());
+
+    // B -> A
+    unsigned long a_count = node_a.frame_count();
+    CHECK(node_b.send_keyboard(NODE_A_ID, report_ba), "B failed to send to A");
+    run_steps(4);
+    CHECK(node_a.frame_count() == a_count + 1, "A processed %lu frames, expected 1", node_a.frame_count() - a_count);
+    CHECK(keyboard_frame_matches(node_a.last_frame(), NODE_A_ID, report_ba), "A got '%s'", node_a.last_frame());
+
+    // A -> A: 線路に出さない。Core0（テストの呼び出し）からは Core1 の link_task に渡して処理する
+    a_count = node_a.frame_count();
+    b_count = node_b.frame_count();
+    CHECK(node_a.send_keyboard(NODE_A_ID, report_local), "A failed to send to itself");
+    CHECK(node_a.frame_count() == a_count, "A processed its own frame on Core0");
+    run_steps(1);
+    CHECK(node_a.frame_count() == a_count + 1, "A did not process its own frame on Core1");
+    CHECK(keyboard_frame_matches(node_a.last_frame(), NODE_A_ID, report_local), "A got '%s'", node_a.last_frame());
+    run_steps(4);
+    CHECK(node_b.frame_count() == b_count, "A's frame to itself reached B");
+
+    // A -> 0x03: B にも下流がないので B で捨てる（A へ戻さない）
+    a_count = node_a.frame_count();
+    b_count = node_b.frame_count();
+    CHECK(node_a.send_keyboard(0x03, report_ab), "A failed to route 0x03 upstream");
+    run_steps(4);
+    CHECK(node_b.frame_count() == b_count, "B processed a frame for 0x03");
+    CHECK(node_a.frame_count() == a_count, "frame for 0x03 came back to A");
+}
+
+static void test_bulk_transfer(void)
+{
+    // ウィンドウ（LINK_BULK_WINDOW フラグメント）を何度も使い切る大きさ
+    static uint8_t data[3000];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+    node_a.put_file("bulk.lua", data, sizeof(data));
+
+    CHECK(node_a.push_file("bulk.lua") == 0, "A failed to start the push");
+    CHECK(node_a.push_file("bulk.lua") == 1, "second push did not report busy");
+
+    // 送信中も入力フレームは割り込める
+    const uint8_t report[8] = { 0, 0, 0x2C, 0, 0, 0, 0, 0 };
+    run_steps(20);
+    unsigned long b_count = node_b.frame_count();
+    CHECK(node_a.send_keyboard(NODE_B_ID, report), "A failed to send input during the push");
+    run_steps(4);
+    CHECK(node_b.frame_count() == b_count + 1, "input frame was held behind the bulk transfer");
+
+    static uint8_t received[sizeof(data)];
+    int len = -1;
+    for (int i = 0; i < 20000 && len < 0; i++) {
+        run_steps(1);
+        len = node_b.get_file("bulk.lua", received, sizeof(received));
+    }
+    CHECK(len == (int)sizeof(data), "B received %d bytes, expected %u", len, (unsigned)sizeof(data));
+    CHECK(len == (int)sizeof(data) && memcmp(received, data, sizeof(data)) == 0, "B received corrupted data");
+
+    run_steps(20);
+    CHECK(!node_a.bulk_busy(LINK_CH_BULK_FILE), "A still busy after the transfer");
+    CHECK(node_a.push_file("bulk.lua") == 0, "A could not start a second push");
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <node_a.so> <node_b.so>\n", argv[0]);
+        return 2;
+    }
+    load_node(&node_a, argv[1]);
+    load_node(&node_b, argv[2]);
+
+    node_a.set_time(now_us);
+    node_b.set_time(now_us);
+    node_a.init(NODE_A_ID, &wire_ab, &wire_ba, 0);
+    node_b.init(NODE_B_ID, &wire_ba, &wire_ab, NODE_B_OFFSET);
+
+    test_clock_sync();
+    test_routing();
+    test_bulk_transfer();
+
+    printf("%s (%lu frames A->B, %lu frames B->A)\n", failures ? "FAILED" : "OK",
+           wire_ab.frames_passed, wire_ba.frames_passed);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,362 @@
+// 入力の記録と再生のテスト
+//
+// MacroRecorder.c を fstask.c・LittleFS（host_flash.c の RAM の flash）と一緒にビルドし、
+// Core0（macro_recorder_task）と Core1（macro_rec_* / macro_player_task）を交互に1つのスレッドで回す。
+//   - 前の記録で汚れたステージング領域のセクタだけを記録の前に消去する
+//   - 記録中の flash の操作は1ページの書き込みだけ（消去しない・消去していない所に書かない）
+//   - 止めたあと LittleFS のファイルに写したものを再生すると、同じイベントが同じ間隔で出る
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tusb.h"
+#include "hardware/flash.h"
+#include "MacroRecorder.h"
+#include "fstask.h"
+#include "LinkMux.h"
+#include "host_flash.h"
+
+#define EVENTS          2000        // リングバッファを何周かする数
+#define DIRTY_SECTORS   5           // 前の記録で使ったことにするセクタ
+#define STEP_US         100         // 再生中のループの間隔
+#define REC_FILE        "test.rec"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            failures++; \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+        } \
+    } while (0)
+
+// 記録した入力 / 再生で出たもの
+typedef struct {
+    uint64_t at_us;
+    char type;                  // 'N', 'U', 'M', 'G'
+    uint8_t wheel_resolution;
+    keyboard_bitmap_t keyboard;
+    uint16_t consumer[USB_CONSUMER_KEYS];
+    uint8_t system;
+    mouse_report_t mouse;
+    parsed_gamepad_report_t gamepad;
+} io_event_t;
+
+static io_event_t inputs[EVENTS];
+static io_event_t played[EVENTS + 8];
+static unsigned played_count = 0;
+static unsigned link_sends = 0;
+
+static uint64_t now_us = 1000000;
+
+//--------------------------------------------------------------------+
+// MacroRecorder.c が使うものの置き換え
+//--------------------------------------------------------------------+
+
+parsed_gamepad_report_t current_gamepad_state;
+bool gamepad_state_updated = false;
+bool has_gamepad_key = false;
+
+uint32_t time_us_32(void)
+{
+    return (uint32_t)now_us;
+}
+
+uint64_t time_us_64(void)
+{
+    return now_us;
+}
+
+uint32_t tud_cdc_n_write(uint8_t itf, void const* buffer, uint32_t bufsize)
+{
+    (void)itf;
+    (void)buffer;
+    return bufsize;
+}
+
+uint32_t tud_cdc_n_write_flush(uint8_t itf)
+{
+    (void)itf;
+    return 0;
+}
+
+void keyboard_bitmap_set(keyboard_bitmap_t* state, uint8_t keycode, bool pressed)
+{
+    if (keycode >= HID_KEY_CONTROL_LEFT && keycode <= HID_KEY_GUI_RIGHT) {
+        uint8_t bit = 1 << (keycode - HID_KEY_CONTROL_LEFT);
+        state->modifier = pressed ? (state->modifier | bit) : (state->modifier & ~bit);
+    } else if (keycode >= HID_KEY_A && keycode < KEYBOARD_NKRO_USAGES) {
+        uint8_t bit = 1 << (keycode & 7);
+        if (pressed) state->keys[keycode >> 3] |= bit;
+        else state->keys[keycode >> 3] &= ~bit;
+    }
+}
+
+bool keyboard_bitmap_test(const keyboard_bitmap_t* state, uint8_t keycode)
+{
+    return keycode < KEYBOARD_NKRO_USAGES && (state->keys[keycode >> 3] & (1 << (keycode & 7)));
+}
+
+static io_event_t* play_output(char type)
+{
+    if (played_count >= sizeof(played) / sizeof(played[0])) {
+        failures++;
+        printf("FAIL: more than %u events played\n", played_count);
+        exit(1);
+    }
+    io_event_t* event = &played[played_count++];
+    memset(event, 0, sizeof(*event));
+    event->at_us = now_us;
+    event->type = type;
+    return event;
+}
+
+bool usb_device_ready(uint8_t instance)
+{
+    (void)instance;
+    return true;
+}
+
+bool usb_device_keyboard_bitmap_report(const keyboard_bitmap_t* state)
+{
+    play_output('N')->keyboard = *state;
+    return true;
+}
+
+bool usb_device_control_report(const uint16_t* consumer, uint8_t system)
+{
+    io_event_t* event = play_output('U');
+    memcpy(event->consumer, consumer, sizeof(event->consumer));
+    event->system = system;
+    return true;
+}
+
+bool usb_device_mouse_report_scaled(const mouse_report_t* report, uint8_t wheel_resolution)
+{
+    io_event_t* event = play_output('M');
+    event->mouse = *report;
+    event->wheel_resolution = wheel_resolution;
+    return true;
+}
+
+// 出力先 0（このノード）で再生するので、リンクには何も送らない
+bool link_send_keyboard_nkro(uint8_t dst, const uint8_t* state)
+{
+    (void)dst;
+    (void)state;
+    link_sends++;
+    return true;
+}
+
+bool link_send_control_keys(uint8_t dst, const uint16_t* consumer, uint8_t system)
+{
+    (void)dst;
+    (void)consumer;
+    (void)system;
+    link_sends++;
+    return true;
+}
+
+bool link_send_mouse(uint8_t dst, const mouse_report_t* report)
+{
+    (void)dst;
+    (void)report;
+    link_sends++;
+    return true;
+}
+
+bool link_send_gamepad(uint8_t dst, const uint8_t data[8])
+{
+    (void)dst;
+    (void)data;
+    link_sends++;
+    return true;
+}
+
+//--------------------------------------------------------------------+
+// テスト
+//--------------------------------------------------------------------+
+
+// i 番目の入力（種類を回し、内容は毎回変える）
+static void make_input(unsigned i, io_event_t* event)
+{
+    memset(event, 0, sizeof(*event));
+    event->type = "NUMG"[i % 4];
+    switch (event->type) {
+        case 'N':
+            event->keyboard.modifier = (uint8_t)(i >> 2);
+            keyboard_bitmap_set(&event->keyboard, (uint8_t)(HID_KEY_A + i % 26), true);
+            keyboard_bitmap_set(&event->keyboard, (uint8_t)(HID_KEY_A + i % 150), true);
+            break;
+        case 'U':
+            event->consumer[0] = (uint16_t)(0x00E9 + i % 3);
+            if (i % 8 == 1) event->consumer[1] = 0x0192;
+            event->system = (uint8_t)(i % 3);
+            break;
+        case 'M':
+            event->mouse.buttons = (uint16_t)(i % 17 == 0 ? 0x8001 : i & 0x1F);
+            event->mouse.x = (int16_t)((int)(i * 37 % 4001) - 2000);
+            event->mouse.y = (int16_t)((int)(i * 53 % 301) - 150);
+            event->mouse.wheel = (int8_t)((int)(i % 241) - 120);
+            event->mouse.pan = (int8_t)((int)(i % 5) - 2);
+            event->wheel_resolution = (uint8_t)(1 + i % 120);
+            break;
+        case 'G':
+            event->gamepad.x = (int8_t)((int)(i % 255) - 127);
+            event->gamepad.y = (int8_t)(i % 100);
+            event->gamepad.z = (int8_t)-(int)(i % 90);
+            event->gamepad.rz = 5;
+            event->gamepad.hat = (uint8_t)(i % 9);
+            event->gamepad.buttons = (uint16_t)i;
+            break;
+    }
+}
+
+static void record_input(io_event_t* event)
+{
+    event->at_us = now_us;
+    switch (event->type) {
+        case 'N': macro_rec_keyboard(&event->keyboard); break;
+        case 'U': macro_rec_control(event->consumer, event->system); break;
+        case 'M': macro_rec_mouse(&event->mouse, event->wheel_resolution); break;
+        case 'G': macro_rec_gamepad(&event->gamepad); break;
+    }
+}
+
+static bool same_event(const io_event_t* a, const io_event_t* b)
+{
+    if (a->type != b->type) return false;
+    switch (a->type) {
+        case 'N':
+            return memcmp(&a->keyboard, &b->keyboard, sizeof(a->keyboard)) == 0;
+        case 'U':
+            return memcmp(a->consumer, b->consumer, sizeof(a->consumer)) == 0 && a->system == b->system;
+        case 'M':
+            return a->mouse.buttons == b->mouse.buttons && a->mouse.x == b->mouse.x &&
+                   a->mouse.y == b->mouse.y && a->mouse.wheel == b->mouse.wheel &&
+                   a->mouse.pan == b->mouse.pan && a->wheel_resolution == b->wheel_resolution;
+        case 'G':
+            return a->gamepad.x == b->gamepad.x && a->gamepad.y == b->gamepad.y &&
+                   a->gamepad.z == b->gamepad.z && a->gamepad.rz == b->gamepad.rz &&
+                   a->gamepad.hat == b->gamepad.hat && a->gamepad.buttons == b->gamepad.buttons;
+    }
+    return false;
+}
+
+// Core0 と Core1 のループを1回ずつ回す
+static void step(uint32_t us)
+{
+    macro_recorder_task();
+    macro_player_task();
+    if (gamepad_state_updated) {
+        gamepad_state_updated = false;
+        play_output('G')->gamepad = current_gamepad_state;
+    }
+    now_us += us;
+}
+
+static void test_record(void)
+{
+    // 前の記録の残り（先頭の数セクタだけ使ったことにする）
+    uint8_t* staging = (uint8_t*)fstask_staging_data();
+    for (unsigned i = 0; i < DIRTY_SECTORS; i++) {
+        memset(&staging[i * FLASH_SECTOR_SIZE * 3], 0x5A, FLASH_SECTOR_SIZE / 2);
+    }
+
+    CHECK(macro_rec_start(REC_FILE) == 0, "cannot start recording");
+
+    // 消去が終わるまでは記録しない
+    host_flash_stats_t before = host_flash_stats;
+    for (unsigned i = 0; i <= FSTASK_STAGING_SIZE / FLASH_SECTOR_SIZE; i++) {
+        io_event_t probe;
+        make_input(0, &probe);
+        record_input(&probe);
+        step(1000);
+    }
+    CHECK(host_flash_stats.erases - before.erases == DIRTY_SECTORS,
+          "%lu sectors erased, expected %u", host_flash_stats.erases - before.erases, DIRTY_SECTORS);
+
+    // 記録中は1ページずつ書くだけ
+    before = host_flash_stats;
+    for (unsigned i = 0; i < EVENTS; i++) {
+        make_input(i, &inputs[i]);
+        record_input(&inputs[i]);
+        step(700 + (i % 7) * 150);
+    }
+    unsigned long programs = host_flash_stats.programs - before.programs;
+    CHECK(host_flash_stats.erases == before.erases, "%lu sectors erased while recording",
+          host_flash_stats.erases - before.erases);
+    CHECK(programs > MACRO_REC_BUFFER_SIZE / FLASH_PAGE_SIZE, "only %lu pages written", programs);
+    CHECK(host_flash_stats.lockouts - before.lockouts == programs,
+          "%lu lockouts for %lu pages", host_flash_stats.lockouts - before.lockouts, programs);
+
+    fstask_lockout_stats_t lockout;
+    fstask_get_lockout_stats(&lockout);
+    CHECK(lockout.count == programs, "lockout stats count %lu, expected %lu",
+          (unsigned long)lockout.count, programs);
+
+    macro_rec_stop();
+}
+
+static void test_play(void)
+{
+    // LittleFS に写し終わるまでは再生できない
+    unsigned waited = 0;
+    while (macro_play_start(REC_FILE, 1, 100, 0) < 0 && waited++ < 1000) {
+        step(1000);
+    }
+    CHECK(waited < 1000, "recording was not saved");
+    if (waited >= 1000) return;
+
+    // ファイルに写したあとはステージング領域を使わない
+    memset((uint8_t*)fstask_staging_data(), 0, FSTASK_STAGING_SIZE);
+
+    uint64_t end = now_us + (inputs[EVENTS - 1].at_us - inputs[0].at_us) + 1000000;
+    while (now_us < end) {
+        step(STEP_US);
+    }
+
+    CHECK(link_sends == 0, "%u frames sent to the link", link_sends);
+    CHECK(played_count == EVENTS + 4, "%u events played, expected %u", played_count, EVENTS + 4);
+    for (unsigned i = 0; i < EVENTS && i < played_count; i++) {
+        CHECK(same_event(&played[i], &inputs[i]), "event %u ('%c') played as '%c' differently",
+              i, inputs[i].type, played[i].type);
+        int64_t expected = (int64_t)(inputs[i].at_us - inputs[0].at_us);
+        int64_t actual = (int64_t)(played[i].at_us - played[0].at_us);
+        CHECK(actual >= expected && actual - expected <= STEP_US,
+              "event %u played at %lld us, expected %lld us", i, (long long)actual, (long long)expected);
+        if (failures > 10) break;
+    }
+
+    // 終わったら押したものを離す
+    static const char releases[] = "NUMG";
+    for (unsigned i = 0; i < 4 && EVENTS + i < played_count; i++) {
+        io_event_t release;
+        memset(&release, 0, sizeof(release));
+        release.type = releases[i];
+        release.wheel_resolution = 1;
+        CHECK(same_event(&played[EVENTS + i], &release), "'%c' was not released", releases[i]);
+    }
+}
+
+int main(void)
+{
+    host_flash_reset();
+    if (fstask_mount_and_init() < 0) {
+        printf("FAILED: cannot mount\n");
+        return 1;
+    }
+    macro_recorder_init();
+
+    test_record();
+    test_play();
+
+    // 残りの書き込み・LittleFS への保存を含めて
+    CHECK(host_flash_stats.misaligned == 0, "%lu misaligned flash operations", host_flash_stats.misaligned);
+    CHECK(host_flash_stats.unerased == 0, "%lu bytes written without erasing", host_flash_stats.unerased);
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,279 @@
+// Raw HID のファイル転送のテスト
+//
+// RawHID.c を fstask.c・LittleFS（host_flash.c の RAM の flash）と一緒にビルドし、
+// OUT レポートを raw_hid_receive に入れて raw_hid_cmd_task / raw_hid_task を回し、
+// tud_hid_n_report に出た IN レポートを読む。
+//   - LittleFS のファイルを READ_OPEN / READ_DATA で読んで1バイトずつ比べる（0 バイトを含む）
+//   - WRITE_OPEN / WRITE_DATA / CLOSE で書いたファイルを fstask で読み戻して比べる
+//   - サイズ分を受け取らずに閉じた転送は保存しない
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tusb.h"
+#include "RawHID.h"
+#include "fstask.h"
+#include "CDCCmd.h"
+#include "LinkMux.h"
+#include "LuaCache.h"
+#include "host_flash.h"
+
+#define WRITE_CHUNK     (RAW_HID_REPORT_SIZE - 7)   // WRITE_DATA 1回のデータ
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            failures++; \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+        } \
+    } while (0)
+
+//--------------------------------------------------------------------+
+// RawHID.c が使うものの置き換え
+//--------------------------------------------------------------------+
+
+static uint8_t last_report[RAW_HID_REPORT_SIZE];
+static unsigned reports = 0;
+
+bool tud_mounted(void)
+{
+    return true;
+}
+
+bool tud_hid_n_ready(uint8_t instance)
+{
+    (void)instance;
+    return true;
+}
+
+bool tud_hid_n_report(uint8_t instance, uint8_t report_id, void const* report, uint16_t len)
+{
+    (void)instance;
+    (void)report_id;
+    memcpy(last_report, report, len < sizeof(last_report) ? len : sizeof(last_report));
+    reports++;
+    return true;
+}
+
+uint32_t board_millis(void)
+{
+    return 0;
+}
+
+uint32_t time_us_32(void)
+{
+    return 0;
+}
+
+uint64_t time_us_64(void)
+{
+    return 0;
+}
+
+uint8_t fifo_get_count(void)
+{
+    return 0;
+}
+
+bool fifo_push_with_duplicate_check(const char* command)
+{
+    (void)command;
+    return true;
+}
+
+const link_transport_stats_t* link_port_stats(link_port_id_t port)
+{
+    (void)port;
+    return NULL;
+}
+
+void lua_cache_schedule(const char* filename)
+{
+    (void)filename;
+}
+
+//--------------------------------------------------------------------+
+// コマンド
+//--------------------------------------------------------------------+
+
+// コマンドを1つ送り、応答のデータ（[3..63]）を返す
+// @return 結果（RAW_HID_OK など）
+static uint8_t command(uint8_t cmd, const void* arg, size_t arg_len, uint8_t* data)
+{
+    static uint8_t seq = 0;
+    uint8_t request[RAW_HID_REPORT_SIZE] = { cmd, ++seq };
+    memcpy(&request[2], arg, arg_len);
+
+    unsigned before = reports;
+    raw_hid_receive(request, sizeof(request));
+    raw_hid_cmd_task();
+    raw_hid_task();
+    if (reports != before + 1 || last_report[0] != cmd || last_report[1] != seq) {
+        failures++;
+        printf("FAIL: no response to command %02X\n", cmd);
+        return RAW_HID_ERR_UNKNOWN;
+    }
+    if (data) memcpy(data, &last_report[3], RAW_HID_DATA_SIZE);
+    return last_report[2];
+}
+
+static void put_u32(uint8_t* p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint32_t get_u32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Raw HID でファイルを読む
+// @return 読んだバイト数、負の値: エラー
+static long raw_read(const char* filename, uint8_t* buffer, size_t size)
+{
+    uint8_t data[RAW_HID_DATA_SIZE];
+    if (command(RAW_HID_CMD_READ_OPEN, filename, strlen(filename) + 1, data) != RAW_HID_OK) return -1;
+    uint32_t total = get_u32(data);
+    if (total > size) return -1;
+
+    uint32_t offset = 0;
+    while (offset < total) {
+        uint8_t arg[4];
+        put_u32(arg, offset);
+        if (command(RAW_HID_CMD_READ_DATA, arg, sizeof(arg), data) != RAW_HID_OK || data[0] == 0) return -1;
+        memcpy(&buffer[offset], &data[1], data[0]);
+        offset += data[0];
+    }
+    command(RAW_HID_CMD_CLOSE, NULL, 0, NULL);
+    return total;
+}
+
+// Raw HID でファイルを書く
+// @return RAW_HID_OK など
+static uint8_t raw_write(const char* filename, const uint8_t* buffer, uint32_t size)
+{
+    uint8_t arg[RAW_HID_REPORT_SIZE - 2];
+    memset(arg, 0, sizeof(arg));
+    put_u32(arg, size);
+    snprintf((char*)&arg[4], sizeof(arg) - 4, "%s", filename);
+    uint8_t result = command(RAW_HID_CMD_WRITE_OPEN, arg, sizeof(arg), NULL);
+    if (result != RAW_HID_OK) return result;
+
+    for (uint32_t offset = 0; offset < size; offset += WRITE_CHUNK) {
+        uint32_t len = size - offset < WRITE_CHUNK ? size - offset : WRITE_CHUNK;
+        put_u32(arg, offset);
+        arg[4] = (uint8_t)len;
+        memcpy(&arg[5], &buffer[offset], len);
+        result = command(RAW_HID_CMD_WRITE_DATA, arg, 5 + len, NULL);
+        if (result != RAW_HID_OK) return result;
+    }
+    return command(RAW_HID_CMD_CLOSE, NULL, 0, NULL);
+}
+
+//--------------------------------------------------------------------+
+// テスト
+//--------------------------------------------------------------------+
+
+static void fill(uint8_t* buffer, size_t size, unsigned seed)
+{
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = (uint8_t)(i * 31 + seed + (i >> 7));
+    }
+}
+
+// fstask で置いたファイルを Raw HID で読む
+static void test_read(size_t size)
+{
+    static uint8_t data[RAW_HID_FILE_MAX];
+    static uint8_t received[RAW_HID_FILE_MAX];
+    fill(data, size, 1);
+
+    char filename[32];
+    snprintf(filename, sizeof(filename), "read%u.bin", (unsigned)size);
+    CHECK(fstask_write_file(filename, data, size) == (int)size, "could not create '%s'", filename);
+
+    memset(received, 0xAA, sizeof(received));
+    long len = raw_read(filename, received, sizeof(received));
+    CHECK(len == (long)size, "read %ld bytes of '%s', expected %u", len, filename, (unsigned)size);
+    CHECK(len == (long)size && memcmp(received, data, size) == 0, "'%s' read back differently", filename);
+}
+
+// Raw HID で書いたファイルを fstask で読む
+static void test_write(size_t size)
+{
+    static uint8_t data[RAW_HID_FILE_MAX];
+    static uint8_t stored[RAW_HID_FILE_MAX + 1];
+    fill(data, size, 7);
+
+    char filename[32];
+    snprintf(filename, sizeof(filename), "write%u.bin", (unsigned)size);
+    uint8_t result = raw_write(filename, data, (uint32_t)size);
+    CHECK(result == RAW_HID_OK, "writing '%s' returned %02X", filename, result);
+
+    CHECK(fstask_get_file_size(filename) == (lfs_ssize_t)size, "'%s' is %ld bytes, expected %u",
+          filename, (long)fstask_get_file_size(filename), (unsigned)size);
+    int len = fstask_read_file(filename, (char*)stored, sizeof(stored));
+    CHECK(len == (int)size && memcmp(stored, data, size) == 0, "'%s' was stored differently", filename);
+}
+
+// 途中で閉じた・飛ばして書いた転送は保存しない
+static void test_incomplete_write(void)
+{
+    static uint8_t data[1000];
+    static uint8_t stored[sizeof(data) + 1];
+    fill(data, sizeof(data), 3);
+    CHECK(fstask_write_file("partial.bin", data, 10) == 10, "could not create 'partial.bin'");
+
+    uint8_t arg[RAW_HID_REPORT_SIZE - 2];
+    memset(arg, 0, sizeof(arg));
+    put_u32(arg, sizeof(data));
+    snprintf((char*)&arg[4], sizeof(arg) - 4, "partial.bin");
+    CHECK(command(RAW_HID_CMD_WRITE_OPEN, arg, sizeof(arg), NULL) == RAW_HID_OK, "cannot open 'partial.bin'");
+
+    // 先頭を2回（書き直し）、次に1つ飛ばした所
+    for (int i = 0; i < 2; i++) {
+        put_u32(arg, 0);
+        arg[4] = WRITE_CHUNK;
+        memcpy(&arg[5], data, WRITE_CHUNK);
+        CHECK(command(RAW_HID_CMD_WRITE_DATA, arg, 5 + WRITE_CHUNK, NULL) == RAW_HID_OK, "rewrite was refused");
+    }
+    put_u32(arg, 2 * WRITE_CHUNK);
+    memcpy(&arg[5], &data[2 * WRITE_CHUNK], WRITE_CHUNK);
+    CHECK(command(RAW_HID_CMD_WRITE_DATA, arg, 5 + WRITE_CHUNK, NULL) == RAW_HID_ERR_ARG, "gap was accepted");
+
+    uint8_t result = command(RAW_HID_CMD_CLOSE, NULL, 0, NULL);
+    CHECK(result == RAW_HID_ERR_INCOMPLETE, "closing a short write returned %02X", result);
+    int len = fstask_read_file("partial.bin", (char*)stored, sizeof(stored));
+    CHECK(len == 10 && memcmp(stored, data, 10) == 0, "'partial.bin' was overwritten by a short write");
+
+    // 1バイトも送らずに閉じる
+    put_u32(arg, 1);
+    snprintf((char*)&arg[4], sizeof(arg) - 4, "never.bin");
+    CHECK(command(RAW_HID_CMD_WRITE_OPEN, arg, sizeof(arg), NULL) == RAW_HID_OK, "cannot open 'never.bin'");
+    result = command(RAW_HID_CMD_CLOSE, NULL, 0, NULL);
+    CHECK(result == RAW_HID_ERR_INCOMPLETE, "closing an empty write returned %02X", result);
+    CHECK(fstask_get_file_size("never.bin") < 0, "'never.bin' was created");
+}
+
+int main(void)
+{
+    host_flash_reset();
+    if (fstask_mount_and_init() < 0) {
+        printf("FAILED: cannot mount\n");
+        return 1;
+    }
+    raw_hid_init();
+
+    const size_t sizes[] = { 0, 1, RAW_HID_DATA_SIZE - 1, RAW_HID_DATA_SIZE, 1000, RAW_HID_FILE_MAX };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        test_read(sizes[i]);
+        test_write(sizes[i]);
+    }
+    test_incomplete_write();
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -83,7 +83,7 @@
 #endif
 
 //------------- CLASS -------------//
-#define CFG_TUD_HID               3  // keyboard, mouse, and gamepad
+#define CFG_TUD_HID               4  // keyboard, mouse, gamepad and raw HID (vendor)
 #define CFG_TUD_CDC               1  // CDC (serial communication)
 
 // CDC FIFO size of TX and RX
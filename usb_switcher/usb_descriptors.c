@@ -1,8 +1,12 @@
 #include "tusb.h"
+#include "USBDeviceTask.h"  // For MOUSE_WHEEL_MULTIPLIER, KEYBOARD_NKRO_USAGES, USB_CONSUMER_KEYS
+#include "RawHID.h"         // For RAW_HID_REPORT_SIZE
 
 /* A combination of interfaces must have a unique product id, since PC will save device driver after the first plug. */
 #define _PID_MAP(itf, n)  ( (CFG_TUD_##itf) << (n) )
-#define USB_PID   0x000a
+// 0x000b: 変更前の構成。Raw HID インターフェースと NKRO・Consumer/System・絶対座標の
+// レポートを足したので別の PID にする（古い記述子をキャッシュした PC が誤って使わないように）
+#define USB_PID   0x000c
 
 #define USB_VID   0xCa07
 #define USB_BCD   0x0200
@@ -24,7 +28,7 @@ tusb_desc_device_t const desc_device =
 
     .idVendor           = USB_VID,
     .idProduct          = USB_PID,
-    .bcdDevice          = 0x0100,
+    .bcdDevice          = 0x0200,
 
     .iManufacturer      = 0x01,
     .iProduct           = 0x02,
@@ -44,14 +48,179 @@ uint8_t const * tud_descriptor_device_cb(void)
 // HID Report Descriptor
 //--------------------------------------------------------------------+
 
+// キーボード: 6KRO（Report ID 1、LED 出力もこちら）と NKRO ビットマップ（Report ID 4）
+// Report プロトコルでは NKRO だけを送り、Boot プロトコルでは 6KRO に戻す（USBDeviceTask.c）
+// メディアキー（Consumer Control、Report ID 6）と電源・スリープ（System Control、Report ID 7）も
+// 同じインターフェースで送る（Report プロトコルのみ）
 uint8_t const desc_hid_keyboard_report[] =
 {
-  TUD_HID_REPORT_DESC_KEYBOARD( HID_REPORT_ID(1) )
+  TUD_HID_REPORT_DESC_KEYBOARD( HID_REPORT_ID(1) ),
+
+  HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP      ),
+  HID_USAGE      ( HID_USAGE_DESKTOP_KEYBOARD  ),
+  HID_COLLECTION ( HID_COLLECTION_APPLICATION  ),
+    // Report ID
+    HID_REPORT_ID( 4 )
+    HID_USAGE_PAGE  ( HID_USAGE_PAGE_KEYBOARD   ),
+
+    // 8 bits Modifier Keys (Shift, Control, Alt, GUI)
+    HID_USAGE_MIN   ( 224                       ),
+    HID_USAGE_MAX   ( 231                       ),
+    HID_LOGICAL_MIN ( 0                         ),
+    HID_LOGICAL_MAX ( 1                         ),
+    HID_REPORT_COUNT( 8                         ),
+    HID_REPORT_SIZE ( 1                         ),
+    HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+
+    // One bit per key usage 0x00-0xDF
+    HID_USAGE_MIN   ( 0                         ),
+    HID_USAGE_MAX   ( KEYBOARD_NKRO_USAGES - 1  ),
+    HID_REPORT_COUNT( KEYBOARD_NKRO_USAGES      ),
+    HID_REPORT_SIZE ( 1                         ),
+    HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+  HID_COLLECTION_END,
+
+  // 同時に押されたメディアキーを USB_CONSUMER_KEYS 個まで（16bit の Usage の配列）
+  HID_USAGE_PAGE ( HID_USAGE_PAGE_CONSUMER    ),
+  HID_USAGE      ( HID_USAGE_CONSUMER_CONTROL ),
+  HID_COLLECTION ( HID_COLLECTION_APPLICATION ),
+    HID_REPORT_ID    ( 6 )
+    HID_LOGICAL_MIN  ( 0x00                                ),
+    HID_LOGICAL_MAX_N( 0x03FF, 2                           ),
+    HID_USAGE_MIN    ( 0x00                                ),
+    HID_USAGE_MAX_N  ( 0x03FF, 2                           ),
+    HID_REPORT_COUNT ( USB_CONSUMER_KEYS                   ),
+    HID_REPORT_SIZE  ( 16                                  ),
+    HID_INPUT        ( HID_DATA | HID_ARRAY | HID_ABSOLUTE ),
+  HID_COLLECTION_END,
+  TUD_HID_REPORT_DESC_SYSTEM_CONTROL( HID_REPORT_ID(7) )
 };
 
+// 16ビット相対マウス（Report ID 2）
+// X/Y を 16bit にして高DPIマウスの速い動きを ±127 で切らないようにする。
+// Boot プロトコル時は Report ID なしの標準 Boot 形式で送る（USBDeviceTask.c）
+// ホイールとチルトには Resolution Multiplier（Feature、Report ID 2）を付けており、
+// ホストが 1 を書き込むと 1ノッチ = MOUSE_WHEEL_MULTIPLIER カウントになる
 uint8_t const desc_hid_mouse_report[] =
 {
-  TUD_HID_REPORT_DESC_MOUSE( HID_REPORT_ID(2) )
+  HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP      ),
+  HID_USAGE      ( HID_USAGE_DESKTOP_MOUSE     ),
+  HID_COLLECTION ( HID_COLLECTION_APPLICATION  ),
+    // Report ID
+    HID_REPORT_ID( 2 )
+    HID_USAGE      ( HID_USAGE_DESKTOP_POINTER ),
+    HID_COLLECTION ( HID_COLLECTION_PHYSICAL   ),
+
+      // Buttons (16 buttons = 2 bytes)
+      HID_USAGE_PAGE  ( HID_USAGE_PAGE_BUTTON     ),
+      HID_USAGE_MIN   ( 1                         ),
+      HID_USAGE_MAX   ( 16                        ),
+      HID_LOGICAL_MIN ( 0                         ),
+      HID_LOGICAL_MAX ( 1                         ),
+      HID_REPORT_COUNT( 16                        ),
+      HID_REPORT_SIZE ( 1                         ),
+      HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+
+      // X, Y (16-bit signed, relative)
+      HID_USAGE_PAGE  ( HID_USAGE_PAGE_DESKTOP    ),
+      HID_USAGE       ( HID_USAGE_DESKTOP_X       ),
+      HID_USAGE       ( HID_USAGE_DESKTOP_Y       ),
+      HID_LOGICAL_MIN_N ( -32767, 2               ),
+      HID_LOGICAL_MAX_N ( 32767, 2                ),
+      HID_REPORT_COUNT( 2                         ),
+      HID_REPORT_SIZE ( 16                        ),
+      HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_RELATIVE ),
+
+      // Vertical wheel (8-bit signed) with its resolution multiplier
+      HID_COLLECTION  ( HID_COLLECTION_LOGICAL    ),
+        HID_USAGE       ( HID_USAGE_DESKTOP_RESOLUTION_MULTIPLIER ),
+        HID_LOGICAL_MIN ( 0                         ),
+        HID_LOGICAL_MAX ( 1                         ),
+        HID_PHYSICAL_MIN( 1                         ),
+        HID_PHYSICAL_MAX( MOUSE_WHEEL_MULTIPLIER    ),
+        HID_REPORT_COUNT( 1                         ),
+        HID_REPORT_SIZE ( 2                         ),
+        HID_FEATURE     ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+
+        HID_USAGE       ( HID_USAGE_DESKTOP_WHEEL   ),
+        HID_LOGICAL_MIN ( 0x81                      ), // -127
+        HID_LOGICAL_MAX ( 0x7F                      ), // 127
+        HID_PHYSICAL_MIN( 0                         ),
+        HID_PHYSICAL_MAX( 0                         ),
+        HID_REPORT_COUNT( 1                         ),
+        HID_REPORT_SIZE ( 8                         ),
+        HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_RELATIVE ),
+      HID_COLLECTION_END,
+
+      // Horizontal wheel (AC Pan, 8-bit signed) with its resolution multiplier
+      HID_COLLECTION  ( HID_COLLECTION_LOGICAL    ),
+        HID_USAGE       ( HID_USAGE_DESKTOP_RESOLUTION_MULTIPLIER ),
+        HID_LOGICAL_MIN ( 0                         ),
+        HID_LOGICAL_MAX ( 1                         ),
+        HID_PHYSICAL_MIN( 1                         ),
+        HID_PHYSICAL_MAX( MOUSE_WHEEL_MULTIPLIER    ),
+        HID_REPORT_COUNT( 1                         ),
+        HID_REPORT_SIZE ( 2                         ),
+        HID_FEATURE     ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+
+        HID_USAGE_PAGE  ( HID_USAGE_PAGE_CONSUMER   ),
+        HID_USAGE_N     ( HID_USAGE_CONSUMER_AC_PAN, 2 ),
+        HID_LOGICAL_MIN ( 0x81                      ), // -127
+        HID_LOGICAL_MAX ( 0x7F                      ), // 127
+        HID_PHYSICAL_MIN( 0                         ),
+        HID_PHYSICAL_MAX( 0                         ),
+        HID_REPORT_COUNT( 1                         ),
+        HID_REPORT_SIZE ( 8                         ),
+        HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_RELATIVE ),
+      HID_COLLECTION_END,
+
+      // Feature padding (4 bits)
+      HID_REPORT_COUNT( 1                         ),
+      HID_REPORT_SIZE ( 4                         ),
+      HID_FEATURE     ( HID_CONSTANT              ),
+
+    HID_COLLECTION_END,
+  HID_COLLECTION_END,
+
+  // Absolute pointer (Report ID 5)
+  // 仮想カーソルの位置を 0-POINTER_ABS_MAX で送る（config の POINTER=ABSOLUTE、Lua の mouse_warp）
+  HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP      ),
+  HID_USAGE      ( HID_USAGE_DESKTOP_MOUSE     ),
+  HID_COLLECTION ( HID_COLLECTION_APPLICATION  ),
+    HID_REPORT_ID( 5 )
+    HID_USAGE      ( HID_USAGE_DESKTOP_POINTER ),
+    HID_COLLECTION ( HID_COLLECTION_PHYSICAL   ),
+
+      // Buttons (8 buttons = 1 byte)
+      HID_USAGE_PAGE  ( HID_USAGE_PAGE_BUTTON     ),
+      HID_USAGE_MIN   ( 1                         ),
+      HID_USAGE_MAX   ( 8                         ),
+      HID_LOGICAL_MIN ( 0                         ),
+      HID_LOGICAL_MAX ( 1                         ),
+      HID_REPORT_COUNT( 8                         ),
+      HID_REPORT_SIZE ( 1                         ),
+      HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+
+      // X, Y (16-bit, absolute)
+      HID_USAGE_PAGE  ( HID_USAGE_PAGE_DESKTOP    ),
+      HID_USAGE       ( HID_USAGE_DESKTOP_X       ),
+      HID_USAGE       ( HID_USAGE_DESKTOP_Y       ),
+      HID_LOGICAL_MIN ( 0                         ),
+      HID_LOGICAL_MAX_N ( POINTER_ABS_MAX, 2      ),
+      HID_REPORT_COUNT( 2                         ),
+      HID_REPORT_SIZE ( 16                        ),
+      HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+
+      // Vertical wheel (8-bit signed)
+      HID_USAGE       ( HID_USAGE_DESKTOP_WHEEL   ),
+      HID_LOGICAL_MIN ( 0x81                      ), // -127
+      HID_LOGICAL_MAX ( 0x7F                      ), // 127
+      HID_REPORT_COUNT( 1                         ),
+      HID_REPORT_SIZE ( 8                         ),
+      HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_RELATIVE ),
+
+    HID_COLLECTION_END,
+  HID_COLLECTION_END
 };
 
 uint8_t const desc_hid_gamepad_report[] =
@@ -107,6 +276,12 @@ uint8_t const desc_hid_gamepad_report[] =
 // Invoked when received GET HID REPORT DESCRIPTOR
 // Application return pointer to descriptor
 // Descriptor contents must exist long enough for transfer to complete
+// Raw HID: ベンダー定義の 64バイト IN/OUT レポート（RawHID.h）
+uint8_t const desc_hid_raw_report[] =
+{
+  TUD_HID_REPORT_DESC_GENERIC_INOUT( RAW_HID_REPORT_SIZE )
+};
+
 uint8_t const * tud_hid_descriptor_report_cb(uint8_t instance)
 {
   switch(instance)
@@ -117,6 +292,8 @@ uint8_t const * tud_hid_descriptor_report_cb(uint8_t instance)
       return desc_hid_mouse_report;
     case 2:
       return desc_hid_gamepad_report;
+    case 3:
+      return desc_hid_raw_report;
     default:
       return NULL;
   }
@@ -133,6 +310,7 @@ enum
   ITF_NUM_GAMEPAD,
   ITF_NUM_CDC,
   ITF_NUM_CDC_DATA,
+  ITF_NUM_RAW_HID,
   ITF_NUM_TOTAL
 };
 
@@ -144,7 +322,10 @@ enum
 #define EPNUM_CDC_OUT   0x04
 #define EPNUM_CDC_IN    0x85
 
-#define  CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_HID_DESC_LEN * 3)
+#define EPNUM_RAW_HID_OUT 0x06
+#define EPNUM_RAW_HID_IN  0x86
+
+#define  CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_HID_DESC_LEN * 3 + TUD_HID_INOUT_DESC_LEN)
 
 uint8_t const desc_configuration[] =
 {
@@ -158,6 +339,9 @@ uint8_t const desc_configuration[] =
 
   // CDC: Interface number, string index, EP notification address and size, EP data address (out, in) and size.
   TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, 4, EPNUM_CDC_NOTIF, 8, EPNUM_CDC_OUT, EPNUM_CDC_IN, 64),
+
+  // Raw HID (HID instance 3): Interface number, string index, protocol, report descriptor len, EP Out & In address, size & polling interval
+  TUD_HID_INOUT_DESCRIPTOR(ITF_NUM_RAW_HID, 5, HID_ITF_PROTOCOL_NONE, sizeof(desc_hid_raw_report), EPNUM_RAW_HID_OUT, EPNUM_RAW_HID_IN, RAW_HID_REPORT_SIZE, 1),
 };
 
 // Invoked when received GET CONFIGURATION DESCRIPTOR
@@ -181,6 +365,7 @@ char const* string_desc_arr [] =
   "TinyUSB Device2",              // 2: Product
   "123456789012",                // 3: Serials, should use chip ID
   "TinyUSB CDC",                 // 4: CDC Interface
+  "USB Switcher Raw HID",        // 5: Raw HID Interface
 };
 
 static uint16_t _desc_str[32];
@@ -19,6 +19,7 @@
 #include "ws2812.h"
 #include "LEDtask.h"
 #include "USBtask.h"
+#include "USBDeviceTask.h"
 #include "USBHostTask.h"
 
 #include "LuaTask.h"
@@ -26,6 +27,12 @@
 #include "UARTtask.h"
 
 #include "CDCCmd.h"
+#include "LinkMux.h"
+#include "RawHID.h"
+#include "PioUsbDevice.h"
+#include "KeyTimeline.h"
+#include "MacroRecorder.h"
+#include "InputEvents.h"
 
 //#define USBHost1_Pin_DP 9 // for RiscoRabbit ver 1.0
 //#define USBHost2_Pin_DP 11 // for RiscoRabbit ver 1.0
@@ -37,6 +44,11 @@
 // #define USBHost3_Pin_DP 10 // for RiscoRabbit ver 1.1
 // #define USBHost4_Pin_DP 12 // for RiscoRabbit ver 1.1
 
+// 2つ目の USB デバイスポート（2台目の PC 用、D+ に 1.5kΩ プルアップが必要）
+// PIO-USB はホストとデバイスを同時に使えないため、定義すると USB ホストは無効になる
+// 出力先は switch(USB2) / リンクの "S FE" で切り替える
+// #define USBDevice2_Pin_DP 12
+
 
 //--------------------------------------------------------------------+
 // MACRO CONSTANT TYPEDEF PROTOTYPES
@@ -73,6 +85,9 @@ void task_tud_function(void *pvParameters)
     while (1)
     {
         cdc_cmd_task();
+        link_bulk_task(); // Reassemble link bulk transfers (LittleFS access stays on Core0)
+        raw_hid_cmd_task(); // Raw HID binary commands (LittleFS / Lua queue on Core0)
+        macro_recorder_task(); // Write recorded input / read the file being played (LittleFS on Core0)
         vTaskDelay(pdMS_TO_TICKS(1)); // 1秒待機
     }
 }
@@ -105,6 +120,11 @@ int main(void)
     // rpt040 test board pin 14
     // rp2350 test board pin 9,14
 
+#ifdef USBDevice2_Pin_DP
+    // Use the PIO port as the second device port instead of the host (started on Core1)
+    if (!pio_usb_device2_init(USBDevice2_Pin_DP))
+        printf("USB Device 2 initialization failed on GPIO %d/%d\n", USBDevice2_Pin_DP, USBDevice2_Pin_DP+1);
+#else
     // Configure PIO USB for host mode BEFORE starting FreeRTOS
     pio_usb_configuration_t pio_cfg = PIO_USB_DEFAULT_CONFIG;
     pio_cfg.pin_dp = USBHost1_Pin_DP;         // Data+ pin for PIO USB
@@ -149,11 +169,19 @@ int main(void)
     else
         printf("USB Host initialized on GPIO %d/%d\n", USBHost4_Pin_DP, USBHost4_Pin_DP+1);
 #endif
+#endif // USBDevice2_Pin_DP
 
     // Initialize WS2812 LED
     ws2812_init();
     printf("WS2812 LED initialized on GPIO %d\n", WS2812_PIN);
 
+    usb_device_task_init();
+    key_timeline_init();
+    macro_recorder_init();
+    input_events_init();
+    lua_task_init();
+    raw_hid_init();
+
     // Launch Core1 first so it can be locked as a victim
     multicore_launch_core1(task1_function);
     
@@ -171,6 +199,9 @@ int main(void)
     show_protocol_settings();
     multicore_lockout_end_blocking();
 
+    // Build the link routing table from DEVICEID/ROUTE= and bring up the downlink port
+    link_mux_init();
+
 
     BaseType_t result;
 
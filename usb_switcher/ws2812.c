@@ -6,6 +6,7 @@
 void ws2812_init() {
     PIO pio = pio1;    // Use PIO1 to avoid conflict with PIO USB
     int sm = 0;
+    pio_sm_claim(pio, sm);  // PIO1 の残りのステートマシンは PIO UART が使う
     uint offset = pio_add_program(pio, &ws2812_program);
 
     pio_sm_config c = ws2812_program_get_default_config(offset);